@@ -795,6 +795,28 @@ int bdrv_parse_cache_mode(const char *mode, int *flags, bool *writethrough)
     return 0;
 }
 
+/**
+ * Set open flags for a given AIO mode
+ *
+ * Return 0 on success, -1 if the AIO mode was invalid.
+ */
+int bdrv_parse_aio(const char *mode, int *flags)
+{
+    *flags &= ~(BDRV_O_NATIVE_AIO | BDRV_O_IO_URING);
+
+    if (!strcmp(mode, "threads")) {
+        /* this is the default */
+    } else if (!strcmp(mode, "native")) {
+        *flags |= BDRV_O_NATIVE_AIO;
+    } else if (!strcmp(mode, "io_uring")) {
+        *flags |= BDRV_O_IO_URING;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 static char *bdrv_child_get_parent_desc(BdrvChild *c)
 {
     BlockDriverState *parent = c->opaque;
@@ -944,6 +966,10 @@ static void bdrv_backing_attach(BdrvChild *c)
                     parent->backing_blocker);
     bdrv_op_unblock(backing_hd, BLOCK_OP_TYPE_BACKUP_TARGET,
                     parent->backing_blocker);
+
+    if (parent->drv && parent->drv->bdrv_backing_changed) {
+        parent->drv->bdrv_backing_changed(parent);
+    }
 }
 
 static void bdrv_backing_detach(BdrvChild *c)
@@ -954,6 +980,10 @@ static void bdrv_backing_detach(BdrvChild *c)
     bdrv_op_unblock_all(c->bs, parent->backing_blocker);
     error_free(parent->backing_blocker);
     parent->backing_blocker = NULL;
+
+    if (parent->drv && parent->drv->bdrv_backing_changed) {
+        parent->drv->bdrv_backing_changed(parent);
+    }
 }
 
 /*
@@ -3993,6 +4023,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_get_specific_stats) {
+        return drv->bdrv_get_specific_stats(bs);
+    }
+    return NULL;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
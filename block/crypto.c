@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -303,6 +304,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
+                                       block_crypto_default_threads(),
                                        errp);
 
     if (!crypto->block) {
@@ -389,6 +391,161 @@ static void block_crypto_close(BlockDriverState *bs)
  */
 #define BLOCK_CRYPTO_MAX_IO_SIZE (1024 * 1024)
 
+/*
+ * Requests of at least this size are encrypted or decrypted in the thread
+ * pool, split in up to one chunk per cipher of the QCryptoBlock.  Smaller
+ * ones are cheaper to process inline than to hand off to another thread.
+ */
+#define BLOCK_CRYPTO_CHUNK_SIZE (64 * 1024)
+
+/* Upper bound for the ciphers of one image */
+#define BLOCK_CRYPTO_MAX_THREADS 16
+
+typedef struct BlockCryptoTask {
+    Coroutine *co;
+    int pending;
+    int ret;
+} BlockCryptoTask;
+
+typedef struct BlockCryptoJob {
+    BlockCryptoTask *task;
+    QCryptoBlock *block;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+    bool encrypt;
+} BlockCryptoJob;
+
+/* Default for the number of ciphers: one per host CPU */
+size_t block_crypto_default_threads(void)
+{
+    long threads = 0;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads <= 0) {
+        threads = 4;
+    }
+
+    return MIN(threads, BLOCK_CRYPTO_MAX_THREADS);
+}
+
+static int block_crypto_job_func(void *opaque)
+{
+    BlockCryptoJob *job = opaque;
+
+    if (job->encrypt) {
+        return qcrypto_block_encrypt(job->block, job->offset, job->buf,
+                                     job->len, NULL);
+    }
+    return qcrypto_block_decrypt(job->block, job->offset, job->buf,
+                                 job->len, NULL);
+}
+
+static void block_crypto_job_complete(void *opaque, int ret)
+{
+    BlockCryptoJob *job = opaque;
+    BlockCryptoTask *task = job->task;
+
+    if (ret < 0) {
+        task->ret = -EIO;
+    }
+    if (--task->pending == 0) {
+        aio_co_wake(task->co);
+    }
+}
+
+static int coroutine_fn
+block_crypto_co_encdec(BlockDriverState *bs, QCryptoBlock *block,
+                       uint64_t offset, uint8_t *buf, size_t len,
+                       bool encrypt)
+{
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    uint64_t sector_size = qcrypto_block_get_sector_size(block);
+    BlockCryptoTask task = {
+        .co = qemu_coroutine_self(),
+    };
+    BlockCryptoJob *jobs;
+    size_t n, chunk, done, i;
+
+    n = MIN(len / BLOCK_CRYPTO_CHUNK_SIZE,
+            qcrypto_block_get_n_threads(block));
+    if (n <= 1) {
+        BlockCryptoJob job = {
+            .block = block,
+            .offset = offset,
+            .buf = buf,
+            .len = len,
+            .encrypt = encrypt,
+        };
+
+        if (len < BLOCK_CRYPTO_CHUNK_SIZE) {
+            return block_crypto_job_func(&job) < 0 ? -EIO : 0;
+        }
+        return thread_pool_submit_co(pool, block_crypto_job_func,
+                                     &job) < 0 ? -EIO : 0;
+    }
+
+    /* Sector-aligned chunks, the last one may be shorter */
+    chunk = QEMU_ALIGN_UP(DIV_ROUND_UP(len, n), sector_size);
+    jobs = g_new(BlockCryptoJob, n);
+
+    for (i = 0, done = 0; done < len; i++) {
+        assert(i < n);
+        jobs[i] = (BlockCryptoJob) {
+            .task = &task,
+            .block = block,
+            .offset = offset + done,
+            .buf = buf + done,
+            .len = MIN(chunk, len - done),
+            .encrypt = encrypt,
+        };
+        task.pending++;
+        thread_pool_submit_aio(pool, block_crypto_job_func, &jobs[i],
+                               block_crypto_job_complete, &jobs[i]);
+        done += jobs[i].len;
+    }
+
+    /* Completions are only delivered in our AioContext, after we yield */
+    qemu_coroutine_yield();
+    assert(task.pending == 0);
+
+    g_free(jobs);
+    return task.ret;
+}
+
+/*
+ * block_crypto_co_encrypt:
+ *
+ * Encrypts @len bytes of @buf that belong at @offset, in the thread pool of
+ * the AioContext of @bs if the request is large enough to be worth it.
+ *
+ * Returns 0 on success, -EIO on error.
+ */
+int coroutine_fn block_crypto_co_encrypt(BlockDriverState *bs,
+                                         QCryptoBlock *block,
+                                         uint64_t offset,
+                                         uint8_t *buf,
+                                         size_t len)
+{
+    return block_crypto_co_encdec(bs, block, offset, buf, len, true);
+}
+
+/*
+ * block_crypto_co_decrypt:
+ *
+ * Same as block_crypto_co_encrypt(), but the other way round.
+ */
+int coroutine_fn block_crypto_co_decrypt(BlockDriverState *bs,
+                                         QCryptoBlock *block,
+                                         uint64_t offset,
+                                         uint8_t *buf,
+                                         size_t len)
+{
+    return block_crypto_co_encdec(bs, block, offset, buf, len, false);
+}
+
 static coroutine_fn int
 block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                        QEMUIOVector *qiov, int flags)
@@ -432,9 +589,9 @@ block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_decrypt(bs, crypto->block, offset + bytes_done,
+                                      cipher_data, cur_bytes);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -488,9 +645,9 @@ block_crypto_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
 
         qemu_iovec_to_buf(qiov, bytes_done, cipher_data, cur_bytes);
 
-        if (qcrypto_block_encrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encrypt(bs, crypto->block, offset + bytes_done,
+                                      cipher_data, cur_bytes);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -21,6 +21,9 @@
 #ifndef BLOCK_CRYPTO_H__
 #define BLOCK_CRYPTO_H__
 
+#include "crypto/block.h"
+#include "qemu/coroutine.h"
+
 #define BLOCK_CRYPTO_OPT_DEF_KEY_SECRET(prefix, helpstr)                \
     {                                                                   \
         .name = prefix BLOCK_CRYPTO_OPT_QCOW_KEY_SECRET,                \
@@ -98,4 +101,18 @@ block_crypto_open_opts_init(QCryptoBlockFormat format,
                             QDict *opts,
                             Error **errp);
 
+size_t block_crypto_default_threads(void);
+
+int coroutine_fn block_crypto_co_encrypt(BlockDriverState *bs,
+                                         QCryptoBlock *block,
+                                         uint64_t offset,
+                                         uint8_t *buf,
+                                         size_t len);
+
+int coroutine_fn block_crypto_co_decrypt(BlockDriverState *bs,
+                                         QCryptoBlock *block,
+                                         uint64_t offset,
+                                         uint8_t *buf,
+                                         size_t len);
+
 #endif /* BLOCK_CRYPTO_H__ */
@@ -199,6 +199,9 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
     bool use_linux_aio:1;
+    bool use_linux_io_uring:1;
+    bool use_fixed_files:1;
+    bool use_fixed_buffers:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
@@ -213,6 +216,9 @@ typedef struct BDRVRawReopenState {
 
 static int fd_open(BlockDriverState *bs);
 static int64_t raw_getlength(BlockDriverState *bs);
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context);
+static void raw_detach_aio_context(BlockDriverState *bs);
 
 typedef struct RawPosixAIOData {
     BlockDriverState *bs;
@@ -444,7 +450,17 @@ static QemuOptsList raw_runtime_opts = {
         {
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
+        },
+        {
+            .name = "aio-fixed-files",
+            .type = QEMU_OPT_BOOL,
+            .help = "register the file with io_uring (default: off)",
+        },
+        {
+            .name = "aio-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest RAM with io_uring (default: off)",
         },
         {
             .name = "locking",
@@ -489,9 +505,13 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
-    aio_default = (bdrv_flags & BDRV_O_NATIVE_AIO)
-                  ? BLOCKDEV_AIO_OPTIONS_NATIVE
-                  : BLOCKDEV_AIO_OPTIONS_THREADS;
+    if (bdrv_flags & BDRV_O_NATIVE_AIO) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_NATIVE;
+    } else if (bdrv_flags & BDRV_O_IO_URING) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_IO_URING;
+    } else {
+        aio_default = BLOCKDEV_AIO_OPTIONS_THREADS;
+    }
     aio = qapi_enum_parse(&BlockdevAioOptions_lookup,
                           qemu_opt_get(opts, "aio"),
                           aio_default, &local_err);
@@ -501,6 +521,16 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
+    s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+    s->use_fixed_files = qemu_opt_get_bool(opts, "aio-fixed-files", false);
+    s->use_fixed_buffers = qemu_opt_get_bool(opts, "aio-fixed-buffers", false);
+    if ((s->use_fixed_files || s->use_fixed_buffers) &&
+        !s->use_linux_io_uring) {
+        error_setg(errp, "aio-fixed-files and aio-fixed-buffers require "
+                         "aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
@@ -588,6 +618,24 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring handles both buffered and O_DIRECT I/O */
+    if (s->use_linux_io_uring &&
+        !aio_get_linux_io_uring(bdrv_get_aio_context(bs))) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "by the host kernel.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#else
+    if (s->use_linux_io_uring) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif /* !defined(CONFIG_LINUX_IO_URING) */
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
@@ -640,6 +688,8 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
+    raw_attach_aio_context(bs, bdrv_get_aio_context(bs));
+
     ret = 0;
 fail:
     if (filename && (bdrv_flags & BDRV_O_TEMPORARY)) {
@@ -910,8 +960,10 @@ static void raw_reopen_commit(BDRVReopenState *state)
 
     s->open_flags = rs->open_flags;
 
+    raw_detach_aio_context(state->bs);
     qemu_close(s->fd);
     s->fd = rs->fd;
+    raw_attach_aio_context(state->bs, bdrv_get_aio_context(state->bs));
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1637,6 +1689,18 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* Misaligned O_DIRECT requests still need the bounce buffer of the
+     * thread pool */
+    if (s->use_linux_io_uring && !(type & QEMU_AIO_MISALIGNED)) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (aio) {
+            assert(qiov->size == bytes);
+            return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        }
+    }
+#endif
+
     return paio_submit_co(bs, s->fd, offset, qiov, bytes, type);
 }
 
@@ -1657,41 +1721,121 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_linux_aio) {
         LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
         laio_io_plug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (aio) {
+            luring_io_plug(bs, aio);
+        }
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_linux_aio) {
         LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
         laio_io_unplug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (aio) {
+            luring_io_unplug(bs, aio);
+        }
+    }
+#endif
 }
 
-static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
-        BlockCompletionFunc *cb, void *opaque)
+static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+    int ret;
 
-    if (fd_open(bs) < 0)
-        return NULL;
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (aio) {
+            /* Same rules as handle_aiocb_flush(): once an fdatasync() has
+             * failed, the page cache cannot be trusted anymore. */
+            if (s->page_cache_inconsistent) {
+                return -EIO;
+            }
+            ret = luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+            if (ret < 0 && (s->open_flags & O_DIRECT) == 0) {
+                s->page_cache_inconsistent = true;
+            }
+            return ret;
+        }
+    }
+#endif
+    return paio_submit_co(bs, s->fd, 0, NULL, 0, QEMU_AIO_FLUSH);
+}
 
-    return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    /* Registered files hold a reference, drop it before the fd is closed */
+    if (s->use_linux_io_uring && s->use_fixed_files && s->fd >= 0) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (aio) {
+            luring_unregister_fd(aio, s->fd);
+        }
+    }
+#endif
+}
+
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+
+    if (!s->use_linux_io_uring) {
+        return;
+    }
+    aio = aio_get_linux_io_uring(new_context);
+    if (!aio) {
+        return;
+    }
+    /* Requests fall back to plain file descriptors and buffers if the
+     * registration fails */
+    if (s->use_fixed_files) {
+        luring_register_fd(aio, s->fd);
+    }
+    if (s->use_fixed_buffers) {
+        luring_enable_fixed_buffers(aio);
+    }
+#endif
 }
 
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+    raw_detach_aio_context(bs);
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -2338,11 +2482,13 @@ BlockDriver bdrv_file = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_aio_pdiscard = raw_aio_pdiscard,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -2815,11 +2961,13 @@ static BlockDriver bdrv_host_device = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_aio_pdiscard   = hdev_aio_pdiscard,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -2937,10 +3085,12 @@ static BlockDriver bdrv_host_cdrom = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3067,10 +3217,12 @@ static BlockDriver bdrv_host_cdrom = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -0,0 +1,640 @@
+/*
+ * Linux io_uring support.
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/coroutine.h"
+#include "exec/ramlist.h"
+#include "trace.h"
+
+/* io_uring ring size (per-AioContext) */
+#define MAX_ENTRIES 128
+
+/* Slots in the table of registered files (per-AioContext) */
+#define MAX_FIXED_FILES 64
+
+/* The kernel limits the size and the number of registered buffers */
+#define MAX_FIXED_BUFFER_SIZE (1ULL << 30)
+#define MAX_FIXED_BUFFERS 1024
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    int fd;
+    uint64_t offset;
+    int type;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /*
+     * Buffered reads may be short without hitting EOF.  The rest of the
+     * request is then resubmitted with resubmit_qiov, total_read is the
+     * number of bytes that have been read so far.
+     */
+    int total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+
+    /* io queue for submit at batch.  Protected by AioContext lock. */
+    LuringQueue io_q;
+
+    /* I/O completion processing.  Only runs in I/O thread.  */
+    QEMUBH *completion_bh;
+
+    /* Registered files, -1 marks a free slot */
+    bool files_registered;
+    int fixed_files[MAX_FIXED_FILES];
+    unsigned int nb_fixed_files;
+
+    /* Registered buffers, a copy of luring_memory at buffers_generation */
+    bool fixed_buffers;
+    unsigned long buffers_generation;
+    struct iovec *buffers;
+    unsigned int nb_buffers;
+};
+
+/*
+ * Guest RAM that is registered with the rings that use fixed buffers.
+ * Protected by luring_memory_lock; luring_memory_generation is bumped on
+ * every change so that the rings notice they have to register it again.
+ */
+static QemuMutex luring_memory_lock;
+static struct iovec luring_memory[MAX_FIXED_BUFFERS];
+static unsigned int luring_nb_memory;
+static unsigned long luring_memory_generation = 1;
+
+static void __attribute__((__constructor__)) luring_memory_init(void)
+{
+    qemu_mutex_init(&luring_memory_lock);
+}
+
+static void luring_ram_block_added(RAMBlockNotifier *n, void *host,
+                                   size_t size)
+{
+    uint8_t *p = host;
+
+    qemu_mutex_lock(&luring_memory_lock);
+    while (size && luring_nb_memory < MAX_FIXED_BUFFERS) {
+        size_t len = MIN(size, MAX_FIXED_BUFFER_SIZE);
+
+        luring_memory[luring_nb_memory].iov_base = p;
+        luring_memory[luring_nb_memory].iov_len = len;
+        luring_nb_memory++;
+        p += len;
+        size -= len;
+    }
+    atomic_inc(&luring_memory_generation);
+    qemu_mutex_unlock(&luring_memory_lock);
+}
+
+static void luring_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                     size_t size)
+{
+    unsigned int i = 0;
+
+    qemu_mutex_lock(&luring_memory_lock);
+    while (i < luring_nb_memory) {
+        uint8_t *base = luring_memory[i].iov_base;
+
+        if (base >= (uint8_t *)host && base < (uint8_t *)host + size) {
+            luring_memory[i] = luring_memory[--luring_nb_memory];
+        } else {
+            i++;
+        }
+    }
+    atomic_inc(&luring_memory_generation);
+    qemu_mutex_unlock(&luring_memory_lock);
+}
+
+static RAMBlockNotifier luring_ram_notifier = {
+    .ram_block_added    = luring_ram_block_added,
+    .ram_block_removed  = luring_ram_block_removed,
+};
+
+/*
+ * Replace the buffers registered with the ring by the current guest RAM.
+ * Buffers can only be swapped while the ring is idle; until then requests
+ * simply do not use them.
+ */
+static void luring_update_buffers(LuringState *s)
+{
+    unsigned long generation = atomic_read(&luring_memory_generation);
+    unsigned int nb;
+    int ret;
+
+    if (!s->fixed_buffers || s->buffers_generation == generation ||
+        s->io_q.in_flight || s->io_q.in_queue) {
+        return;
+    }
+
+    if (s->nb_buffers) {
+        io_uring_unregister_buffers(&s->ring);
+        s->nb_buffers = 0;
+    }
+    g_free(s->buffers);
+
+    qemu_mutex_lock(&luring_memory_lock);
+    s->buffers_generation = luring_memory_generation;
+    nb = luring_nb_memory;
+    s->buffers = g_memdup(luring_memory, nb * sizeof(struct iovec));
+    qemu_mutex_unlock(&luring_memory_lock);
+
+    if (!nb) {
+        return;
+    }
+
+    /* Fails if the guest RAM does not fit in RLIMIT_MEMLOCK */
+    ret = io_uring_register_buffers(&s->ring, s->buffers, nb);
+    trace_luring_register_buffers(s, nb, ret);
+    if (ret == 0) {
+        s->nb_buffers = nb;
+    }
+}
+
+/* Returns the index of the registered buffer that holds @qiov, or -1 */
+static int luring_fixed_buffer(LuringState *s, QEMUIOVector *qiov)
+{
+    uintptr_t base, end;
+    unsigned int i;
+
+    /* Fixed buffer operations take a single buffer */
+    if (!s->nb_buffers || qiov->niov != 1 ||
+        s->buffers_generation != atomic_read(&luring_memory_generation)) {
+        return -1;
+    }
+
+    base = (uintptr_t)qiov->iov[0].iov_base;
+    end = base + qiov->iov[0].iov_len;
+    for (i = 0; i < s->nb_buffers; i++) {
+        uintptr_t start = (uintptr_t)s->buffers[i].iov_base;
+
+        if (base >= start && end <= start + s->buffers[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Returns the slot of @fd in the table of registered files, or -1 */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nb_fixed_files; i++) {
+        if (s->fixed_files[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void luring_prep_sqe(LuringState *s, LuringAIOCB *luringcb,
+                            QEMUIOVector *qiov, uint64_t offset)
+{
+    struct io_uring_sqe *sqe = &luringcb->sqeq;
+    int fd = luringcb->fd;
+    int index;
+
+    switch (luringcb->type) {
+    case QEMU_AIO_WRITE:
+        index = luring_fixed_buffer(s, qiov);
+        if (index >= 0) {
+            io_uring_prep_write_fixed(sqe, fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset, index);
+        } else {
+            io_uring_prep_writev(sqe, fd, qiov->iov, qiov->niov, offset);
+        }
+        break;
+    case QEMU_AIO_READ:
+        index = luring_fixed_buffer(s, qiov);
+        if (index >= 0) {
+            io_uring_prep_read_fixed(sqe, fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset, index);
+        } else {
+            io_uring_prep_readv(sqe, fd, qiov->iov, qiov->niov, offset);
+        }
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        abort();
+    }
+
+    index = luring_fixed_file(s, fd);
+    if (index >= 0) {
+        sqe->fd = index;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    io_uring_sqe_set_data(sqe, luringcb);
+}
+
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov = &luringcb->resubmit_qiov;
+    size_t remaining;
+
+    trace_luring_resubmit_short_read(s, luringcb, nread);
+
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      remaining);
+
+    luring_prep_sqe(s, luringcb, resubmit_qiov,
+                    luringcb->offset + luringcb->total_read);
+    luring_resubmit(s, luringcb);
+}
+
+static void ioq_submit(LuringState *s);
+
+/**
+ * luring_process_completions:
+ * @s: AIO state
+ *
+ * Fetches completed I/O requests and wakes their coroutines.
+ *
+ * Every completion is consumed from the ring before its coroutine is
+ * entered, so a nested event loop simply continues with the next one.
+ * The BH is scheduled so that a nested event loop sees the pending
+ * completions even if it does not poll the ring itself.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+        size_t total_bytes;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        /* Change counters one-by-one because we can be nested. */
+        s->io_q.in_flight--;
+        trace_luring_process_completion(s, luringcb, ret);
+
+        if (ret == -EINTR || ret == -EAGAIN) {
+            luring_resubmit(s, luringcb);
+            continue;
+        }
+
+        if (ret >= 0 && luringcb->qiov) {
+            /* total_read is only non-zero for resubmitted reads */
+            total_bytes = ret + luringcb->total_read;
+            if (total_bytes == luringcb->qiov->size) {
+                ret = 0;
+            } else if (luringcb->type == QEMU_AIO_READ) {
+                if (ret > 0) {
+                    luring_resubmit_short_read(s, luringcb, ret);
+                    continue;
+                }
+                /* EOF, pad with zeros. */
+                qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                                  luringcb->qiov->size - total_bytes);
+                ret = 0;
+            } else {
+                ret = -ENOSPC;
+            }
+        }
+
+        luringcb->ret = ret;
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+
+        /* If the coroutine is already entered it must be in ioq_submit()
+         * and will notice luringcb->ret has been filled in when it
+         * eventually runs later.  Coroutines cannot be entered recursively
+         * so avoid doing that!
+         */
+        if (!qemu_coroutine_entered(luringcb->co)) {
+            aio_co_wake(luringcb->co);
+        }
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+}
+
+static void ioq_submit(LuringState *s)
+{
+    LuringAIOCB *luringcb;
+    int ret;
+
+    while (s->io_q.in_queue) {
+        /* Fill the submission ring with as many requests as it takes */
+        while ((luringcb = QSIMPLEQ_FIRST(&s->io_q.submit_queue))) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+
+            if (!sqe) {
+                break;
+            }
+            *sqe = luringcb->sqeq;
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        }
+
+        /* One system call submits the whole batch */
+        ret = io_uring_submit(&s->ring);
+        trace_luring_io_uring_submit(s, ret);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            /* Entries stay in the ring and are submitted with the next
+             * batch, once completions have freed resources.
+             */
+            break;
+        }
+
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue  -= ret;
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+
+    if (s->io_q.in_flight) {
+        /* We can try to complete something just right away if there are
+         * still requests in-flight. */
+        luring_process_completions(s);
+    }
+}
+
+static void luring_process_completions_and_submit(LuringState *s)
+{
+    luring_process_completions(s);
+
+    aio_context_acquire(s->aio_context);
+    if (!s->io_q.plugged && s->io_q.in_queue) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static void qemu_luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+/* Completions are visible in the shared ring without a system call */
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_process_completions_and_submit(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+static int luring_do_submit(LuringState *s, LuringAIOCB *luringcb)
+{
+    switch (luringcb->type) {
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_READ:
+        luring_update_buffers(s);
+        break;
+    case QEMU_AIO_FLUSH:
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, luringcb->type);
+        return -EIO;
+    }
+
+    luring_prep_sqe(s, luringcb, luringcb->qiov, luringcb->offset);
+    luring_resubmit(s, luringcb);
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+
+    return 0;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov,
+                                  int type)
+{
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .fd         = fd,
+        .offset     = offset,
+        .type       = type,
+    };
+
+    trace_luring_co_submit(bs, s, &luringcb, fd, offset,
+                           qiov ? qiov->size : 0, type);
+    ret = luring_do_submit(s, &luringcb);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
+/**
+ * luring_register_fd:
+ * @s: AIO state
+ * @fd: file descriptor
+ *
+ * Registers @fd with the ring, so that requests on @fd do not have to look
+ * up and reference the file.  Returns the slot of @fd or a negative errno;
+ * requests on an unregistered file descriptor still work.
+ */
+int luring_register_fd(LuringState *s, int fd)
+{
+    int slot, ret;
+
+    if (!s->files_registered) {
+        /* Sparse tables need Linux 5.5 */
+        memset(s->fixed_files, -1, sizeof(s->fixed_files));
+        ret = io_uring_register_files(&s->ring, s->fixed_files,
+                                      MAX_FIXED_FILES);
+        if (ret < 0) {
+            return ret;
+        }
+        s->files_registered = true;
+    }
+
+    slot = luring_fixed_file(s, fd);
+    if (slot >= 0) {
+        return slot;
+    }
+    slot = luring_fixed_file(s, -1);
+    if (slot < 0) {
+        if (s->nb_fixed_files == MAX_FIXED_FILES) {
+            return -ENOSPC;
+        }
+        slot = s->nb_fixed_files;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, slot, &fd, 1);
+    trace_luring_register_fd(s, fd, slot, ret);
+    if (ret < 0) {
+        return ret;
+    }
+    s->fixed_files[slot] = fd;
+    s->nb_fixed_files = MAX(s->nb_fixed_files, slot + 1);
+    return slot;
+}
+
+/**
+ * luring_unregister_fd:
+ * @s: AIO state
+ * @fd: file descriptor
+ *
+ * Drops @fd from the registered files.  Must be called before @fd is
+ * closed, and with no request on @fd waiting for submission.
+ */
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int slot = luring_fixed_file(s, fd);
+    int none = -1;
+
+    if (slot < 0) {
+        return;
+    }
+    /* Requests in flight hold their own reference to the file */
+    io_uring_register_files_update(&s->ring, slot, &none, 1);
+    s->fixed_files[slot] = -1;
+    trace_luring_register_fd(s, -1, slot, 0);
+}
+
+/**
+ * luring_enable_fixed_buffers:
+ * @s: AIO state
+ *
+ * Registers guest RAM with the ring, so that requests to guest memory do
+ * not have to pin their pages.  Must be called from the main loop.
+ */
+void luring_enable_fixed_buffers(LuringState *s)
+{
+    static bool notifier_added;
+
+    if (!notifier_added) {
+        ram_block_notifier_add_replay(&luring_ram_notifier);
+        notifier_added = true;
+    }
+    s->fixed_buffers = true;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_fd_handler(old_context, s->ring.ring_fd, false,
+                       NULL, NULL, NULL, s);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_fd_handler(s->aio_context, s->ring.ring_fd, false,
+                       qemu_luring_completion_cb, NULL,
+                       qemu_luring_poll_cb, s);
+}
+
+LuringState *luring_init(void)
+{
+    LuringState *s;
+    int ret;
+
+    s = g_new0(LuringState, 1);
+    ret = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    trace_luring_init_state(s, ret);
+    if (ret < 0) {
+        g_free(s);
+        return NULL;
+    }
+
+    ioq_init(&s->io_q);
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    io_uring_queue_exit(&s->ring);
+    g_free(s->buffers);
+    trace_luring_cleanup_state(s);
+    g_free(s);
+}
@@ -29,6 +29,7 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qemu/error-report.h"
 #include "nbd-client.h"
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
@@ -180,39 +181,205 @@ err:
     return rc;
 }
 
+/* Read the payload of the structured reply chunk in s->reply, which
+ * belongs to @request.  Return 0 on success or a negative errno if the
+ * chunk reports an error for the request; if the chunk cannot be parsed,
+ * set s->quit and return -EIO. */
+static int nbd_co_receive_chunk_payload(NBDClientSession *s,
+                                        NBDRequest *request,
+                                        QEMUIOVector *qiov,
+                                        NBDExtent *extent)
+{
+    NBDReply *chunk = &s->reply;
+    Error *local_err = NULL;
+    QEMUIOVector sub_qiov;
+    uint64_t offset;
+    uint32_t len, context_id, error;
+    uint16_t msglen;
+    int ret;
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        if (!(chunk->flags & NBD_REPLY_FLAG_DONE) || chunk->length) {
+            error_setg(&local_err, "invalid NBD_REPLY_TYPE_NONE chunk");
+            goto fail;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        if (!qiov || chunk->length <= sizeof(offset)) {
+            error_setg(&local_err, "unexpected data chunk");
+            goto fail;
+        }
+        if (nbd_read(s->ioc, &offset, sizeof(offset), &local_err) < 0) {
+            goto fail;
+        }
+        offset = be64_to_cpu(offset);
+        len = chunk->length - sizeof(offset);
+        if (offset < request->from || len > request->len ||
+            offset - request->from > request->len - len) {
+            error_setg(&local_err, "data chunk outside of the request");
+            goto fail;
+        }
+
+        qemu_iovec_init(&sub_qiov, qiov->niov);
+        qemu_iovec_concat(&sub_qiov, qiov, offset - request->from, len);
+        ret = qio_channel_readv_all(s->ioc, sub_qiov.iov, sub_qiov.niov,
+                                    &local_err);
+        qemu_iovec_destroy(&sub_qiov);
+        if (ret < 0) {
+            goto fail;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || chunk->length != sizeof(offset) + sizeof(len)) {
+            error_setg(&local_err, "unexpected hole chunk");
+            goto fail;
+        }
+        if (nbd_read(s->ioc, &offset, sizeof(offset), &local_err) < 0 ||
+            nbd_read(s->ioc, &len, sizeof(len), &local_err) < 0) {
+            goto fail;
+        }
+        offset = be64_to_cpu(offset);
+        len = be32_to_cpu(len);
+        if (offset < request->from || len > request->len ||
+            offset - request->from > request->len - len) {
+            error_setg(&local_err, "hole chunk outside of the request");
+            goto fail;
+        }
+
+        qemu_iovec_memset(qiov, offset - request->from, 0, len);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        if (!extent || extent->length ||
+            chunk->length < sizeof(context_id) + sizeof(*extent) ||
+            (chunk->length - sizeof(context_id)) % sizeof(*extent)) {
+            error_setg(&local_err, "unexpected block status chunk");
+            goto fail;
+        }
+        if (nbd_read(s->ioc, &context_id, sizeof(context_id),
+                     &local_err) < 0 ||
+            nbd_read(s->ioc, extent, sizeof(*extent), &local_err) < 0) {
+            goto fail;
+        }
+        if (be32_to_cpu(context_id) != s->info.meta_base_allocation_id) {
+            error_setg(&local_err, "block status for an unknown context");
+            goto fail;
+        }
+        extent->length = be32_to_cpu(extent->length);
+        extent->flags = be32_to_cpu(extent->flags);
+        if (!extent->length || extent->length > request->len) {
+            error_setg(&local_err, "invalid extent length %" PRIu32,
+                       extent->length);
+            goto fail;
+        }
+
+        /* We asked for a single extent; ignore any others */
+        len = chunk->length - sizeof(context_id) - sizeof(*extent);
+        if (len && nbd_drop(s->ioc, len, &local_err) < 0) {
+            goto fail;
+        }
+        return 0;
+
+    default:
+        if (!nbd_reply_type_is_error(chunk->type) ||
+            chunk->length < sizeof(error) + sizeof(msglen)) {
+            error_setg(&local_err, "unexpected reply chunk type %" PRIu16,
+                       chunk->type);
+            goto fail;
+        }
+        if (nbd_read(s->ioc, &error, sizeof(error), &local_err) < 0 ||
+            nbd_read(s->ioc, &msglen, sizeof(msglen), &local_err) < 0) {
+            goto fail;
+        }
+        error = nbd_errno_to_system_errno(be32_to_cpu(error));
+        msglen = be16_to_cpu(msglen);
+        len = chunk->length - sizeof(error) - sizeof(msglen);
+        if (!error || msglen > len) {
+            error_setg(&local_err, "invalid error chunk");
+            goto fail;
+        }
+
+        /* Skip the message and, for NBD_REPLY_TYPE_ERROR_OFFSET, the
+         * offset of the error; the errno is all the block layer needs */
+        if (len && nbd_drop(s->ioc, len, &local_err) < 0) {
+            goto fail;
+        }
+        return -error;
+    }
+
+fail:
+    error_report_err(local_err);
+    s->quit = true;
+    return -EIO;
+}
+
 static int nbd_co_receive_reply(NBDClientSession *s,
                                 NBDRequest *request,
-                                QEMUIOVector *qiov)
+                                QEMUIOVector *qiov,
+                                NBDExtent *extent)
 {
-    int ret;
+    int ret = 0;
     int i = HANDLE_TO_INDEX(s, request->handle);
+    bool done = false;
+
+    while (!done) {
+        int chunk_ret;
+
+        /* Wait until we're woken up by nbd_read_reply_entry.  */
+        s->requests[i].receiving = true;
+        qemu_coroutine_yield();
+        s->requests[i].receiving = false;
+        if (!s->ioc || s->quit) {
+            ret = -EIO;
+            break;
+        }
 
-    /* Wait until we're woken up by nbd_read_reply_entry.  */
-    s->requests[i].receiving = true;
-    qemu_coroutine_yield();
-    s->requests[i].receiving = false;
-    if (!s->ioc || s->quit) {
-        ret = -EIO;
-    } else {
         assert(s->reply.handle == request->handle);
-        ret = -s->reply.error;
-        if (qiov && s->reply.error == 0) {
-            assert(request->len == iov_size(qiov->iov, qiov->niov));
-            if (qio_channel_readv_all(s->ioc, qiov->iov, qiov->niov,
-                                      NULL) < 0) {
-                ret = -EIO;
-                s->quit = true;
+        if (!s->reply.structured) {
+            chunk_ret = -s->reply.error;
+            if (qiov && s->reply.error == 0) {
+                assert(request->len == iov_size(qiov->iov, qiov->niov));
+                if (qio_channel_readv_all(s->ioc, qiov->iov, qiov->niov,
+                                          NULL) < 0) {
+                    chunk_ret = -EIO;
+                    s->quit = true;
+                }
             }
+            done = true;
+        } else if (!s->info.structured_reply) {
+            error_report("server sent a structured reply chunk without "
+                         "negotiating structured replies");
+            chunk_ret = -EIO;
+            s->quit = true;
+        } else {
+            chunk_ret = nbd_co_receive_chunk_payload(s, request, qiov, extent);
+            done = s->reply.flags & NBD_REPLY_FLAG_DONE;
+        }
+
+        /* Report the first error, but keep reading the other chunks */
+        if (!ret) {
+            ret = chunk_ret;
+        }
+        if (s->quit) {
+            ret = -EIO;
+            break;
         }
 
         /* Tell the read handler to read another header.  */
         s->reply.handle = 0;
+
+        /* Kick the read_reply_co to get the next reply (or chunk).  */
+        if (s->read_reply_co) {
+            aio_co_wake(s->read_reply_co);
+        }
     }
 
     s->requests[i].coroutine = NULL;
 
-    /* Kick the read_reply_co to get the next reply.  */
-    if (s->read_reply_co) {
+    if (!done && s->read_reply_co) {
         aio_co_wake(s->read_reply_co);
     }
 
@@ -240,7 +407,8 @@ static int nbd_co_request(BlockDriverState *bs,
     }
 
     return nbd_co_receive_reply(client, request,
-                                request->type == NBD_CMD_READ ? qiov : NULL);
+                                request->type == NBD_CMD_READ ? qiov : NULL,
+                                NULL);
 }
 
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
@@ -334,6 +502,59 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
     return nbd_co_request(bs, &request, NULL);
 }
 
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDExtent extent = { 0 };
+    NBDRequest request = {
+        .type = NBD_CMD_BLOCK_STATUS,
+        .from = sector_num << BDRV_SECTOR_BITS,
+        .len = MIN((uint64_t)nb_sectors << BDRV_SECTOR_BITS, UINT32_MAX),
+        .flags = NBD_CMD_FLAG_REQ_ONE,
+    };
+    int64_t ret = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+                  (sector_num << BDRV_SECTOR_BITS);
+    int err;
+
+    *pnum = nb_sectors;
+    *file = bs;
+
+    if (!client->info.base_allocation) {
+        return ret;
+    }
+
+    err = nbd_co_send_request(bs, &request, NULL);
+    if (err < 0) {
+        return err;
+    }
+    err = nbd_co_receive_reply(client, &request, NULL, &extent);
+    if (err < 0) {
+        return err;
+    }
+    if (!extent.length) {
+        error_report("server did not send block status");
+        return -EIO;
+    }
+
+    /* Extents need not be sector-aligned; treat a short one as data */
+    if (extent.length < BDRV_SECTOR_SIZE) {
+        *pnum = 1;
+        return ret;
+    }
+
+    *pnum = MIN(extent.length >> BDRV_SECTOR_BITS, nb_sectors);
+    if (extent.flags & NBD_STATE_HOLE) {
+        ret &= ~BDRV_BLOCK_DATA;
+    }
+    if (extent.flags & NBD_STATE_ZERO) {
+        ret |= BDRV_BLOCK_ZERO;
+    }
+    return ret;
+}
+
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
@@ -377,6 +598,8 @@ int nbd_client_init(BlockDriverState *bs,
     qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
     client->info.request_sizes = true;
+    client->info.structured_reply = true;
+    client->info.base_allocation = true;
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
                                 tlscreds, hostname,
                                 &client->ioc, &client->info, errp);
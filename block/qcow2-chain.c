@@ -0,0 +1,409 @@
+/*
+ * Allocation index for qcow2 backing chains
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Every savevm-ext snapshot freezes the active image and puts a new qcow2
+ * overlay on top of it, so long running guests end up with chains of
+ * hundreds of images.  Without help, a read of a cluster that the active
+ * image does not have goes down the chain one image at a time, with an L2
+ * lookup in each of them.
+ *
+ * The index maps every guest cluster of the active image to the level of
+ * the topmost image in the chain that has it (level 0 being the bottom), so
+ * the read can go straight to that image.  It is built on the first read
+ * that needs it, kept up to date by allocating writes to the active image,
+ * and handed over to the new overlay when another one is put on top.
+ *
+ * Anything else that could change what the chain below the active image
+ * returns (writes to backing files, discards, resizing, changing a backing
+ * link) makes all indexes stale by bumping a global generation number.
+ * These events are rare next to guest I/O, and a stale index is simply
+ * rebuilt on the next read that needs it.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "block/block_int.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/* Owner values that are not a level */
+#define QCOW2_CHAIN_ZERO    0xffff  /* no image has it, reads as zeroes */
+#define QCOW2_CHAIN_WALK    0xfffe  /* take the normal path */
+#define QCOW2_CHAIN_MAX_LAYERS  QCOW2_CHAIN_WALK
+
+struct Qcow2ChainIndex {
+    unsigned long generation;
+    uint64_t nb_clusters;
+    int cluster_bits;
+    unsigned nb_layers;
+    /* layers[0] is the bottom of the chain, the last one the active image */
+    BlockDriverState **layers;
+    /* size of layers[0], which may not be a qcow2 image */
+    int64_t bottom_sectors;
+    /* level of the topmost image that has each cluster */
+    uint16_t *owner;
+};
+
+static unsigned long qcow2_chain_generation = 1;
+
+/* Whether @bs is part of an index that is not stale */
+static bool qcow2_chain_member(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return s->chain_generation == atomic_read(&qcow2_chain_generation);
+}
+
+void qcow2_chain_index_invalidate(BlockDriverState *bs)
+{
+    if (qcow2_chain_member(bs)) {
+        trace_qcow2_chain_index_invalidate(bs);
+        atomic_inc(&qcow2_chain_generation);
+    }
+}
+
+void qcow2_chain_index_allocated(BlockDriverState *bs, uint64_t offset,
+                                 uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ChainIndex *ci = s->chain_index;
+    uint64_t start, end;
+
+    if (!ci || !qcow2_chain_member(bs)) {
+        /* a backing file of some index changed */
+        qcow2_chain_index_invalidate(bs);
+        return;
+    }
+
+    start = offset >> ci->cluster_bits;
+    end = MIN(DIV_ROUND_UP(offset + bytes, 1ULL << ci->cluster_bits),
+              ci->nb_clusters);
+    for (; start < end; start++) {
+        ci->owner[start] = ci->nb_layers - 1;
+    }
+}
+
+void qcow2_chain_index_free(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ChainIndex *ci = s->chain_index;
+
+    if (ci) {
+        g_free(ci->layers);
+        g_free(ci->owner);
+        g_free(ci);
+        s->chain_index = NULL;
+    }
+}
+
+/*
+ * Whether an index can look into the allocation of @bs directly; other
+ * images end the indexed part of the chain and are read through normally.
+ * The index has one owner per cluster, so images with subclusters, where a
+ * cluster can be partly allocated, are not indexable either.
+ */
+static bool qcow2_chain_indexable(BlockDriverState *bs, int cluster_bits)
+{
+    return bs->drv == &bdrv_qcow2 &&
+           ((BDRVQcow2State *)bs->opaque)->cluster_bits == cluster_bits &&
+           !has_subclusters((BDRVQcow2State *)bs->opaque);
+}
+
+/* Whether @bs is the backing file of another node */
+static bool qcow2_chain_is_backing(BlockDriverState *bs)
+{
+    BdrvChild *c;
+
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        if (c->role == &child_backing) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Hide what is below an image of @length bytes from the levels above it:
+ * clusters past its end read as zeroes, a cluster that it only partly
+ * covers is left to the normal path.
+ */
+static void qcow2_chain_clip(Qcow2ChainIndex *ci, uint64_t length)
+{
+    uint64_t c = length >> ci->cluster_bits;
+
+    if (c < ci->nb_clusters && (length & ((1ULL << ci->cluster_bits) - 1))) {
+        ci->owner[c++] = QCOW2_CHAIN_WALK;
+    }
+    for (; c < ci->nb_clusters; c++) {
+        ci->owner[c] = QCOW2_CHAIN_ZERO;
+    }
+}
+
+/*
+ * Give the clusters that @bs has allocated to @level.  The caller holds the
+ * lock of the active image; the lock of any other image is taken here.
+ */
+static int coroutine_fn qcow2_chain_scan(BlockDriverState *bs,
+                                         Qcow2ChainIndex *ci, uint16_t level,
+                                         bool locked)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t size = MIN(bs->total_sectors * BDRV_SECTOR_SIZE,
+                        ci->nb_clusters << ci->cluster_bits);
+    uint64_t offset = 0;
+    int ret = 0;
+
+    if (!locked) {
+        qemu_co_mutex_lock(&s->lock);
+    }
+    while (offset < size) {
+        unsigned int bytes = MIN(size - offset, 1U << 30);
+        uint64_t cluster_offset, c, end;
+
+        ret = qcow2_get_cluster_offset(bs, offset, &bytes, &cluster_offset);
+        if (ret < 0) {
+            break;
+        }
+        if (ret != QCOW2_CLUSTER_UNALLOCATED) {
+            c = offset >> ci->cluster_bits;
+            end = DIV_ROUND_UP(offset + bytes, 1ULL << ci->cluster_bits);
+            for (; c < end; c++) {
+                ci->owner[c] = level;
+            }
+        }
+        offset += bytes;
+        ret = 0;
+    }
+    if (!locked) {
+        qemu_co_mutex_unlock(&s->lock);
+    }
+
+    s->chain_generation = ci->generation;
+    return ret;
+}
+
+/* Build an index for the chain below @bs from scratch */
+static Qcow2ChainIndex *coroutine_fn qcow2_chain_build(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ChainIndex *ci = g_new0(Qcow2ChainIndex, 1);
+    BlockDriverState *layer;
+    unsigned i;
+    int ret;
+
+    ci->generation = atomic_read(&qcow2_chain_generation);
+    ci->cluster_bits = s->cluster_bits;
+    ci->nb_clusters = size_to_clusters(s, bs->total_sectors *
+                                          BDRV_SECTOR_SIZE);
+
+    /* Collect the chain top down, then turn it around */
+    for (layer = bs; ; layer = layer->backing->bs) {
+        /* leave room for an image of another kind at the bottom */
+        if (ci->nb_layers + 1 >= QCOW2_CHAIN_MAX_LAYERS) {
+            goto fail;
+        }
+        ci->layers = g_renew(BlockDriverState *, ci->layers,
+                             ci->nb_layers + 1);
+        ci->layers[ci->nb_layers++] = layer;
+        if (layer != bs) {
+            /* drop what is left of an index from before the last snapshot */
+            BDRVQcow2State *ls = layer->opaque;
+
+            if (ls->chain_index &&
+                ls->chain_index->generation != ci->generation) {
+                qcow2_chain_index_free(layer);
+            }
+        }
+        if (!layer->backing ||
+            !qcow2_chain_indexable(layer->backing->bs, ci->cluster_bits)) {
+            if (layer->backing) {
+                /* the rest of the chain is read through this image */
+                ci->layers = g_renew(BlockDriverState *, ci->layers,
+                                     ci->nb_layers + 1);
+                ci->layers[ci->nb_layers++] = layer->backing->bs;
+            }
+            break;
+        }
+    }
+    for (i = 0; i < ci->nb_layers / 2; i++) {
+        layer = ci->layers[i];
+        ci->layers[i] = ci->layers[ci->nb_layers - 1 - i];
+        ci->layers[ci->nb_layers - 1 - i] = layer;
+    }
+
+    ci->owner = g_try_new(uint16_t, ci->nb_clusters);
+    if (ci->nb_clusters && !ci->owner) {
+        goto fail;
+    }
+
+    layer = ci->layers[0];
+    ci->bottom_sectors = layer->total_sectors;
+    if (qcow2_chain_indexable(layer, ci->cluster_bits)) {
+        qcow2_chain_clip(ci, 0);
+        ret = qcow2_chain_scan(layer, ci, 0, layer == bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    } else {
+        /* an image of another kind has everything that is left */
+        memset(ci->owner, 0, ci->nb_clusters * sizeof(ci->owner[0]));
+    }
+
+    for (i = 1; i < ci->nb_layers; i++) {
+        layer = ci->layers[i];
+        qcow2_chain_clip(ci, ci->layers[i - 1]->total_sectors *
+                             BDRV_SECTOR_SIZE);
+        ret = qcow2_chain_scan(layer, ci, i, layer == bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    trace_qcow2_chain_index_build(bs, ci->nb_layers, ci->nb_clusters);
+    return ci;
+
+fail:
+    g_free(ci->layers);
+    g_free(ci->owner);
+    g_free(ci);
+    return NULL;
+}
+
+/* Take over the index of the backing file of @bs and add @bs on top */
+static Qcow2ChainIndex *coroutine_fn qcow2_chain_adopt(BlockDriverState *bs)
+{
+    BlockDriverState *backing = bs->backing->bs;
+    BDRVQcow2State *bs_backing = backing->opaque;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ChainIndex *ci = bs_backing->chain_index;
+    uint64_t nb_clusters = size_to_clusters(s, bs->total_sectors *
+                                               BDRV_SECTOR_SIZE);
+    uint16_t *owner;
+
+    if (ci->nb_layers >= QCOW2_CHAIN_MAX_LAYERS) {
+        return NULL;
+    }
+    if (nb_clusters > ci->nb_clusters) {
+        owner = g_try_renew(uint16_t, ci->owner, nb_clusters);
+        if (!owner) {
+            return NULL;
+        }
+        ci->owner = owner;
+    }
+    bs_backing->chain_index = NULL;
+
+    /* qcow2_chain_clip() fills in whatever the array just grew by */
+    ci->nb_clusters = nb_clusters;
+    qcow2_chain_clip(ci, backing->total_sectors * BDRV_SECTOR_SIZE);
+
+    ci->layers = g_renew(BlockDriverState *, ci->layers, ci->nb_layers + 1);
+    ci->layers[ci->nb_layers++] = bs;
+    if (qcow2_chain_scan(bs, ci, ci->nb_layers - 1, true) < 0) {
+        s->chain_index = ci;
+        qcow2_chain_index_free(bs);
+        return NULL;
+    }
+
+    trace_qcow2_chain_index_adopt(bs, backing, ci->nb_layers);
+    return ci;
+}
+
+/* Returns the index of the chain below @bs, or NULL if there is none */
+static Qcow2ChainIndex *coroutine_fn qcow2_chain_index_get(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned long generation = atomic_read(&qcow2_chain_generation);
+    BlockDriverState *backing;
+    Qcow2ChainIndex *ci = s->chain_index;
+
+    /* The bottom image is not necessarily qcow2, check its size here */
+    if (ci && ci->generation == generation &&
+        ci->layers[0]->total_sectors == ci->bottom_sectors) {
+        return ci;
+    }
+    qcow2_chain_index_free(bs);
+
+    /* Only the image at the top of a chain keeps an index */
+    if (!s->use_chain_index || !bs->backing || has_subclusters(s) ||
+        s->chain_failed_generation == generation ||
+        qcow2_chain_is_backing(bs)) {
+        return NULL;
+    }
+
+    backing = bs->backing->bs;
+    ci = NULL;
+    if (qcow2_chain_indexable(backing, s->cluster_bits)) {
+        ci = ((BDRVQcow2State *)backing->opaque)->chain_index;
+    }
+    if (ci && ci->generation == generation &&
+        ci->layers[0]->total_sectors == ci->bottom_sectors) {
+        s->chain_index = qcow2_chain_adopt(bs);
+    } else {
+        s->chain_index = qcow2_chain_build(bs);
+    }
+
+    /* A failed build would only fail again, wait for the chain to change */
+    if (!s->chain_index) {
+        s->chain_failed_generation = generation;
+    }
+    return s->chain_index;
+}
+
+/*
+ * qcow2_chain_index_lookup: Find where to read a range that @bs does not
+ * have allocated
+ *
+ * The caller holds the lock of @bs, which must have a backing file.
+ *
+ * On entry, *bytes is the length of the range at @offset.  On exit, it is the
+ * length of the part of the range that comes from the same place.
+ *
+ * *depth is set to the number of levels below @bs that the data is read
+ * from, zero if the range reads as zeroes and -1 if it is not known.
+ *
+ * Returns the child to read from, bs->backing if the range must go down the
+ * chain as usual, or NULL if it reads as zeroes.
+ */
+BdrvChild *coroutine_fn qcow2_chain_index_lookup(BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 uint64_t *bytes, int *depth)
+{
+    Qcow2ChainIndex *ci = qcow2_chain_index_get(bs);
+    uint64_t c, end, last;
+    unsigned top;
+    uint16_t owner;
+
+    *depth = -1;
+    if (!ci) {
+        return bs->backing;
+    }
+
+    c = offset >> ci->cluster_bits;
+    last = DIV_ROUND_UP(offset + *bytes, 1ULL << ci->cluster_bits);
+    if (c >= ci->nb_clusters) {
+        return bs->backing;
+    }
+    owner = ci->owner[c];
+    for (end = c + 1; end < MIN(last, ci->nb_clusters); end++) {
+        if (ci->owner[end] != owner) {
+            *bytes = (end << ci->cluster_bits) - offset;
+            break;
+        }
+    }
+
+    top = ci->nb_layers - 1;
+    if (owner == QCOW2_CHAIN_ZERO) {
+        *depth = 0;
+        return NULL;
+    } else if (owner == QCOW2_CHAIN_WALK || owner >= top) {
+        return bs->backing;
+    }
+
+    *depth = top - owner;
+    return ci->layers[owner + 1]->backing;
+}
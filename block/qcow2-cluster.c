@@ -23,7 +23,6 @@
  */
 
 #include "qemu/osdep.h"
-#include <zlib.h>
 
 #include "qapi/error.h"
 #include "qemu-common.h"
@@ -196,20 +195,26 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
 /*
  * l2_load
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * @bs: The BlockDriverState
+ * @offset: A guest offset, used to calculate what slice of the L2
+ *          table to load.
+ * @l2_offset: Offset to the L2 table in the image file.
+ * @l2_slice: Location to store the pointer to the L2 slice.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Loads a L2 slice into memory (L2 slices are the parts of L2 tables
+ * that are loaded by the qcow2 cache). If the slice is in the cache,
+ * the cache is used; otherwise the L2 slice is loaded from the image
+ * file.
  */
-
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+                   uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcow2State *s = bs->opaque;
+    int start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
 
-    return qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                           (void **)l2_table);
+    return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
+                           (void **)l2_slice);
 }
 
 /*
@@ -256,13 +261,15 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * The new table is written through the L2 cache one slice at a time.
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t old_l2_offset;
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
+    unsigned slice, slice_size2, n_slices;
     int64_t l2_offset;
     int ret;
 
@@ -272,7 +279,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * l2_entry_size(s));
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -283,41 +290,49 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    /* allocate a new entry in the l2 cache */
+    /* allocate new entries in the l2 cache */
+
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
 
     trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        goto fail;
-    }
+    for (slice = 0; slice < n_slices; slice++) {
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice * slice_size2,
+                                    (void **) &l2_slice);
+        if (ret < 0) {
+            goto fail;
+        }
 
-    l2_table = *table;
+        if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
+            /* if there was no old l2 table, clear the new slice */
+            memset(l2_slice, 0, slice_size2);
+        } else {
+            uint64_t *old_slice;
+            uint64_t old_l2_slice_offset =
+                (old_l2_offset & L1E_OFFSET_MASK) + slice * slice_size2;
+
+            /* if there was an old l2 table, read a slice from the disk */
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache, old_l2_slice_offset,
+                                  (void **) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
 
-    if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
-        /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-    } else {
-        uint64_t* old_table;
+            memcpy(l2_slice, old_slice, slice_size2);
 
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
-        if (ret < 0) {
-            goto fail;
+            qcow2_cache_put(bs, s->l2_table_cache, (void **) &old_slice);
         }
 
-        memcpy(l2_table, old_table, s->cluster_size);
+        /* write the l2 slice to the file */
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
-        qcow2_cache_put(bs, s->l2_table_cache, (void **) &old_table);
+        trace_qcow2_l2_allocate_write_l2(bs, l1_index);
+        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
     }
 
-    /* write the l2 table to the file */
-    BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
-
-    trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -331,18 +346,17 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    if (l2_table != NULL) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
+    if (l2_slice != NULL) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -355,13 +369,13 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(int nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcow2State *s, int nb_clusters,
+        uint64_t *l2_slice, int l2_index, uint64_t stop_flags)
 {
     int i;
     QCow2ClusterType first_cluster_type;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_slice, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset) {
@@ -374,8 +388,8 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
            first_cluster_type == QCOW2_CLUSTER_ZERO_ALLOC);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i) & mask;
+        if (offset + (uint64_t) i * s->cluster_size != l2_entry) {
             break;
         }
     }
@@ -387,8 +401,10 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
  * Checks how many consecutive unallocated clusters in a given L2
  * table have the same cluster type.
  */
-static int count_contiguous_clusters_unallocated(int nb_clusters,
-                                                 uint64_t *l2_table,
+static int count_contiguous_clusters_unallocated(BDRVQcow2State *s,
+                                                 int nb_clusters,
+                                                 uint64_t *l2_slice,
+                                                 int l2_index,
                                                  QCow2ClusterType wanted_type)
 {
     int i;
@@ -396,7 +412,7 @@ static int count_contiguous_clusters_unallocated(int nb_clusters,
     assert(wanted_type == QCOW2_CLUSTER_ZERO_PLAIN ||
            wanted_type == QCOW2_CLUSTER_UNALLOCATED);
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t entry = be64_to_cpu(l2_table[i]);
+        uint64_t entry = get_l2_entry(s, l2_slice, l2_index + i);
         QCow2ClusterType type = qcow2_get_cluster_type(entry);
 
         if (type != wanted_type) {
@@ -407,6 +423,87 @@ static int count_contiguous_clusters_unallocated(int nb_clusters,
     return i;
 }
 
+/*
+ * What a subcluster of an image with extended L2 entries looks like to the
+ * callers of qcow2_get_cluster_offset().  Subclusters that are neither
+ * allocated nor zero read from the backing file, whether there is a host
+ * cluster for them or not.
+ */
+static QCow2ClusterType qcow2_subcluster_to_cluster_type(QCow2SubclusterType t)
+{
+    switch (t) {
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+        return QCOW2_CLUSTER_UNALLOCATED;
+    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+        return QCOW2_CLUSTER_ZERO_PLAIN;
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+        return QCOW2_CLUSTER_ZERO_ALLOC;
+    case QCOW2_SUBCLUSTER_NORMAL:
+        return QCOW2_CLUSTER_NORMAL;
+    case QCOW2_SUBCLUSTER_COMPRESSED:
+        return QCOW2_CLUSTER_COMPRESSED;
+    default:
+        abort();
+    }
+}
+
+/*
+ * Counts the subclusters, starting at subcluster @sc_index of the cluster at
+ * @l2_index and going on for at most @nb_clusters clusters, that look the
+ * same to qcow2_get_cluster_offset() as the first one.  Allocated
+ * subclusters must also be contiguous in the image file.  The type of the
+ * first subcluster is stored in *@type.
+ *
+ * Compressed clusters are returned one by one.
+ *
+ * Returns -EIO if one of the subclusters has an invalid state.
+ */
+static int count_contiguous_subclusters(BDRVQcow2State *s, int nb_clusters,
+                                        unsigned sc_index, uint64_t *l2_slice,
+                                        int l2_index, QCow2ClusterType *type)
+{
+    uint64_t first_offset = 0;
+    int i, count = 0;
+
+    assert(nb_clusters > 0 && l2_index + nb_clusters <= s->l2_slice_size);
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+
+        for (; sc_index < s->subclusters_per_cluster; sc_index++) {
+            QCow2SubclusterType sc_type =
+                qcow2_get_subcluster_type(l2_entry, l2_bitmap, sc_index);
+            QCow2ClusterType cl_type;
+
+            if (sc_type == QCOW2_SUBCLUSTER_INVALID) {
+                return count ? count : -EIO;
+            }
+            cl_type = qcow2_subcluster_to_cluster_type(sc_type);
+
+            if (count == 0) {
+                *type = cl_type;
+                first_offset = l2_entry & L2E_OFFSET_MASK;
+                if (cl_type == QCOW2_CLUSTER_COMPRESSED) {
+                    return s->subclusters_per_cluster - sc_index;
+                }
+            } else if (cl_type != *type) {
+                return count;
+            } else if ((cl_type == QCOW2_CLUSTER_NORMAL ||
+                        cl_type == QCOW2_CLUSTER_ZERO_ALLOC) &&
+                       (l2_entry & L2E_OFFSET_MASK) !=
+                       first_offset + ((uint64_t)i << s->cluster_bits)) {
+                return count;
+            }
+            count++;
+        }
+        sc_index = 0;
+    }
+
+    return count;
+}
+
 static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
                                             uint64_t src_cluster_offset,
                                             unsigned offset_in_cluster,
@@ -498,7 +595,9 @@ static int coroutine_fn do_perform_cow_write(BlockDriverState *bs,
  *
  * On exit, *bytes is the number of bytes starting at offset that have the same
  * cluster type and (if applicable) are stored contiguously in the image file.
- * Compressed clusters are always returned one by one.
+ * Compressed clusters are always returned one by one.  In images with
+ * extended L2 entries, the type is that of the subclusters, and a subcluster
+ * that is neither allocated nor zero is reported as unallocated.
  *
  * Returns the cluster type (QCOW2_CLUSTER_*) on success, -errno in error
  * cases.
@@ -508,8 +607,8 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 {
     BDRVQcow2State *s = bs->opaque;
     unsigned int l2_index;
-    uint64_t l1_index, l2_offset, *l2_table;
-    int l1_bits, c;
+    uint64_t l1_index, l2_offset, *l2_slice;
+    int c;
     unsigned int offset_in_cluster;
     uint64_t bytes_available, bytes_needed, nb_clusters;
     QCow2ClusterType type;
@@ -518,12 +617,12 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     offset_in_cluster = offset_into_cluster(s, offset);
     bytes_needed = (uint64_t) *bytes + offset_in_cluster;
 
-    l1_bits = s->l2_bits + s->cluster_bits;
-
     /* compute how many bytes there are between the start of the cluster
-     * containing offset and the end of the l1 entry */
-    bytes_available = (1ULL << l1_bits) - (offset & ((1ULL << l1_bits) - 1))
-                    + offset_in_cluster;
+     * containing offset and the end of the l2 slice that contains
+     * the entry pointing to it */
+    bytes_available =
+        ((uint64_t) (s->l2_slice_size - offset_to_l2_slice_index(s, offset)))
+        << s->cluster_bits;
 
     if (bytes_needed > bytes_available) {
         bytes_needed = bytes_available;
@@ -533,7 +632,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* seek to the l2 offset in the l1 table */
 
-    l1_index = offset >> l1_bits;
+    l1_index = offset_to_l1_index(s, offset);
     if (l1_index >= s->l1_size) {
         type = QCOW2_CLUSTER_UNALLOCATED;
         goto out;
@@ -552,17 +651,17 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         return -EIO;
     }
 
-    /* load the l2 table in memory */
+    /* load the l2 slice in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
     if (ret < 0) {
         return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = offset_to_l2_index(s, offset);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    l2_index = offset_to_l2_slice_index(s, offset);
+    *cluster_offset = get_l2_entry(s, l2_slice, l2_index);
 
     nb_clusters = size_to_clusters(s, bytes_needed);
     /* bytes_needed <= *bytes + offset_in_cluster, both of which are unsigned
@@ -570,12 +669,51 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
      * true */
     assert(nb_clusters <= INT_MAX);
 
+    if (has_subclusters(s)) {
+        unsigned sc_index = offset_to_sc_index(s, offset);
+
+        c = count_contiguous_subclusters(s, nb_clusters, sc_index, l2_slice,
+                                         l2_index, &type);
+        if (c < 0) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Invalid cluster entry "
+                                    "found (L2 offset: %#" PRIx64
+                                    ", L2 index: %#x)", l2_offset,
+                                    offset_to_l2_index(s, offset));
+            ret = -EIO;
+            goto fail;
+        }
+
+        if (type == QCOW2_CLUSTER_COMPRESSED) {
+            *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
+        } else if (type == QCOW2_CLUSTER_NORMAL ||
+                   type == QCOW2_CLUSTER_ZERO_ALLOC) {
+            *cluster_offset &= L2E_OFFSET_MASK;
+            if (offset_into_cluster(s, *cluster_offset)) {
+                qcow2_signal_corruption(bs, true, -1, -1,
+                                        "Cluster allocation offset %#"
+                                        PRIx64 " unaligned (L2 offset: %#"
+                                        PRIx64 ", L2 index: %#x)",
+                                        *cluster_offset, l2_offset,
+                                        offset_to_l2_index(s, offset));
+                ret = -EIO;
+                goto fail;
+            }
+        } else {
+            *cluster_offset = 0;
+        }
+
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+        bytes_available = ((uint64_t)sc_index + c) << s->subcluster_bits;
+        goto out;
+    }
+
     type = qcow2_get_cluster_type(*cluster_offset);
     if (s->qcow_version < 3 && (type == QCOW2_CLUSTER_ZERO_PLAIN ||
                                 type == QCOW2_CLUSTER_ZERO_ALLOC)) {
         qcow2_signal_corruption(bs, true, -1, -1, "Zero cluster entry found"
                                 " in pre-v3 image (L2 offset: %#" PRIx64
-                                ", L2 index: %#x)", l2_offset, l2_index);
+                                ", L2 index: %#x)", l2_offset,
+                                offset_to_l2_index(s, offset));
         ret = -EIO;
         goto fail;
     }
@@ -588,22 +726,22 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     case QCOW2_CLUSTER_ZERO_PLAIN:
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_clusters_unallocated(nb_clusters,
-                                                  &l2_table[l2_index], type);
+        c = count_contiguous_clusters_unallocated(s, nb_clusters, l2_slice,
+                                                  l2_index, type);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_ZERO_ALLOC:
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_slice, l2_index,
+                                      QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1,
                                     "Cluster allocation offset %#"
                                     PRIx64 " unaligned (L2 offset: %#" PRIx64
                                     ", L2 index: %#x)", *cluster_offset,
-                                    l2_offset, l2_index);
+                                    l2_offset, offset_to_l2_index(s, offset));
             ret = -EIO;
             goto fail;
         }
@@ -612,7 +750,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         abort();
     }
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
 
     bytes_available = (int64_t)c * s->cluster_size;
 
@@ -630,7 +768,7 @@ out:
     return type;
 
 fail:
-    qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_slice);
     return ret;
 }
 
@@ -638,26 +776,25 @@ fail:
  * get_cluster_table
  *
  * for a given disk offset, load (and allocate if needed)
- * the l2 table.
+ * the appropriate slice of its l2 table.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the cluster index in the l2 slice is given to the caller.
  *
  * Returns 0 on success, -errno in failure case
  */
 static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
-                             uint64_t **new_l2_table,
+                             uint64_t **new_l2_slice,
                              int *new_l2_index)
 {
     BDRVQcow2State *s = bs->opaque;
     unsigned int l2_index;
     uint64_t l1_index, l2_offset;
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
     int ret;
 
     /* seek to the l2 offset in the l1 table */
 
-    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    l1_index = offset_to_l1_index(s, offset);
     if (l1_index >= s->l1_size) {
         ret = qcow2_grow_l1_table(bs, l1_index + 1, false);
         if (ret < 0) {
@@ -674,38 +811,101 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
         return -EIO;
     }
 
-    /* seek the l2 table of the given l2 offset */
-
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
-        if (ret < 0) {
-            return ret;
-        }
-    } else {
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index);
         if (ret < 0) {
             return ret;
         }
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                                 QCOW2_DISCARD_OTHER);
         }
+
+        /* Get the offset of the newly-allocated l2 table */
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+        assert(offset_into_cluster(s, l2_offset) == 0);
+    }
+
+    /* load the l2 slice in memory */
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
+    if (ret < 0) {
+        return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = offset_to_l2_index(s, offset);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
-    *new_l2_table = l2_table;
+    *new_l2_slice = l2_slice;
     *new_l2_index = l2_index;
 
     return 0;
 }
 
+/* Returns the cached decompressed data of @coffset, or NULL */
+static Qcow2CompressedCacheEntry *
+qcow2_compressed_cache_find(BDRVQcow2State *s, uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < QCOW2_COMPRESSED_CACHE_SIZE; i++) {
+        Qcow2CompressedCacheEntry *entry = &s->compressed_cache[i];
+
+        if (entry->offset == coffset) {
+            entry->lru_counter = ++s->compressed_cache_lru_counter;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Caches @data, which must have been allocated with g_malloc() */
+static void qcow2_compressed_cache_insert(BDRVQcow2State *s, uint64_t coffset,
+                                          uint8_t *data)
+{
+    Qcow2CompressedCacheEntry *entry = &s->compressed_cache[0];
+    int i;
+
+    for (i = 1; i < QCOW2_COMPRESSED_CACHE_SIZE; i++) {
+        if (s->compressed_cache[i].lru_counter < entry->lru_counter) {
+            entry = &s->compressed_cache[i];
+        }
+    }
+
+    g_free(entry->data);
+    entry->offset = coffset;
+    entry->data = data;
+    entry->lru_counter = ++s->compressed_cache_lru_counter;
+}
+
+/*
+ * Drops the cached data of @coffset when new compressed data is stored
+ * there.  Compressed clusters are never rewritten in place, so this is the
+ * only way cached data can become stale.
+ */
+static void qcow2_compressed_cache_invalidate(BDRVQcow2State *s,
+                                              uint64_t coffset)
+{
+    int i;
+
+    /* Requests that are decompressing right now must not cache their data */
+    s->compressed_cache_generation++;
+
+    for (i = 0; i < QCOW2_COMPRESSED_CACHE_SIZE; i++) {
+        Qcow2CompressedCacheEntry *entry = &s->compressed_cache[i];
+
+        if (entry->offset == coffset) {
+            g_free(entry->data);
+            entry->data = NULL;
+            entry->offset = -1;
+            entry->lru_counter = 0;
+        }
+    }
+}
+
 /*
  * alloc_compressed_cluster_offset
  *
@@ -725,28 +925,29 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     int l2_index, ret;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     int64_t cluster_offset;
     int nb_csectors;
 
-    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return 0;
     }
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
         return 0;
     }
 
     cluster_offset = qcow2_alloc_bytes(bs, compressed_size);
     if (cluster_offset < 0) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
         return 0;
     }
+    qcow2_compressed_cache_invalidate(s, cluster_offset);
 
     nb_csectors = ((cluster_offset + compressed_size - 1) >> 9) -
                   (cluster_offset >> 9);
@@ -759,9 +960,15 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
     /* compressed clusters never have the copied flag */
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
-    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        /* the bitmap of compressed clusters is reserved */
+        set_l2_bitmap(s, l2_slice, l2_index, 0);
+    }
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+
+    qcow2_chain_index_allocated(bs, offset, s->cluster_size);
 
     return cluster_offset;
 }
@@ -896,11 +1103,50 @@ fail:
     return ret;
 }
 
+/*
+ * Returns the new subcluster bitmap of cluster @i of the allocation @m.
+ *
+ * The subclusters that @m writes (the guest data and both COW regions) are
+ * allocated.  If the host cluster is kept or was not there before, the other
+ * subclusters stay as they were; otherwise handle_alloc() has copied the
+ * whole cluster and all of it is allocated anyway.
+ */
+static uint64_t link_l2_bitmap(BDRVQcow2State *s, QCowL2Meta *m, int i,
+                               uint64_t old_entry, uint64_t old_bitmap)
+{
+    uint64_t start = m->cow_start.offset;
+    uint64_t end = m->cow_end.offset + m->cow_end.nb_bytes;
+    uint64_t cluster_start = (uint64_t)i << s->cluster_bits;
+    uint64_t alloc;
+
+    if (end == 0) {
+        /* preallocation, which does not describe any data */
+        end = (uint64_t)m->nb_clusters << s->cluster_bits;
+    }
+
+    /* A subcluster that is only partly covered is allocated already */
+    start = MAX(start, cluster_start) - cluster_start;
+    start = QEMU_ALIGN_DOWN(start, s->subcluster_size);
+    end = MIN(end, cluster_start + s->cluster_size) - cluster_start;
+    end = QEMU_ALIGN_UP(end, s->subcluster_size);
+    assert(start < end);
+
+    alloc = QCOW_OFLAG_SUB_ALLOC_RANGE(start >> s->subcluster_bits,
+                                       end >> s->subcluster_bits);
+
+    if (!m->keep_old_clusters &&
+        (old_entry & (L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED))) {
+        assert(alloc == QCOW_L2_BITMAP_ALL_ALLOC);
+        return alloc;
+    }
+    return (old_bitmap | alloc) & ~(alloc << 32);
+}
+
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcow2State *s = bs->opaque;
     int i, j = 0, l2_index, ret;
-    uint64_t *old_cluster, *l2_table;
+    uint64_t *old_cluster, *l2_slice;
     uint64_t cluster_offset = m->alloc_offset;
 
     trace_qcow2_cluster_link_l2(qemu_coroutine_self(), m->nb_clusters);
@@ -927,30 +1173,41 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
                                    s->refcount_block_cache);
     }
 
-    ret = get_cluster_table(bs, m->offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, m->offset, &l2_slice, &l2_index);
     if (ret < 0) {
         goto err;
     }
-    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
 
-    assert(l2_index + m->nb_clusters <= s->l2_size);
+    assert(l2_index + m->nb_clusters <= s->l2_slice_size);
     for (i = 0; i < m->nb_clusters; i++) {
+        uint64_t old_entry = get_l2_entry(s, l2_slice, l2_index + i);
+
         /* if two concurrent writes happen to the same unallocated cluster
          * each write allocates separate cluster and writes data concurrently.
          * The first one to complete updates l2 table with pointer to its
          * cluster the second one has to do RMW (which is done above by
          * perform_cow()), update l2 table with its cluster pointer and free
          * old cluster. This is what this loop does */
-        if (l2_table[l2_index + i] != 0) {
-            old_cluster[j++] = l2_table[l2_index + i];
+        if (old_entry != 0) {
+            old_cluster[j++] = old_entry;
         }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+        if (has_subclusters(s)) {
+            uint64_t old_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+
+            set_l2_bitmap(s, l2_slice, l2_index + i,
+                          link_l2_bitmap(s, m, i, old_entry, old_bitmap));
+        }
+        set_l2_entry(s, l2_slice, l2_index + i,
+                     (cluster_offset + (i << s->cluster_bits)) |
+                     QCOW_OFLAG_COPIED);
      }
 
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+    qcow2_chain_index_allocated(bs, m->offset,
+                                (uint64_t)m->nb_clusters << s->cluster_bits);
 
     /*
      * If this was a COW, we need to decrease the refcount of the old cluster.
@@ -977,12 +1234,12 @@ err:
  * which must copy from the backing file)
  */
 static int count_cow_clusters(BDRVQcow2State *s, int nb_clusters,
-    uint64_t *l2_table, int l2_index)
+    uint64_t *l2_slice, int l2_index)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
         QCow2ClusterType cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -1034,6 +1291,13 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        if (has_subclusters(s) && !old_alloc->keep_old_clusters) {
+            /* New clusters only get the subclusters that the allocation
+             * writes, so nobody else may use them before they are linked */
+            old_start = start_of_cluster(s, old_start);
+            old_end = ROUND_UP(old_end, s->cluster_size);
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -1069,6 +1333,90 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
     return 0;
 }
 
+/*
+ * In images with extended L2 entries, a write to clusters that are allocated
+ * already must still allocate the subclusters that it touches.  Unless they
+ * all are allocated, this adds an allocation to *m that keeps the host
+ * clusters, copies what the write leaves out of its first and last subcluster
+ * and updates the subcluster bitmaps in the end.
+ */
+static void handle_copied_subclusters(BlockDriverState *bs,
+                                      uint64_t guest_offset,
+                                      uint64_t host_cluster_offset,
+                                      uint64_t bytes, uint64_t *l2_slice,
+                                      int l2_index, QCowL2Meta **m)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t start = offset_into_cluster(s, guest_offset);
+    uint64_t end = start + bytes;
+    int nb_clusters = size_to_clusters(s, end);
+    uint64_t cow_start_from, cow_end_to;
+    uint64_t l2_entry, l2_bitmap;
+    QCowL2Meta *old_m = *m;
+    int i;
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t cluster_start = (uint64_t)i << s->cluster_bits;
+        uint64_t from = MAX(start, cluster_start) - cluster_start;
+        uint64_t to = MIN(end, cluster_start + s->cluster_size) - cluster_start;
+        uint64_t wanted = QCOW_OFLAG_SUB_ALLOC_RANGE(
+            from >> s->subcluster_bits,
+            DIV_ROUND_UP(to, s->subcluster_size));
+
+        l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+        if ((l2_bitmap & wanted) != wanted) {
+            break;
+        }
+    }
+    if (i == nb_clusters) {
+        /* Everything is allocated, just write the data */
+        return;
+    }
+
+    /* Partly written subclusters that are allocated need no COW */
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    if (qcow2_get_subcluster_type(l2_entry, l2_bitmap,
+                                  start >> s->subcluster_bits) ==
+        QCOW2_SUBCLUSTER_NORMAL) {
+        cow_start_from = start;
+    } else {
+        cow_start_from = QEMU_ALIGN_DOWN(start, s->subcluster_size);
+    }
+
+    l2_entry = get_l2_entry(s, l2_slice, l2_index + nb_clusters - 1);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + nb_clusters - 1);
+    if (qcow2_get_subcluster_type(l2_entry, l2_bitmap,
+                                  offset_to_sc_index(s, end - 1)) ==
+        QCOW2_SUBCLUSTER_NORMAL) {
+        cow_end_to = end;
+    } else {
+        cow_end_to = QEMU_ALIGN_UP(end, s->subcluster_size);
+    }
+
+    *m = g_malloc0(sizeof(**m));
+    **m = (QCowL2Meta) {
+        .next           = old_m,
+
+        .alloc_offset   = host_cluster_offset,
+        .offset         = start_of_cluster(s, guest_offset),
+        .nb_clusters    = nb_clusters,
+
+        .keep_old_clusters  = true,
+
+        .cow_start = {
+            .offset     = cow_start_from,
+            .nb_bytes   = start - cow_start_from,
+        },
+        .cow_end = {
+            .offset     = end,
+            .nb_bytes   = cow_end_to - end,
+        },
+    };
+    qemu_co_queue_init(&(*m)->dependent_requests);
+    QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
+}
+
 /*
  * Checks how many already allocated clusters that don't require a copy on
  * write there are at the given guest_offset (up to *bytes). If
@@ -1097,7 +1445,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
     BDRVQcow2State *s = bs->opaque;
     int l2_index;
     uint64_t cluster_offset;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     uint64_t nb_clusters;
     unsigned int keep_clusters;
     int ret;
@@ -1109,23 +1457,23 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                                 == offset_into_cluster(s, *host_offset));
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     /* Find L2 entry for the first involved cluster */
-    ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -1152,8 +1500,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
+            count_contiguous_clusters(s, nb_clusters, l2_slice, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
@@ -1161,6 +1508,12 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                  keep_clusters * s->cluster_size
                  - offset_into_cluster(s, guest_offset));
 
+        if (has_subclusters(s)) {
+            handle_copied_subclusters(bs, guest_offset,
+                                      cluster_offset & L2E_OFFSET_MASK,
+                                      *bytes, l2_slice, l2_index, m);
+        }
+
         ret = 1;
     } else {
         ret = 0;
@@ -1168,7 +1521,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Cleanup */
 out:
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
 
     /* Only return a host offset if we actually made progress. Otherwise we
      * would make requirements for handle_alloc() that it can't fulfill */
@@ -1252,11 +1605,12 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
 {
     BDRVQcow2State *s = bs->opaque;
     int l2_index;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     uint64_t entry;
     uint64_t nb_clusters;
     int ret;
     bool keep_old_clusters = false;
+    bool cow_whole_clusters = true;
 
     uint64_t alloc_cluster_offset = 0;
 
@@ -1265,29 +1619,29 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     assert(*bytes > 0);
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     /* Find L2 entry for the first involved cluster */
-    ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_slice, l2_index);
 
     /* For the moment, overwrite compressed clusters one by one */
     if (entry & QCOW_OFLAG_COMPRESSED) {
         nb_clusters = 1;
     } else {
-        nb_clusters = count_cow_clusters(s, nb_clusters, l2_table, l2_index);
+        nb_clusters = count_cow_clusters(s, nb_clusters, l2_slice, l2_index);
     }
 
     /* This function is only called when there were no non-COW clusters, so if
@@ -1295,6 +1649,22 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * wrong with our code. */
     assert(nb_clusters > 0);
 
+    if (has_subclusters(s)) {
+        /* Clusters that had no host cluster only need the subclusters that
+         * are written, the others are copied as a whole.  Don't mix them. */
+        uint64_t i;
+
+        cow_whole_clusters = entry & (L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED);
+        for (i = 1; i < nb_clusters; i++) {
+            uint64_t next = get_l2_entry(s, l2_slice, l2_index + i);
+            if (!!(next & (L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED)) !=
+                cow_whole_clusters) {
+                break;
+            }
+        }
+        nb_clusters = i;
+    }
+
     if (qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_ZERO_ALLOC &&
         (entry & QCOW_OFLAG_COPIED) &&
         (!*host_offset ||
@@ -1304,8 +1674,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
          * would be fine, too, but count_cow_clusters() above has limited
          * nb_clusters already to a range of COW clusters */
         int preallocated_nb_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index], QCOW_OFLAG_COPIED);
+            count_contiguous_clusters(s, nb_clusters, l2_slice, l2_index,
+                                      QCOW_OFLAG_COPIED);
         assert(preallocated_nb_clusters > 0);
 
         nb_clusters = preallocated_nb_clusters;
@@ -1316,7 +1686,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         keep_old_clusters = true;
     }
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
 
     if (!alloc_cluster_offset) {
         /* Allocate, if necessary at a given offset in the image file */
@@ -1362,8 +1732,17 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t requested_bytes = *bytes + offset_into_cluster(s, guest_offset);
     int avail_bytes = MIN(INT_MAX, nb_clusters << s->cluster_bits);
     int nb_bytes = MIN(requested_bytes, avail_bytes);
+    int cow_start_from = 0, cow_end_to = avail_bytes;
     QCowL2Meta *old_m = *m;
 
+    /* Only the subclusters that are written need COW in new clusters */
+    if (!cow_whole_clusters) {
+        cow_start_from = QEMU_ALIGN_DOWN(offset_into_cluster(s, guest_offset),
+                                         s->subcluster_size);
+        cow_end_to = MIN(QEMU_ALIGN_UP(nb_bytes, s->subcluster_size),
+                         avail_bytes);
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1376,12 +1755,13 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .keep_old_clusters  = keep_old_clusters,
 
         .cow_start = {
-            .offset     = 0,
-            .nb_bytes   = offset_into_cluster(s, guest_offset),
+            .offset     = cow_start_from,
+            .nb_bytes   = offset_into_cluster(s, guest_offset) -
+                          cow_start_from,
         },
         .cow_end = {
             .offset     = nb_bytes,
-            .nb_bytes   = avail_bytes - nb_bytes,
+            .nb_bytes   = cow_end_to - nb_bytes,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
@@ -1526,79 +1906,101 @@ again:
     return 0;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
+void qcow2_compressed_cache_reset(BlockDriverState *bs)
 {
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
+    BDRVQcow2State *s = bs->opaque;
+    int i;
+
+    s->compressed_cache_generation++;
+
+    for (i = 0; i < QCOW2_COMPRESSED_CACHE_SIZE; i++) {
+        g_free(s->compressed_cache[i].data);
+        s->compressed_cache[i] = (Qcow2CompressedCacheEntry) {
+            .offset = -1,
+        };
+    }
+    s->compressed_cache_lru_counter = 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+/*
+ * qcow2_co_preadv_compressed
+ *
+ * Reads @bytes at @offset_in_cluster of the compressed cluster described by
+ * @cluster_descriptor into @qiov.
+ *
+ * Called with s->lock held.  The lock is dropped while the compressed data
+ * is read and inflated in the thread pool, so that several compressed
+ * clusters are decompressed in parallel.
+ */
+int coroutine_fn qcow2_co_preadv_compressed(BlockDriverState *bs,
+                                            uint64_t cluster_descriptor,
+                                            uint64_t offset_in_cluster,
+                                            uint64_t bytes,
+                                            QEMUIOVector *qiov)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret, csize, nb_csectors, sector_offset;
+    Qcow2CompressedCacheEntry *entry;
+    int ret, csize, nb_csectors;
     uint64_t coffset;
+    unsigned generation;
+    uint8_t *in_buf = NULL, *out_buf = NULL;
+    QEMUIOVector local_qiov;
+    struct iovec iov;
+
+    coffset = cluster_descriptor & s->cluster_offset_mask;
+    entry = qcow2_compressed_cache_find(s, coffset);
+    if (entry) {
+        qemu_iovec_from_buf(qiov, 0, entry->data + offset_in_cluster, bytes);
+        return 0;
+    }
 
-    coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
+    nb_csectors = ((cluster_descriptor >> s->csize_shift) & s->csize_mask) + 1;
+    csize = nb_csectors * BDRV_SECTOR_SIZE - (coffset & ~BDRV_SECTOR_MASK);
 
-        /* Allocate buffers on first decompress operation, most images are
-         * uncompressed and the memory overhead can be avoided.  The buffers
-         * are freed in .bdrv_close().
-         */
-        if (!s->cluster_data) {
-            /* one more sector for decompressed data alignment */
-            s->cluster_data = qemu_try_blockalign(bs->file->bs,
-                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size + 512);
-            if (!s->cluster_data) {
-                return -ENOMEM;
-            }
-        }
-        if (!s->cluster_cache) {
-            s->cluster_cache = g_malloc(s->cluster_size);
-        }
+    in_buf = g_try_malloc(csize);
+    out_buf = g_try_malloc(s->cluster_size);
+    if (!in_buf || !out_buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
 
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data,
-                        nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
-        s->cluster_cache_offset = coffset;
+    iov.iov_base = in_buf;
+    iov.iov_len = csize;
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    generation = s->compressed_cache_generation;
+    qemu_co_mutex_unlock(&s->lock);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_preadv(bs->file, coffset, csize, &local_qiov, 0);
+    if (ret >= 0) {
+        ret = qcow2_co_decompress(bs, out_buf, s->cluster_size, in_buf, csize);
     }
-    return 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, out_buf + offset_in_cluster, bytes);
+
+    /* Another request may have cached the same cluster in the meantime */
+    if (generation == s->compressed_cache_generation &&
+        !qcow2_compressed_cache_find(s, coffset)) {
+        qcow2_compressed_cache_insert(s, coffset, out_buf);
+        out_buf = NULL;
+    }
+    ret = 0;
+
+out:
+    g_free(in_buf);
+    g_free(out_buf);
+    return ret;
 }
 
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of discarded
+ * all clusters in the same L2 slice) and returns the number of discarded
  * clusters.
  */
 static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1606,24 +2008,27 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
                              bool full_discard)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     int l2_index;
     int ret;
     int i;
 
-    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t old_l2_entry;
+        uint64_t old_l2_entry, new_l2_entry, new_l2_bitmap;
 
-        old_l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        old_l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        new_l2_entry = (!full_discard && s->qcow_version >= 3) ?
+                       QCOW_OFLAG_ZERO : 0;
+        new_l2_bitmap = 0;
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1638,41 +2043,54 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
          * If full_discard is true, the sector should not read back as zeroes,
          * but rather fall through to the backing file.
          */
-        switch (qcow2_get_cluster_type(old_l2_entry)) {
-        case QCOW2_CLUSTER_UNALLOCATED:
-            if (full_discard || !bs->backing) {
+        if (has_subclusters(s)) {
+            /* The bitmap alone says whether subclusters read as zeroes */
+            uint64_t old_l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+
+            new_l2_entry = 0;
+            new_l2_bitmap = full_discard ? 0 : QCOW_L2_BITMAP_ALL_ZEROES;
+            if (!(old_l2_entry & (L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED)) &&
+                (old_l2_bitmap == new_l2_bitmap ||
+                 (!full_discard && !bs->backing &&
+                  !(old_l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC)))) {
                 continue;
             }
-            break;
+        } else {
+            switch (qcow2_get_cluster_type(old_l2_entry)) {
+            case QCOW2_CLUSTER_UNALLOCATED:
+                if (full_discard || !bs->backing) {
+                    continue;
+                }
+                break;
 
-        case QCOW2_CLUSTER_ZERO_PLAIN:
-            if (!full_discard) {
-                continue;
-            }
-            break;
+            case QCOW2_CLUSTER_ZERO_PLAIN:
+                if (!full_discard) {
+                    continue;
+                }
+                break;
 
-        case QCOW2_CLUSTER_ZERO_ALLOC:
-        case QCOW2_CLUSTER_NORMAL:
-        case QCOW2_CLUSTER_COMPRESSED:
-            break;
+            case QCOW2_CLUSTER_ZERO_ALLOC:
+            case QCOW2_CLUSTER_NORMAL:
+            case QCOW2_CLUSTER_COMPRESSED:
+                break;
 
-        default:
-            abort();
+            default:
+                abort();
+            }
         }
 
         /* First remove L2 entries */
-        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-        if (!full_discard && s->qcow_version >= 3) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
-        } else {
-            l2_table[l2_index + i] = cpu_to_be64(0);
+        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
+        set_l2_entry(s, l2_slice, l2_index + i, new_l2_entry);
+        if (has_subclusters(s)) {
+            set_l2_bitmap(s, l2_slice, l2_index + i, new_l2_bitmap);
         }
 
         /* Then decrease the refcount */
         qcow2_free_any_clusters(bs, old_l2_entry, 1, type);
     }
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
 
     return nb_clusters;
 }
@@ -1694,9 +2112,17 @@ int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
 
     nb_clusters = size_to_clusters(s, bytes);
 
+    /* Clusters that fall through to the backing file again are news to the
+     * index, zero clusters are not */
+    if (full_discard || s->qcow_version < 3 || !bs->backing) {
+        qcow2_chain_index_invalidate(bs);
+    } else {
+        qcow2_chain_index_allocated(bs, offset, bytes);
+    }
+
     s->cache_discards = true;
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     while (nb_clusters > 0) {
         cleared = discard_single_l2(bs, offset, nb_clusters, type,
                                     full_discard);
@@ -1719,54 +2145,75 @@ fail:
 
 /*
  * This zeroes as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of zeroed
+ * all clusters in the same L2 slice) and returns the number of zeroed
  * clusters.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
                           uint64_t nb_clusters, int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     int l2_index;
     int ret;
     int i;
     bool unmap = !!(flags & BDRV_REQ_MAY_UNMAP);
 
-    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
         QCow2ClusterType cluster_type;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_slice, l2_index + i);
+        cluster_type = qcow2_get_cluster_type(old_offset);
+
+        if (has_subclusters(s)) {
+            /* Same as below, but the bitmap says what reads as zeroes */
+            uint64_t old_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+
+            if (old_bitmap == QCOW_L2_BITMAP_ALL_ZEROES &&
+                (!unmap || !(old_offset & L2E_OFFSET_MASK))) {
+                continue;
+            }
+
+            qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
+            if (cluster_type == QCOW2_CLUSTER_COMPRESSED || unmap) {
+                set_l2_entry(s, l2_slice, l2_index + i, 0);
+                qcow2_free_any_clusters(bs, old_offset, 1,
+                                        QCOW2_DISCARD_REQUEST);
+            }
+            set_l2_bitmap(s, l2_slice, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
+            continue;
+        }
 
         /*
          * Minimize L2 changes if the cluster already reads back as
          * zeroes with correct allocation.
          */
-        cluster_type = qcow2_get_cluster_type(old_offset);
         if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN ||
             (cluster_type == QCOW2_CLUSTER_ZERO_ALLOC && !unmap)) {
             continue;
         }
 
-        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
         if (cluster_type == QCOW2_CLUSTER_COMPRESSED || unmap) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_slice, l2_index + i, QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_slice, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
 
     return nb_clusters;
 }
@@ -1790,9 +2237,11 @@ int qcow2_cluster_zeroize(BlockDriverState *bs, uint64_t offset,
         return -ENOTSUP;
     }
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     nb_clusters = size_to_clusters(s, bytes);
 
+    qcow2_chain_index_allocated(bs, offset, bytes);
+
     s->cache_discards = true;
 
     while (nb_clusters > 0) {
@@ -1830,22 +2279,28 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
 {
     BDRVQcow2State *s = bs->opaque;
     bool is_active_l1 = (l1_table == s->l1_table);
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
+    unsigned slice, slice_size2, n_slices;
     int ret;
     int i, j;
 
+    /* qcow2_downgrade() refuses images with extended L2 entries */
+    assert(!has_subclusters(s));
+
+    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    n_slices = s->cluster_size / slice_size2;
+
     if (!is_active_l1) {
         /* inactive L2 tables require a buffer to be stored in when loading
          * them from disk */
-        l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
-        if (l2_table == NULL) {
+        l2_slice = qemu_try_blockalign(bs->file->bs, slice_size2);
+        if (l2_slice == NULL) {
             return -ENOMEM;
         }
     }
 
     for (i = 0; i < l1_size; i++) {
         uint64_t l2_offset = l1_table[i] & L1E_OFFSET_MASK;
-        bool l2_dirty = false;
         uint64_t l2_refcount;
 
         if (!l2_offset) {
@@ -1865,124 +2320,133 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             goto fail;
         }
 
-        if (is_active_l1) {
-            /* get active L2 tables from cache */
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                    (void **)&l2_table);
-        } else {
-            /* load inactive L2 tables from disk */
-            ret = bdrv_read(bs->file, l2_offset / BDRV_SECTOR_SIZE,
-                            (void *)l2_table, s->cluster_sectors);
-        }
-        if (ret < 0) {
-            goto fail;
-        }
-
         ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
                                  &l2_refcount);
         if (ret < 0) {
             goto fail;
         }
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            int64_t offset = l2_entry & L2E_OFFSET_MASK;
-            QCow2ClusterType cluster_type = qcow2_get_cluster_type(l2_entry);
+        for (slice = 0; slice < n_slices; slice++) {
+            uint64_t slice_offset = l2_offset + slice * slice_size2;
+            bool l2_dirty = false;
 
-            if (cluster_type != QCOW2_CLUSTER_ZERO_PLAIN &&
-                cluster_type != QCOW2_CLUSTER_ZERO_ALLOC) {
-                continue;
+            if (is_active_l1) {
+                /* get active L2 tables from cache */
+                ret = qcow2_cache_get(bs, s->l2_table_cache, slice_offset,
+                                      (void **)&l2_slice);
+            } else {
+                /* load inactive L2 tables from disk */
+                ret = bdrv_pread(bs->file, slice_offset, l2_slice,
+                                 slice_size2);
             }
+            if (ret < 0) {
+                goto fail;
+            }
+
+            for (j = 0; j < s->l2_slice_size; j++) {
+                uint64_t l2_entry = be64_to_cpu(l2_slice[j]);
+                int64_t offset = l2_entry & L2E_OFFSET_MASK;
+                QCow2ClusterType cluster_type =
+                    qcow2_get_cluster_type(l2_entry);
 
-            if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN) {
-                if (!bs->backing) {
-                    /* not backed; therefore we can simply deallocate the
-                     * cluster */
-                    l2_table[j] = 0;
-                    l2_dirty = true;
+                if (cluster_type != QCOW2_CLUSTER_ZERO_PLAIN &&
+                    cluster_type != QCOW2_CLUSTER_ZERO_ALLOC) {
                     continue;
                 }
 
-                offset = qcow2_alloc_clusters(bs, s->cluster_size);
-                if (offset < 0) {
-                    ret = offset;
-                    goto fail;
-                }
+                if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN) {
+                    if (!bs->backing) {
+                        /* not backed; therefore we can simply deallocate the
+                         * cluster */
+                        l2_slice[j] = 0;
+                        l2_dirty = true;
+                        continue;
+                    }
 
-                if (l2_refcount > 1) {
-                    /* For shared L2 tables, set the refcount accordingly (it is
-                     * already 1 and needs to be l2_refcount) */
-                    ret = qcow2_update_cluster_refcount(bs,
-                            offset >> s->cluster_bits,
-                            refcount_diff(1, l2_refcount), false,
-                            QCOW2_DISCARD_OTHER);
-                    if (ret < 0) {
-                        qcow2_free_clusters(bs, offset, s->cluster_size,
-                                            QCOW2_DISCARD_OTHER);
+                    offset = qcow2_alloc_clusters(bs, s->cluster_size);
+                    if (offset < 0) {
+                        ret = offset;
                         goto fail;
                     }
+
+                    if (l2_refcount > 1) {
+                        /* For shared L2 tables, set the refcount accordingly
+                         * (it is already 1 and needs to be l2_refcount) */
+                        ret = qcow2_update_cluster_refcount(bs,
+                                offset >> s->cluster_bits,
+                                refcount_diff(1, l2_refcount), false,
+                                QCOW2_DISCARD_OTHER);
+                        if (ret < 0) {
+                            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                                QCOW2_DISCARD_OTHER);
+                            goto fail;
+                        }
+                    }
                 }
-            }
 
-            if (offset_into_cluster(s, offset)) {
-                qcow2_signal_corruption(bs, true, -1, -1,
-                                        "Cluster allocation offset "
-                                        "%#" PRIx64 " unaligned (L2 offset: %#"
-                                        PRIx64 ", L2 index: %#x)", offset,
-                                        l2_offset, j);
-                if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                if (offset_into_cluster(s, offset)) {
+                    int l2_index = slice * s->l2_slice_size + j;
+                    qcow2_signal_corruption(bs, true, -1, -1,
+                                            "Cluster allocation offset %#"
+                                            PRIx64 " unaligned (L2 offset: %#"
+                                            PRIx64 ", L2 index: %#x)", offset,
+                                            l2_offset, l2_index);
+                    if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    ret = -EIO;
+                    goto fail;
                 }
-                ret = -EIO;
-                goto fail;
-            }
 
-            ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
-            if (ret < 0) {
-                if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                                    s->cluster_size);
+                if (ret < 0) {
+                    if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            ret = bdrv_pwrite_zeroes(bs->file, offset, s->cluster_size, 0);
-            if (ret < 0) {
-                if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = bdrv_pwrite_zeroes(bs->file, offset, s->cluster_size, 0);
+                if (ret < 0) {
+                    if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            if (l2_refcount == 1) {
-                l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
-            } else {
-                l2_table[j] = cpu_to_be64(offset);
+                if (l2_refcount == 1) {
+                    l2_slice[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+                } else {
+                    l2_slice[j] = cpu_to_be64(offset);
+                }
+                l2_dirty = true;
             }
-            l2_dirty = true;
-        }
 
-        if (is_active_l1) {
-            if (l2_dirty) {
-                qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-                qcow2_cache_depends_on_flush(s->l2_table_cache);
-            }
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
-        } else {
-            if (l2_dirty) {
-                ret = qcow2_pre_write_overlap_check(bs,
-                        QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2, l2_offset,
-                        s->cluster_size);
-                if (ret < 0) {
-                    goto fail;
+            if (is_active_l1) {
+                if (l2_dirty) {
+                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                 l2_slice);
+                    qcow2_cache_depends_on_flush(s->l2_table_cache);
                 }
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+            } else {
+                if (l2_dirty) {
+                    ret = qcow2_pre_write_overlap_check(bs,
+                            QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2,
+                            slice_offset, slice_size2);
+                    if (ret < 0) {
+                        goto fail;
+                    }
 
-                ret = bdrv_write(bs->file, l2_offset / BDRV_SECTOR_SIZE,
-                                 (void *)l2_table, s->cluster_sectors);
-                if (ret < 0) {
-                    goto fail;
+                    ret = bdrv_pwrite(bs->file, slice_offset, l2_slice,
+                                      slice_size2);
+                    if (ret < 0) {
+                        goto fail;
+                    }
                 }
             }
         }
@@ -1996,11 +2460,11 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     ret = 0;
 
 fail:
-    if (l2_table) {
+    if (l2_slice) {
         if (!is_active_l1) {
-            qemu_vfree(l2_table);
+            qemu_vfree(l2_slice);
         } else {
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
         }
     }
     return ret;
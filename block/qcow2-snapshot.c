@@ -484,6 +484,9 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
         goto fail;
     }
 
+    /* The whole active L1 table is replaced */
+    qcow2_chain_index_invalidate(bs);
+
     /*
      * Make sure that the current L1 table is big enough to contain the whole
      * L1 table of the snapshot. If the snapshot L1 table is smaller, the
@@ -0,0 +1,197 @@
+/*
+ * Threaded data processing for qcow2: compression and decompression
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "block/qcow2.h"
+
+typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size,
+                                     int level);
+
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    int level;
+    ssize_t ret;
+    Qcow2CompressFunc func;
+} Qcow2CompressData;
+
+/*
+ * qcow2_compress:
+ *
+ * Compresses @src into @dest with raw deflate at @level and a 4k window.
+ *
+ * Returns the size of the compressed data, -ENOMEM if it does not fit
+ * into @dest_size bytes or -EIO on other errors.
+ */
+static ssize_t qcow2_compress(void *dest, size_t dest_size,
+                              const void *src, size_t src_size, int level)
+{
+    ssize_t ret;
+    z_stream strm;
+
+    /* small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, level, Z_DEFLATED,
+                       -12, 9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK || ret == Z_BUF_ERROR) ? -ENOMEM : -EIO;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+/*
+ * qcow2_decompress:
+ *
+ * Decompresses @src into @dest, which must be filled completely.  @level
+ * is not needed for decompression and ignored.
+ *
+ * Returns 0 on success, -EIO on error.
+ */
+static ssize_t qcow2_decompress(void *dest, size_t dest_size,
+                                const void *src, size_t src_size, int level)
+{
+    ssize_t ret = 0;
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.next_in = (uint8_t *)src;
+    strm.avail_in = src_size;
+    strm.next_out = dest;
+    strm.avail_out = dest_size;
+
+    if (inflateInit2(&strm, -12) != Z_OK) {
+        return -EIO;
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out != 0) {
+        /* We approve Z_BUF_ERROR because we need @dest buffer to be filled,
+         * but @src buffer may be processed partly (because in qcow2 we
+         * know size of compressed data with precision of one sector) */
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+
+    inflateEnd(&strm);
+    return ret;
+}
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size, data->level);
+
+    return 0;
+}
+
+static ssize_t coroutine_fn
+qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size, Qcow2CompressFunc func)
+{
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressData arg = {
+        .dest = dest,
+        .dest_size = dest_size,
+        .src = src,
+        .src_size = src_size,
+        .level = s->compress_level,
+        .func = func,
+    };
+
+    while (s->nb_compress_threads >= s->max_compress_threads) {
+        qemu_co_queue_wait(&s->compress_wait, NULL);
+    }
+
+    s->nb_compress_threads++;
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &arg);
+    s->nb_compress_threads--;
+
+    qemu_co_queue_next(&s->compress_wait);
+
+    return arg.ret;
+}
+
+ssize_t coroutine_fn
+qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                  const void *src, size_t src_size)
+{
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size,
+                                qcow2_compress);
+}
+
+ssize_t coroutine_fn
+qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                    const void *src, size_t src_size)
+{
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size,
+                                qcow2_decompress);
+}
+
+/* Default for the compress-threads option: one per host CPU */
+int qcow2_compress_default_threads(void)
+{
+    int threads = 0;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads <= 0) {
+        threads = 4;
+    }
+
+    return MIN(threads, QCOW2_MAX_COMPRESS_THREADS);
+}
+
+/* The limits themselves are set from the runtime options */
+void qcow2_compress_init(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    qemu_co_queue_init(&s->compress_wait);
+    s->nb_compress_threads = 0;
+
+    qemu_co_queue_init(&s->compress_alloc_wait);
+    s->compress_alloc_next = s->compress_alloc_turn = 0;
+}
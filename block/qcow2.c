@@ -69,7 +69,6 @@
 #include "block/block_int.h"
 #include "sysemu/block-backend.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
@@ -331,7 +330,9 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            qcow2_crypto_hdr_read_func,
-                                           bs, cflags, errp);
+                                           bs, cflags,
+                                           block_crypto_default_threads(),
+                                           errp);
             if (!s->crypto) {
                 return -EINVAL;
             }
@@ -706,6 +707,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum L2 table cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
         {
             .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -716,6 +722,22 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_CHAIN_INDEX,
+            .type = QEMU_OPT_BOOL,
+            .help = "Index the allocation of the backing chain",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESS_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of clusters compressed or decompressed "
+                    "in parallel",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESS_LEVEL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "deflate level for compressed writes (1-9)",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -778,6 +800,7 @@ static void qcow2_attach_aio_context(BlockDriverState *bs,
 
 static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
                              uint64_t *l2_cache_size,
+                             uint64_t *l2_cache_entry_size,
                              uint64_t *refcount_cache_size, Error **errp)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -792,6 +815,18 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     *l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE, 0);
     *refcount_cache_size = qemu_opt_get_size(opts,
                                              QCOW2_OPT_REFCOUNT_CACHE_SIZE, 0);
+    *l2_cache_entry_size = qemu_opt_get_size(
+        opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+        MIN(s->cluster_size, DEFAULT_L2_CACHE_ENTRY_SIZE));
+
+    if (*l2_cache_entry_size < (1 << MIN_CLUSTER_BITS) ||
+        *l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(*l2_cache_entry_size)) {
+        error_setg(errp, "L2 cache entry size must be a power of two "
+                   "between %d and the cluster size (%d)",
+                   1 << MIN_CLUSTER_BITS, s->cluster_size);
+        return;
+    }
 
     if (combined_cache_size_set) {
         if (l2_cache_size_set && refcount_cache_size_set) {
@@ -820,11 +855,10 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
         }
     } else {
         if (!l2_cache_size_set && !refcount_cache_size_set) {
-            *l2_cache_size = MAX(DEFAULT_L2_CACHE_BYTE_SIZE,
-                                 (uint64_t)DEFAULT_L2_CACHE_CLUSTERS
-                                 * s->cluster_size);
-            *refcount_cache_size = *l2_cache_size
-                                 / DEFAULT_L2_REFCOUNT_SIZE_RATIO;
+            *l2_cache_size = DEFAULT_L2_CACHE_MAX_SIZE;
+            *refcount_cache_size = MAX(DEFAULT_REFCOUNT_CACHE_BYTE_SIZE,
+                                       (uint64_t)DEFAULT_REFCOUNT_CACHE_CLUSTERS
+                                       * s->cluster_size);
         } else if (!l2_cache_size_set) {
             *l2_cache_size = *refcount_cache_size
                            * DEFAULT_L2_REFCOUNT_SIZE_RATIO;
@@ -835,13 +869,35 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     }
 }
 
+/* Number of L2 cache entries to allocate for an image of @image_size bytes.
+ * The L2 cache size is a memory budget; only what is needed to cover the
+ * image is actually allocated.
+ */
+static uint64_t l2_cache_entries(BDRVQcow2State *s, uint64_t budget,
+                                 uint64_t entry_size, uint64_t image_size)
+{
+    uint64_t l2_slices, entries;
+
+    /* An L2 cache that covers the whole image never needs to grow further */
+    l2_slices = DIV_ROUND_UP(size_to_clusters(s, image_size),
+                             entry_size / l2_entry_size(s));
+    entries = MIN(budget, l2_slices * entry_size) / entry_size;
+
+    return MAX(entries, MIN_L2_CACHE_SIZE);
+}
+
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    int l2_slice_size; /* Number of entries in a slice of the L2 table */
+    uint64_t l2_cache_budget;
     bool use_lazy_refcounts;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    bool use_chain_index;
+    int compress_threads;
+    int compress_level;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -854,7 +910,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     QemuOpts *opts = NULL;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -873,18 +929,17 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     }
 
     /* get L2 table/refcount block cache size from command line options */
-    read_cache_sizes(bs, opts, &l2_cache_size, &refcount_cache_size,
-                     &local_err);
+    read_cache_sizes(bs, opts, &l2_cache_size, &l2_cache_entry_size,
+                     &refcount_cache_size, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
-    if (l2_cache_size < MIN_L2_CACHE_SIZE) {
-        l2_cache_size = MIN_L2_CACHE_SIZE;
-    }
+    r->l2_cache_budget = l2_cache_size;
+    l2_cache_size = l2_cache_entries(s, l2_cache_size, l2_cache_entry_size,
+                                     bs->total_sectors * BDRV_SECTOR_SIZE);
     if (l2_cache_size > INT_MAX) {
         error_setg(errp, "L2 cache size too big");
         ret = -EINVAL;
@@ -919,8 +974,11 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
+    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -1014,6 +1072,26 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     r->discard_passthrough[QCOW2_DISCARD_OTHER] =
         qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
+    r->use_chain_index = qemu_opt_get_bool(opts, QCOW2_OPT_CHAIN_INDEX, true);
+
+    r->compress_threads = qemu_opt_get_number(opts, QCOW2_OPT_COMPRESS_THREADS,
+                                              qcow2_compress_default_threads());
+    if (r->compress_threads < 1 ||
+        r->compress_threads > QCOW2_MAX_COMPRESS_THREADS) {
+        error_setg(errp, "Compress threads must be between 1 and %d",
+                   QCOW2_MAX_COMPRESS_THREADS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->compress_level = qemu_opt_get_number(opts, QCOW2_OPT_COMPRESS_LEVEL,
+                                            DEFAULT_COMPRESS_LEVEL);
+    if (r->compress_level < 1 || r->compress_level > 9) {
+        error_setg(errp, "Compress level must be between 1 and 9");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     switch (s->crypt_method_header) {
     case QCOW_CRYPT_NONE:
         if (encryptfmt) {
@@ -1082,6 +1160,8 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    s->l2_slice_size = r->l2_slice_size;
+    s->l2_cache_budget = r->l2_cache_budget;
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
@@ -1090,6 +1170,14 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         s->discard_passthrough[i] = r->discard_passthrough[i];
     }
 
+    s->max_compress_threads = r->compress_threads;
+    s->compress_level = r->compress_level;
+
+    s->use_chain_index = r->use_chain_index;
+    if (!s->use_chain_index) {
+        qcow2_chain_index_free(bs);
+    }
+
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
         s->cache_clean_interval = r->cache_clean_interval;
@@ -1304,8 +1392,21 @@ static int qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (has_subclusters(s) && s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+        error_setg(errp, "Extended L2 entries are only supported with "
+                   "cluster sizes of at least %d bytes",
+                   1 << MIN_EXTL2_CLUSTER_BITS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
+    s->subclusters_per_cluster =
+        has_subclusters(s) ? QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER : 1;
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
     s->refcount_block_size = 1 << s->refcount_block_bits;
@@ -1404,7 +1505,8 @@ static int qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    s->cluster_cache_offset = -1;
+    qcow2_compressed_cache_reset(bs);
+    qcow2_compress_init(bs);
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -1435,7 +1537,9 @@ static int qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
                 cflags |= QCRYPTO_BLOCK_OPEN_NO_IO;
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
-                                           NULL, NULL, cflags, errp);
+                                           NULL, NULL, cflags,
+                                           block_crypto_default_threads(),
+                                           errp);
             if (!s->crypto) {
                 ret = -EINVAL;
                 goto fail;
@@ -1726,12 +1830,81 @@ int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
     return n1;
 }
 
+/*
+ * Read a range that is not allocated in @bs from its backing chain.  The
+ * allocation index sends each part of the range straight to the image that
+ * has it; without an index, the range goes to the backing file as usual.
+ */
+static coroutine_fn int qcow2_co_preadv_backing(BlockDriverState *bs,
+                                                uint64_t offset,
+                                                uint64_t bytes,
+                                                QEMUIOVector *qiov)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QEMUIOVector local_qiov;
+    uint64_t bytes_done = 0;
+    int ret = 0;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+
+    while (bytes_done < bytes) {
+        uint64_t cur_bytes = bytes - bytes_done;
+        BdrvChild *child;
+        int n1, depth;
+
+        child = qcow2_chain_index_lookup(bs, offset, &cur_bytes, &depth);
+        trace_qcow2_backing_read(bs, offset, cur_bytes, depth);
+
+        s->backing_reads++;
+        if (depth >= 0) {
+            s->backing_indexed_reads++;
+            s->backing_total_depth += depth;
+            s->backing_max_depth = MAX(s->backing_max_depth, depth);
+        }
+
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, bytes_done, cur_bytes);
+
+        if (!child) {
+            qemu_iovec_memset(&local_qiov, 0, 0, cur_bytes);
+            n1 = 0;
+        } else if (child == bs->backing) {
+            /* read from the base image */
+            n1 = qcow2_backing_read1(bs->backing->bs, &local_qiov,
+                                     offset, cur_bytes);
+        } else {
+            /* the index made sure that the range is inside of the image */
+            n1 = cur_bytes;
+        }
+
+        if (n1 > 0) {
+            qemu_iovec_reset(&local_qiov);
+            qemu_iovec_concat(&local_qiov, qiov, bytes_done, n1);
+
+            BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
+            qemu_co_mutex_unlock(&s->lock);
+            ret = bdrv_co_preadv(child, offset, n1, &local_qiov, 0);
+            qemu_co_mutex_lock(&s->lock);
+
+            if (ret < 0) {
+                break;
+            }
+        }
+
+        offset += cur_bytes;
+        bytes_done += cur_bytes;
+    }
+
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
+}
+
 static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                                         uint64_t bytes, QEMUIOVector *qiov,
                                         int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    int offset_in_cluster, n1;
+    int offset_in_cluster;
     int ret;
     unsigned int cur_bytes; /* number of bytes in current iteration */
     uint64_t cluster_offset = 0;
@@ -1766,26 +1939,10 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
         case QCOW2_CLUSTER_UNALLOCATED:
 
             if (bs->backing) {
-                /* read from the base image */
-                n1 = qcow2_backing_read1(bs->backing->bs, &hd_qiov,
-                                         offset, cur_bytes);
-                if (n1 > 0) {
-                    QEMUIOVector local_qiov;
-
-                    qemu_iovec_init(&local_qiov, hd_qiov.niov);
-                    qemu_iovec_concat(&local_qiov, &hd_qiov, 0, n1);
-
-                    BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                    qemu_co_mutex_unlock(&s->lock);
-                    ret = bdrv_co_preadv(bs->backing, offset, n1,
-                                         &local_qiov, 0);
-                    qemu_co_mutex_lock(&s->lock);
-
-                    qemu_iovec_destroy(&local_qiov);
-
-                    if (ret < 0) {
-                        goto fail;
-                    }
+                ret = qcow2_co_preadv_backing(bs, offset, cur_bytes,
+                                              &hd_qiov);
+                if (ret < 0) {
+                    goto fail;
                 }
             } else {
                 /* Note: in this case, no need to wait */
@@ -1799,15 +1956,12 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_co_preadv_compressed(bs, cluster_offset,
+                                             offset_in_cluster, cur_bytes,
+                                             &hd_qiov);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                                s->cluster_cache + offset_in_cluster,
-                                cur_bytes);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1844,24 +1998,23 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
             ret = bdrv_co_preadv(bs->file,
                                  cluster_offset + offset_in_cluster,
                                  cur_bytes, &hd_qiov, 0);
+            if (ret >= 0 && bs->encrypted) {
+                /* Decryption does not touch metadata, keep the lock free */
+                assert(s->crypto);
+                assert((offset & (BDRV_SECTOR_SIZE - 1)) == 0);
+                assert((cur_bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
+                ret = block_crypto_co_decrypt(bs, s->crypto,
+                                              (s->crypt_physical_offset ?
+                                               cluster_offset +
+                                               offset_in_cluster :
+                                               offset),
+                                              cluster_data, cur_bytes);
+            }
             qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
             if (bs->encrypted) {
-                assert(s->crypto);
-                assert((offset & (BDRV_SECTOR_SIZE - 1)) == 0);
-                assert((cur_bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
-                if (qcrypto_block_decrypt(s->crypto,
-                                          (s->crypt_physical_offset ?
-                                           cluster_offset + offset_in_cluster :
-                                           offset),
-                                          cluster_data,
-                                          cur_bytes,
-                                          NULL) < 0) {
-                    ret = -EIO;
-                    goto fail;
-                }
                 qemu_iovec_from_buf(qiov, bytes_done, cluster_data, cur_bytes);
             }
             break;
@@ -1943,8 +2096,6 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
     while (bytes != 0) {
@@ -1987,13 +2138,15 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
             qemu_iovec_to_buf(&hd_qiov, 0, cluster_data, hd_qiov.size);
 
-            if (qcrypto_block_encrypt(s->crypto,
-                                      (s->crypt_physical_offset ?
-                                       cluster_offset + offset_in_cluster :
-                                       offset),
-                                      cluster_data,
-                                      cur_bytes, NULL) < 0) {
-                ret = -EIO;
+            /* The clusters are allocated, encryption needs no lock */
+            qemu_co_mutex_unlock(&s->lock);
+            ret = block_crypto_co_encrypt(bs, s->crypto,
+                                          (s->crypt_physical_offset ?
+                                           cluster_offset + offset_in_cluster :
+                                           offset),
+                                          cluster_data, cur_bytes);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0) {
                 goto fail;
             }
 
@@ -2113,6 +2266,10 @@ static int qcow2_inactivate(BlockDriverState *bs)
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+
+    qcow2_chain_index_invalidate(bs);
+    qcow2_chain_index_free(bs);
+
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -2134,8 +2291,7 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->image_backing_file);
     g_free(s->image_backing_format);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_reset(bs);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -2331,6 +2487,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
                 .name = "corrupt bit",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -2637,28 +2798,31 @@ int64_t qcow2_refcount_metadata_size(int64_t clusters, size_t cluster_size,
  * @total_size: virtual disk size in bytes
  * @cluster_size: cluster size in bytes
  * @refcount_order: refcount bits power-of-2 exponent
+ * @extended_l2: true if the image has extended L2 entries
  *
  * Returns: Total number of bytes required for the fully allocated image
  * (including metadata).
  */
 static int64_t qcow2_calc_prealloc_size(int64_t total_size,
                                         size_t cluster_size,
-                                        int refcount_order)
+                                        int refcount_order,
+                                        bool extended_l2)
 {
     int64_t meta_size = 0;
     uint64_t nl1e, nl2e;
     int64_t aligned_total_size = align_offset(total_size, cluster_size);
+    size_t l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
 
     /* header: 1 cluster */
     meta_size += cluster_size;
 
     /* total size of L2 tables */
     nl2e = aligned_total_size / cluster_size;
-    nl2e = align_offset(nl2e, cluster_size / sizeof(uint64_t));
-    meta_size += nl2e * sizeof(uint64_t);
+    nl2e = align_offset(nl2e, cluster_size / l2e_size);
+    meta_size += nl2e * l2e_size;
 
     /* total size of L1 tables */
-    nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+    nl1e = nl2e * l2e_size / cluster_size;
     nl1e = align_offset(nl1e, cluster_size / sizeof(uint64_t));
     meta_size += nl1e * sizeof(uint64_t);
 
@@ -2758,7 +2922,8 @@ static int qcow2_create2(const char *filename, int64_t total_size,
 
     if (prealloc == PREALLOC_MODE_FULL || prealloc == PREALLOC_MODE_FALLOC) {
         int64_t prealloc_size =
-            qcow2_calc_prealloc_size(total_size, cluster_size, refcount_order);
+            qcow2_calc_prealloc_size(total_size, cluster_size, refcount_order,
+                                     flags & BLOCK_FLAG_EXTENDED_L2);
         qemu_opt_set_number(opts, BLOCK_OPT_SIZE, prealloc_size, &error_abort);
         qemu_opt_set(opts, BLOCK_OPT_PREALLOC, PreallocMode_str(prealloc),
                      &error_abort);
@@ -2804,6 +2969,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTENDED_L2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = blk_pwrite(blk, 0, header, cluster_size, 0);
     g_free(header);
     if (ret < 0) {
@@ -2993,6 +3163,27 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         goto finish;
     }
 
+    if (qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false)) {
+        flags |= BLOCK_FLAG_EXTENDED_L2;
+    }
+
+    if (version < 3 && (flags & BLOCK_FLAG_EXTENDED_L2)) {
+        error_setg(errp, "Extended L2 entries only supported with "
+                   "compatibility level 1.1 and above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    if ((flags & BLOCK_FLAG_EXTENDED_L2) &&
+        cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+        error_setg(errp, "Extended L2 entries are only supported with "
+                   "cluster sizes of at least %d bytes",
+                   1 << MIN_EXTL2_CLUSTER_BITS);
+        ret = -EINVAL;
+        goto finish;
+    }
+
     refcount_bits = qcow2_opt_get_refcount_bits_del(opts, version, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -3071,9 +3262,12 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
         bytes = s->cluster_size;
         nr = s->cluster_size;
         ret = qcow2_get_cluster_offset(bs, offset, &nr, &off);
-        if (ret != QCOW2_CLUSTER_UNALLOCATED &&
-            ret != QCOW2_CLUSTER_ZERO_PLAIN &&
-            ret != QCOW2_CLUSTER_ZERO_ALLOC) {
+        /* With extended L2 entries, the type is only that of the first
+         * subclusters; the others may have been written in the meantime */
+        if (nr < s->cluster_size ||
+            (ret != QCOW2_CLUSTER_UNALLOCATED &&
+             ret != QCOW2_CLUSTER_ZERO_PLAIN &&
+             ret != QCOW2_CLUSTER_ZERO_ALLOC)) {
             qemu_co_mutex_unlock(&s->lock);
             return -ENOTSUP;
         }
@@ -3113,11 +3307,53 @@ static coroutine_fn int qcow2_co_pdiscard(BlockDriverState *bs,
     return ret;
 }
 
+/* Resize the L2 cache after the image has been resized, so that it keeps
+ * covering the image within the budget set by the cache options.  Failing
+ * to do so is not fatal; the old cache is simply kept.
+ */
+static void qcow2_update_l2_cache(BlockDriverState *bs, uint64_t image_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CacheStats stats;
+    Qcow2Cache *l2_table_cache;
+    uint64_t entries;
+    int ret;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &stats);
+    entries = l2_cache_entries(s, s->l2_cache_budget, stats.entry_size,
+                               image_size);
+    if (entries == stats.entries || entries > INT_MAX) {
+        return;
+    }
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        warn_report("Failed to flush the L2 table cache: %s", strerror(-ret));
+        return;
+    }
+    /* Discarding clusters when shrinking makes the refcount cache depend
+     * on the L2 cache, which must not outlive it */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        warn_report("Failed to flush the refcount block cache: %s",
+                    strerror(-ret));
+        return;
+    }
+    l2_table_cache = qcow2_cache_create(bs, entries, stats.entry_size);
+    if (!l2_table_cache) {
+        warn_report("Could not resize the L2 table cache");
+        return;
+    }
+    qcow2_cache_drop_dependency(s->refcount_block_cache, s->l2_table_cache);
+    qcow2_cache_destroy(bs, s->l2_table_cache);
+    s->l2_table_cache = l2_table_cache;
+}
+
 static int qcow2_truncate(BlockDriverState *bs, int64_t offset,
                           PreallocMode prealloc, Error **errp)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t old_length;
+    uint64_t old_length, be_offset;
     int64_t new_l1_size;
     int ret;
 
@@ -3134,6 +3370,8 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset,
         return -EINVAL;
     }
 
+    qcow2_chain_index_invalidate(bs);
+
     /* cannot proceed if image has snapshots */
     if (s->nb_snapshots) {
         error_setg(errp, "Can't resize an image which has snapshots");
@@ -3251,7 +3489,7 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset,
          *  preallocation. All that matters is that we will not have to allocate
          *  new refcount structures for them.) */
         nb_new_l2_tables = DIV_ROUND_UP(nb_new_data_clusters,
-                                        s->cluster_size / sizeof(uint64_t));
+                                        s->cluster_size / l2_entry_size(s));
         /* The cluster range may not be aligned to L2 boundaries, so add one L2
          * table for a potential head/tail */
         nb_new_l2_tables++;
@@ -3293,8 +3531,9 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset,
         guest_offset = old_length;
         while (nb_new_data_clusters) {
             int64_t guest_cluster = guest_offset >> s->cluster_bits;
-            int64_t nb_clusters = MIN(nb_new_data_clusters,
-                                      s->l2_size - guest_cluster % s->l2_size);
+            int64_t nb_clusters = MIN(
+                nb_new_data_clusters,
+                s->l2_slice_size - guest_cluster % s->l2_slice_size);
             QCowL2Meta allocation = {
                 .offset       = guest_offset,
                 .alloc_offset = host_offset,
@@ -3333,18 +3572,26 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset,
     }
 
     /* write updated header.size */
-    offset = cpu_to_be64(offset);
+    be_offset = cpu_to_be64(offset);
     ret = bdrv_pwrite_sync(bs->file, offsetof(QCowHeader, size),
-                           &offset, sizeof(uint64_t));
+                           &be_offset, sizeof(uint64_t));
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to update the image size");
         return ret;
     }
 
     s->l1_vm_state_index = new_l1_size;
+    qcow2_update_l2_cache(bs, offset);
     return 0;
 }
 
+/* Let the next compressed write allocate its cluster */
+static void qcow2_compress_alloc_done(BDRVQcow2State *s)
+{
+    s->compress_alloc_turn++;
+    qemu_co_queue_restart_all(&s->compress_alloc_wait);
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static coroutine_fn int
@@ -3354,10 +3601,11 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
     BDRVQcow2State *s = bs->opaque;
     QEMUIOVector hd_qiov;
     struct iovec iov;
-    z_stream strm;
-    int ret, out_len;
+    int ret;
+    size_t out_len;
     uint8_t *buf, *out_buf;
     int64_t cluster_offset;
+    uint64_t ticket;
 
     if (bytes == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -3384,43 +3632,36 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
 
     out_buf = g_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
+    /* Deflate in the thread pool, concurrent writes compress in parallel.
+     * The clusters are still allocated in the order in which the writes
+     * came in, so that in-order writers such as qemu-img convert get a
+     * sequential layout. */
+    ticket = s->compress_alloc_next++;
+    ret = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                            buf, s->cluster_size);
+    while (s->compress_alloc_turn != ticket) {
+        qemu_co_queue_wait(&s->compress_alloc_wait, NULL);
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (ret == -ENOMEM) {
         /* could not compress: write normal cluster */
+        qcow2_compress_alloc_done(s);
         ret = qcow2_co_pwritev(bs, offset, bytes, qiov, 0);
         if (ret < 0) {
             goto fail;
         }
         goto success;
+    } else if (ret < 0) {
+        qcow2_compress_alloc_done(s);
+        ret = -EINVAL;
+        goto fail;
     }
+    out_len = ret;
 
     qemu_co_mutex_lock(&s->lock);
     cluster_offset =
         qcow2_alloc_compressed_cluster_offset(bs, offset, out_len);
+    qcow2_compress_alloc_done(s);
     if (!cluster_offset) {
         qemu_co_mutex_unlock(&s->lock);
         ret = -EIO;
@@ -3613,6 +3854,8 @@ static int qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
+    qcow2_chain_index_invalidate(bs);
+
     if (s->qcow_version >= 3 && !s->snapshots &&
         3 + l1_clusters <= s->refcount_block_size) {
         /* The following function only works for qcow2 v3 images (it requires
@@ -3680,6 +3923,7 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     char *optstr;
     PreallocMode prealloc;
     bool has_backing_file;
+    bool extended_l2;
 
     /* Parse image creation options */
     cluster_size = qcow2_opt_get_cluster_size_del(opts, &local_err);
@@ -3709,12 +3953,21 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     has_backing_file = !!optstr;
     g_free(optstr);
 
+    extended_l2 = qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false);
+    if (extended_l2 && cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+        error_setg(&local_err, "Extended L2 entries are only supported with "
+                   "cluster sizes of at least %d bytes",
+                   1 << MIN_EXTL2_CLUSTER_BITS);
+        goto err;
+    }
+
     virtual_size = align_offset(qemu_opt_get_size_del(opts, BLOCK_OPT_SIZE, 0),
                                 cluster_size);
 
     /* Check that virtual disk size is valid */
     l2_tables = DIV_ROUND_UP(virtual_size / cluster_size,
-                             cluster_size / sizeof(uint64_t));
+                             cluster_size / (extended_l2 ? L2E_SIZE_EXTENDED :
+                                                           L2E_SIZE_NORMAL));
     if (l2_tables * sizeof(uint64_t) > QCOW_MAX_L1_SIZE) {
         error_setg(&local_err, "The image size is too large "
                                "(try using a larger cluster size)");
@@ -3785,7 +4038,7 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     info = g_new(BlockMeasureInfo, 1);
     info->fully_allocated =
         qcow2_calc_prealloc_size(virtual_size, cluster_size,
-                                 ctz32(refcount_bits));
+                                 ctz32(refcount_bits), extended_l2);
 
     /* Remove data clusters that are not required.  This overestimates the
      * required size because metadata needed for the fully allocated file is
@@ -3809,6 +4062,28 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats;
+    BlockStatsSpecificQcow2 *qcow2_stats;
+
+    qcow2_stats = g_new0(BlockStatsSpecificQcow2, 1);
+    qcow2_stats->l2_cache = g_new0(Qcow2CacheStats, 1);
+    qcow2_cache_get_stats(s->l2_table_cache, qcow2_stats->l2_cache);
+    qcow2_stats->refcount_cache = g_new0(Qcow2CacheStats, 1);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          qcow2_stats->refcount_cache);
+
+    stats = g_new(BlockStatsSpecific, 1);
+    *stats = (BlockStatsSpecific){
+        .type  = BLOCK_STATS_SPECIFIC_KIND_QCOW2,
+        .u.qcow2.data = qcow2_stats,
+    };
+
+    return stats;
+}
+
 static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -3839,6 +4114,8 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
             .refcount_bits      = s->refcount_bits,
+            .extended_l2        = has_subclusters(s),
+            .has_extended_l2    = has_subclusters(s),
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -3846,6 +4123,19 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
         assert(false);
     }
 
+    if (s->backing_reads) {
+        Qcow2BackingReadStats *stats = g_new(Qcow2BackingReadStats, 1);
+
+        *stats = (Qcow2BackingReadStats){
+            .reads          = s->backing_reads,
+            .indexed_reads  = s->backing_indexed_reads,
+            .total_depth    = s->backing_total_depth,
+            .max_depth      = s->backing_max_depth,
+        };
+        spec_info->u.qcow2.data->has_backing_reads = true;
+        spec_info->u.qcow2.data->backing_reads = stats;
+    }
+
     if (encrypt_info) {
         ImageInfoSpecificQCow2Encryption *qencrypt =
             g_new(ImageInfoSpecificQCow2Encryption, 1);
@@ -3917,6 +4207,11 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (has_subclusters(s)) {
+        error_report("compat=0.10 does not support extended L2 entries");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -4095,6 +4390,13 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                 error_report("Changing the cluster size is not supported");
                 return -ENOTSUP;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2, has_subclusters(s)) !=
+                has_subclusters(s)) {
+                error_report("Changing the extended L2 entries setting is not "
+                             "supported");
+                return -ENOTSUP;
+            }
         } else if (!strcmp(desc->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             lazy_refcounts = qemu_opt_get_bool(opts, BLOCK_OPT_LAZY_REFCOUNTS,
                                                lazy_refcounts);
@@ -4342,6 +4644,11 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 tables",
+        },
         { /* end of list */ }
     }
 };
@@ -4379,12 +4686,14 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure           = qcow2_measure,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
 
     .supports_backing           = true,
     .bdrv_change_backing_file   = qcow2_change_backing_file,
+    .bdrv_backing_changed       = qcow2_chain_index_invalidate,
 
     .bdrv_refresh_limits        = qcow2_refresh_limits,
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
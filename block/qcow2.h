@@ -26,6 +26,7 @@
 #define BLOCK_QCOW2_H
 
 #include "crypto/block.h"
+#include "qemu/bswap.h"
 #include "qemu/coroutine.h"
 
 //#define DEBUG_ALLOC
@@ -67,15 +68,50 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Size of normal and extended L2 entries */
+#define L2E_SIZE_NORMAL   (sizeof(uint64_t))
+#define L2E_SIZE_EXTENDED (sizeof(uint64_t) * 2)
+
+/* Clusters of images with extended L2 entries are split into subclusters */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+
+/* Subclusters must be at least one sector large */
+#define MIN_EXTL2_CLUSTER_BITS 14
+
+/* The subcluster bitmap of an extended L2 entry */
+#define QCOW_L2_BITMAP_ALL_ALLOC  0x00000000ffffffffULL
+#define QCOW_L2_BITMAP_ALL_ZEROES 0xffffffff00000000ULL
+#define QCOW_OFLAG_SUB_ALLOC(X)   (1ULL << (X))
+#define QCOW_OFLAG_SUB_ZERO(X)    (QCOW_OFLAG_SUB_ALLOC(X) << 32)
+/* Bits @x to @y - 1 of the allocation (or zero) bitmap */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC(Y) - QCOW_OFLAG_SUB_ALLOC(X))
+#define QCOW_OFLAG_SUB_ZERO_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) << 32)
+
 /* Must be at least 2 to cover COW */
-#define MIN_L2_CACHE_SIZE 2 /* clusters */
+#define MIN_L2_CACHE_SIZE 2 /* entries */
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
 
+/* The L2 cache is sized to cover the whole image, but by default it does not
+ * grow beyond this */
+#define DEFAULT_L2_CACHE_MAX_SIZE 33554432 /* bytes */
+
+/* L2 tables are cached in slices of this size (or of one cluster, whichever
+ * is less) */
+#define DEFAULT_L2_CACHE_ENTRY_SIZE 4096 /* bytes */
+
+/* Upper bound for the compression requests of one image in the thread pool */
+#define QCOW2_MAX_COMPRESS_THREADS 16
+
+/* deflate level for compressed clusters, between 1 (fast) and 9 (small) */
+#define DEFAULT_COMPRESS_LEVEL 6
+
 /* Whichever is more */
-#define DEFAULT_L2_CACHE_CLUSTERS 8 /* clusters */
-#define DEFAULT_L2_CACHE_BYTE_SIZE 1048576 /* bytes */
+#define DEFAULT_REFCOUNT_CACHE_CLUSTERS 2 /* clusters */
+#define DEFAULT_REFCOUNT_CACHE_BYTE_SIZE 262144 /* bytes */
 
 /* The refblock cache needs only a fourth of the L2 cache size to cover as many
  * clusters */
@@ -100,8 +136,12 @@
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_CHAIN_INDEX "chain-index"
+#define QCOW2_OPT_COMPRESS_THREADS "compress-threads"
+#define QCOW2_OPT_COMPRESS_LEVEL "compress-level"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -190,11 +230,14 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 4,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -247,12 +290,27 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+typedef struct Qcow2ChainIndex Qcow2ChainIndex;
+
+/* Number of decompressed clusters that are kept in memory */
+#define QCOW2_COMPRESSED_CACHE_SIZE 16
+
+typedef struct Qcow2CompressedCacheEntry {
+    uint64_t offset;        /* host offset of the compressed data, or -1 */
+    uint64_t lru_counter;
+    uint8_t *data;
+} Qcow2CompressedCacheEntry;
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size; /* L2 entries per cache entry */
+    int subcluster_bits;
+    int subcluster_size;
+    int subclusters_per_cluster;
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -265,12 +323,27 @@ typedef struct BDRVQcow2State {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    uint64_t l2_cache_budget; /* L2 cache size limit in bytes */
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    /* Recently decompressed clusters */
+    Qcow2CompressedCacheEntry compressed_cache[QCOW2_COMPRESSED_CACHE_SIZE];
+    uint64_t compressed_cache_lru_counter;
+    unsigned compressed_cache_generation;
+
+    /* Compression and decompression requests in the thread pool */
+    CoQueue compress_wait;
+    int nb_compress_threads;
+    int max_compress_threads;
+    int compress_level;
+
+    /* Compressed clusters are allocated in the order in which the writes
+     * came in, even though they are compressed in parallel */
+    CoQueue compress_alloc_wait;
+    uint64_t compress_alloc_next;   /* ticket of the next compressed write */
+    uint64_t compress_alloc_turn;   /* ticket that may allocate now */
+
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -327,6 +400,18 @@ typedef struct BDRVQcow2State {
      * override) */
     char *image_backing_file;
     char *image_backing_format;
+
+    /* Allocation index of the backing chain, see qcow2-chain.c */
+    bool use_chain_index;
+    Qcow2ChainIndex *chain_index;
+    unsigned long chain_generation;
+    unsigned long chain_failed_generation;
+
+    /* Reads of unallocated clusters that went to the backing chain */
+    uint64_t backing_reads;
+    uint64_t backing_indexed_reads;
+    uint64_t backing_total_depth;
+    uint64_t backing_max_depth;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -397,6 +482,17 @@ typedef enum QCow2ClusterType {
     QCOW2_CLUSTER_COMPRESSED,
 } QCow2ClusterType;
 
+/* The state of one subcluster in an image with extended L2 entries */
+typedef enum QCow2SubclusterType {
+    QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN,
+    QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC,
+    QCOW2_SUBCLUSTER_ZERO_PLAIN,
+    QCOW2_SUBCLUSTER_ZERO_ALLOC,
+    QCOW2_SUBCLUSTER_NORMAL,
+    QCOW2_SUBCLUSTER_COMPRESSED,
+    QCOW2_SUBCLUSTER_INVALID,
+} QCow2SubclusterType;
+
 typedef enum QCow2MetadataOverlap {
     QCOW2_OL_MAIN_HEADER_BITNR    = 0,
     QCOW2_OL_ACTIVE_L1_BITNR      = 1,
@@ -442,6 +538,49 @@ typedef enum QCow2MetadataOverlap {
 
 #define REFT_OFFSET_MASK 0xfffffffffffffe00ULL
 
+static inline bool has_subclusters(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+static inline size_t l2_entry_size(BDRVQcow2State *s)
+{
+    return has_subclusters(s) ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
+}
+
+static inline uint64_t get_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                    int idx)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(l2_slice[idx]);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                     int idx)
+{
+    if (has_subclusters(s)) {
+        idx *= l2_entry_size(s) / sizeof(uint64_t);
+        return be64_to_cpu(l2_slice[idx + 1]);
+    } else {
+        return 0; /* For convenience only; this value has no meaning. */
+    }
+}
+
+static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                int idx, uint64_t entry)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx] = cpu_to_be64(entry);
+}
+
+static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx + 1] = cpu_to_be64(bitmap);
+}
+
 static inline int64_t start_of_cluster(BDRVQcow2State *s, int64_t offset)
 {
     return offset & ~(s->cluster_size - 1);
@@ -452,6 +591,11 @@ static inline int64_t offset_into_cluster(BDRVQcow2State *s, int64_t offset)
     return offset & (s->cluster_size - 1);
 }
 
+static inline int offset_to_sc_index(BDRVQcow2State *s, int64_t offset)
+{
+    return offset_into_cluster(s, offset) >> s->subcluster_bits;
+}
+
 static inline uint64_t size_to_clusters(BDRVQcow2State *s, uint64_t size)
 {
     return (size + (s->cluster_size - 1)) >> s->cluster_bits;
@@ -463,11 +607,21 @@ static inline int64_t size_to_l1(BDRVQcow2State *s, int64_t size)
     return (size + (1ULL << shift) - 1) >> shift;
 }
 
+static inline int64_t offset_to_l1_index(BDRVQcow2State *s, uint64_t offset)
+{
+    return offset >> (s->l2_bits + s->cluster_bits);
+}
+
 static inline int offset_to_l2_index(BDRVQcow2State *s, int64_t offset)
 {
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -500,6 +654,53 @@ static inline QCow2ClusterType qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Returns the type of subcluster @sc_index of a cluster with the extended L2
+ * entry @l2_entry and @l2_bitmap.
+ */
+static inline
+QCow2SubclusterType qcow2_get_subcluster_type(uint64_t l2_entry,
+                                              uint64_t l2_bitmap,
+                                              unsigned sc_index)
+{
+    uint32_t sc_alloc = QCOW_OFLAG_SUB_ALLOC(sc_index);
+    uint64_t sc_zero = QCOW_OFLAG_SUB_ZERO(sc_index);
+
+    assert(sc_index < QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER);
+
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        /* The bitmap of a compressed cluster is reserved */
+        return l2_bitmap ? QCOW2_SUBCLUSTER_INVALID
+                         : QCOW2_SUBCLUSTER_COMPRESSED;
+    }
+    if (l2_entry & QCOW_OFLAG_ZERO) {
+        /* Zero clusters are described by the bitmap alone */
+        return QCOW2_SUBCLUSTER_INVALID;
+    }
+    if ((l2_bitmap & sc_alloc) && (l2_bitmap & sc_zero)) {
+        return QCOW2_SUBCLUSTER_INVALID;
+    }
+
+    if (l2_entry & L2E_OFFSET_MASK) {
+        if (l2_bitmap & sc_zero) {
+            return QCOW2_SUBCLUSTER_ZERO_ALLOC;
+        } else if (l2_bitmap & sc_alloc) {
+            return QCOW2_SUBCLUSTER_NORMAL;
+        } else {
+            return QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC;
+        }
+    } else {
+        if (l2_bitmap & sc_alloc) {
+            /* Subclusters can't be allocated without a host cluster */
+            return QCOW2_SUBCLUSTER_INVALID;
+        } else if (l2_bitmap & sc_zero) {
+            return QCOW2_SUBCLUSTER_ZERO_PLAIN;
+        } else {
+            return QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN;
+        }
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcow2State *s)
 {
@@ -604,7 +805,12 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_shrink_l1_table(BlockDriverState *bs, uint64_t max_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_co_preadv_compressed(BlockDriverState *bs,
+                                            uint64_t cluster_descriptor,
+                                            uint64_t offset_in_cluster,
+                                            uint64_t bytes,
+                                            QEMUIOVector *qiov);
+void qcow2_compressed_cache_reset(BlockDriverState *bs);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *buf, int nb_sectors, bool enc, Error **errp);
 
@@ -645,8 +851,10 @@ void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               unsigned table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats);
 
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
      void *table);
@@ -654,6 +862,7 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
+void qcow2_cache_drop_dependency(Qcow2Cache *c, Qcow2Cache *dependency);
 void qcow2_cache_depends_on_flush(Qcow2Cache *c);
 
 void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c);
@@ -667,6 +876,27 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(BlockDriverState *bs, Qcow2Cache *c,
                                   uint64_t offset);
 void qcow2_cache_discard(BlockDriverState *bs, Qcow2Cache *c, void *table);
+void qcow2_cache_discard_range(BlockDriverState *bs, Qcow2Cache *c,
+                               uint64_t offset, uint64_t length);
+
+/* qcow2-chain.c functions */
+BdrvChild *coroutine_fn qcow2_chain_index_lookup(BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 uint64_t *bytes, int *depth);
+void qcow2_chain_index_allocated(BlockDriverState *bs, uint64_t offset,
+                                 uint64_t bytes);
+void qcow2_chain_index_invalidate(BlockDriverState *bs);
+void qcow2_chain_index_free(BlockDriverState *bs);
+
+/* qcow2-threads.c functions */
+void qcow2_compress_init(BlockDriverState *bs);
+int qcow2_compress_default_threads(void);
+ssize_t coroutine_fn
+qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                  const void *src, size_t src_size);
+ssize_t coroutine_fn
+qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                    const void *src, size_t src_size);
 
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -0,0 +1,868 @@
+/*
+ * RAM-backed volatile overlay block driver
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A ramoverlay node keeps every write in memory, in fixed-size chunks over
+ * its backing file; nothing is ever written to the backing file or to an
+ * image of its own.  A chunk that is written for the first time is filled
+ * from the backing file, so it always holds the complete data of its range.
+ *
+ * With a size-limit, the least recently written chunks are moved to an
+ * unlinked spill file in spill-dir when the limit is reached.  Without a
+ * spill-dir, writes that need more memory fail with ENOSPC.
+ *
+ * The contents are lost when the node is closed, unless they are saved
+ * into a qcow2 image with ramoverlay_commit().
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/option.h"
+#include "qemu/queue.h"
+#include "block/block_int.h"
+#include "block/ramoverlay.h"
+#include "block/thread-pool.h"
+#include "sysemu/block-backend.h"
+
+#define RAMOVERLAY_OPT_SIZE         "size"
+#define RAMOVERLAY_OPT_CHUNK_SIZE   "chunk-size"
+#define RAMOVERLAY_OPT_SIZE_LIMIT   "size-limit"
+#define RAMOVERLAY_OPT_SPILL_DIR    "spill-dir"
+
+#define RAMOVERLAY_DEFAULT_CHUNK_SIZE   (64 * 1024)
+#define RAMOVERLAY_MIN_CHUNK_SIZE       BDRV_SECTOR_SIZE
+#define RAMOVERLAY_MAX_CHUNK_SIZE       (2 * 1024 * 1024)
+
+typedef struct RamOverlayChunk {
+    uint64_t index;
+
+    /* Exactly one of these describes the contents, or none for zeroes */
+    uint8_t *data;
+    int64_t spill_offset;
+    bool zero;
+
+    /* Chunks with data in memory, least recently written first */
+    QTAILQ_ENTRY(RamOverlayChunk) next;
+} RamOverlayChunk;
+
+typedef struct BDRVRamOverlayState {
+    CoMutex lock;
+    GHashTable *chunks;
+    QTAILQ_HEAD(, RamOverlayChunk) lru;
+
+    uint32_t chunk_size;
+    uint64_t size;
+    uint64_t size_limit;
+    uint64_t mem_used;
+
+    int spill_fd;
+    int64_t spill_end;
+    GArray *spill_free;
+    uint64_t spilled;
+    uint64_t spill_reads;
+    uint64_t spill_writes;
+} BDRVRamOverlayState;
+
+typedef struct RamOverlaySpillRequest {
+    int fd;
+    uint8_t *buf;
+    size_t bytes;
+    off_t offset;
+    bool is_write;
+} RamOverlaySpillRequest;
+
+static BlockDriver bdrv_ramoverlay;
+
+static QemuOptsList ramoverlay_runtime_opts = {
+    .name = "ramoverlay",
+    .head = QTAILQ_HEAD_INITIALIZER(ramoverlay_runtime_opts.head),
+    .desc = {
+        {
+            .name = RAMOVERLAY_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Virtual disk size (default: size of the backing file)",
+        },
+        {
+            .name = RAMOVERLAY_OPT_CHUNK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of the in-memory copies",
+        },
+        {
+            .name = RAMOVERLAY_OPT_SIZE_LIMIT,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum memory for written data (default: no limit)",
+        },
+        {
+            .name = RAMOVERLAY_OPT_SPILL_DIR,
+            .type = QEMU_OPT_STRING,
+            .help = "Directory for data that exceeds the size limit",
+        },
+        { /* end of list */ }
+    },
+};
+
+bool bdrv_is_ramoverlay(BlockDriverState *bs)
+{
+    return bs->drv == &bdrv_ramoverlay;
+}
+
+static RamOverlayChunk *ramoverlay_find_chunk(BDRVRamOverlayState *s,
+                                              uint64_t index)
+{
+    return g_hash_table_lookup(s->chunks, &index);
+}
+
+static int ramoverlay_spill_rw(int fd, uint8_t *buf, size_t bytes,
+                               off_t offset, bool is_write)
+{
+    while (bytes) {
+        ssize_t len = is_write ? pwrite(fd, buf, bytes, offset)
+                               : pread(fd, buf, bytes, offset);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        } else if (len == 0) {
+            return -EIO;
+        }
+        buf += len;
+        bytes -= len;
+        offset += len;
+    }
+    return 0;
+}
+
+static int ramoverlay_spill_worker(void *opaque)
+{
+    RamOverlaySpillRequest *req = opaque;
+
+    return ramoverlay_spill_rw(req->fd, req->buf, req->bytes, req->offset,
+                               req->is_write);
+}
+
+static int coroutine_fn ramoverlay_spill_co_rw(BlockDriverState *bs,
+                                               uint8_t *buf, size_t bytes,
+                                               int64_t offset, bool is_write)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    RamOverlaySpillRequest req = {
+        .fd = s->spill_fd,
+        .buf = buf,
+        .bytes = bytes,
+        .offset = offset,
+        .is_write = is_write,
+    };
+
+    if (is_write) {
+        s->spill_writes++;
+    } else {
+        s->spill_reads++;
+    }
+    return thread_pool_submit_co(pool, ramoverlay_spill_worker, &req);
+}
+
+/* Forget the contents of @chunk, which then reads as zeroes */
+static void ramoverlay_chunk_release(BDRVRamOverlayState *s,
+                                     RamOverlayChunk *chunk)
+{
+    if (chunk->data) {
+        QTAILQ_REMOVE(&s->lru, chunk, next);
+        qemu_vfree(chunk->data);
+        chunk->data = NULL;
+        s->mem_used -= s->chunk_size;
+    }
+    if (chunk->spill_offset >= 0) {
+        g_array_append_val(s->spill_free, chunk->spill_offset);
+        chunk->spill_offset = -1;
+        s->spilled -= s->chunk_size;
+    }
+    chunk->zero = false;
+}
+
+static void ramoverlay_drop_chunks(BDRVRamOverlayState *s)
+{
+    GHashTableIter iter;
+    RamOverlayChunk *chunk;
+
+    g_hash_table_iter_init(&iter, s->chunks);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&chunk)) {
+        g_hash_table_iter_remove(&iter);
+        qemu_vfree(chunk->data);
+        g_free(chunk);
+    }
+    QTAILQ_INIT(&s->lru);
+    s->mem_used = 0;
+
+    g_array_set_size(s->spill_free, 0);
+    s->spill_end = 0;
+    s->spilled = 0;
+    if (s->spill_fd >= 0 && ftruncate(s->spill_fd, 0) < 0) {
+        error_report("ramoverlay: failed to truncate the spill file: %s",
+                     strerror(errno));
+    }
+}
+
+/* Move the data of @chunk from memory to the spill file */
+static int coroutine_fn ramoverlay_spill_chunk(BlockDriverState *bs,
+                                               RamOverlayChunk *chunk)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    int64_t offset;
+    int ret;
+
+    if (s->spill_free->len) {
+        offset = g_array_index(s->spill_free, int64_t, s->spill_free->len - 1);
+        g_array_set_size(s->spill_free, s->spill_free->len - 1);
+    } else {
+        offset = s->spill_end;
+        s->spill_end += s->chunk_size;
+    }
+
+    ret = ramoverlay_spill_co_rw(bs, chunk->data, s->chunk_size, offset, true);
+    if (ret < 0) {
+        g_array_append_val(s->spill_free, offset);
+        return ret;
+    }
+
+    QTAILQ_REMOVE(&s->lru, chunk, next);
+    qemu_vfree(chunk->data);
+    chunk->data = NULL;
+    chunk->spill_offset = offset;
+    s->mem_used -= s->chunk_size;
+    s->spilled += s->chunk_size;
+
+    return 0;
+}
+
+static int coroutine_fn ramoverlay_alloc_data(BlockDriverState *bs,
+                                              uint8_t **data)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    int ret;
+
+    while (s->size_limit && s->mem_used + s->chunk_size > s->size_limit) {
+        RamOverlayChunk *victim = QTAILQ_FIRST(&s->lru);
+
+        if (s->spill_fd < 0 || !victim) {
+            return -ENOSPC;
+        }
+        ret = ramoverlay_spill_chunk(bs, victim);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    *data = qemu_try_blockalign(bs, s->chunk_size);
+    return *data ? 0 : -ENOMEM;
+}
+
+/*
+ * Reads @bytes at @offset of the backing file into @qiov at @qiov_offset.
+ * Whatever the backing file does not cover reads as zeroes.
+ */
+static int coroutine_fn ramoverlay_read_backing(BlockDriverState *bs,
+                                                uint64_t offset,
+                                                uint64_t bytes,
+                                                QEMUIOVector *qiov,
+                                                size_t qiov_offset)
+{
+    QEMUIOVector hd_qiov;
+    int64_t backing_length = 0;
+    uint64_t n = 0;
+    int ret;
+
+    if (bs->backing) {
+        backing_length = bdrv_getlength(bs->backing->bs);
+        if (backing_length < 0) {
+            return backing_length;
+        }
+    }
+
+    if (offset < backing_length) {
+        n = MIN(bytes, backing_length - offset);
+        qemu_iovec_init(&hd_qiov, qiov->niov);
+        qemu_iovec_concat(&hd_qiov, qiov, qiov_offset, n);
+        ret = bdrv_co_preadv(bs->backing, offset, n, &hd_qiov, 0);
+        qemu_iovec_destroy(&hd_qiov);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (n < bytes) {
+        qemu_iovec_memset(qiov, qiov_offset + n, 0, bytes - n);
+    }
+
+    return 0;
+}
+
+/*
+ * Returns in @pchunk the chunk @index with its data in memory, reading its
+ * previous contents unless the caller is going to @overwrite all of it.
+ */
+static int coroutine_fn ramoverlay_get_data(BlockDriverState *bs,
+                                            uint64_t index, bool overwrite,
+                                            RamOverlayChunk **pchunk)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    RamOverlayChunk *chunk = ramoverlay_find_chunk(s, index);
+    uint8_t *data;
+    int ret = 0;
+
+    if (chunk && chunk->data) {
+        QTAILQ_REMOVE(&s->lru, chunk, next);
+        QTAILQ_INSERT_TAIL(&s->lru, chunk, next);
+        *pchunk = chunk;
+        return 0;
+    }
+
+    ret = ramoverlay_alloc_data(bs, &data);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!overwrite) {
+        if (!chunk) {
+            QEMUIOVector qiov;
+            struct iovec iov = {
+                .iov_base = data,
+                .iov_len = s->chunk_size,
+            };
+
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = ramoverlay_read_backing(bs, index * s->chunk_size,
+                                          s->chunk_size, &qiov, 0);
+        } else if (chunk->zero) {
+            memset(data, 0, s->chunk_size);
+        } else {
+            ret = ramoverlay_spill_co_rw(bs, data, s->chunk_size,
+                                         chunk->spill_offset, false);
+        }
+        if (ret < 0) {
+            qemu_vfree(data);
+            return ret;
+        }
+    }
+
+    if (!chunk) {
+        chunk = g_new0(RamOverlayChunk, 1);
+        chunk->index = index;
+        chunk->spill_offset = -1;
+        g_hash_table_insert(s->chunks, &chunk->index, chunk);
+    } else {
+        ramoverlay_chunk_release(s, chunk);
+    }
+
+    chunk->data = data;
+    QTAILQ_INSERT_TAIL(&s->lru, chunk, next);
+    s->mem_used += s->chunk_size;
+
+    *pchunk = chunk;
+    return 0;
+}
+
+static int ramoverlay_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *spill_dir;
+    uint64_t chunk_size;
+    int ret;
+
+    opts = qemu_opts_create(&ramoverlay_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->size = qemu_opt_get_size(opts, RAMOVERLAY_OPT_SIZE, 0);
+    chunk_size = qemu_opt_get_size(opts, RAMOVERLAY_OPT_CHUNK_SIZE,
+                                   RAMOVERLAY_DEFAULT_CHUNK_SIZE);
+    if (chunk_size < RAMOVERLAY_MIN_CHUNK_SIZE ||
+        chunk_size > RAMOVERLAY_MAX_CHUNK_SIZE || !is_power_of_2(chunk_size)) {
+        error_setg(errp, "Chunk size must be a power of two between %d and "
+                   "%d bytes", RAMOVERLAY_MIN_CHUNK_SIZE,
+                   RAMOVERLAY_MAX_CHUNK_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->chunk_size = chunk_size;
+
+    s->size_limit = qemu_opt_get_size(opts, RAMOVERLAY_OPT_SIZE_LIMIT, 0);
+    if (s->size_limit && s->size_limit < s->chunk_size) {
+        error_setg(errp, "size-limit must hold at least one chunk (%" PRIu32
+                   " bytes)", s->chunk_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->spill_fd = -1;
+    spill_dir = qemu_opt_get(opts, RAMOVERLAY_OPT_SPILL_DIR);
+    if (spill_dir) {
+        char *path = g_strdup_printf("%s/ramoverlay-XXXXXX", spill_dir);
+
+        s->spill_fd = g_mkstemp(path);
+        if (s->spill_fd < 0) {
+            ret = -errno;
+            error_setg_errno(errp, -ret, "Could not create spill file in "
+                             "'%s'", spill_dir);
+            g_free(path);
+            goto fail;
+        }
+        /* nobody else needs to see it, and it goes away with us */
+        unlink(path);
+        g_free(path);
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    s->chunks = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+    s->spill_free = g_array_new(false, false, sizeof(int64_t));
+
+    bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
+    ret = 0;
+fail:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void ramoverlay_close(BlockDriverState *bs)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+
+    ramoverlay_drop_chunks(s);
+    g_hash_table_destroy(s->chunks);
+    g_array_free(s->spill_free, true);
+    if (s->spill_fd >= 0) {
+        close(s->spill_fd);
+    }
+}
+
+static void ramoverlay_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+
+    bs->bl.pwrite_zeroes_alignment = s->chunk_size;
+    bs->bl.pdiscard_alignment = s->chunk_size;
+}
+
+static int64_t ramoverlay_getlength(BlockDriverState *bs)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+
+    if (s->size) {
+        return s->size;
+    }
+    return bs->backing ? bdrv_getlength(bs->backing->bs) : 0;
+}
+
+static int coroutine_fn ramoverlay_co_preadv(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    uint8_t *bounce = NULL;
+    uint64_t done = 0;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    while (done < bytes) {
+        uint64_t pos = offset + done;
+        uint64_t in_chunk = pos % s->chunk_size;
+        uint64_t n = MIN(bytes - done, s->chunk_size - in_chunk);
+        RamOverlayChunk *chunk = ramoverlay_find_chunk(s, pos / s->chunk_size);
+
+        if (!chunk) {
+            /* One backing read for all of the following unwritten chunks */
+            while (done + n < bytes &&
+                   !ramoverlay_find_chunk(s, (pos + n) / s->chunk_size)) {
+                n += MIN(bytes - done - n, s->chunk_size);
+            }
+            qemu_co_mutex_unlock(&s->lock);
+            ret = ramoverlay_read_backing(bs, pos, n, qiov, done);
+            qemu_co_mutex_lock(&s->lock);
+        } else if (chunk->data) {
+            qemu_iovec_from_buf(qiov, done, chunk->data + in_chunk, n);
+        } else if (chunk->zero) {
+            qemu_iovec_memset(qiov, done, 0, n);
+        } else {
+            if (!bounce) {
+                bounce = qemu_try_blockalign(bs, s->chunk_size);
+                if (!bounce) {
+                    ret = -ENOMEM;
+                    break;
+                }
+            }
+            ret = ramoverlay_spill_co_rw(bs, bounce, n,
+                                         chunk->spill_offset + in_chunk,
+                                         false);
+            if (ret == 0) {
+                qemu_iovec_from_buf(qiov, done, bounce, n);
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+        done += n;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    qemu_vfree(bounce);
+    return ret;
+}
+
+static int coroutine_fn ramoverlay_co_pwritev(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    uint64_t done = 0;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    while (done < bytes) {
+        uint64_t pos = offset + done;
+        uint64_t in_chunk = pos % s->chunk_size;
+        uint64_t n = MIN(bytes - done, s->chunk_size - in_chunk);
+        RamOverlayChunk *chunk;
+
+        ret = ramoverlay_get_data(bs, pos / s->chunk_size,
+                                  n == s->chunk_size, &chunk);
+        if (ret < 0) {
+            break;
+        }
+        qemu_iovec_to_buf(qiov, done, chunk->data + in_chunk, n);
+        done += n;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/* Make @nb_chunks chunks starting at @index read as zeroes */
+static void ramoverlay_zero_chunks(BlockDriverState *bs, uint64_t index,
+                                   uint64_t nb_chunks)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    uint64_t i;
+
+    for (i = index; i < index + nb_chunks; i++) {
+        RamOverlayChunk *chunk = ramoverlay_find_chunk(s, i);
+
+        if (chunk) {
+            ramoverlay_chunk_release(s, chunk);
+        } else if (bs->backing) {
+            chunk = g_new0(RamOverlayChunk, 1);
+            chunk->index = i;
+            chunk->spill_offset = -1;
+            g_hash_table_insert(s->chunks, &chunk->index, chunk);
+        } else {
+            /* unwritten chunks without a backing file read as zeroes */
+            continue;
+        }
+        chunk->zero = true;
+    }
+}
+
+static int coroutine_fn ramoverlay_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+
+    /* Partial chunks are written as a zeroed buffer by the block layer */
+    if (!QEMU_IS_ALIGNED(offset | bytes, s->chunk_size)) {
+        return -ENOTSUP;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ramoverlay_zero_chunks(bs, offset / s->chunk_size, bytes / s->chunk_size);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return 0;
+}
+
+static int coroutine_fn ramoverlay_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    uint64_t first = DIV_ROUND_UP(offset, s->chunk_size);
+    uint64_t end = (offset + bytes) / s->chunk_size;
+
+    /* Discarding whole chunks gives their memory back */
+    if (end > first) {
+        qemu_co_mutex_lock(&s->lock);
+        ramoverlay_zero_chunks(bs, first, end - first);
+        qemu_co_mutex_unlock(&s->lock);
+    }
+
+    return 0;
+}
+
+static int64_t coroutine_fn ramoverlay_co_get_block_status(
+        BlockDriverState *bs, int64_t sector_num, int nb_sectors, int *pnum,
+        BlockDriverState **file)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    uint64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    uint64_t bytes = (uint64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    int64_t status = 0;
+    uint64_t n = 0;
+
+    while (n < bytes) {
+        RamOverlayChunk *chunk;
+        int64_t chunk_status;
+
+        chunk = ramoverlay_find_chunk(s, (offset + n) / s->chunk_size);
+        chunk_status = !chunk ? 0 :
+                       chunk->zero ? BDRV_BLOCK_ZERO : BDRV_BLOCK_DATA;
+        if (n && chunk_status != status) {
+            break;
+        }
+        status = chunk_status;
+        n += MIN(bytes - n, s->chunk_size - (offset + n) % s->chunk_size);
+    }
+
+    *pnum = n >> BDRV_SECTOR_BITS;
+    *file = NULL;
+    return status;
+}
+
+static int ramoverlay_make_empty(BlockDriverState *bs)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+
+    bdrv_drain(bs);
+    ramoverlay_drop_chunks(s);
+
+    return 0;
+}
+
+static int ramoverlay_change_backing_file(BlockDriverState *bs,
+                                          const char *backing_file,
+                                          const char *backing_fmt)
+{
+    /* There is no header, the new name only lives in @bs */
+    return 0;
+}
+
+static int ramoverlay_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+
+    bdi->cluster_size = s->chunk_size;
+    bdi->unallocated_blocks_are_zero = !bs->backing;
+    return 0;
+}
+
+static BlockStatsSpecific *ramoverlay_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    BlockStatsSpecific *stats;
+    BlockStatsSpecificRamOverlay *ro_stats;
+
+    ro_stats = g_new(BlockStatsSpecificRamOverlay, 1);
+    *ro_stats = (BlockStatsSpecificRamOverlay){
+        .chunks         = g_hash_table_size(s->chunks),
+        .chunk_size     = s->chunk_size,
+        .memory_used    = s->mem_used,
+        .size_limit     = s->size_limit,
+        .spilled        = s->spilled,
+        .spill_reads    = s->spill_reads,
+        .spill_writes   = s->spill_writes,
+    };
+
+    stats = g_new(BlockStatsSpecific, 1);
+    *stats = (BlockStatsSpecific){
+        .type  = BLOCK_STATS_SPECIFIC_KIND_RAMOVERLAY,
+        .u.ramoverlay.data = ro_stats,
+    };
+
+    return stats;
+}
+
+int ramoverlay_commit(BlockDriverState *bs, const char *filename,
+                      Error **errp)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    BlockDriverState *backing = bs->backing ? bs->backing->bs : NULL;
+    BlockDriverState *target;
+    BlockBackend *blk = NULL;
+    GHashTableIter iter;
+    RamOverlayChunk *chunk;
+    QDict *options;
+    Error *local_err = NULL;
+    uint8_t *buf = NULL;
+    char *create_opts;
+    int64_t size;
+    int ret;
+
+    assert(bdrv_is_ramoverlay(bs));
+
+    size = bdrv_getlength(bs);
+    if (size < 0) {
+        error_setg_errno(errp, -size, "Could not get the overlay size");
+        return size;
+    }
+
+    bdrv_drained_begin(bs);
+
+    create_opts = g_strdup_printf("cluster_size=%" PRIu32, s->chunk_size);
+    bdrv_img_create(filename, "qcow2", backing ? backing->filename : NULL,
+                    backing ? backing->drv->format_name : NULL, create_opts,
+                    size, BDRV_O_RDWR, true, &local_err);
+    g_free(create_opts);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EIO;
+        goto out;
+    }
+
+    options = qdict_new();
+    qdict_put_str(options, "driver", "qcow2");
+    blk = blk_new_open(filename, NULL, options,
+                       BDRV_O_RDWR | BDRV_O_NO_BACKING, errp);
+    if (!blk) {
+        ret = -EIO;
+        goto out;
+    }
+    target = blk_bs(blk);
+
+    /* Share the backing node, partly written clusters must see its data */
+    if (backing) {
+        bdrv_set_backing_hd(target, backing, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            ret = -EIO;
+            goto out;
+        }
+    }
+
+    buf = qemu_blockalign(bs, s->chunk_size);
+    g_hash_table_iter_init(&iter, s->chunks);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&chunk)) {
+        int64_t offset = chunk->index * s->chunk_size;
+        int bytes;
+
+        if (offset >= size) {
+            continue;
+        }
+        bytes = MIN(s->chunk_size, size - offset);
+
+        if (chunk->zero) {
+            ret = blk_pwrite_zeroes(blk, offset, bytes, 0);
+        } else {
+            const uint8_t *data = chunk->data;
+
+            if (!data) {
+                ret = ramoverlay_spill_rw(s->spill_fd, buf, s->chunk_size,
+                                         chunk->spill_offset, false);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "Could not read the spill "
+                                     "file");
+                    goto out;
+                }
+                data = buf;
+            }
+            ret = blk_pwrite(blk, offset, data, bytes, 0);
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write to '%s'", filename);
+            goto out;
+        }
+    }
+
+    ret = blk_flush(blk);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush '%s'", filename);
+        goto out;
+    }
+
+    /* The image is never written again, it only backs the overlay */
+    bdrv_ref(target);
+    blk_unref(blk);
+    blk = NULL;
+
+    ret = bdrv_reopen(target, bdrv_get_flags(target) & ~BDRV_O_RDWR, errp);
+    if (ret < 0) {
+        bdrv_unref(target);
+        goto out;
+    }
+
+    bdrv_set_backing_hd(bs, target, &local_err);
+    bdrv_unref(target);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EIO;
+        goto out;
+    }
+    pstrcpy(bs->backing_file, sizeof(bs->backing_file), filename);
+    pstrcpy(bs->backing_format, sizeof(bs->backing_format), "qcow2");
+
+    ramoverlay_drop_chunks(s);
+    ret = 0;
+out:
+    blk_unref(blk);
+    qemu_vfree(buf);
+    bdrv_drained_end(bs);
+    return ret;
+}
+
+static BlockDriver bdrv_ramoverlay = {
+    .format_name                = "ramoverlay",
+    .instance_size              = sizeof(BDRVRamOverlayState),
+
+    .bdrv_open                  = ramoverlay_open,
+    .bdrv_close                 = ramoverlay_close,
+    .bdrv_child_perm            = bdrv_format_default_perms,
+    .bdrv_refresh_limits        = ramoverlay_refresh_limits,
+
+    .bdrv_getlength             = ramoverlay_getlength,
+    .has_variable_length        = true,
+
+    .bdrv_co_preadv             = ramoverlay_co_preadv,
+    .bdrv_co_pwritev            = ramoverlay_co_pwritev,
+    .bdrv_co_pwrite_zeroes      = ramoverlay_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = ramoverlay_co_pdiscard,
+    .bdrv_co_get_block_status   = ramoverlay_co_get_block_status,
+
+    .bdrv_make_empty            = ramoverlay_make_empty,
+    .bdrv_change_backing_file   = ramoverlay_change_backing_file,
+    .bdrv_get_info              = ramoverlay_get_info,
+    .bdrv_get_specific_stats    = ramoverlay_get_specific_stats,
+
+    .supports_backing           = true,
+};
+
+static void bdrv_ramoverlay_init(void)
+{
+    bdrv_register(&bdrv_ramoverlay);
+}
+
+block_init(bdrv_ramoverlay_init);
@@ -2506,6 +2506,47 @@ void pause_all_vcpus(void)
     }
 }
 
+#ifdef CONFIG_FLEXUS
+/*
+ * Once Flexus has taken control of the vCPUs in timing mode, it drives them
+ * from the TCG thread and never looks at cpu->stop, so pause_all_vcpus()
+ * would wait forever.  Ask Flexus to end the simulation instead, and wait
+ * until the TCG thread has left its loop and released the vCPUs.
+ *
+ * Returns false if Flexus could not be asked to stop, in which case the
+ * vCPUs may still be running.
+ */
+bool flexus_pause_all_vcpus(void)
+{
+    CPUState *cpu;
+    Error *err = NULL;
+
+    if (!flexus_in_timing() || !qflex_control_with_flexus) {
+        pause_all_vcpus();
+        return true;
+    }
+
+    /* Nothing to do if the simulation has already ended */
+    if (!first_cpu->created) {
+        return true;
+    }
+
+    flexus_terminateSimulation(&err);
+    if (err) {
+        /* Nobody would release the vCPUs, do not wait for them */
+        error_report_err(err);
+        return false;
+    }
+
+    CPU_FOREACH(cpu) {
+        while (cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+    }
+    return true;
+}
+#endif
+
 void cpu_resume(CPUState *cpu)
 {
     cpu->stop = false;
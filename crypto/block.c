@@ -52,29 +52,36 @@ QCryptoBlock *qcrypto_block_open(QCryptoBlockOpenOptions *options,
                                  QCryptoBlockReadFunc readfunc,
                                  void *opaque,
                                  unsigned int flags,
+                                 size_t n_threads,
                                  Error **errp)
 {
     QCryptoBlock *block = g_new0(QCryptoBlock, 1);
 
     block->format = options->format;
+    qemu_mutex_init(&block->mutex);
+    qemu_cond_init(&block->cipher_cond);
 
     if (options->format >= G_N_ELEMENTS(qcrypto_block_drivers) ||
         !qcrypto_block_drivers[options->format]) {
         error_setg(errp, "Unsupported block driver %s",
                    QCryptoBlockFormat_str(options->format));
-        g_free(block);
-        return NULL;
+        goto fail;
     }
 
     block->driver = qcrypto_block_drivers[options->format];
 
     if (block->driver->open(block, options, optprefix,
-                            readfunc, opaque, flags, errp) < 0) {
-        g_free(block);
-        return NULL;
+                            readfunc, opaque, flags, n_threads, errp) < 0) {
+        goto fail;
     }
 
     return block;
+
+ fail:
+    qemu_cond_destroy(&block->cipher_cond);
+    qemu_mutex_destroy(&block->mutex);
+    g_free(block);
+    return NULL;
 }
 
 
@@ -88,24 +95,30 @@ QCryptoBlock *qcrypto_block_create(QCryptoBlockCreateOptions *options,
     QCryptoBlock *block = g_new0(QCryptoBlock, 1);
 
     block->format = options->format;
+    qemu_mutex_init(&block->mutex);
+    qemu_cond_init(&block->cipher_cond);
 
     if (options->format >= G_N_ELEMENTS(qcrypto_block_drivers) ||
         !qcrypto_block_drivers[options->format]) {
         error_setg(errp, "Unsupported block driver %s",
                    QCryptoBlockFormat_str(options->format));
-        g_free(block);
-        return NULL;
+        goto fail;
     }
 
     block->driver = qcrypto_block_drivers[options->format];
 
     if (block->driver->create(block, options, optprefix, initfunc,
                               writefunc, opaque, errp) < 0) {
-        g_free(block);
-        return NULL;
+        goto fail;
     }
 
     return block;
+
+ fail:
+    qemu_cond_destroy(&block->cipher_cond);
+    qemu_mutex_destroy(&block->mutex);
+    g_free(block);
+    return NULL;
 }
 
 
@@ -148,7 +161,8 @@ int qcrypto_block_encrypt(QCryptoBlock *block,
 
 QCryptoCipher *qcrypto_block_get_cipher(QCryptoBlock *block)
 {
-    return block->cipher;
+    /* Ciphers in the pool only differ in their state */
+    return block->n_ciphers > 0 ? block->ciphers[0] : NULL;
 }
 
 
@@ -184,73 +198,114 @@ void qcrypto_block_free(QCryptoBlock *block)
 
     block->driver->cleanup(block);
 
-    qcrypto_cipher_free(block->cipher);
+    qcrypto_block_free_cipher(block);
     qcrypto_ivgen_free(block->ivgen);
+    qemu_cond_destroy(&block->cipher_cond);
+    qemu_mutex_destroy(&block->mutex);
     g_free(block);
 }
 
 
-int qcrypto_block_decrypt_helper(QCryptoCipher *cipher,
-                                 size_t niv,
-                                 QCryptoIVGen *ivgen,
-                                 int sectorsize,
-                                 uint64_t offset,
-                                 uint8_t *buf,
-                                 size_t len,
-                                 Error **errp)
+size_t qcrypto_block_get_n_threads(QCryptoBlock *block)
 {
-    uint8_t *iv;
-    int ret = -1;
-    uint64_t startsector = offset / sectorsize;
+    return block->n_ciphers;
+}
 
-    assert(QEMU_IS_ALIGNED(offset, sectorsize));
-    assert(QEMU_IS_ALIGNED(len, sectorsize));
 
-    iv = niv ? g_new0(uint8_t, niv) : NULL;
+int qcrypto_block_init_cipher(QCryptoBlock *block,
+                              QCryptoCipherAlgorithm alg,
+                              QCryptoCipherMode mode,
+                              const uint8_t *key, size_t nkey,
+                              size_t n_threads, Error **errp)
+{
+    size_t i;
 
-    while (len > 0) {
-        size_t nbytes;
-        if (niv) {
-            if (qcrypto_ivgen_calculate(ivgen,
-                                        startsector,
-                                        iv, niv,
-                                        errp) < 0) {
-                goto cleanup;
-            }
+    assert(!block->ciphers && !block->n_ciphers && !block->n_free_ciphers);
 
-            if (qcrypto_cipher_setiv(cipher,
-                                     iv, niv,
-                                     errp) < 0) {
-                goto cleanup;
-            }
-        }
+    block->ciphers = g_new0(QCryptoCipher *, MAX(n_threads, 1));
 
-        nbytes = len > sectorsize ? sectorsize : len;
-        if (qcrypto_cipher_decrypt(cipher, buf, buf,
-                                   nbytes, errp) < 0) {
-            goto cleanup;
+    for (i = 0; i < MAX(n_threads, 1); i++) {
+        block->ciphers[i] = qcrypto_cipher_new(alg, mode, key, nkey, errp);
+        if (!block->ciphers[i]) {
+            qcrypto_block_free_cipher(block);
+            return -1;
         }
+        block->n_ciphers++;
+        block->n_free_ciphers++;
+    }
 
-        startsector++;
-        buf += nbytes;
-        len -= nbytes;
+    return 0;
+}
+
+
+void qcrypto_block_free_cipher(QCryptoBlock *block)
+{
+    size_t i;
+
+    if (!block->ciphers) {
+        return;
     }
 
-    ret = 0;
- cleanup:
-    g_free(iv);
-    return ret;
+    assert(block->n_ciphers == block->n_free_ciphers);
+
+    for (i = 0; i < block->n_ciphers; i++) {
+        qcrypto_cipher_free(block->ciphers[i]);
+    }
+
+    g_free(block->ciphers);
+    block->ciphers = NULL;
+    block->n_ciphers = block->n_free_ciphers = 0;
 }
 
 
-int qcrypto_block_encrypt_helper(QCryptoCipher *cipher,
-                                 size_t niv,
-                                 QCryptoIVGen *ivgen,
-                                 int sectorsize,
-                                 uint64_t offset,
-                                 uint8_t *buf,
-                                 size_t len,
-                                 Error **errp)
+static QCryptoCipher *qcrypto_block_pop_cipher(QCryptoBlock *block)
+{
+    QCryptoCipher *cipher;
+
+    qemu_mutex_lock(&block->mutex);
+
+    while (block->n_free_ciphers == 0) {
+        qemu_cond_wait(&block->cipher_cond, &block->mutex);
+    }
+    block->n_free_ciphers--;
+    cipher = block->ciphers[block->n_free_ciphers];
+
+    qemu_mutex_unlock(&block->mutex);
+
+    return cipher;
+}
+
+
+static void qcrypto_block_push_cipher(QCryptoBlock *block,
+                                      QCryptoCipher *cipher)
+{
+    qemu_mutex_lock(&block->mutex);
+
+    assert(block->n_free_ciphers < block->n_ciphers);
+    block->ciphers[block->n_free_ciphers] = cipher;
+    block->n_free_ciphers++;
+    qemu_cond_signal(&block->cipher_cond);
+
+    qemu_mutex_unlock(&block->mutex);
+}
+
+
+typedef int (*QCryptoCipherEncDecFunc)(QCryptoCipher *cipher,
+                                        const void *in,
+                                        void *out,
+                                        size_t len,
+                                        Error **errp);
+
+static int do_qcrypto_block_cipher_encdec(QCryptoCipher *cipher,
+                                          size_t niv,
+                                          QCryptoIVGen *ivgen,
+                                          QemuMutex *ivgen_mutex,
+                                          int sectorsize,
+                                          uint64_t offset,
+                                          uint8_t *buf,
+                                          size_t len,
+                                          QCryptoCipherEncDecFunc func,
+                                          Error **errp)
 {
     uint8_t *iv;
     int ret = -1;
@@ -264,23 +319,28 @@ int qcrypto_block_encrypt_helper(QCryptoCipher *cipher,
     while (len > 0) {
         size_t nbytes;
         if (niv) {
-            if (qcrypto_ivgen_calculate(ivgen,
-                                        startsector,
-                                        iv, niv,
-                                        errp) < 0) {
+            if (ivgen_mutex) {
+                qemu_mutex_lock(ivgen_mutex);
+            }
+            ret = qcrypto_ivgen_calculate(ivgen, startsector, iv, niv, errp);
+            if (ivgen_mutex) {
+                qemu_mutex_unlock(ivgen_mutex);
+            }
+            if (ret < 0) {
                 goto cleanup;
             }
 
             if (qcrypto_cipher_setiv(cipher,
                                      iv, niv,
                                      errp) < 0) {
+                ret = -1;
                 goto cleanup;
             }
         }
 
         nbytes = len > sectorsize ? sectorsize : len;
-        if (qcrypto_cipher_encrypt(cipher, buf, buf,
-                                   nbytes, errp) < 0) {
+        if (func(cipher, buf, buf, nbytes, errp) < 0) {
+            ret = -1;
             goto cleanup;
         }
 
@@ -294,3 +354,86 @@ int qcrypto_block_encrypt_helper(QCryptoCipher *cipher,
     g_free(iv);
     return ret;
 }
+
+
+int qcrypto_block_cipher_decrypt_helper(QCryptoCipher *cipher,
+                                        size_t niv,
+                                        QCryptoIVGen *ivgen,
+                                        int sectorsize,
+                                        uint64_t offset,
+                                        uint8_t *buf,
+                                        size_t len,
+                                        Error **errp)
+{
+    return do_qcrypto_block_cipher_encdec(cipher, niv, ivgen, NULL,
+                                          sectorsize, offset, buf, len,
+                                          qcrypto_cipher_decrypt, errp);
+}
+
+
+int qcrypto_block_cipher_encrypt_helper(QCryptoCipher *cipher,
+                                        size_t niv,
+                                        QCryptoIVGen *ivgen,
+                                        int sectorsize,
+                                        uint64_t offset,
+                                        uint8_t *buf,
+                                        size_t len,
+                                        Error **errp)
+{
+    return do_qcrypto_block_cipher_encdec(cipher, niv, ivgen, NULL,
+                                          sectorsize, offset, buf, len,
+                                          qcrypto_cipher_encrypt, errp);
+}
+
+
+static int qcrypto_block_encdec(QCryptoBlock *block,
+                                int sectorsize,
+                                uint64_t offset,
+                                uint8_t *buf,
+                                size_t len,
+                                QCryptoCipherEncDecFunc func,
+                                Error **errp)
+{
+    QCryptoCipher *cipher = qcrypto_block_pop_cipher(block);
+    QemuMutex *ivgen_mutex = NULL;
+    int ret;
+
+    /* Only ESSIV keeps a cipher of its own in the IV generator, plain
+     * and plain64 can be used from several threads at once */
+    if (block->niv &&
+        qcrypto_ivgen_get_algorithm(block->ivgen) == QCRYPTO_IVGEN_ALG_ESSIV) {
+        ivgen_mutex = &block->mutex;
+    }
+
+    ret = do_qcrypto_block_cipher_encdec(cipher, block->niv, block->ivgen,
+                                         ivgen_mutex, sectorsize, offset,
+                                         buf, len, func, errp);
+
+    qcrypto_block_push_cipher(block, cipher);
+
+    return ret;
+}
+
+
+int qcrypto_block_decrypt_helper(QCryptoBlock *block,
+                                 int sectorsize,
+                                 uint64_t offset,
+                                 uint8_t *buf,
+                                 size_t len,
+                                 Error **errp)
+{
+    return qcrypto_block_encdec(block, sectorsize, offset, buf, len,
+                                qcrypto_cipher_decrypt, errp);
+}
+
+
+int qcrypto_block_encrypt_helper(QCryptoBlock *block,
+                                 int sectorsize,
+                                 uint64_t offset,
+                                 uint8_t *buf,
+                                 size_t len,
+                                 Error **errp)
+{
+    return qcrypto_block_encdec(block, sectorsize, offset, buf, len,
+                                qcrypto_cipher_encrypt, errp);
+}
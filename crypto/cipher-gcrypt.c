@@ -56,6 +56,20 @@ bool qcrypto_cipher_supports(QCryptoCipherAlgorithm alg,
     }
 }
 
+/*
+ * libgcrypt 1.8 and newer implement XTS themselves and process a whole
+ * sector per call with their accelerated AES code.  Older versions only
+ * provide the block cipher, with XTS built on top of it by crypto/xts.c.
+ */
+static bool qcrypto_gcrypt_emulate_xts(QCryptoCipherMode mode)
+{
+#ifdef CONFIG_GCRYPT_XTS
+    return false;
+#else
+    return mode == QCRYPTO_CIPHER_MODE_XTS;
+#endif
+}
+
 typedef struct QCryptoCipherGcrypt QCryptoCipherGcrypt;
 struct QCryptoCipherGcrypt {
     gcry_cipher_hd_t handle;
@@ -74,7 +88,7 @@ qcrypto_gcrypt_cipher_free_ctx(QCryptoCipherGcrypt *ctx,
     }
 
     gcry_cipher_close(ctx->handle);
-    if (mode == QCRYPTO_CIPHER_MODE_XTS) {
+    if (qcrypto_gcrypt_emulate_xts(mode)) {
         gcry_cipher_close(ctx->tweakhandle);
     }
     g_free(ctx->iv);
@@ -94,8 +108,14 @@ static QCryptoCipherGcrypt *qcrypto_cipher_ctx_new(QCryptoCipherAlgorithm alg,
 
     switch (mode) {
     case QCRYPTO_CIPHER_MODE_ECB:
+        gcrymode = GCRY_CIPHER_MODE_ECB;
+        break;
     case QCRYPTO_CIPHER_MODE_XTS:
+#ifdef CONFIG_GCRYPT_XTS
+        gcrymode = GCRY_CIPHER_MODE_XTS;
+#else
         gcrymode = GCRY_CIPHER_MODE_ECB;
+#endif
         break;
     case QCRYPTO_CIPHER_MODE_CBC:
         gcrymode = GCRY_CIPHER_MODE_CBC;
@@ -172,7 +192,7 @@ static QCryptoCipherGcrypt *qcrypto_cipher_ctx_new(QCryptoCipherAlgorithm alg,
                    gcry_strerror(err));
         goto error;
     }
-    if (mode == QCRYPTO_CIPHER_MODE_XTS) {
+    if (qcrypto_gcrypt_emulate_xts(mode)) {
         err = gcry_cipher_open(&ctx->tweakhandle, gcryalg, gcrymode, 0);
         if (err != 0) {
             error_setg(errp, "Cannot initialize cipher: %s",
@@ -191,7 +211,7 @@ static QCryptoCipherGcrypt *qcrypto_cipher_ctx_new(QCryptoCipherAlgorithm alg,
         g_free(rfbkey);
         ctx->blocksize = 8;
     } else {
-        if (mode == QCRYPTO_CIPHER_MODE_XTS) {
+        if (qcrypto_gcrypt_emulate_xts(mode)) {
             nkey /= 2;
             err = gcry_cipher_setkey(ctx->handle, key, nkey);
             if (err != 0) {
@@ -235,6 +255,9 @@ static QCryptoCipherGcrypt *qcrypto_cipher_ctx_new(QCryptoCipherAlgorithm alg,
                        ctx->blocksize, XTS_BLOCK_SIZE);
             goto error;
         }
+    }
+
+    if (qcrypto_gcrypt_emulate_xts(mode)) {
         ctx->iv = g_new0(uint8_t, ctx->blocksize);
     }
 
@@ -289,7 +312,7 @@ qcrypto_gcrypt_cipher_encrypt(QCryptoCipher *cipher,
         return -1;
     }
 
-    if (cipher->mode == QCRYPTO_CIPHER_MODE_XTS) {
+    if (qcrypto_gcrypt_emulate_xts(cipher->mode)) {
         xts_encrypt(ctx->handle, ctx->tweakhandle,
                     qcrypto_gcrypt_xts_encrypt,
                     qcrypto_gcrypt_xts_decrypt,
@@ -325,7 +348,7 @@ qcrypto_gcrypt_cipher_decrypt(QCryptoCipher *cipher,
         return -1;
     }
 
-    if (cipher->mode == QCRYPTO_CIPHER_MODE_XTS) {
+    if (qcrypto_gcrypt_emulate_xts(cipher->mode)) {
         xts_decrypt(ctx->handle, ctx->tweakhandle,
                     qcrypto_gcrypt_xts_encrypt,
                     qcrypto_gcrypt_xts_decrypt,
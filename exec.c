@@ -146,6 +146,9 @@ static MemoryRegion io_mem_unassigned;
  */
 #define RAM_RESIZEABLE (1 << 2)
 
+/* RAM is a private mapping of a file, see qemu_ram_remap_file() */
+#define RAM_PRIVATE_FILE (1 << 3)
+
 #endif
 
 #ifdef TARGET_PAGE_BITS_VARY
@@ -2210,6 +2213,35 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/*
+ * Replace the memory of @block with a private, copy-on-write mapping of
+ * @fd at @offset.  Pages the guest does not write stay shared through the
+ * page cache with every other process mapping the same file.
+ *
+ * Called within RCU critical section.
+ */
+int qemu_ram_remap_file(RAMBlock *block, int fd, off_t offset, Error **errp)
+{
+    void *area;
+
+    if (block->fd >= 0 || (block->flags & RAM_PREALLOC) || xen_enabled()) {
+        error_setg(errp, "RAM block '%s' cannot be remapped to a file",
+                   block->idstr);
+        return -ENOTSUP;
+    }
+
+    area = mmap(block->host, block->used_length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, offset);
+    if (area != block->host) {
+        error_setg_errno(errp, errno, "Could not remap RAM block '%s'",
+                         block->idstr);
+        return -errno;
+    }
+    qemu_ram_setup_dump(area, block->used_length);
+    block->flags |= RAM_PRIVATE_FILE;
+    return 0;
+}
 #endif /* !_WIN32 */
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
@@ -3650,6 +3682,22 @@ err:
     return ret;
 }
 
+/*
+ * Returns true if ram_block_discard_range() leaves the discarded range of
+ * @rb reading as zero, i.e. the host releases the memory rather than going
+ * back to the contents of a file.
+ */
+bool ram_block_discard_zeroes(RAMBlock *rb)
+{
+#if defined(CONFIG_MADVISE)
+    return rb->fd < 0 && !xen_enabled() &&
+           !(rb->flags & (RAM_PREALLOC | RAM_SHARED | RAM_PRIVATE_FILE)) &&
+           rb->page_size == qemu_host_page_size;
+#else
+    return false;
+#endif
+}
+
 #endif
 
 void page_size_init(void)
@@ -295,12 +295,16 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->bytes >> 10);
         monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
                        info->xbzrle_cache->pages);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
     }
 
     if (info->has_cpu_throttle_percentage) {
@@ -386,6 +390,9 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %" PRId64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_X_MULTIFD_PAGE_COUNT),
             params->x_multifd_page_count);
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_RAM_FILE_THREADS),
+            params->x_ram_file_threads);
     }
 
     qapi_free_MigrationParameters(params);
@@ -1683,6 +1690,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_x_multifd_page_count = true;
         visit_type_int(v, param, &p->x_multifd_page_count, &err);
         break;
+    case MIGRATION_PARAMETER_X_RAM_FILE_THREADS:
+        p->has_x_ram_file_threads = true;
+        visit_type_int(v, param, &p->x_ram_file_threads, &err);
+        break;
     default:
         assert(0);
     }
@@ -2878,6 +2889,27 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
         monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
+        monitor_printf(mon, "  thread-pool-min=%" PRId64 "\n",
+                       value->thread_pool_min);
+        monitor_printf(mon, "  thread-pool-max=%" PRId64 "\n",
+                       value->thread_pool_max);
+        if (value->has_thread_pool) {
+            ThreadPoolInfo *tp = value->thread_pool;
+
+            monitor_printf(mon, "  thread-pool: threads=%" PRId64
+                           " idle=%" PRId64 " numa-node=%" PRId64
+                           " queue-depth=%" PRId64 "\n",
+                           tp->threads, tp->idle_threads, tp->numa_node,
+                           tp->queue_depth);
+            monitor_printf(mon, "  thread-pool: requests=%" PRIu64
+                           " steals=%" PRIu64 " avg-queue-ns=%" PRIu64
+                           " avg-service-ns=%" PRIu64 "\n",
+                           tp->requests, tp->steals, tp->avg_queue_ns,
+                           tp->avg_service_ns);
+        }
+        if (value->has_group) {
+            monitor_printf(mon, "  group=%s\n", value->group);
+        }
     }
 
     qapi_free_IOThreadInfoList(info_list);
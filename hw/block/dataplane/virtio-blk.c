@@ -26,6 +26,19 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+/* A virtqueue that is serviced by an IOThread of its own */
+typedef struct VirtIOBlockDataPlaneQueue {
+    VirtIOBlockDataPlane *s;
+    VirtQueue *vq;
+    IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *bh;                     /* bh for guest notification in ctx */
+    QEMUBH *submit_bh;              /* bh for request submission in s->ctx */
+    QemuMutex lock;                 /* protects the vring and pending */
+    VirtIOBlockReq *pending;        /* popped, not yet submitted requests */
+    VirtIOBlockReq **pending_tail;
+} VirtIOBlockDataPlaneQueue;
+
 struct VirtIOBlockDataPlane {
     bool starting;
     bool stopping;
@@ -42,15 +55,80 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /* Only with the iothreads property, one per virtqueue */
+    VirtIOBlockDataPlaneQueue *queues;
 };
 
+static VirtIOBlockDataPlaneQueue *
+virtio_blk_data_plane_queue(VirtIOBlockDataPlane *s, VirtQueue *vq)
+{
+    return s->queues ? &s->queues[virtio_get_queue_index(vq)] : NULL;
+}
+
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
+    VirtIOBlockDataPlaneQueue *q = virtio_blk_data_plane_queue(s, vq);
+
+    if (q) {
+        qemu_bh_schedule(q->bh);
+        return;
+    }
     set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
     qemu_bh_schedule(s->bh);
 }
 
+/* Context: BlockBackend AioContext acquired */
+void virtio_blk_data_plane_push(VirtIOBlockDataPlane *s, VirtQueue *vq,
+                                VirtQueueElement *elem, unsigned int len)
+{
+    VirtIOBlockDataPlaneQueue *q = virtio_blk_data_plane_queue(s, vq);
+
+    if (q) {
+        qemu_mutex_lock(&q->lock);
+        virtqueue_push(vq, elem, len);
+        qemu_mutex_unlock(&q->lock);
+    } else {
+        virtqueue_push(vq, elem, len);
+    }
+    virtio_blk_data_plane_notify(s, vq);
+}
+
+static void notify_queue_bh(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = opaque;
+
+    qemu_mutex_lock(&q->lock);
+    virtio_notify_irqfd(q->s->vdev, q->vq);
+    qemu_mutex_unlock(&q->lock);
+}
+
+/* Context: BlockBackend AioContext acquired */
+static void submit_queue(VirtIOBlockDataPlaneQueue *q)
+{
+    VirtIOBlockReq *reqs;
+
+    qemu_mutex_lock(&q->lock);
+    reqs = q->pending;
+    q->pending = NULL;
+    q->pending_tail = &q->pending;
+    qemu_mutex_unlock(&q->lock);
+
+    if (reqs) {
+        virtio_blk_submit_requests(VIRTIO_BLK(q->s->vdev), reqs, &q->lock);
+    }
+}
+
+static void submit_queue_bh(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = opaque;
+
+    aio_context_acquire(q->s->ctx);
+    submit_queue(q);
+    aio_context_release(q->s->ctx);
+}
+
 static void notify_guest_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
@@ -75,6 +153,69 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+static IOThread *virtio_blk_find_iothread(const char *id, Error **errp)
+{
+    Object *obj;
+
+    obj = object_resolve_path_component(object_get_objects_root(), id);
+    if (!obj || !object_dynamic_cast(obj, TYPE_IOTHREAD)) {
+        error_setg(errp, "iothread '%s' not found", id);
+        return NULL;
+    }
+    return IOTHREAD(obj);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_blk_data_plane_create_queues(VirtIOBlockDataPlane *s,
+                                                Error **errp)
+{
+    VirtIOBlkConf *conf = s->conf;
+    gchar **ids = g_strsplit(conf->iothreads, ":", -1);
+    unsigned n = g_strv_length(ids);
+    IOThread **iothreads;
+    unsigned i;
+
+    if (n == 0) {
+        error_setg(errp, "iothreads must list at least one iothread");
+        g_strfreev(ids);
+        return;
+    }
+
+    iothreads = g_new(IOThread *, n);
+    for (i = 0; i < n; i++) {
+        iothreads[i] = virtio_blk_find_iothread(ids[i], errp);
+        if (!iothreads[i]) {
+            goto out;
+        }
+    }
+
+    /* The BlockBackend lives in the first IOThread unless told otherwise */
+    if (!s->iothread) {
+        s->iothread = iothreads[0];
+        object_ref(OBJECT(s->iothread));
+        s->ctx = iothread_get_aio_context(s->iothread);
+    }
+
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        q->s = s;
+        q->vq = virtio_get_queue(s->vdev, i);
+        q->iothread = iothreads[i % n];
+        object_ref(OBJECT(q->iothread));
+        q->ctx = iothread_get_aio_context(q->iothread);
+        q->bh = aio_bh_new(q->ctx, notify_queue_bh, q);
+        q->submit_bh = aio_bh_new(s->ctx, submit_queue_bh, q);
+        q->pending_tail = &q->pending;
+        qemu_mutex_init(&q->lock);
+    }
+
+out:
+    g_free(iothreads);
+    g_strfreev(ids);
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -86,7 +227,7 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread || conf->iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -125,6 +266,17 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
+    if (conf->iothreads) {
+        Error *local_err = NULL;
+
+        virtio_blk_data_plane_create_queues(s, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            virtio_blk_data_plane_destroy(s);
+            return;
+        }
+    }
+
     *dataplane = s;
 }
 
@@ -139,6 +291,19 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
+    if (s->queues) {
+        unsigned i;
+
+        for (i = 0; i < s->conf->num_queues; i++) {
+            VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+            qemu_bh_delete(q->bh);
+            qemu_bh_delete(q->submit_bh);
+            qemu_mutex_destroy(&q->lock);
+            object_unref(OBJECT(q->iothread));
+        }
+        g_free(s->queues);
+    }
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
     if (s->iothread) {
@@ -158,6 +323,38 @@ static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
     return virtio_blk_handle_vq(s, vq);
 }
 
+static bool virtio_blk_data_plane_handle_queue(VirtIODevice *vdev,
+                                               VirtQueue *vq)
+{
+    VirtIOBlock *s = (VirtIOBlock *)vdev;
+    VirtIOBlockDataPlaneQueue *q;
+    VirtIOBlockReq *reqs, *last;
+
+    assert(s->dataplane);
+    assert(s->dataplane_started);
+
+    /* Holding our own context lets stop wait for the handler to finish */
+    q = virtio_blk_data_plane_queue(s->dataplane, vq);
+    aio_context_acquire(q->ctx);
+    reqs = virtio_blk_pop_requests(s, vq, &q->lock);
+    if (reqs) {
+        /* Requests submitted from here would only be entered later in the
+         * BlockBackend's AioContext, one by one; hand over the whole batch
+         * so that it is submitted there under blk_io_plug() */
+        last = reqs;
+        while (last->next) {
+            last = last->next;
+        }
+        qemu_mutex_lock(&q->lock);
+        *q->pending_tail = reqs;
+        q->pending_tail = &last->next;
+        qemu_mutex_unlock(&q->lock);
+        qemu_bh_schedule(q->submit_bh);
+    }
+    aio_context_release(q->ctx);
+    return reqs != NULL;
+}
+
 /* Context: QEMU global mutex held */
 int virtio_blk_data_plane_start(VirtIODevice *vdev)
 {
@@ -209,6 +406,18 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
+    if (s->queues) {
+        for (i = 0; i < nvqs; i++) {
+            VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+            aio_context_acquire(q->ctx);
+            virtio_queue_aio_set_host_notifier_handler(q->vq, q->ctx,
+                    virtio_blk_data_plane_handle_queue);
+            aio_context_release(q->ctx);
+        }
+        return 0;
+    }
+
     aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
@@ -249,13 +458,32 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    if (s->queues) {
+        /* Once the handler is gone, no queue can submit new requests */
+        for (i = 0; i < nvqs; i++) {
+            VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+            aio_context_acquire(q->ctx);
+            virtio_queue_aio_set_host_notifier_handler(q->vq, q->ctx, NULL);
+            aio_context_release(q->ctx);
+        }
+    }
+
     aio_context_acquire(s->ctx);
 
     /* Stop notifications for new requests from guest */
-    for (i = 0; i < nvqs; i++) {
-        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+    if (!s->queues) {
+        for (i = 0; i < nvqs; i++) {
+            VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+            virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        }
+    } else {
+        /* Submit what the queues handed over, so that it is drained below */
+        for (i = 0; i < nvqs; i++) {
+            qemu_bh_cancel(s->queues[i].submit_bh);
+            submit_queue(&s->queues[i]);
+        }
     }
 
     /* Drain and switch bs back to the QEMU main loop */
@@ -263,6 +491,14 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
 
     aio_context_release(s->ctx);
 
+    if (s->queues) {
+        /* Deliver interrupts for the last completions while irqfds exist */
+        for (i = 0; i < nvqs; i++) {
+            qemu_bh_cancel(s->queues[i].bh);
+            notify_queue_bh(&s->queues[i]);
+        }
+    }
+
     for (i = 0; i < nvqs; i++) {
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
     }
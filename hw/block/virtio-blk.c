@@ -53,10 +53,11 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
     trace_virtio_blk_req_complete(vdev, req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(req->vq, &req->elem, req->in_len);
     if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane, req->vq);
+        virtio_blk_data_plane_push(s->dataplane, req->vq, &req->elem,
+                                   req->in_len);
     } else {
+        virtqueue_push(req->vq, &req->elem, req->in_len);
         virtio_notify(vdev, req->vq);
     }
 }
@@ -625,6 +626,88 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     return progress;
 }
 
+/*
+ * Variant of virtio_blk_handle_vq() for a virtqueue that is serviced by an
+ * IOThread of its own.  The vring is only accessed with @lock held, which is
+ * also taken by the completion path.  The popped requests are returned as a
+ * list linked through VirtIOBlockReq.next, to be submitted with
+ * virtio_blk_submit_requests() in the AioContext of the BlockBackend.
+ *
+ * At most VIRTIO_BLK_MAX_MERGE_REQS requests are popped per call, so that a
+ * busy virtqueue cannot monopolize its IOThread.  If more are left, the host
+ * notifier is kicked to come back once the other handlers had their turn.
+ */
+VirtIOBlockReq *virtio_blk_pop_requests(VirtIOBlock *s, VirtQueue *vq,
+                                        QemuMutex *lock)
+{
+    VirtIOBlockReq *reqs = NULL, **tail = &reqs;
+    VirtIOBlockReq *req;
+    unsigned nr_reqs = 0;
+
+    qemu_mutex_lock(lock);
+    do {
+        virtio_queue_set_notification(vq, 0);
+
+        while (nr_reqs < VIRTIO_BLK_MAX_MERGE_REQS &&
+               (req = virtio_blk_get_request(s, vq))) {
+            *tail = req;
+            tail = &req->next;
+            nr_reqs++;
+        }
+
+        virtio_queue_set_notification(vq, 1);
+    } while (nr_reqs < VIRTIO_BLK_MAX_MERGE_REQS && !virtio_queue_empty(vq));
+
+    if (nr_reqs == VIRTIO_BLK_MAX_MERGE_REQS && !virtio_queue_empty(vq)) {
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+    qemu_mutex_unlock(lock);
+
+    *tail = NULL;
+    return reqs;
+}
+
+/*
+ * Submit requests from virtio_blk_pop_requests().  Must run in the AioContext
+ * of the BlockBackend, so that the request coroutines are entered, and the
+ * batch is submitted, right here rather than later in that context.
+ */
+void virtio_blk_submit_requests(VirtIOBlock *s, VirtIOBlockReq *reqs,
+                                QemuMutex *lock)
+{
+    MultiReqBuffer mrb = {};
+    VirtIOBlockReq *req;
+
+    blk_io_plug(s->blk);
+
+    while (reqs) {
+        req = reqs;
+        reqs = req->next;
+        req->next = NULL;
+
+        if (virtio_blk_handle_request(req, &mrb)) {
+            /* The device is broken, give back what was not handled */
+            qemu_mutex_lock(lock);
+            virtqueue_detach_element(req->vq, &req->elem, 0);
+            virtio_blk_free_request(req);
+            while (reqs) {
+                req = reqs;
+                reqs = req->next;
+                virtqueue_detach_element(req->vq, &req->elem, 0);
+                virtio_blk_free_request(req);
+            }
+            qemu_mutex_unlock(lock);
+            break;
+        }
+    }
+
+    if (mrb.num_reqs) {
+        virtio_blk_submit_multireq(s->blk, &mrb);
+    }
+
+    blk_io_unplug(s->blk);
+}
+
 static void virtio_blk_handle_output_do(VirtIOBlock *s, VirtQueue *vq)
 {
     virtio_blk_handle_vq(s, vq);
@@ -1014,6 +1097,7 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_STRING("iothreads", VirtIOBlock, conf.iothreads),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -116,6 +116,8 @@ struct AioContext {
      * Has its own locking.
      */
     struct ThreadPool *thread_pool;
+    int thread_pool_min;
+    int thread_pool_max;
 
 #ifdef CONFIG_LINUX_AIO
     /* State for native Linux AIO.  Uses aio_context_acquire/release for
@@ -123,6 +125,12 @@ struct AioContext {
      */
     struct LinuxAioState *linux_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+#endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
      * locking.
@@ -384,6 +392,11 @@ struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Return the LuringState bound to this AioContext, or NULL if the host
+ * kernel does not support io_uring.
+ */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
 /**
  * aio_timer_new:
  * @ctx: the aio context
@@ -551,6 +564,40 @@ static inline bool aio_context_in_iothread(AioContext *ctx)
  */
 void aio_context_setup(AioContext *ctx);
 
+/**
+ * aio_context_add_pollfds:
+ * @ctx: the aio context
+ * @pollfds: array of #GPollFD
+ *
+ * Append to @pollfds the file descriptors that an outer event loop has to
+ * wait on in order to learn that @ctx has events to dispatch.  When
+ * possible @ctx is switched to epoll, even if it has fewer handlers than
+ * aio_poll() would normally switch at, and its epoll file descriptor is
+ * the only one added.
+ *
+ * The caller must have incremented ctx->notify_me, so that aio_notify()
+ * wakes it up, and must call aio_poll() on @ctx to dispatch the events.
+ *
+ * Returns the number of file descriptors added.
+ */
+int aio_context_add_pollfds(AioContext *ctx, GArray *pollfds);
+
+/**
+ * aio_context_poll_once:
+ * @ctx: the aio context
+ *
+ * Put @ctx in polling mode and run its ->io_poll() callbacks once, without
+ * waiting for file descriptors.  This lets a single thread busy poll
+ * several AioContexts in turn.  aio_poll() leaves polling mode again and
+ * must be called before blocking on @ctx, and after progress was made to
+ * dispatch bottom halves and timers.
+ *
+ * The caller must have incremented ctx->notify_me.
+ *
+ * Returns: true if progress was made, false otherwise
+ */
+bool aio_context_poll_once(AioContext *ctx);
+
 /**
  * aio_context_set_poll_params:
  * @ctx: the aio context
@@ -564,4 +611,17 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_thread_pool_params:
+ * @ctx: the aio context
+ * @min: number of worker threads that are kept even when idle
+ * @max: maximum number of worker threads
+ *
+ * Bounds the size of the thread pool returned by aio_get_thread_pool().
+ * @max must be between 1 and THREAD_POOL_MAX_THREADS_LIMIT, and @min
+ * between 0 and @max.
+ */
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, Error **errp);
+
 #endif
@@ -60,9 +60,61 @@ typedef struct NBDRequest NBDRequest;
 struct NBDReply {
     uint64_t handle;
     uint32_t error;
+    /* The rest is only valid for structured reply chunks */
+    bool structured;
+    uint16_t flags; /* NBD_REPLY_FLAG_* */
+    uint16_t type; /* NBD_REPLY_TYPE_* */
+    uint32_t length; /* length of the payload */
 };
 typedef struct NBDReply NBDReply;
 
+/* Structured reply chunks - these structs are passed on the wire */
+
+struct NBDStructuredReplyChunk {
+    uint32_t magic; /* NBD_STRUCTURED_REPLY_MAGIC */
+    uint16_t flags; /* NBD_REPLY_FLAG_* */
+    uint16_t type; /* NBD_REPLY_TYPE_* */
+    uint64_t handle; /* request handle */
+    uint32_t length; /* length of payload */
+} QEMU_PACKED;
+typedef struct NBDStructuredReplyChunk NBDStructuredReplyChunk;
+
+struct NBDStructuredReadData {
+    NBDStructuredReplyChunk h; /* h.length >= 9 */
+    uint64_t offset;
+    /* At least one byte of data payload follows */
+} QEMU_PACKED;
+typedef struct NBDStructuredReadData NBDStructuredReadData;
+
+struct NBDStructuredReadHole {
+    NBDStructuredReplyChunk h; /* h.length == 12 */
+    uint64_t offset;
+    uint32_t length;
+} QEMU_PACKED;
+typedef struct NBDStructuredReadHole NBDStructuredReadHole;
+
+struct NBDStructuredError {
+    NBDStructuredReplyChunk h; /* h.length >= 6 */
+    uint32_t error;
+    uint16_t message_length;
+    /* message_length bytes of message, then an offset for ERROR_OFFSET */
+} QEMU_PACKED;
+typedef struct NBDStructuredError NBDStructuredError;
+
+struct NBDStructuredMeta {
+    NBDStructuredReplyChunk h; /* h.length >= 12 (at least one extent) */
+    uint32_t context_id;
+    /* NBDExtent extents[] follows, array length implied by h.length */
+} QEMU_PACKED;
+typedef struct NBDStructuredMeta NBDStructuredMeta;
+
+/* One extent of an NBD_REPLY_TYPE_BLOCK_STATUS chunk */
+struct NBDExtent {
+    uint32_t length;
+    uint32_t flags; /* NBD_STATE_* */
+} QEMU_PACKED;
+typedef struct NBDExtent NBDExtent;
+
 /* Transmission (export) flags: sent from server to client during handshake,
    but describe what will happen during transmission */
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
@@ -72,6 +124,8 @@ typedef struct NBDReply NBDReply;
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
 #define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)     /* Send WRITE_ZEROES */
+/* #define NBD_FLAG_SEND_DF     (1 << 7)           not in use */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Multi-client cache consistent */
 
 /* New-style handshake (global) flags, sent from server to client, and
    control what will happen during handshake phase. */
@@ -92,6 +146,8 @@ typedef struct NBDReply NBDReply;
 #define NBD_OPT_INFO             (6)
 #define NBD_OPT_GO               (7)
 #define NBD_OPT_STRUCTURED_REPLY (8)
+#define NBD_OPT_LIST_META_CONTEXT (9)
+#define NBD_OPT_SET_META_CONTEXT (10)
 
 /* Option reply types. */
 #define NBD_REP_ERR(value) ((UINT32_C(1) << 31) | (value))
@@ -99,6 +155,7 @@ typedef struct NBDReply NBDReply;
 #define NBD_REP_ACK             (1)             /* Data sending finished. */
 #define NBD_REP_SERVER          (2)             /* Export description. */
 #define NBD_REP_INFO            (3)             /* NBD_OPT_INFO/GO. */
+#define NBD_REP_META_CONTEXT    (4)             /* NBD_OPT_{LIST,SET}_META_CONTEXT */
 
 #define NBD_REP_ERR_UNSUP           NBD_REP_ERR(1)  /* Unknown option */
 #define NBD_REP_ERR_POLICY          NBD_REP_ERR(2)  /* Server denied */
@@ -118,6 +175,7 @@ typedef struct NBDReply NBDReply;
 /* Request flags, sent from client to server during transmission phase */
 #define NBD_CMD_FLAG_FUA        (1 << 0) /* 'force unit access' during write */
 #define NBD_CMD_FLAG_NO_HOLE    (1 << 1) /* don't punch hole on zero run */
+#define NBD_CMD_FLAG_REQ_ONE    (1 << 3) /* only one extent in BLOCK_STATUS */
 
 /* Supported request types */
 enum {
@@ -128,8 +186,34 @@ enum {
     NBD_CMD_TRIM = 4,
     /* 5 reserved for failed experiment NBD_CMD_CACHE */
     NBD_CMD_WRITE_ZEROES = 6,
+    NBD_CMD_BLOCK_STATUS = 7,
 };
 
+/* Structured reply flags */
+#define NBD_REPLY_FLAG_DONE          (1 << 0) /* This reply-chunk is last */
+
+/* Structured reply types */
+#define NBD_REPLY_ERR(value)         ((1 << 15) | (value))
+
+#define NBD_REPLY_TYPE_NONE          0
+#define NBD_REPLY_TYPE_OFFSET_DATA   1
+#define NBD_REPLY_TYPE_OFFSET_HOLE   2
+#define NBD_REPLY_TYPE_BLOCK_STATUS  5
+#define NBD_REPLY_TYPE_ERROR         NBD_REPLY_ERR(1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET  NBD_REPLY_ERR(2)
+
+static inline bool nbd_reply_type_is_error(int type)
+{
+    return type & (1 << 15);
+}
+
+/* Extent flags for the "base:allocation" metadata context */
+#define NBD_STATE_HOLE (1 << 0)
+#define NBD_STATE_ZERO (1 << 1)
+
+/* The only metadata context we know about */
+#define NBD_META_BASE_ALLOCATION "base:allocation"
+
 #define NBD_DEFAULT_PORT	10809
 
 /* Maximum size of a single READ/WRITE data buffer */
@@ -146,12 +230,17 @@ enum {
 struct NBDExportInfo {
     /* Set by client before nbd_receive_negotiate() */
     bool request_sizes;
+    /* Requested by client before nbd_receive_negotiate(), cleared during
+     * it if the server lacks support */
+    bool structured_reply;
+    bool base_allocation;
     /* Set by server results during nbd_receive_negotiate() */
     uint64_t size;
     uint16_t flags;
     uint32_t min_block;
     uint32_t opt_block;
     uint32_t max_block;
+    uint32_t meta_base_allocation_id;
 };
 typedef struct NBDExportInfo NBDExportInfo;
 
@@ -163,6 +252,17 @@ int nbd_init(int fd, QIOChannelSocket *sioc, NBDExportInfo *info,
              Error **errp);
 int nbd_send_request(QIOChannel *ioc, NBDRequest *request);
 int nbd_receive_reply(QIOChannel *ioc, NBDReply *reply, Error **errp);
+int nbd_errno_to_system_errno(int err);
+int nbd_drop(QIOChannel *ioc, size_t size, Error **errp);
+
+/* nbd_read
+ * Reads @size bytes from @ioc. Returns 0 on success.
+ */
+static inline int nbd_read(QIOChannel *ioc, void *buffer, size_t size,
+                           Error **errp)
+{
+    return qio_channel_read_all(ioc, buffer, size, errp) < 0 ? -EIO : 0;
+}
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
@@ -0,0 +1,35 @@
+/*
+ * RAM-backed volatile overlay block driver
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOCK_RAMOVERLAY_H
+#define BLOCK_RAMOVERLAY_H
+
+#include "block/block.h"
+
+bool bdrv_is_ramoverlay(BlockDriverState *bs);
+
+/*
+ * Write everything that @bs holds into a new qcow2 image at @filename whose
+ * backing file is the current backing file of @bs, then put that image
+ * below @bs and start over with an empty overlay.
+ */
+int ramoverlay_commit(BlockDriverState *bs, const char *filename,
+                      Error **errp);
+
+#endif
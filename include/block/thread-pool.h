@@ -19,6 +19,11 @@
 #define QEMU_THREAD_POOL_H
 
 #include "block/block.h"
+#include "qapi-types.h"
+
+#define THREAD_POOL_MIN_THREADS_DEFAULT 0
+#define THREAD_POOL_MAX_THREADS_DEFAULT 64
+#define THREAD_POOL_MAX_THREADS_LIMIT   256
 
 typedef int ThreadPoolFunc(void *opaque);
 
@@ -34,4 +39,11 @@ int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg);
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 
+/* Change the number of worker threads; see aio_context_set_thread_pool_params
+ * for the valid ranges.
+ */
+void thread_pool_update_params(ThreadPool *pool, int min_threads,
+                               int max_threads);
+void thread_pool_get_info(ThreadPool *pool, ThreadPoolInfo *info);
+
 #endif
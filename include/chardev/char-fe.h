@@ -167,6 +167,10 @@ void qemu_chr_fe_printf(CharBackend *be, const char *fmt, ...)
  * is active; return the #GSource's tag.  If it is disconnected,
  * or without associated Chardev, return 0.
  *
+ * The source is attached to the #GMainContext that was passed to
+ * qemu_chr_fe_set_handlers(), so @func runs in the same thread as the
+ * frontend's read handler.
+ *
  * @cond the condition to poll for
  * @func the function to call when the condition happens
  * @user_data the opaque pointer to pass to @func
@@ -75,6 +75,7 @@ typedef enum {
  * @readfunc: callback for reading data from the volume
  * @opaque: data to pass to @readfunc
  * @flags: bitmask of QCryptoBlockOpenFlags values
+ * @n_threads: how many threads may encrypt or decrypt at the same time
  * @errp: pointer to a NULL-initialized error object
  *
  * Create a new block encryption object for an existing
@@ -94,6 +95,10 @@ typedef enum {
  * metadata such as the payload offset. There will be
  * no cipher or ivgen objects available.
  *
+ * Every one of the @n_threads threads gets a cipher of its own, so
+ * that qcrypto_block_decrypt() and qcrypto_block_encrypt() can run
+ * in parallel.  Further callers wait for a cipher to become free.
+ *
  * If any part of initializing the encryption context
  * fails an error will be returned. This could be due
  * to the volume being in the wrong format, a cipher
@@ -107,6 +112,7 @@ QCryptoBlock *qcrypto_block_open(QCryptoBlockOpenOptions *options,
                                  QCryptoBlockReadFunc readfunc,
                                  void *opaque,
                                  unsigned int flags,
+                                 size_t n_threads,
                                  Error **errp);
 
 /**
@@ -198,6 +204,17 @@ int qcrypto_block_encrypt(QCryptoBlock *block,
                           size_t len,
                           Error **errp);
 
+/**
+ * qcrypto_block_get_n_threads:
+ * @block: the block encryption object
+ *
+ * Get the number of threads that can encrypt or decrypt
+ * at the same time without waiting for each other
+ *
+ * Returns: the number of threads, or 0 without ciphers
+ */
+size_t qcrypto_block_get_n_threads(QCryptoBlock *block);
+
 /**
  * qcrypto_block_get_cipher:
  * @block: the block encryption object
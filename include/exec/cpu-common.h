@@ -63,6 +63,7 @@ typedef void CPUWriteMemoryFunc(void *opaque, hwaddr addr, uint32_t value);
 typedef uint32_t CPUReadMemoryFunc(void *opaque, hwaddr addr);
 
 void qemu_ram_remap(ram_addr_t addr, ram_addr_t length);
+int qemu_ram_remap_file(RAMBlock *block, int fd, off_t offset, Error **errp);
 /* This should not be used by devices.  */
 ram_addr_t qemu_ram_addr_from_host(void *ptr);
 RAMBlock *qemu_ram_block_by_name(const char *name);
@@ -116,6 +117,7 @@ typedef int (RAMBlockIterFunc)(const char *block_name, void *host_addr,
 
 int qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque);
 int ram_block_discard_range(RAMBlock *rb, uint64_t start, size_t length);
+bool ram_block_discard_zeroes(RAMBlock *rb);
 
 #endif
 
@@ -69,6 +69,7 @@ struct RAMBlockNotifier {
 };
 
 void ram_block_notifier_add(RAMBlockNotifier *n);
+void ram_block_notifier_add_replay(RAMBlockNotifier *n);
 void ram_block_notifier_remove(RAMBlockNotifier *n);
 void ram_block_notify_add(void *host, size_t size);
 void ram_block_notify_remove(void *host, size_t size);
@@ -39,6 +39,7 @@ struct VirtIOBlkConf
     uint32_t config_wce;
     uint32_t request_merging;
     uint16_t num_queues;
+    char *iothreads;        /* per-virtqueue IOThread ids, colon-separated */
 };
 
 struct VirtIOBlockDataPlane;
@@ -81,5 +82,9 @@ typedef struct MultiReqBuffer {
 } MultiReqBuffer;
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
+VirtIOBlockReq *virtio_blk_pop_requests(VirtIOBlock *s, VirtQueue *vq,
+                                        QemuMutex *lock);
+void virtio_blk_submit_requests(VirtIOBlock *s, VirtIOBlockReq *reqs,
+                                QemuMutex *lock);
 
 #endif
@@ -49,6 +49,7 @@
 /* Private global variables, don't use */
 extern FILE *qemu_logfile;
 extern int qemu_loglevel;
+extern bool qemu_log_async;
 
 /* 
  * The new API:
@@ -87,6 +88,7 @@ static inline bool qemu_log_separate(void)
 #define CPU_LOG_PAGE       (1 << 14)
 #define LOG_TRACE          (1 << 15)
 #define CPU_LOG_TB_OP_IND  (1 << 16)
+#define LOG_ASYNC          (1 << 17)
 /* Returns true if a bit is set in the current loglevel mask
  */
 static inline bool qemu_loglevel_mask(int mask)
@@ -100,14 +102,25 @@ static inline bool qemu_loglevel_mask(int mask)
  * qemu_loglevel is never set when qemu_logfile is unset.
  */
 
+void qemu_log_stage_lock(void);
+void qemu_log_stage_unlock(void);
+
 static inline void qemu_log_lock(void)
 {
-    qemu_flockfile(qemu_logfile);
+    if (qemu_log_async) {
+        qemu_log_stage_lock();
+    } else {
+        qemu_flockfile(qemu_logfile);
+    }
 }
 
 static inline void qemu_log_unlock(void)
 {
-    qemu_funlockfile(qemu_logfile);
+    if (qemu_log_async) {
+        qemu_log_stage_unlock();
+    } else {
+        qemu_funlockfile(qemu_logfile);
+    }
 }
 
 /* Logging functions: */
@@ -118,13 +131,7 @@ int GCC_FMT_ATTR(1, 2) qemu_log(const char *fmt, ...);
 
 /* vfprintf-like logging function
  */
-static inline void GCC_FMT_ATTR(1, 0)
-qemu_log_vprintf(const char *fmt, va_list va)
-{
-    if (qemu_logfile) {
-        vfprintf(qemu_logfile, fmt, va);
-    }
-}
+void GCC_FMT_ATTR(1, 0) qemu_log_vprintf(const char *fmt, va_list va);
 
 /* log only if a bit is set on the current loglevel mask:
  * @mask: bit to check in the mask
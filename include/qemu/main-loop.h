@@ -26,6 +26,7 @@
 #define QEMU_MAIN_LOOP_H
 
 #include "block/aio.h"
+#include "qapi-types.h"
 
 #define SIG_IPI SIGUSR1
 
@@ -44,6 +45,27 @@
  */
 int qemu_init_main_loop(Error **errp);
 
+/**
+ * qemu_main_loop_set_backend: Choose how the main loop waits for events.
+ *
+ * With %MAIN_LOOP_BACKEND_GLIB, the main AioContext and the iohandler
+ * context are glib sources and every handler they have is passed to
+ * g_poll on each iteration.  With %MAIN_LOOP_BACKEND_NATIVE, both contexts
+ * use epoll and main_loop_wait() only polls their epoll descriptors, next
+ * to whatever other glib sources (chardevs, UIs) and slirp need.
+ *
+ * Must be called before qemu_init_main_loop().  Returns a negative errno
+ * value if @backend is not supported on this host.
+ */
+int qemu_main_loop_set_backend(MainLoopBackend backend, Error **errp);
+
+/**
+ * qemu_main_loop_info: Return statistics of the main loop.
+ *
+ * The caller must free the result with qapi_free_MainLoopInfo().
+ */
+MainLoopInfo *qemu_main_loop_info(void);
+
 /**
  * main_loop_wait: Run one iteration of the main loop.
  *
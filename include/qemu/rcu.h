@@ -71,6 +71,7 @@
 #include "qemu/thread.h"
 #include "qemu/queue.h"
 #include "qemu/atomic.h"
+#include "qemu/sys_membarrier.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -110,6 +111,12 @@ struct rcu_reader_data {
 
     /* Data used for registry, protected by rcu_registry_lock */
     QLIST_ENTRY(rcu_reader_data) node;
+    bool registered;
+
+    /* Callbacks queued by call_rcu1() on this thread, newest first.
+     * Pushed by the thread itself, taken over by the call_rcu thread.
+     */
+    struct rcu_head *cb_batch;
 };
 #else
 #include "include/qemu/thread-pth.h"
@@ -130,7 +137,10 @@ static inline void rcu_read_lock(void)
     }
 
     ctr = atomic_read(&rcu_gp_ctr);
-    atomic_xchg(&p_rcu_reader->ctr, ctr);
+    atomic_set(&p_rcu_reader->ctr, ctr);
+
+    /* Write p_rcu_reader->ctr before reading RCU-protected pointers.  */
+    smp_mb_placeholder();
 }
 
 static inline void rcu_read_unlock(void)
@@ -143,7 +153,13 @@ static inline void rcu_read_unlock(void)
         return;
     }
 
-    atomic_xchg(&p_rcu_reader->ctr, 0);
+    /* Ensure that the critical section is seen to precede the store
+     * to p_rcu_reader->ctr, then write p_rcu_reader->ctr before reading
+     * p_rcu_reader->waiting.  The second barrier pairs with
+     * smp_mb_global() in wait_for_readers().
+     */
+    atomic_store_release(&p_rcu_reader->ctr, 0);
+    smp_mb_placeholder();
     if (unlikely(atomic_read(&p_rcu_reader->waiting))) {
         atomic_set(&p_rcu_reader->waiting, false);
         qemu_event_set(&rcu_gp_event);
@@ -0,0 +1,50 @@
+/*
+ * Process-wide memory barriers
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QEMU_SYS_MEMBARRIER_H
+#define QEMU_SYS_MEMBARRIER_H
+
+#include "qemu/atomic.h"
+
+/*
+ * smp_mb_placeholder() marks a full barrier on a fast path that pairs with
+ * smp_mb_global() on a slow path.  When the kernel can run a barrier on
+ * every CPU that executes one of our threads, the fast path only needs a
+ * compiler barrier and the slow path pays for an IPI instead.
+ */
+#ifdef CONFIG_MEMBARRIER
+extern bool have_sys_membarrier;
+void smp_mb_global(void);
+void smp_mb_global_init(void);
+
+static inline void smp_mb_placeholder(void)
+{
+    if (likely(have_sys_membarrier)) {
+        barrier();
+    } else {
+        smp_mb();
+    }
+}
+#else
+#define smp_mb_placeholder()    smp_mb()
+#define smp_mb_global()         smp_mb()
+#define smp_mb_global_init()    do { } while (0)
+#endif
+
+#endif
@@ -66,7 +66,15 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
+
+    /* Pairing heap links, protected by the timer list's lock: the first
+     * child, the next sibling, and either the previous sibling or, for a
+     * first child, the parent.  seq orders timers with the same expiry.
+     */
+    QEMUTimer *child;
     QEMUTimer *next;
+    QEMUTimer *prev;
+    uint64_t seq;
     int scale;
 };
 
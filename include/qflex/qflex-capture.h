@@ -0,0 +1,164 @@
+//  DO-NOT-REMOVE begin-copyright-block
+// QFlex consists of several software components that are governed by various
+// licensing terms, in addition to software that was developed internally.
+// Anyone interested in using QFlex needs to fully understand and abide by the
+// licenses governing all the software components.
+// 
+// ### Software developed externally (not by the QFlex group)
+// 
+//     * [NS-3] (https://www.gnu.org/copyleft/gpl.html)
+//     * [QEMU] (http://wiki.qemu.org/License)
+//     * [SimFlex] (http://parsa.epfl.ch/simflex/)
+//     * [GNU PTH] (https://www.gnu.org/software/pth/)
+// 
+// ### Software developed internally (by the QFlex group)
+// **QFlex License**
+// 
+// QFlex
+// Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+// 
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright notice,
+//       this list of conditions and the following disclaimer in the documentation
+//       and/or other materials provided with the distribution.
+//     * Neither the name of the Parallel Systems Architecture Laboratory, EPFL,
+//       nor the names of its contributors may be used to endorse or promote
+//       products derived from this software without specific prior written
+//       permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE PARALLEL SYSTEMS ARCHITECTURE LABORATORY,
+// EPFL BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//  DO-NOT-REMOVE end-copyright-block
+#ifndef QFLEX_CAPTURE_H
+#define QFLEX_CAPTURE_H
+
+#include "qemu/osdep.h"
+#include "qemu/queue.h"
+
+/** Offline instruction and memory trace capture
+ *
+ * Every vCPU writes its own trace file, <prefix>.cpu<N>.qtrace.  A file
+ * starts with a QFlexCaptureHeader and continues with chunks: a
+ * QFlexCaptureChunkHeader followed by the zlib-compressed records of the
+ * chunk.  The chunk header carries the index of its first record and the
+ * size of its payload, so a reader can skip to any record without
+ * decompressing what comes before it.  Everything is little endian.
+ */
+
+#define QFLEX_CAPTURE_MAGIC         0x45435254584c4651ULL /* "QFLXTRCE" */
+#define QFLEX_CAPTURE_VERSION       1
+#define QFLEX_CAPTURE_CHUNK_MAGIC   0x4b4e4843            /* "CHNK" */
+
+/* Records per chunk; a full chunk holds 2 MB before compression */
+#define QFLEX_CAPTURE_CHUNK_RECORDS (64 * 1024)
+
+typedef enum QFlexCaptureType {
+    QFLEX_CAPTURE_INSN  = 0,
+    QFLEX_CAPTURE_LOAD  = 1,
+    QFLEX_CAPTURE_STORE = 2,
+} QFlexCaptureType;
+
+#define QFLEX_CAPTURE_FLAG_USER     (1 << 0)
+#define QFLEX_CAPTURE_FLAG_ATOMIC   (1 << 1)
+
+typedef struct QFlexCaptureRecord {
+    uint64_t pc;        /* PC of the instruction */
+    uint64_t vaddr;     /* accessed address, the PC for instructions */
+    uint64_t paddr;     /* guest physical address of @vaddr, -1 if none */
+    uint32_t opcode;    /* instruction encoding, 0 for memory accesses */
+    uint8_t type;       /* QFlexCaptureType */
+    uint8_t size;       /* access size in bytes */
+    uint8_t el;         /* exception level */
+    uint8_t flags;      /* QFLEX_CAPTURE_FLAG_* */
+} QFlexCaptureRecord;
+
+typedef struct QFlexCaptureHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t cpu_index;
+    uint32_t chunk_records;
+} QFlexCaptureHeader;
+
+typedef struct QFlexCaptureChunkHeader {
+    uint32_t magic;
+    uint32_t nr_records;
+    uint32_t compressed_size;
+    uint32_t reserved;
+    uint64_t first_record;
+} QFlexCaptureChunkHeader;
+
+/* Writing a single trace file
+ *
+ * Records are appended to the chunk being filled, which is the only part
+ * of a QFlexCaptureFile that the producer touches.  Full chunks are
+ * compressed and written by a thread of their own.
+ */
+typedef struct QFlexCaptureChunk {
+    QFlexCaptureRecord *records;
+    uint32_t nr_records;
+    uint64_t first_record;
+    QSIMPLEQ_ENTRY(QFlexCaptureChunk) next;
+} QFlexCaptureChunk;
+
+typedef struct QFlexCaptureFile {
+    QFlexCaptureChunk *cur;
+    struct QFlexCaptureWriter *writer;  /* private to qflex-capture.c */
+} QFlexCaptureFile;
+
+QFlexCaptureFile *qflex_capture_file_open(const char *filename, int cpu_index,
+                                          Error **errp);
+void qflex_capture_file_submit(QFlexCaptureFile *f);
+int qflex_capture_file_close(QFlexCaptureFile *f);
+
+/* Returns the slot for the next record of @f */
+static inline QFlexCaptureRecord *
+qflex_capture_file_next(QFlexCaptureFile *f)
+{
+    if (unlikely(f->cur->nr_records == QFLEX_CAPTURE_CHUNK_RECORDS)) {
+        qflex_capture_file_submit(f);
+    }
+    return &f->cur->records[f->cur->nr_records++];
+}
+
+/* Reading a trace file */
+typedef struct QFlexCaptureReader QFlexCaptureReader;
+
+QFlexCaptureReader *qflex_capture_reader_open(const char *filename,
+                                              Error **errp);
+int qflex_capture_reader_next(QFlexCaptureReader *r, QFlexCaptureRecord *rec,
+                              Error **errp);
+int qflex_capture_reader_seek(QFlexCaptureReader *r, uint64_t index,
+                              Error **errp);
+uint32_t qflex_capture_reader_cpu_index(QFlexCaptureReader *r);
+void qflex_capture_reader_close(QFlexCaptureReader *r);
+
+/* Capturing from the vCPUs (-qflex_capture) */
+extern bool qflex_capture_on;
+extern QFlexCaptureFile **qflex_capture_files;
+
+static inline bool qflex_capture_enabled(void) { return qflex_capture_on; }
+
+int qflex_capture_start(const char *prefix, int nr_cpus, Error **errp);
+void qflex_capture_stop(void);
+
+/* Returns the slot for the next record of vCPU @cpu_index */
+static inline QFlexCaptureRecord *qflex_capture_next(int cpu_index)
+{
+    return qflex_capture_file_next(qflex_capture_files[cpu_index]);
+}
+
+#endif /* QFLEX_CAPTURE_H */
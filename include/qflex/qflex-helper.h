@@ -46,6 +46,8 @@
  */
 
 DEF_HELPER_4(qflex_executed_instruction, void, env, i64, int, int)
+// env, pc, encoding
+DEF_HELPER_3(qflex_log_insn, void, env, i64, i32)
 DEF_HELPER_1(qflex_magic_insn, void, int)
 DEF_HELPER_1(qflex_exception_return, void, env)
 
@@ -57,6 +57,7 @@ extern int qflex_iExit;
 #define QFLEX_LOG_TB_EXEC       (1 << 2)
 #define QFLEX_LOG_MAGIC_INSN    (1 << 3)
 #define QFLEX_LOG_FF            (1 << 4)
+#define QFLEX_LOG_TB_EXEC_RAW   (1 << 5)
 
 #define QFLEX_INIT_LOOP() do {  \
     qflex_iExit = 0;                  \
@@ -60,8 +60,12 @@
 
 #include "block/aio.h"
 #include "qemu/thread.h"
+#include "qemu/event_notifier.h"
 
 #define TYPE_IOTHREAD "iothread"
+#define TYPE_IOTHREAD_GROUP "iothread-group"
+
+typedef struct IOThreadGroup IOThreadGroup;
 
 typedef struct IOThread {
     Object parent_obj;
@@ -80,14 +84,58 @@ typedef struct IOThread {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* Thread pool parameters */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+
+    /* If set, the thread of this group runs the AioContext */
+    char *group_id;
+    IOThreadGroup *group;
 } IOThread;
 
 #define IOTHREAD(obj) \
    OBJECT_CHECK(IOThread, obj, TYPE_IOTHREAD)
 
+/*
+ * A single host thread that runs the AioContexts of several iothreads.
+ * It busy polls them in turn under a shared CPU budget and waits on all
+ * of them at once when polling does not pay off.
+ */
+struct IOThreadGroup {
+    Object parent_obj;
+
+    QemuThread thread;
+    EventNotifier notifier;     /* kicks the thread when members change */
+    bool stopping;
+    int thread_id;
+
+    /* Polling parameters */
+    int64_t poll_budget;        /* percentage of one host CPU */
+    int64_t poll_max_ns;
+
+    /* Protects everything below */
+    QemuMutex lock;
+    QemuCond members_cond;
+    GPtrArray *members;
+    unsigned members_gen;       /* bumped whenever members change */
+    unsigned members_seen;      /* last generation the thread picked up */
+    bool running;               /* cleared when the thread exits */
+
+    int64_t poll_ns;            /* current busy polling time */
+    uint64_t poll_successes;
+    uint64_t poll_failures;
+    uint64_t poll_throttled;
+    uint64_t poll_time_ns;
+};
+
+#define IOTHREAD_GROUP(obj) \
+   OBJECT_CHECK(IOThreadGroup, obj, TYPE_IOTHREAD_GROUP)
+
 char *iothread_get_id(IOThread *iothread);
 AioContext *iothread_get_aio_context(IOThread *iothread);
 void iothread_stop_all(void);
+/* Must not be called for members of an iothread-group, which have none */
 GMainContext *iothread_get_g_main_context(IOThread *iothread);
 
 /*
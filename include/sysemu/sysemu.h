@@ -145,6 +145,7 @@ int save_vmstate_ext_test(Monitor *mon, const char *name);
 int incremental_load_vmstate_ext(const char *name, Monitor* mon);
 int create_tmp_overlay(void);
 int delete_tmp_overlay(void);
+void set_tmp_overlay_ram(QemuOpts *opts);
 
 #endif
 
@@ -199,6 +200,7 @@ void flexus_writeMeasurement(const char *measurement, const char *filename, Erro
 void flexus_writeProfile(const char *filename, Error **errp);
 int flexus_in_timing(void);
 int flexus_in_trace(void);
+bool flexus_pause_all_vcpus(void);
 void flexus_doSave(const char* dir_name, Error **errp);
 void flexus_doLoad(const char* dir_name, Error **errp);
 #endif
@@ -66,6 +66,7 @@
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
 #include "qemu/main-loop.h"
+#include "block/thread-pool.h"
 
 typedef ObjectClass IOThreadClass;
 
@@ -125,12 +126,18 @@ static void *iothread_run(void *opaque)
     return NULL;
 }
 
+static void iothread_group_remove(IOThreadGroup *group, IOThread *iothread);
+
 void iothread_stop(IOThread *iothread)
 {
     if (!iothread->ctx || iothread->stopping) {
         return;
     }
     iothread->stopping = true;
+    if (iothread->group) {
+        iothread_group_remove(iothread->group, iothread);
+        return;
+    }
     aio_notify(iothread->ctx);
     if (atomic_read(&iothread->main_loop)) {
         g_main_loop_quit(iothread->main_loop);
@@ -150,11 +157,27 @@ static int iothread_stop_iter(Object *object, void *opaque)
     return 0;
 }
 
+static void iothread_group_stop(IOThreadGroup *group);
+
+static int iothread_group_stop_iter(Object *object, void *opaque)
+{
+    IOThreadGroup *group;
+
+    group = (IOThreadGroup *)object_dynamic_cast(object, TYPE_IOTHREAD_GROUP);
+    if (!group) {
+        return 0;
+    }
+    iothread_group_stop(group);
+    return 0;
+}
+
 static void iothread_instance_init(Object *obj)
 {
     IOThread *iothread = IOTHREAD(obj);
 
     iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->thread_pool_min = THREAD_POOL_MIN_THREADS_DEFAULT;
+    iothread->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
 }
 
 static void iothread_instance_finalize(Object *obj)
@@ -168,18 +191,42 @@ static void iothread_instance_finalize(Object *obj)
     }
     qemu_cond_destroy(&iothread->init_done_cond);
     qemu_mutex_destroy(&iothread->init_done_lock);
+    if (iothread->group) {
+        object_unref(OBJECT(iothread->group));
+    }
+    g_free(iothread->group_id);
     if (!iothread->ctx) {
         return;
     }
     aio_context_unref(iothread->ctx);
 }
 
+static void iothread_group_add(IOThreadGroup *group, IOThread *iothread);
+
 static void iothread_complete(UserCreatable *obj, Error **errp)
 {
     Error *local_error = NULL;
     IOThread *iothread = IOTHREAD(obj);
+    IOThreadGroup *group = NULL;
     char *name, *thread_name;
 
+    if (iothread->group_id) {
+        Object *container = object_get_objects_root();
+        Object *group_obj;
+
+        group_obj = object_resolve_path_component(container,
+                                                  iothread->group_id);
+        if (group_obj) {
+            group = (IOThreadGroup *)object_dynamic_cast(group_obj,
+                                                         TYPE_IOTHREAD_GROUP);
+        }
+        if (!group) {
+            error_setg(errp, "iothread-group '%s' not found",
+                       iothread->group_id);
+            return;
+        }
+    }
+
     iothread->stopping = false;
     iothread->thread_id = -1;
     iothread->ctx = aio_context_new(&local_error);
@@ -193,6 +240,12 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                                 iothread->poll_grow,
                                 iothread->poll_shrink,
                                 &local_error);
+    if (!local_error) {
+        aio_context_set_thread_pool_params(iothread->ctx,
+                                           iothread->thread_pool_min,
+                                           iothread->thread_pool_max,
+                                           &local_error);
+    }
     if (local_error) {
         error_propagate(errp, local_error);
         aio_context_unref(iothread->ctx);
@@ -204,6 +257,15 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
     qemu_cond_init(&iothread->init_done_cond);
     iothread->once = (GOnce) G_ONCE_INIT;
 
+    if (group) {
+        /* The group's thread runs our AioContext, we have none */
+        object_ref(OBJECT(group));
+        iothread->group = group;
+        iothread->thread_id = group->thread_id;
+        iothread_group_add(group, iothread);
+        return;
+    }
+
     /* This assumes we are called from a thread with useful CPU affinity for us
      * to inherit.
      */
@@ -226,23 +288,29 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
 typedef struct {
     const char *name;
     ptrdiff_t offset; /* field's byte offset in IOThread struct */
-} PollParamInfo;
+} IOThreadParamInfo;
 
-static PollParamInfo poll_max_ns_info = {
+static IOThreadParamInfo poll_max_ns_info = {
     "poll-max-ns", offsetof(IOThread, poll_max_ns),
 };
-static PollParamInfo poll_grow_info = {
+static IOThreadParamInfo poll_grow_info = {
     "poll-grow", offsetof(IOThread, poll_grow),
 };
-static PollParamInfo poll_shrink_info = {
+static IOThreadParamInfo poll_shrink_info = {
     "poll-shrink", offsetof(IOThread, poll_shrink),
 };
+static IOThreadParamInfo thread_pool_min_info = {
+    "thread-pool-min", offsetof(IOThread, thread_pool_min),
+};
+static IOThreadParamInfo thread_pool_max_info = {
+    "thread-pool-max", offsetof(IOThread, thread_pool_max),
+};
 
-static void iothread_get_poll_param(Object *obj, Visitor *v,
+static void iothread_get_param(Object *obj, Visitor *v,
         const char *name, void *opaque, Error **errp)
 {
     IOThread *iothread = IOTHREAD(obj);
-    PollParamInfo *info = opaque;
+    IOThreadParamInfo *info = opaque;
     int64_t *field = (void *)iothread + info->offset;
 
     visit_type_int64(v, name, field, errp);
@@ -252,7 +320,7 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
         const char *name, void *opaque, Error **errp)
 {
     IOThread *iothread = IOTHREAD(obj);
-    PollParamInfo *info = opaque;
+    IOThreadParamInfo *info = opaque;
     int64_t *field = (void *)iothread + info->offset;
     Error *local_err = NULL;
     int64_t value;
@@ -282,23 +350,85 @@ out:
     error_propagate(errp, local_err);
 }
 
+static void iothread_set_thread_pool_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    int64_t old, value;
+    Error *local_err = NULL;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    old = *field;
+    *field = value;
+
+    /* Range checks happen when the iothread is created */
+    if (iothread->ctx) {
+        aio_context_set_thread_pool_params(iothread->ctx,
+                                           iothread->thread_pool_min,
+                                           iothread->thread_pool_max,
+                                           &local_err);
+        if (local_err) {
+            *field = old;
+        }
+    }
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static char *iothread_get_group(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return g_strdup(iothread->group_id ? iothread->group_id : "");
+}
+
+static void iothread_set_group(Object *obj, const char *value, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread->ctx) {
+        error_setg(errp, "Cannot move a running iothread to another group");
+        return;
+    }
+    g_free(iothread->group_id);
+    iothread->group_id = *value ? g_strdup(value) : NULL;
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
     ucc->complete = iothread_complete;
 
     object_class_property_add(klass, "poll-max-ns", "int",
-                              iothread_get_poll_param,
+                              iothread_get_param,
                               iothread_set_poll_param,
                               NULL, &poll_max_ns_info, &error_abort);
     object_class_property_add(klass, "poll-grow", "int",
-                              iothread_get_poll_param,
+                              iothread_get_param,
                               iothread_set_poll_param,
                               NULL, &poll_grow_info, &error_abort);
     object_class_property_add(klass, "poll-shrink", "int",
-                              iothread_get_poll_param,
+                              iothread_get_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-min", "int",
+                              iothread_get_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_min_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-max", "int",
+                              iothread_get_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_max_info, &error_abort);
+    object_class_property_add_str(klass, "group",
+                                  iothread_get_group, iothread_set_group,
+                                  &error_abort);
 }
 
 static const TypeInfo iothread_info = {
@@ -337,6 +467,7 @@ static int query_one_iothread(Object *object, void *opaque)
     IOThreadInfoList *elem;
     IOThreadInfo *info;
     IOThread *iothread;
+    ThreadPool *pool;
 
     iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
     if (!iothread) {
@@ -349,6 +480,19 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    info->thread_pool_min = iothread->thread_pool_min;
+    info->thread_pool_max = iothread->thread_pool_max;
+    if (iothread->group) {
+        info->has_group = true;
+        info->group = object_get_canonical_path_component(
+                          OBJECT(iothread->group));
+    }
+    pool = iothread->ctx ? atomic_read(&iothread->ctx->thread_pool) : NULL;
+    if (pool) {
+        info->has_thread_pool = true;
+        info->thread_pool = g_new0(ThreadPoolInfo, 1);
+        thread_pool_get_info(pool, info->thread_pool);
+    }
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
@@ -386,6 +530,8 @@ void iothread_stop_all(void)
     }
 
     object_child_foreach(container, iothread_stop_iter, NULL);
+    /* Members are gone, the group threads can go too */
+    object_child_foreach(container, iothread_group_stop_iter, NULL);
 }
 
 static gpointer iothread_g_main_context_init(gpointer opaque)
@@ -407,6 +553,8 @@ static gpointer iothread_g_main_context_init(gpointer opaque)
 
 GMainContext *iothread_get_g_main_context(IOThread *iothread)
 {
+    /* The thread of a group only ever runs AioContexts */
+    assert(!iothread->group);
     g_once(&iothread->once, iothread_g_main_context_init, iothread);
 
     return iothread->worker_context;
@@ -427,3 +575,459 @@ void iothread_destroy(IOThread *iothread)
 {
     object_unparent(OBJECT(iothread));
 }
+
+/*
+ * IOThread groups
+ *
+ * The thread of a group runs the AioContexts of all of its members.  Each
+ * iteration first busy polls the members in turn, starting one further
+ * every time, until one of them makes progress or poll_ns runs out.  If
+ * that fails, the thread waits on all of the members at once.  poll_ns is
+ * a single value for the whole group, adjusted after each wait the same
+ * way aio_poll() adjusts ctx->poll_ns, so every member feeds the same
+ * controller.  On top of that, busy polling is limited to poll-budget
+ * percent of the wall clock time: unused budget is banked for at most
+ * IOTHREAD_GROUP_WINDOW_NS, and a group that has used it up waits right
+ * away.
+ */
+
+#define IOTHREAD_GROUP_WINDOW_NS (100 * SCALE_MS)
+
+typedef struct {
+    int idx;
+    int n;
+} IOThreadGroupFds;
+
+static void iothread_group_poll_adjust(int64_t *poll_ns, int64_t poll_max_ns,
+                                       int64_t block_ns)
+{
+    if (block_ns <= *poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        *poll_ns /= 2;
+        if (*poll_ns < 4000) {
+            *poll_ns = 0;
+        }
+    } else if (*poll_ns < poll_max_ns) {
+        /* There is room to grow, poll longer */
+        *poll_ns = *poll_ns ? *poll_ns * 2 : 4000;
+        *poll_ns = MIN(*poll_ns, poll_max_ns);
+    }
+}
+
+static bool iothread_group_dispatch(IOThread *iothread)
+{
+    PTH_UPDATE_CONTEXT
+    bool progress;
+
+    PTH(my_iothread) = iothread;
+    progress = aio_poll(iothread->ctx, false);
+    PTH(my_iothread) = NULL;
+    return progress;
+}
+
+/* ->io_poll() handlers may look at the current AioContext too */
+static bool iothread_group_poll_once(IOThread *iothread)
+{
+    PTH_UPDATE_CONTEXT
+    bool progress;
+
+    PTH(my_iothread) = iothread;
+    progress = aio_context_poll_once(iothread->ctx);
+    PTH(my_iothread) = NULL;
+    return progress;
+}
+
+static void *iothread_group_run(void *opaque)
+{
+    IOThreadGroup *group = opaque;
+    GPtrArray *members = g_ptr_array_new();
+    GArray *pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    IOThreadGroupFds *fds = NULL;
+    GPollFD notifier_pfd = { .events = G_IO_IN };
+    int64_t poll_ns = 0, poll_max_ns = 0, budget = 0, credit = 0;
+    uint64_t successes = 0, failures = 0, throttled = 0, poll_time = 0;
+    int64_t last = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    unsigned rr = 0;
+
+#ifdef _WIN32
+    notifier_pfd.fd = (uintptr_t)event_notifier_get_handle(&group->notifier);
+#else
+    notifier_pfd.fd = event_notifier_get_fd(&group->notifier);
+#endif
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&group->lock);
+    group->thread_id = qemu_get_thread_id();
+    qemu_cond_broadcast(&group->members_cond);
+    qemu_mutex_unlock(&group->lock);
+
+    while (!atomic_read(&group->stopping)) {
+        bool progress = false;
+        int64_t now, start;
+        int i, n;
+
+        /* Publish statistics, pick up parameter and membership changes */
+        qemu_mutex_lock(&group->lock);
+        group->poll_ns = poll_ns;
+        group->poll_successes += successes;
+        group->poll_failures += failures;
+        group->poll_throttled += throttled;
+        group->poll_time_ns += poll_time;
+        successes = failures = throttled = poll_time = 0;
+        budget = group->poll_budget;
+        poll_max_ns = group->poll_max_ns;
+        if (group->members_seen != group->members_gen) {
+            g_ptr_array_set_size(members, 0);
+            for (i = 0; i < group->members->len; i++) {
+                g_ptr_array_add(members, g_ptr_array_index(group->members, i));
+            }
+            fds = g_renew(IOThreadGroupFds, fds, members->len);
+            group->members_seen = group->members_gen;
+            qemu_cond_broadcast(&group->members_cond);
+        }
+        qemu_mutex_unlock(&group->lock);
+
+        n = members->len;
+        poll_ns = MIN(poll_ns, poll_max_ns);
+        for (i = 0; i < n; i++) {
+            IOThread *iothread = g_ptr_array_index(members, i);
+
+            /* Like a blocking aio_poll(), have aio_notify() wake us up */
+            atomic_add(&iothread->ctx->notify_me, 2);
+        }
+
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        credit = MIN(credit + (now - last) * budget / 100,
+                     IOTHREAD_GROUP_WINDOW_NS * budget / 100);
+        last = now;
+
+        /* Busy poll the members in turn */
+        if (n && poll_ns && credit <= 0) {
+            throttled++;
+        } else if (n && poll_ns) {
+            int64_t end = now + MIN(poll_ns, credit);
+
+            start = now;
+            do {
+                for (i = 0; i < n && !progress; i++) {
+                    IOThread *iothread;
+
+                    iothread = g_ptr_array_index(members, (rr + i) % n);
+                    if (iothread_group_poll_once(iothread)) {
+                        iothread_group_dispatch(iothread);
+                        progress = true;
+                    }
+                }
+                now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            } while (!progress && now < end);
+            rr++;
+
+            credit -= now - start;
+            poll_time += now - start;
+            if (progress) {
+                successes++;
+            } else {
+                failures++;
+            }
+        }
+
+        if (!progress) {
+            int64_t timeout = -1;
+            int ret;
+
+            /* Leave polling mode, which may still find work */
+            g_array_set_size(pollfds, 0);
+            g_array_append_val(pollfds, notifier_pfd);
+            for (i = 0; i < n; i++) {
+                IOThread *iothread = g_ptr_array_index(members, i);
+
+                progress |= iothread_group_dispatch(iothread);
+                fds[i].idx = pollfds->len;
+                fds[i].n = aio_context_add_pollfds(iothread->ctx, pollfds);
+                timeout = qemu_soonest_timeout(timeout,
+                              aio_compute_timeout(iothread->ctx));
+            }
+
+            start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            ret = qemu_poll_ns((GPollFD *)pollfds->data, pollfds->len,
+                               progress ? 0 : timeout);
+            if (!progress) {
+                iothread_group_poll_adjust(&poll_ns, poll_max_ns,
+                    qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+            }
+
+            if (ret > 0 && g_array_index(pollfds, GPollFD, 0).revents) {
+                event_notifier_test_and_clear(&group->notifier);
+            }
+            for (i = 0; i < n; i++) {
+                IOThread *iothread = g_ptr_array_index(members, i);
+                bool ready = false;
+                int j;
+
+                for (j = 0; ret > 0 && j < fds[i].n; j++) {
+                    ready |= !!g_array_index(pollfds, GPollFD,
+                                             fds[i].idx + j).revents;
+                }
+                if (ready || aio_compute_timeout(iothread->ctx) == 0) {
+                    iothread_group_dispatch(iothread);
+                }
+            }
+        }
+
+        for (i = 0; i < n; i++) {
+            IOThread *iothread = g_ptr_array_index(members, i);
+
+            atomic_sub(&iothread->ctx->notify_me, 2);
+        }
+    }
+
+    qemu_mutex_lock(&group->lock);
+    group->running = false;
+    qemu_cond_broadcast(&group->members_cond);
+    qemu_mutex_unlock(&group->lock);
+
+    g_free(fds);
+    g_array_free(pollfds, TRUE);
+    g_ptr_array_free(members, TRUE);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void iothread_group_add(IOThreadGroup *group, IOThread *iothread)
+{
+    qemu_mutex_lock(&group->lock);
+    g_ptr_array_add(group->members, iothread);
+    group->members_gen++;
+    qemu_mutex_unlock(&group->lock);
+    event_notifier_set(&group->notifier);
+}
+
+static void iothread_group_remove(IOThreadGroup *group, IOThread *iothread)
+{
+    unsigned gen;
+
+    qemu_mutex_lock(&group->lock);
+    g_ptr_array_remove(group->members, iothread);
+    gen = ++group->members_gen;
+    event_notifier_set(&group->notifier);
+
+    /* The AioContext may go away as soon as we return */
+    while (group->running && group->members_seen != gen) {
+        qemu_cond_wait(&group->members_cond, &group->lock);
+    }
+    qemu_mutex_unlock(&group->lock);
+}
+
+static void iothread_group_stop(IOThreadGroup *group)
+{
+    if (!group->running || group->stopping) {
+        return;
+    }
+    atomic_set(&group->stopping, true);
+    event_notifier_set(&group->notifier);
+    qemu_thread_join(&group->thread);
+}
+
+static void iothread_group_instance_init(Object *obj)
+{
+    IOThreadGroup *group = IOTHREAD_GROUP(obj);
+
+    group->poll_budget = 100;
+    group->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    group->thread_id = -1;
+    group->members = g_ptr_array_new();
+    qemu_mutex_init(&group->lock);
+    qemu_cond_init(&group->members_cond);
+}
+
+static void iothread_group_instance_finalize(Object *obj)
+{
+    IOThreadGroup *group = IOTHREAD_GROUP(obj);
+
+    iothread_group_stop(group);
+    if (group->thread_id != -1) {
+        event_notifier_cleanup(&group->notifier);
+    }
+    assert(group->members->len == 0);
+    g_ptr_array_free(group->members, TRUE);
+    qemu_cond_destroy(&group->members_cond);
+    qemu_mutex_destroy(&group->lock);
+}
+
+static void iothread_group_complete(UserCreatable *obj, Error **errp)
+{
+    IOThreadGroup *group = IOTHREAD_GROUP(obj);
+    char *name, *thread_name;
+    int ret;
+
+    ret = event_notifier_init(&group->notifier, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to initialize event notifier");
+        return;
+    }
+
+    group->running = true;
+    name = object_get_canonical_path_component(OBJECT(obj));
+    thread_name = g_strdup_printf("IO %s", name);
+    qemu_thread_create(&group->thread, thread_name, iothread_group_run,
+                       group, QEMU_THREAD_JOINABLE);
+    g_free(thread_name);
+    g_free(name);
+
+    /* Wait for initialization to complete */
+    qemu_mutex_lock(&group->lock);
+    while (group->thread_id == -1) {
+        qemu_cond_wait(&group->members_cond, &group->lock);
+    }
+    qemu_mutex_unlock(&group->lock);
+}
+
+static bool iothread_group_can_be_deleted(UserCreatable *uc)
+{
+    /* Every member holds a reference */
+    return OBJECT(uc)->ref == 1;
+}
+
+static IOThreadParamInfo poll_budget_info = {
+    "poll-budget", offsetof(IOThreadGroup, poll_budget),
+};
+static IOThreadParamInfo group_poll_max_ns_info = {
+    "poll-max-ns", offsetof(IOThreadGroup, poll_max_ns),
+};
+
+static void iothread_group_get_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThreadGroup *group = IOTHREAD_GROUP(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)group + info->offset;
+    int64_t value;
+
+    qemu_mutex_lock(&group->lock);
+    value = *field;
+    qemu_mutex_unlock(&group->lock);
+
+    visit_type_int64(v, name, &value, errp);
+}
+
+static void iothread_group_set_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThreadGroup *group = IOTHREAD_GROUP(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)group + info->offset;
+    int64_t max = info == &poll_budget_info ? 100 : INT64_MAX;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    if (value < 0 || value > max) {
+        error_setg(&local_err, "%s value must be in range [0, %"PRId64"]",
+                   info->name, max);
+        goto out;
+    }
+
+    /* The group thread picks the new value up on its next iteration */
+    qemu_mutex_lock(&group->lock);
+    *field = value;
+    qemu_mutex_unlock(&group->lock);
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void iothread_group_class_init(ObjectClass *klass, void *class_data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
+    ucc->complete = iothread_group_complete;
+    ucc->can_be_deleted = iothread_group_can_be_deleted;
+
+    object_class_property_add(klass, "poll-budget", "int",
+                              iothread_group_get_param,
+                              iothread_group_set_param,
+                              NULL, &poll_budget_info, &error_abort);
+    object_class_property_add(klass, "poll-max-ns", "int",
+                              iothread_group_get_param,
+                              iothread_group_set_param,
+                              NULL, &group_poll_max_ns_info, &error_abort);
+}
+
+static const TypeInfo iothread_group_info = {
+    .name = TYPE_IOTHREAD_GROUP,
+    .parent = TYPE_OBJECT,
+    .class_init = iothread_group_class_init,
+    .instance_size = sizeof(IOThreadGroup),
+    .instance_init = iothread_group_instance_init,
+    .instance_finalize = iothread_group_instance_finalize,
+    .interfaces = (InterfaceInfo[]) {
+        {TYPE_USER_CREATABLE},
+        {}
+    },
+};
+
+static void iothread_group_register_types(void)
+{
+    type_register_static(&iothread_group_info);
+}
+
+type_init(iothread_group_register_types)
+
+static int query_one_iothread_group(Object *object, void *opaque)
+{
+    IOThreadGroupInfoList ***prev = opaque;
+    IOThreadGroupInfoList *elem;
+    IOThreadGroupInfo *info;
+    IOThreadGroup *group;
+    strList **members;
+    int i;
+
+    group = (IOThreadGroup *)object_dynamic_cast(object, TYPE_IOTHREAD_GROUP);
+    if (!group) {
+        return 0;
+    }
+
+    info = g_new0(IOThreadGroupInfo, 1);
+    info->id = object_get_canonical_path_component(object);
+    info->thread_id = group->thread_id;
+
+    qemu_mutex_lock(&group->lock);
+    members = &info->members;
+    for (i = 0; i < group->members->len; i++) {
+        *members = g_new0(strList, 1);
+        (*members)->value =
+            iothread_get_id(g_ptr_array_index(group->members, i));
+        members = &(*members)->next;
+    }
+    info->poll_budget = group->poll_budget;
+    info->poll_max_ns = group->poll_max_ns;
+    info->poll_ns = group->poll_ns;
+    info->poll_successes = group->poll_successes;
+    info->poll_failures = group->poll_failures;
+    info->poll_throttled = group->poll_throttled;
+    info->poll_time_ns = group->poll_time_ns;
+    qemu_mutex_unlock(&group->lock);
+
+    elem = g_new0(IOThreadGroupInfoList, 1);
+    elem->value = info;
+
+    **prev = elem;
+    *prev = &elem->next;
+    return 0;
+}
+
+IOThreadGroupInfoList *qmp_query_iothread_groups(Error **errp)
+{
+    IOThreadGroupInfoList *head = NULL;
+    IOThreadGroupInfoList **prev = &head;
+    Object *container = object_get_objects_root();
+
+    object_child_foreach(container, query_one_iothread_group, &prev);
+    return head;
+}
@@ -82,6 +82,12 @@
 
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
+/* Regions whose rendering changed since the FlatViews were last updated,
+ * or memory_region_update_all if the FlatViews must be rendered again
+ * from scratch.
+ */
+static GHashTable *memory_region_update_dirty;
+static bool memory_region_update_all;
 static bool ioeventfd_update_pending;
 static bool global_dirty_log = false;
 
@@ -266,6 +272,15 @@ struct FlatRange {
     bool readonly;
 };
 
+/* Part of the global map covered by a region, clipped by its containers,
+ * when a FlatView was rendered.  The same region can appear more than once,
+ * e.g. when it is the target of several aliases.
+ */
+typedef struct RenderedRegion {
+    MemoryRegion *mr;
+    AddrRange addr;
+} RenderedRegion;
+
 /* Flattened global view of current active memory hierarchy.  Kept in sorted
  * order.
  */
@@ -275,6 +290,11 @@ struct FlatView {
     FlatRange *ranges;
     unsigned nr;
     unsigned nr_allocated;
+    /* where each region was rendered, to update the view incrementally */
+    RenderedRegion *rendered;
+    unsigned nr_rendered;
+    unsigned nr_rendered_allocated;
+    unsigned nr_rendered_merged;
     struct AddressSpaceDispatch *dispatch;
     MemoryRegion *root;
 };
@@ -336,6 +356,36 @@ static void flatview_insert(FlatView *view, unsigned pos, FlatRange *range)
     ++view->nr;
 }
 
+/* Returns the position of the first range of @view that ends after @addr */
+static unsigned flatview_find_first(FlatView *view, Int128 addr)
+{
+    unsigned lo = 0, hi = view->nr;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+
+        if (int128_ge(addr, addrrange_end(view->ranges[mid].addr))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void flatview_add_rendered(FlatView *view, MemoryRegion *mr,
+                                  AddrRange addr)
+{
+    if (view->nr_rendered == view->nr_rendered_allocated) {
+        view->nr_rendered_allocated = MAX(2 * view->nr_rendered, 10);
+        view->rendered = g_renew(RenderedRegion, view->rendered,
+                                 view->nr_rendered_allocated);
+    }
+    view->rendered[view->nr_rendered].mr = mr;
+    view->rendered[view->nr_rendered].addr = addr;
+    ++view->nr_rendered;
+}
+
 static void flatview_destroy(FlatView *view)
 {
     int i;
@@ -348,6 +398,7 @@ static void flatview_destroy(FlatView *view)
         memory_region_unref(view->ranges[i].mr);
     }
     g_free(view->ranges);
+    g_free(view->rendered);
     memory_region_unref(view->root);
     g_free(view);
 }
@@ -722,6 +773,7 @@ static void render_memory_region(FlatView *view,
     }
 
     clip = addrrange_intersection(tmp, clip);
+    flatview_add_rendered(view, mr, clip);
 
     if (mr->alias) {
         int128_subfrom(&base, int128_make64(mr->alias->addr));
@@ -749,7 +801,8 @@ static void render_memory_region(FlatView *view,
     fr.readonly = readonly;
 
     /* Render the region itself into any gaps left by the current view. */
-    for (i = 0; i < view->nr && int128_nz(remain); ++i) {
+    for (i = flatview_find_first(view, base);
+         i < view->nr && int128_nz(remain); ++i) {
         if (int128_ge(base, addrrange_end(view->ranges[i].addr))) {
             continue;
         }
@@ -822,10 +875,26 @@ static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
     return NULL;
 }
 
+/* Build the dispatch of a freshly rendered view and make it current. */
+static void flatview_publish(FlatView *view)
+{
+    int i;
+
+    flatview_simplify(view);
+
+    view->dispatch = address_space_dispatch_new(view);
+    for (i = 0; i < view->nr; i++) {
+        MemoryRegionSection mrs =
+            section_from_flat_range(&view->ranges[i], view);
+        flatview_add_to_dispatch(view, &mrs);
+    }
+    address_space_dispatch_compact(view->dispatch);
+    g_hash_table_replace(flat_views, view->root, view);
+}
+
 /* Render a memory topology into a list of disjoint absolute ranges. */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
-    int i;
     FlatView *view;
 
     view = flatview_new(mr);
@@ -834,20 +903,314 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
         render_memory_region(view, mr, int128_zero(),
                              addrrange_make(int128_zero(), int128_2_64()), false);
     }
-    flatview_simplify(view);
+    view->nr_rendered_merged = view->nr_rendered;
+    flatview_publish(view);
 
-    view->dispatch = address_space_dispatch_new(view);
-    for (i = 0; i < view->nr; i++) {
-        MemoryRegionSection mrs =
-            section_from_flat_range(&view->ranges[i], view);
-        flatview_add_to_dispatch(view, &mrs);
+    return view;
+}
+
+/* Collect the parts of the global map where dirty regions are now visible. */
+static void memory_region_collect_dirty(GArray *dirty, MemoryRegion *mr,
+                                        Int128 base, AddrRange clip)
+{
+    MemoryRegion *subregion;
+    AddrRange tmp;
+
+    if (!mr->enabled) {
+        return;
     }
-    address_space_dispatch_compact(view->dispatch);
-    g_hash_table_replace(flat_views, mr, view);
+
+    int128_addto(&base, int128_make64(mr->addr));
+    tmp = addrrange_make(base, mr->size);
+    if (!addrrange_intersects(tmp, clip)) {
+        return;
+    }
+    clip = addrrange_intersection(tmp, clip);
+
+    if (g_hash_table_contains(memory_region_update_dirty, mr)) {
+        /* Everything below is rendered inside @clip as well */
+        g_array_append_val(dirty, clip);
+        return;
+    }
+
+    if (mr->alias) {
+        int128_subfrom(&base, int128_make64(mr->alias->addr));
+        int128_subfrom(&base, int128_make64(mr->alias_offset));
+        memory_region_collect_dirty(dirty, mr->alias, base, clip);
+        return;
+    }
+
+    QTAILQ_FOREACH(subregion, &mr->subregions, subregions_link) {
+        memory_region_collect_dirty(dirty, subregion, base, clip);
+    }
+}
+
+static gint addrrange_compare(gconstpointer a, gconstpointer b)
+{
+    const AddrRange *r1 = a, *r2 = b;
+
+    if (int128_lt(r1->start, r2->start)) {
+        return -1;
+    }
+    return int128_gt(r1->start, r2->start);
+}
+
+static gint rendered_region_compare(gconstpointer a, gconstpointer b)
+{
+    const RenderedRegion *r1 = a, *r2 = b;
+
+    if (r1->mr != r2->mr) {
+        return (uintptr_t)r1->mr < (uintptr_t)r2->mr ? -1 : 1;
+    }
+    return addrrange_compare(&r1->addr, &r2->addr);
+}
+
+/* Sort @dirty and merge ranges that overlap or touch. */
+static void addrranges_normalize(GArray *dirty)
+{
+    AddrRange *r = (AddrRange *)dirty->data;
+    unsigned i, n = 0;
+
+    g_array_sort(dirty, addrrange_compare);
+    for (i = 0; i < dirty->len; i++) {
+        if (n && int128_ge(addrrange_end(r[n - 1]), r[i].start)) {
+            Int128 end = int128_max(addrrange_end(r[n - 1]),
+                                    addrrange_end(r[i]));
+            r[n - 1].size = int128_sub(end, r[n - 1].start);
+        } else {
+            r[n++] = r[i];
+        }
+    }
+    g_array_set_size(dirty, n);
+}
+
+/* Returns the first of the sorted and disjoint @ranges that ends after @addr */
+static unsigned addrranges_find_first(const AddrRange *ranges, unsigned nr,
+                                      Int128 addr)
+{
+    unsigned lo = 0, hi = nr;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+
+        if (int128_ge(addr, addrrange_end(ranges[mid]))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Sort the rendered regions of @view and merge the pieces of each region,
+ * so that they do not pile up as the view is updated again and again.
+ */
+static void flatview_merge_rendered(FlatView *view)
+{
+    RenderedRegion *rr = view->rendered;
+    unsigned i, n = 0;
+
+    qsort(rr, view->nr_rendered, sizeof(*rr), rendered_region_compare);
+    for (i = 0; i < view->nr_rendered; i++) {
+        if (n && rr[i].mr == rr[n - 1].mr &&
+            int128_ge(addrrange_end(rr[n - 1].addr), rr[i].addr.start)) {
+            Int128 end = int128_max(addrrange_end(rr[n - 1].addr),
+                                    addrrange_end(rr[i].addr));
+            rr[n - 1].addr.size = int128_sub(end, rr[n - 1].addr.start);
+        } else {
+            rr[n++] = rr[i];
+        }
+    }
+    view->nr_rendered = view->nr_rendered_merged = n;
+}
+
+/* Returns the next part of @range, starting at or after *@start, that does
+ * not intersect the sorted and disjoint @holes, and advances *@start past it.
+ * *@hole is the first hole that may still matter; it only moves forward, so
+ * the same index can be used for ranges that come one after the other.
+ * The result is empty when nothing is left of @range.
+ */
+static AddrRange addrrange_next_outside(AddrRange range, Int128 *start,
+                                        const AddrRange *holes,
+                                        unsigned nr_holes, unsigned *hole)
+{
+    Int128 end = addrrange_end(range);
+    AddrRange piece;
+
+    for (;;) {
+        if (int128_ge(*start, end)) {
+            return addrrange_make(end, int128_zero());
+        }
+        while (*hole < nr_holes &&
+               int128_le(addrrange_end(holes[*hole]), *start)) {
+            ++*hole;
+        }
+        if (*hole < nr_holes && int128_le(holes[*hole].start, *start)) {
+            /* *start is inside a hole, skip it */
+            *start = addrrange_end(holes[*hole]);
+            continue;
+        }
+        break;
+    }
+
+    piece.start = *start;
+    if (*hole < nr_holes && int128_lt(holes[*hole].start, end)) {
+        piece.size = int128_sub(holes[*hole].start, *start);
+    } else {
+        piece.size = int128_sub(end, *start);
+    }
+    *start = addrrange_end(piece);
+    return piece;
+}
+
+/* Update @old_view after changes to the regions in memory_region_update_dirty.
+ * Only the parts of the global map where those regions were visible before,
+ * or are visible now, are rendered again; the rest is copied from @old_view.
+ * If nothing changed, @old_view itself is made current again.
+ */
+static FlatView *flatview_update(FlatView *old_view, MemoryRegion *mr)
+{
+    GArray *dirty = g_array_new(false, false, sizeof(AddrRange));
+    const AddrRange *holes;
+    FlatView *view;
+    unsigned i, hole;
+
+    for (i = 0; i < old_view->nr_rendered; i++) {
+        if (g_hash_table_contains(memory_region_update_dirty,
+                                  old_view->rendered[i].mr)) {
+            g_array_append_val(dirty, old_view->rendered[i].addr);
+        }
+    }
+    if (mr) {
+        memory_region_collect_dirty(dirty, mr, int128_zero(),
+                                    addrrange_make(int128_zero(),
+                                                   int128_2_64()));
+    }
+
+    trace_flatview_update(old_view, mr, dirty->len);
+    if (!dirty->len) {
+        g_array_free(dirty, true);
+        flatview_ref(old_view);
+        g_hash_table_replace(flat_views, mr, old_view);
+        return old_view;
+    }
+
+    addrranges_normalize(dirty);
+    holes = (const AddrRange *)dirty->data;
+
+    view = flatview_new(mr);
+    view->nr_allocated = old_view->nr + 2 * dirty->len;
+    view->ranges = g_new(FlatRange, view->nr_allocated);
+    view->nr_rendered_allocated = old_view->nr_rendered + 2 * dirty->len;
+    view->rendered = g_new(RenderedRegion, view->nr_rendered_allocated);
+    view->nr_rendered_merged = old_view->nr_rendered_merged;
+
+    /* Keep what is outside the dirty ranges... */
+    hole = 0;
+    for (i = 0; i < old_view->nr; i++) {
+        FlatRange *fr = &old_view->ranges[i];
+        Int128 start = fr->addr.start;
+        FlatRange piece = *fr;
+
+        if (hole == dirty->len ||
+            int128_le(addrrange_end(fr->addr), holes[hole].start)) {
+            flatview_insert(view, view->nr, fr);
+            continue;
+        }
+        for (;;) {
+            piece.addr = addrrange_next_outside(fr->addr, &start,
+                                                holes, dirty->len, &hole);
+            if (!int128_nz(piece.addr.size)) {
+                break;
+            }
+            piece.offset_in_region = fr->offset_in_region +
+                int128_get64(int128_sub(piece.addr.start, fr->addr.start));
+            flatview_insert(view, view->nr, &piece);
+        }
+    }
+    for (i = 0; i < old_view->nr_rendered; i++) {
+        RenderedRegion *rr = &old_view->rendered[i];
+        Int128 start = rr->addr.start;
+        AddrRange piece;
+
+        if (g_hash_table_contains(memory_region_update_dirty, rr->mr)) {
+            continue;
+        }
+        hole = addrranges_find_first(holes, dirty->len, start);
+        if (hole == dirty->len ||
+            int128_le(addrrange_end(rr->addr), holes[hole].start)) {
+            flatview_add_rendered(view, rr->mr, rr->addr);
+            continue;
+        }
+        for (;;) {
+            piece = addrrange_next_outside(rr->addr, &start,
+                                           holes, dirty->len, &hole);
+            if (!int128_nz(piece.size)) {
+                break;
+            }
+            flatview_add_rendered(view, rr->mr, piece);
+        }
+    }
+
+    /* ... and render the rest again */
+    for (i = 0; i < dirty->len; i++) {
+        render_memory_region(view, mr, int128_zero(), holes[i], false);
+    }
+
+    if (view->nr_rendered > 2 * view->nr_rendered_merged) {
+        flatview_merge_rendered(view);
+    }
+
+    g_array_free(dirty, true);
+    flatview_publish(view);
 
     return view;
 }
 
+/* Debugging aid: QEMU_FLATVIEW_CHECK=1 in the environment renders every
+ * incrementally updated FlatView again from scratch and compares the two.
+ * This costs a full render per update, so it is off by default.
+ */
+static bool flatview_check_enabled(void)
+{
+    static int enabled = -1;
+
+    if (enabled < 0) {
+        const char *env = getenv("QEMU_FLATVIEW_CHECK");
+
+        enabled = env && strcmp(env, "0");
+    }
+    return enabled;
+}
+
+/* Check that @view, after an incremental update, matches a render of
+ * @mr from scratch.
+ */
+static void flatview_check_update(FlatView *view, MemoryRegion *mr)
+{
+    FlatView *full;
+    unsigned i;
+
+    full = flatview_new(mr);
+    render_memory_region(full, mr, int128_zero(),
+                         addrrange_make(int128_zero(), int128_2_64()), false);
+    flatview_simplify(full);
+
+    for (i = 0; i < MAX(view->nr, full->nr); i++) {
+        FlatRange *a = i < view->nr ? &view->ranges[i] : NULL;
+        FlatRange *b = i < full->nr ? &full->ranges[i] : NULL;
+
+        if (!a || !b || !flatrange_equal(a, b) ||
+            a->dirty_log_mask != b->dirty_log_mask) {
+            error_report("memory: incremental update of FlatView for %s "
+                         "differs from a full render at range %u",
+                         memory_region_name(mr), i);
+            abort();
+        }
+    }
+    flatview_unref(full);
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -1035,24 +1398,42 @@ static void flatviews_init(void)
 
 static void flatviews_reset(void)
 {
+    GHashTable *old_views = flat_views;
     AddressSpace *as;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
-    }
+    flat_views = NULL;
     flatviews_init();
 
-    /* Render unique FVs */
+    /* Render unique FVs, starting from the previous ones where possible */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *old_view = NULL;
 
         if (g_hash_table_lookup(flat_views, physmr)) {
             continue;
         }
 
-        generate_memory_topology(physmr);
+        if (old_views && !memory_region_update_all) {
+            old_view = g_hash_table_lookup(old_views, physmr);
+        }
+        if (old_view) {
+            FlatView *view = flatview_update(old_view, physmr);
+
+            if (flatview_check_enabled()) {
+                flatview_check_update(view, physmr);
+            }
+        } else {
+            generate_memory_topology(physmr);
+        }
+    }
+
+    if (old_views) {
+        g_hash_table_unref(old_views);
+    }
+    if (memory_region_update_dirty) {
+        g_hash_table_remove_all(memory_region_update_dirty);
     }
+    memory_region_update_all = false;
 }
 
 static void address_space_set_flatview(AddressSpace *as)
@@ -1111,6 +1492,23 @@ static void address_space_update_topology(AddressSpace *as)
     address_space_set_flatview(as);
 }
 
+/* Schedule a topology update that renders again the parts of the global
+ * map where @mr was or will be visible.  With a NULL @mr, everything is
+ * rendered again.
+ */
+static void memory_region_update_pending_add(MemoryRegion *mr)
+{
+    memory_region_update_pending = true;
+    if (!mr) {
+        memory_region_update_all = true;
+        return;
+    }
+    if (!memory_region_update_dirty) {
+        memory_region_update_dirty = g_hash_table_new(NULL, NULL);
+    }
+    g_hash_table_add(memory_region_update_dirty, mr);
+}
+
 void memory_region_transaction_begin(void)
 {
     qemu_flush_coalesced_mmio_buffer();
@@ -1981,7 +2379,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_pending_add(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2061,7 +2461,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_pending_add(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2071,7 +2473,9 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_pending_add(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2341,7 +2745,9 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_pending_add(subregion);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2379,8 +2785,10 @@ void memory_region_del_subregion(MemoryRegion *mr,
     assert(subregion->container == mr);
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_pending_add(subregion);
+    }
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
 
@@ -2391,7 +2799,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_update_pending_add(mr);
     memory_region_transaction_commit();
 }
 
@@ -2407,7 +2815,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
-    memory_region_update_pending = true;
+    memory_region_update_pending_add(mr);
     memory_region_transaction_commit();
 }
 
@@ -2444,7 +2852,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_pending_add(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2586,7 +2996,7 @@ void memory_global_dirty_log_start(void)
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
-    memory_region_update_pending = true;
+    memory_region_update_pending_add(NULL);
     memory_region_transaction_commit();
 }
 
@@ -2596,7 +3006,7 @@ static void memory_global_dirty_log_do_stop(void)
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
-    memory_region_update_pending = true;
+    memory_region_update_pending_add(NULL);
     memory_region_transaction_commit();
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
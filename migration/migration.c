@@ -79,6 +79,7 @@
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
 #define DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT 16
+#define DEFAULT_MIGRATE_RAM_FILE_THREADS 8
 
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
@@ -512,6 +513,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->x_multifd_channels = s->parameters.x_multifd_channels;
     params->has_x_multifd_page_count = true;
     params->x_multifd_page_count = s->parameters.x_multifd_page_count;
+    params->has_x_ram_file_threads = true;
+    params->x_ram_file_threads = s->parameters.x_ram_file_threads;
 
     return params;
 }
@@ -557,9 +560,11 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
         info->xbzrle_cache->bytes = xbzrle_counters.bytes;
         info->xbzrle_cache->pages = xbzrle_counters.pages;
+        info->xbzrle_cache->cache_hit = xbzrle_counters.cache_hit;
         info->xbzrle_cache->cache_miss = xbzrle_counters.cache_miss;
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
+        info->xbzrle_cache->cache_eviction = xbzrle_counters.cache_eviction;
     }
 
     if (cpu_throttle_active()) {
@@ -809,6 +814,13 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
                    "is invalid, it should be in the range of 1 to 10000");
         return false;
     }
+    if (params->has_x_ram_file_threads &&
+        (params->x_ram_file_threads < 1 || params->x_ram_file_threads > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "ram_file_threads",
+                   "is invalid, it should be in the range of 1 to 255");
+        return false;
+    }
 
     return true;
 }
@@ -865,6 +877,10 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_block_incremental) {
         dest->block_incremental = params->block_incremental;
     }
+
+    if (params->has_x_ram_file_threads) {
+        dest->x_ram_file_threads = params->x_ram_file_threads;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params)
@@ -933,6 +949,9 @@ static void migrate_params_apply(MigrateSetParameters *params)
     if (params->has_x_multifd_page_count) {
         s->parameters.x_multifd_page_count = params->x_multifd_page_count;
     }
+    if (params->has_x_ram_file_threads) {
+        s->parameters.x_ram_file_threads = params->x_ram_file_threads;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -1539,6 +1558,33 @@ int migrate_multifd_page_count(void)
     return s->parameters.x_multifd_page_count;
 }
 
+bool migrate_use_seekable_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_SEEKABLE_RAM];
+}
+
+bool migrate_ram_file_share(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_RAM_FILE_SHARE];
+}
+
+int migrate_ram_file_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_ram_file_threads;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -2324,6 +2370,9 @@ static Property migration_properties[] = {
     DEFINE_PROP_INT64("x-multifd-page-count", MigrationState,
                       parameters.x_multifd_page_count,
                       DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT),
+    DEFINE_PROP_INT64("x-ram-file-threads", MigrationState,
+                      parameters.x_ram_file_threads,
+                      DEFAULT_MIGRATE_RAM_FILE_THREADS),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -2338,6 +2387,9 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_X_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-seekable-ram", MIGRATION_CAPABILITY_X_SEEKABLE_RAM),
+    DEFINE_PROP_MIG_CAP("x-ram-file-share",
+                        MIGRATION_CAPABILITY_X_RAM_FILE_SHARE),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -2383,6 +2435,7 @@ static void migration_instance_init(Object *obj)
     params->has_block_incremental = true;
     params->has_x_multifd_channels = true;
     params->has_x_multifd_page_count = true;
+    params->has_x_ram_file_threads = true;
 }
 
 /*
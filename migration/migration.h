@@ -179,6 +179,9 @@ bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
 int migrate_multifd_channels(void);
 int migrate_multifd_page_count(void);
+bool migrate_use_seekable_ram(void);
+bool migrate_ram_file_share(void);
+int migrate_ram_file_threads(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
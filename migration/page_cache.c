@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set-associative on the page address, with LRU replacement
+ * inside each set
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -29,11 +30,15 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* pages per set; a page can live in any way of the set its address maps to */
+#define CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint64_t it_lru;
     uint8_t *it_data;
 };
 
@@ -41,8 +46,12 @@ struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
+    int64_t num_sets;
+    unsigned int num_ways;
     uint64_t max_item_age;
     int64_t num_items;
+    /* incremented on every access, orders the ways of a set for LRU */
+    uint64_t lru_clock;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -70,9 +79,13 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_item_age = 0;
+    cache->lru_clock = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(CACHE_WAYS, num_pages);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " (%" PRId64 " sets of %u)\n",
+            cache->max_num_items, cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -86,6 +99,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_lru = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -108,40 +122,65 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    size_t set;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    unsigned int way;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (way = 0; way < cache->num_ways; way++) {
+        if (set[way].it_data && set[way].it_addr == addr) {
+            return &set[way];
+        }
+    }
+    return NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/* Returns a free way of the set of @addr, or else its least recently used */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = &set[0];
+    unsigned int way;
 
-    return &cache->page_cache[pos];
+    for (way = 0; way < cache->num_ways; way++) {
+        if (!set[way].it_data) {
+            return &set[way];
+        }
+        if (set[way].it_lru < victim->it_lru) {
+            victim = &set[way];
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
 {
     CacheItem *it;
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
-        /* update the it_age when the cache hit */
+    if (it) {
+        /* update the it_age and LRU order when the cache hit */
         it->it_age = current_age;
+        it->it_lru = ++cache->lru_clock;
         return true;
     }
     return false;
@@ -152,14 +191,19 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 {
 
     CacheItem *it;
+    int ret = 0;
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, addr);
+        if (it->it_data) {
+            if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+                /* even the oldest page of the set is fresh, keep it */
+                return -1;
+            }
+            ret = 1;
+        }
     }
     /* allocate page */
     if (!it->it_data) {
@@ -174,7 +218,8 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
+    it->it_lru = ++cache->lru_clock;
     it->it_addr = addr;
 
-    return 0;
+    return ret;
 }
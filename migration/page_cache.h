@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set-associative on the page address, with LRU replacement
+ * inside each set
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -45,8 +46,7 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age);
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -62,7 +62,8 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
- * Returns -1 when the page isn't inserted into cache
+ * Returns -1 when the page isn't inserted into cache, 1 when another page
+ * was evicted to make room for it and 0 otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
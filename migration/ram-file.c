@@ -0,0 +1,600 @@
+/*
+ * Seekable RAM snapshot file
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * File layout, all integers big endian:
+ *
+ *   0                    RAMFileHeader
+ *                        RAMFileBlockHeader[nr_blocks]
+ *   bitmap_offset        present-page bitmap of each block
+ *   zero_bitmap_offset   zero-page bitmap of each block
+ *   data_offset          contents of each block, page N at data_offset + N * page
+ *
+ * Bitmaps are arrays of little endian longs.  Zero pages are saved like any
+ * other page, but only recorded in the zero-page bitmap: their place in the
+ * data region is left as a hole, so a mostly empty guest gives a mostly
+ * sparse file.
+ *
+ * The header and bitmaps form the metadata region (meta_size bytes).  Every
+ * bitmap starts on a RAM_FILE_IO_ALIGN boundary and every data region on a
+ * RAM_FILE_ALIGN boundary, so that the data can be moved with O_DIRECT by
+ * several threads at once and mapped straight into guest memory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/bitops.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/thread.h"
+#include "exec/ram_addr.h"
+#include "ram-file.h"
+#include "trace.h"
+
+#define RAM_FILE_MAGIC      0x5152414d46494c45ULL   /* "QRAMFILE" */
+#define RAM_FILE_VERSION    2
+
+/* Alignment of the data regions, large enough for 2M huge pages */
+#define RAM_FILE_ALIGN      (2 * 1024 * 1024)
+/* Granularity of O_DIRECT transfers */
+#define RAM_FILE_IO_ALIGN   4096
+/* Largest transfer handed to an I/O thread at a time */
+#define RAM_FILE_CHUNK      (8 * 1024 * 1024)
+
+typedef struct QEMU_PACKED RAMFileHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t nr_blocks;
+    uint32_t meta_size;
+    uint64_t file_size;
+} RAMFileHeader;
+
+typedef struct QEMU_PACKED RAMFileBlockHeader {
+    char idstr[256];
+    uint64_t used_length;
+    uint64_t bitmap_offset;
+    uint64_t zero_bitmap_offset;
+    uint64_t data_offset;
+} RAMFileBlockHeader;
+
+typedef struct RAMFileJob {
+    uint8_t *host;
+    off_t offset;
+    size_t len;
+    /* when saving, zero-page bitmap of the block and index of the job's
+     * first page in it
+     */
+    unsigned long *zero;
+    unsigned long page;
+} RAMFileJob;
+
+typedef struct RAMFileIO {
+    int fd;
+    bool write;
+    RAMFileJob *jobs;
+    size_t nr_jobs;
+    /* next job to pick, shared by the I/O threads */
+    size_t next_job;
+    /* first errno hit by any I/O thread */
+    int error;
+    /* pages found to be zero while saving */
+    unsigned long zero_pages;
+} RAMFileIO;
+
+static char *ram_file_target;
+
+void ram_file_set_target(const char *path)
+{
+    g_free(ram_file_target);
+    ram_file_target = g_strdup(path);
+}
+
+const char *ram_file_get_target(void)
+{
+    return ram_file_target;
+}
+
+/*
+ * Returns the file descriptor on success or a negative errno
+ */
+static int ram_file_open(const char *path, int flags, Error **errp)
+{
+    int fd = -1;
+
+#ifdef O_DIRECT
+    /* Not every filesystem supports O_DIRECT, fall back to the page cache */
+    fd = qemu_open(path, flags | O_DIRECT, 0644);
+#endif
+    if (fd < 0) {
+        fd = qemu_open(path, flags, 0644);
+    }
+    if (fd < 0) {
+        fd = -errno;
+        error_setg_errno(errp, -fd, "Could not open RAM file '%s'", path);
+    }
+    return fd;
+}
+
+static int ram_file_rw(int fd, bool write, uint8_t *buf, size_t len,
+                       off_t offset)
+{
+    while (len) {
+        ssize_t ret;
+
+        if (write) {
+            ret = pwrite(fd, buf, len, offset);
+        } else {
+            ret = pread(fd, buf, len, offset);
+        }
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return -errno;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        buf += ret;
+        offset += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/*
+ * Save the contents of @job, except for the I/O units that are all zero:
+ * those are left as holes in the file and marked in the zero-page bitmap.
+ *
+ * Returns zero on success or a negative errno
+ */
+static int ram_file_write_sparse(RAMFileIO *io, RAMFileJob *job)
+{
+    size_t unit = MAX(RAM_FILE_IO_ALIGN, TARGET_PAGE_SIZE);
+    size_t pos = 0, start = 0;
+    unsigned long zero_pages = 0;
+    int ret = 0;
+
+    while (pos < job->len) {
+        size_t len = MIN(unit, job->len - pos);
+
+        if (buffer_is_zero(job->host + pos, len)) {
+            if (pos > start) {
+                ret = ram_file_rw(io->fd, true, job->host + start,
+                                  pos - start, job->offset + start);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            bitmap_set_atomic(job->zero, job->page + (pos >> TARGET_PAGE_BITS),
+                              len >> TARGET_PAGE_BITS);
+            zero_pages += len >> TARGET_PAGE_BITS;
+            start = pos + len;
+        }
+        pos += len;
+    }
+    if (pos > start) {
+        ret = ram_file_rw(io->fd, true, job->host + start, pos - start,
+                          job->offset + start);
+    }
+    atomic_add(&io->zero_pages, zero_pages);
+    return ret;
+}
+
+static void *ram_file_io_thread(void *opaque)
+{
+    RAMFileIO *io = opaque;
+    size_t i;
+
+    while (!atomic_read(&io->error) &&
+           (i = atomic_fetch_inc(&io->next_job)) < io->nr_jobs) {
+        RAMFileJob *job = &io->jobs[i];
+        int ret;
+
+        if (job->zero) {
+            ret = ram_file_write_sparse(io, job);
+        } else {
+            ret = ram_file_rw(io->fd, io->write, job->host, job->len,
+                              job->offset);
+        }
+        if (ret < 0) {
+            atomic_cmpxchg(&io->error, 0, -ret);
+        }
+    }
+    return NULL;
+}
+
+static int ram_file_run(RAMFileIO *io, GArray *jobs, int threads)
+{
+    QemuThread *t;
+    int i;
+
+    io->jobs = (RAMFileJob *)jobs->data;
+    io->nr_jobs = jobs->len;
+    io->next_job = 0;
+    io->error = 0;
+
+    threads = MIN(threads, io->nr_jobs);
+    if (threads < 1) {
+        return 0;
+    }
+
+    t = g_new(QemuThread, threads);
+    for (i = 0; i < threads; i++) {
+        qemu_thread_create(t + i, "ram-file", ram_file_io_thread, io,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < threads; i++) {
+        qemu_thread_join(t + i);
+    }
+    g_free(t);
+
+    return -io->error;
+}
+
+static size_t ram_file_bitmap_size(unsigned long nbits)
+{
+    return ROUND_UP(BITS_TO_LONGS(nbits) * sizeof(unsigned long),
+                    RAM_FILE_IO_ALIGN);
+}
+
+/*
+ * Queue I/O for every run of present pages in @bmap.  Runs are widened to
+ * RAM_FILE_IO_ALIGN so that they can be transferred with O_DIRECT; the
+ * widened pages are marked present in @bmap as their contents get saved too.
+ * When saving, @zero is the bitmap where the I/O threads record zero pages.
+ *
+ * Returns the number of target pages queued
+ */
+static uint64_t ram_file_queue_block(GArray *jobs, uint8_t *host,
+                                     unsigned long *bmap, unsigned long *zero,
+                                     unsigned long nbits, uint64_t data_offset)
+{
+    unsigned long align = MAX(RAM_FILE_IO_ALIGN >> TARGET_PAGE_BITS, 1);
+    unsigned long start = find_first_bit(bmap, nbits);
+    uint64_t pages = 0;
+
+    while (start < nbits) {
+        unsigned long end = find_next_zero_bit(bmap, nbits, start);
+        uint64_t offset, len;
+
+        start = QEMU_ALIGN_DOWN(start, align);
+        end = MIN(QEMU_ALIGN_UP(end, align), nbits);
+        bitmap_set(bmap, start, end - start);
+        pages += end - start;
+
+        offset = (uint64_t)start << TARGET_PAGE_BITS;
+        len = (uint64_t)(end - start) << TARGET_PAGE_BITS;
+        while (len) {
+            RAMFileJob job = {
+                .host = host + offset,
+                .offset = data_offset + offset,
+                .len = MIN(len, RAM_FILE_CHUNK),
+                .zero = zero,
+                .page = offset >> TARGET_PAGE_BITS,
+            };
+
+            g_array_append_val(jobs, job);
+            offset += job.len;
+            len -= job.len;
+        }
+
+        start = find_next_bit(bmap, nbits, end);
+    }
+    return pages;
+}
+
+/* Clear the pages of [@start, @end) in @host that are not zero already */
+static void ram_file_clear_range(uint8_t *host, uint64_t start, uint64_t end)
+{
+    for (; start < end; start += TARGET_PAGE_SIZE) {
+        if (!buffer_is_zero(host + start, TARGET_PAGE_SIZE)) {
+            memset(host + start, 0, TARGET_PAGE_SIZE);
+        }
+    }
+}
+
+int64_t ram_file_save(const char *path, int threads, uint64_t *zero_pages,
+                      Error **errp)
+{
+    RAMFileIO io = { .write = true };
+    GArray *jobs = g_array_new(false, false, sizeof(RAMFileJob));
+    RAMFileHeader *hdr;
+    RAMFileBlockHeader *bh;
+    RAMBlock *block;
+    unsigned long **present, **zero;
+    uint32_t nr_blocks = 0, i;
+    uint64_t meta_size, bitmap_offset, data_offset;
+    int64_t pages = 0;
+    uint8_t *meta;
+    int ret;
+
+    RAMBLOCK_FOREACH(block) {
+        nr_blocks++;
+    }
+
+    bitmap_offset = ROUND_UP(sizeof(*hdr) + nr_blocks * sizeof(*bh),
+                             RAM_FILE_IO_ALIGN);
+    meta_size = bitmap_offset;
+    RAMBLOCK_FOREACH(block) {
+        meta_size += 2 * ram_file_bitmap_size(block->used_length >>
+                                              TARGET_PAGE_BITS);
+    }
+    data_offset = ROUND_UP(meta_size, RAM_FILE_ALIGN);
+
+    meta = qemu_memalign(RAM_FILE_IO_ALIGN, meta_size);
+    memset(meta, 0, meta_size);
+    hdr = (RAMFileHeader *)meta;
+    bh = (RAMFileBlockHeader *)(hdr + 1);
+    present = g_new0(unsigned long *, nr_blocks);
+    zero = g_new0(unsigned long *, nr_blocks);
+
+    i = 0;
+    RAMBLOCK_FOREACH(block) {
+        unsigned long nbits = block->used_length >> TARGET_PAGE_BITS;
+        uint64_t block_pages = 0;
+
+        present[i] = bitmap_new(nbits);
+        zero[i] = bitmap_new(nbits);
+        if (block->bmap) {
+            bitmap_copy(present[i], block->bmap, nbits);
+            block_pages = ram_file_queue_block(jobs, block->host, present[i],
+                                               zero[i], nbits, data_offset);
+        }
+        trace_ram_file_block(block->idstr, data_offset, block_pages);
+
+        pstrcpy(bh->idstr, sizeof(bh->idstr), block->idstr);
+        bh->used_length = cpu_to_be64(block->used_length);
+        bh->bitmap_offset = cpu_to_be64(bitmap_offset);
+        bitmap_offset += ram_file_bitmap_size(nbits);
+        bh->zero_bitmap_offset = cpu_to_be64(bitmap_offset);
+        bitmap_offset += ram_file_bitmap_size(nbits);
+        bh->data_offset = cpu_to_be64(data_offset);
+        bh++;
+
+        pages += block_pages;
+        data_offset += ROUND_UP(block->used_length, RAM_FILE_ALIGN);
+        i++;
+    }
+
+    hdr->magic = cpu_to_be64(RAM_FILE_MAGIC);
+    hdr->version = cpu_to_be32(RAM_FILE_VERSION);
+    hdr->page_size = cpu_to_be32(TARGET_PAGE_SIZE);
+    hdr->nr_blocks = cpu_to_be32(nr_blocks);
+    hdr->meta_size = cpu_to_be32(meta_size);
+    hdr->file_size = cpu_to_be64(data_offset);
+
+    /*
+     * Instances restored with a private mapping of a previous file under
+     * the same name still see its unmodified pages, so never truncate it
+     * in place.
+     */
+    unlink(path);
+    io.fd = ram_file_open(path, O_WRONLY | O_CREAT | O_TRUNC, errp);
+    if (io.fd < 0) {
+        ret = io.fd;
+        goto out;
+    }
+
+    trace_ram_file_save(path, pages, threads);
+    ret = ram_file_run(&io, jobs, threads);
+    if (!ret) {
+        /* The bitmaps are only complete once the zero pages are known */
+        bh = (RAMFileBlockHeader *)(hdr + 1);
+        for (i = 0; i < nr_blocks; i++, bh++) {
+            unsigned long nbits = be64_to_cpu(bh->used_length) >>
+                                  TARGET_PAGE_BITS;
+
+            bitmap_andnot(present[i], present[i], zero[i], nbits);
+            bitmap_to_le((unsigned long *)(meta +
+                                           be64_to_cpu(bh->bitmap_offset)),
+                         present[i], nbits);
+            bitmap_to_le((unsigned long *)(meta +
+                                           be64_to_cpu(bh->zero_bitmap_offset)),
+                         zero[i], nbits);
+        }
+        trace_ram_file_zero(path, io.zero_pages);
+        ret = ram_file_rw(io.fd, true, meta, meta_size, 0);
+    }
+    if (!ret && ftruncate(io.fd, data_offset) < 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write RAM file '%s'", path);
+    }
+    qemu_close(io.fd);
+
+out:
+    for (i = 0; i < nr_blocks; i++) {
+        g_free(present[i]);
+        g_free(zero[i]);
+    }
+    g_free(present);
+    g_free(zero);
+    qemu_vfree(meta);
+    g_array_free(jobs, true);
+    if (ret < 0) {
+        return ret;
+    }
+    *zero_pages = io.zero_pages;
+    return pages - io.zero_pages;
+}
+
+/*
+ * Make the pages of @block set in @zero read as zero.  Memory that the host
+ * can give back is discarded rather than cleared, and pages that already
+ * read as zero are left alone, so that restoring does not populate memory
+ * the guest never used.
+ */
+static void ram_file_zero_block(RAMBlock *block, unsigned long *zero,
+                                unsigned long nbits)
+{
+    bool discard = ram_block_discard_zeroes(block);
+    size_t align = qemu_ram_pagesize(block);
+    unsigned long start = find_first_bit(zero, nbits);
+
+    while (start < nbits) {
+        unsigned long end = find_next_zero_bit(zero, nbits, start);
+        uint64_t offset = (uint64_t)start << TARGET_PAGE_BITS;
+        uint64_t limit = (uint64_t)end << TARGET_PAGE_BITS;
+        uint64_t first = QEMU_ALIGN_UP(offset, align);
+        uint64_t last = QEMU_ALIGN_DOWN(limit, align);
+
+        if (discard && first < last &&
+            ram_block_discard_range(block, first, last - first) == 0) {
+            /* only the unaligned head and tail are left */
+            ram_file_clear_range(block->host, offset, first);
+            ram_file_clear_range(block->host, last, limit);
+        } else {
+            ram_file_clear_range(block->host, offset, limit);
+        }
+
+        start = find_next_bit(zero, nbits, end);
+    }
+}
+
+int ram_file_load(const char *path, int threads, bool map, Error **errp)
+{
+    RAMFileIO io = { .write = false };
+    GArray *jobs = g_array_new(false, false, sizeof(RAMFileJob));
+    RAMFileHeader *hdr;
+    RAMFileBlockHeader *bh;
+    uint64_t pages = 0;
+    uint32_t nr_blocks, meta_size, i;
+    uint8_t *meta;
+    int ret;
+
+    io.fd = ram_file_open(path, O_RDONLY, errp);
+    if (io.fd < 0) {
+        g_array_free(jobs, true);
+        return io.fd;
+    }
+
+    meta = qemu_memalign(RAM_FILE_IO_ALIGN, RAM_FILE_IO_ALIGN);
+    ret = ram_file_rw(io.fd, false, meta, RAM_FILE_IO_ALIGN, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read RAM file '%s'", path);
+        goto out;
+    }
+
+    hdr = (RAMFileHeader *)meta;
+    nr_blocks = be32_to_cpu(hdr->nr_blocks);
+    meta_size = be32_to_cpu(hdr->meta_size);
+    if (be64_to_cpu(hdr->magic) != RAM_FILE_MAGIC ||
+        be32_to_cpu(hdr->version) != RAM_FILE_VERSION ||
+        meta_size < sizeof(*hdr) + nr_blocks * sizeof(*bh) ||
+        meta_size % RAM_FILE_IO_ALIGN) {
+        error_setg(errp, "'%s' is not a valid RAM file", path);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (be32_to_cpu(hdr->page_size) != TARGET_PAGE_SIZE) {
+        error_setg(errp, "RAM file '%s' has page size %u, expected %u",
+                   path, be32_to_cpu(hdr->page_size),
+                   (unsigned)TARGET_PAGE_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    qemu_vfree(meta);
+    meta = qemu_memalign(RAM_FILE_IO_ALIGN, meta_size);
+    ret = ram_file_rw(io.fd, false, meta, meta_size, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read RAM file '%s'", path);
+        goto out;
+    }
+
+    rcu_read_lock();
+    bh = (RAMFileBlockHeader *)((RAMFileHeader *)meta + 1);
+    for (i = 0; i < nr_blocks; i++, bh++) {
+        uint64_t length = be64_to_cpu(bh->used_length);
+        uint64_t bitmap_offset = be64_to_cpu(bh->bitmap_offset);
+        uint64_t zero_bitmap_offset = be64_to_cpu(bh->zero_bitmap_offset);
+        uint64_t data_offset = be64_to_cpu(bh->data_offset);
+        unsigned long nbits = length >> TARGET_PAGE_BITS;
+        unsigned long *present, *zero, *mapped;
+        uint64_t block_pages;
+        RAMBlock *block;
+
+        bh->idstr[sizeof(bh->idstr) - 1] = 0;
+        block = qemu_ram_block_by_name(bh->idstr);
+        if (!block) {
+            error_setg(errp, "Unknown ramblock \"%s\" in RAM file '%s'",
+                       bh->idstr, path);
+            ret = -EINVAL;
+            break;
+        }
+        if (length != block->used_length) {
+            ret = qemu_ram_resize(block, length, errp);
+            if (ret < 0) {
+                break;
+            }
+        }
+        if (bitmap_offset + ram_file_bitmap_size(nbits) > meta_size ||
+            zero_bitmap_offset + ram_file_bitmap_size(nbits) > meta_size ||
+            data_offset % RAM_FILE_ALIGN) {
+            error_setg(errp, "Corrupt layout for ramblock \"%s\" in RAM "
+                       "file '%s'", bh->idstr, path);
+            ret = -EINVAL;
+            break;
+        }
+
+        present = bitmap_new(nbits);
+        bitmap_from_le(present, (unsigned long *)(meta + bitmap_offset),
+                       nbits);
+        zero = bitmap_new(nbits);
+        bitmap_from_le(zero, (unsigned long *)(meta + zero_bitmap_offset),
+                       nbits);
+
+        /* Zero pages are holes in the file, so they can be mapped too */
+        mapped = bitmap_new(nbits);
+        bitmap_or(mapped, present, zero, nbits);
+        if (map && bitmap_full(mapped, nbits) &&
+            qemu_ram_pagesize(block) == qemu_real_host_page_size) {
+            g_free(present);
+            g_free(zero);
+            g_free(mapped);
+            trace_ram_file_map(block->idstr, data_offset);
+            ret = qemu_ram_remap_file(block, io.fd, data_offset, errp);
+            if (ret < 0) {
+                break;
+            }
+            continue;
+        }
+        g_free(mapped);
+
+        ram_file_zero_block(block, zero, nbits);
+        trace_ram_file_zero(block->idstr, bitmap_count_one(zero, nbits));
+        g_free(zero);
+
+        block_pages = ram_file_queue_block(jobs, block->host, present, NULL,
+                                           nbits, data_offset);
+        g_free(present);
+        trace_ram_file_block(block->idstr, data_offset, block_pages);
+        pages += block_pages;
+    }
+
+    if (!ret) {
+        trace_ram_file_load(path, pages, threads);
+        ret = ram_file_run(&io, jobs, threads);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read RAM file '%s'",
+                             path);
+        }
+    }
+    rcu_read_unlock();
+
+out:
+    qemu_vfree(meta);
+    qemu_close(io.fd);
+    g_array_free(jobs, true);
+    return ret;
+}
@@ -0,0 +1,75 @@
+/*
+ * Seekable RAM snapshot file
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_RAM_FILE_H
+#define QEMU_MIGRATION_RAM_FILE_H
+
+/*
+ * A RAM file stores every RAMBlock in a fixed region of the file, so the
+ * position of any guest page can be computed from its block and offset.
+ * Each block is preceded by a bitmap of the pages that are present in the
+ * file; for incremental savevm-ext snapshots those are the pages dirtied
+ * since the previous snapshot, the rest of the region is left sparse.
+ */
+
+/**
+ * ram_file_set_target: Redirect the pages of the next RAM save to a file
+ *
+ * While a target is set, the "ram" savevm section only carries the
+ * RAMBlock list and the page contents are written to @path instead.
+ *
+ * @path: file to create, or NULL to go back to the migration stream
+ */
+void ram_file_set_target(const char *path);
+
+/**
+ * ram_file_get_target: Returns the current RAM file target or NULL
+ */
+const char *ram_file_get_target(void);
+
+/**
+ * ram_file_save: Write the dirty pages of all RAMBlocks to a RAM file
+ *
+ * The pages to save are taken from each block's migration bitmap
+ * (block->bmap).  Pages that are all zero are only recorded as such and
+ * take no space in the file.  Must be called inside an RCU critical section.
+ *
+ * Returns the number of target pages written or a negative errno
+ *
+ * @path: file to create
+ * @threads: number of I/O threads to use
+ * @zero_pages: set to the number of zero pages that were not written
+ * @errp: pointer to error object
+ */
+int64_t ram_file_save(const char *path, int threads, uint64_t *zero_pages,
+                      Error **errp);
+
+/**
+ * ram_file_load: Read the pages present in a RAM file into guest memory
+ *
+ * Pages that are not present in the file are left untouched, so that a
+ * chain of incremental RAM files can be loaded oldest first.  Zero pages
+ * are released to the host where possible instead of being written.
+ *
+ * With @map, blocks that are completely present in the file are not read
+ * but backed by a private copy-on-write mapping of their region, so that
+ * clean pages are shared with every other instance restored from the same
+ * file.
+ *
+ * Returns zero on success or a negative errno
+ *
+ * @path: file to read
+ * @threads: number of I/O threads to use
+ * @map: map complete blocks instead of reading them
+ * @errp: pointer to error object
+ */
+int ram_file_load(const char *path, int threads, bool map, Error **errp);
+
+#endif
@@ -91,6 +91,7 @@
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
 #include "migration/block.h"
+#include "ram-file.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -680,8 +681,10 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
+                     ram_counters.dirty_sync_count) > 0) {
+        xbzrle_counters.cache_eviction++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -704,17 +707,21 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
                             ram_addr_t current_addr, RAMBlock *block,
                             ram_addr_t offset, bool last_stage)
 {
-    int encoded_len = 0, bytes_xbzrle;
+    int encoded_len = 0, bytes_xbzrle, ret;
     uint8_t *prev_cached_page;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr,
                          ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             ram_counters.dirty_sync_count) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               ram_counters.dirty_sync_count);
+            if (ret == -1) {
                 return -1;
             } else {
+                if (ret > 0) {
+                    xbzrle_counters.cache_eviction++;
+                }
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -722,6 +729,7 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
         }
         return -1;
     }
+    xbzrle_counters.cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -2219,6 +2227,12 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     int64_t t0;
     int done = 0;
 
+    if (ram_file_get_target()) {
+        /* Pages are written to the RAM file by ram_save_complete */
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 1;
+    }
+
     rcu_read_lock();
     if (ram_list.version != rs->last_version) {
         ram_state_reset(rs);
@@ -2276,6 +2290,42 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     return done;
 }
 
+/**
+ * ram_save_file: write all dirty pages to the RAM file target
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * Called with iothread lock and inside an RCU critical section
+ *
+ * @rs: current RAM state
+ */
+static int ram_save_file(RAMState *rs)
+{
+    Error *local_err = NULL;
+    RAMBlock *block;
+    uint64_t zero_pages;
+    int64_t pages;
+
+    pages = ram_file_save(ram_file_get_target(), migrate_ram_file_threads(),
+                          &zero_pages, &local_err);
+    if (pages < 0) {
+        error_report_err(local_err);
+        return pages;
+    }
+
+    RAMBLOCK_FOREACH(block) {
+        if (block->bmap) {
+            bitmap_zero(block->bmap, block->max_length >> TARGET_PAGE_BITS);
+        }
+    }
+    rs->migration_dirty_pages = 0;
+    ram_counters.duplicate += zero_pages;
+    ram_counters.normal += pages;
+    ram_counters.transferred += pages * TARGET_PAGE_SIZE;
+
+    return 0;
+}
+
 /**
  * ram_save_complete: function called to send the remaining amount of ram
  *
@@ -2297,6 +2347,14 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         migration_bitmap_sync(rs);
     }
 
+    if (ram_file_get_target()) {
+        int ret = ram_save_file(rs);
+
+        rcu_read_unlock();
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return ret;
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
     /* try transferring iterative blocks of memory */
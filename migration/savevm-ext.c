@@ -71,6 +71,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 #include "qapi/qmp/qerror.h"
 #include "block/block_int.h"
@@ -101,11 +102,13 @@
 #include "qemu/iov.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
+#include "block/ramoverlay.h"
 #include "qemu/cutils.h"
 #include "io/channel-buffer.h"
 #include "io/channel-file.h"
 #include "qemu-file-channel.h"
 #include "qemu-file.h"
+#include "ram-file.h"
 
 #include "benchmark.h"
 
@@ -115,6 +118,9 @@ const char *output_command = "pbzip2 -c";
 FILE *savedump = NULL;
 FILE *loaddump = NULL;
 
+/* Options of the ramoverlay node used as temporary overlay, if any */
+static QDict *tmp_overlay_ram_opts;
+
 static int qemu_savevm_state(QEMUFile *f, Error **errp)
 {
     int ret;
@@ -277,17 +283,64 @@ static void generate_name(char *name, int inc) {
     }
 }
 
+void set_tmp_overlay_ram(QemuOpts *opts)
+{
+    QDECREF(tmp_overlay_ram_opts);
+    tmp_overlay_ram_opts = qemu_opts_to_qdict(opts, NULL);
+}
+
 int delete_tmp_overlay(void) {
     BlockDriverState *bs = find_active();
     if (bs == NULL) {
         return -EINVAL;
     }
+    if (bdrv_is_ramoverlay(bs)) {
+        /* Nothing on disk, the contents go away with the node */
+        return 0;
+    }
     return unlink(bs->filename);
 }
 
+/*
+ * Put a ramoverlay node on top of @bs, so that writes until the next
+ * snapshot stay in memory instead of going to a qcow2 file.
+ */
+static int create_ram_overlay(BlockDriverState *bs)
+{
+    BlockDriverState *overlay;
+    QDict *options = qdict_clone_shallow(tmp_overlay_ram_opts);
+    Error *local_err = NULL;
+
+    qdict_put_str(options, "driver", "ramoverlay");
+    overlay = bdrv_open(NULL, NULL, options,
+                        BDRV_O_RDWR | BDRV_O_NO_BACKING, &local_err);
+    if (overlay == NULL) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+    bdrv_set_aio_context(overlay, bdrv_get_aio_context(bs));
+    bdrv_change_backing_file(overlay, bs->filename, bs->drv->format_name);
+
+    bdrv_append(overlay, bs, &local_err);
+    if (local_err != NULL) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+    return 0;
+}
+
 int create_tmp_overlay(void) {
     BlockDriverState *bs = find_active();
-    char* tmp_name = g_malloc0(8192*sizeof(char));
+    char* tmp_name;
+
+    if (bs == NULL) {
+        return -EINVAL;
+    }
+    if (tmp_overlay_ram_opts != NULL) {
+        return create_ram_overlay(bs);
+    }
+
+    tmp_name = g_malloc0(8192*sizeof(char));
     const char *dev_name = bdrv_get_device_name(bs);
     int i = 0;
 
@@ -396,6 +449,7 @@ int save_vmstate_ext(Monitor *mon, const char *name)
     int saved_vm_running = 0;
     Error *local_err = NULL;
     char snapshot_file[PATH_MAX] = {};
+    char ram_file[PATH_MAX] = {};
     char command[PATH_MAX] = {};
 
     if(isNumber(name)){
@@ -428,26 +482,36 @@ int save_vmstate_ext(Monitor *mon, const char *name)
         monitor_printf(mon, "overwriting snapshot directory %s\n", name);
         remove(snapshot_file);
     }
-    ret = link(bs->filename, snapshot_file);
-    if (ret < 0) {
-        monitor_printf(mon, "Cannot save snapshot %s\n", name);
-        goto end;
-    }
-    ret = unlink(bs->filename);
-    if (ret < 0) {
-        monitor_printf(mon, "Cannot save snapshot %s\n", name);
-        goto end;
-    }
+    if (bdrv_is_ramoverlay(bs)) {
+        /* Only now do the writes since the last snapshot reach the disk */
+        ret = ramoverlay_commit(bs, snapshot_file, &local_err);
+        if (ret < 0) {
+            error_report_err(local_err);
+            monitor_printf(mon, "Cannot save snapshot %s\n", name);
+            goto end;
+        }
+    } else {
+        ret = link(bs->filename, snapshot_file);
+        if (ret < 0) {
+            monitor_printf(mon, "Cannot save snapshot %s\n", name);
+            goto end;
+        }
+        ret = unlink(bs->filename);
+        if (ret < 0) {
+            monitor_printf(mon, "Cannot save snapshot %s\n", name);
+            goto end;
+        }
 
-    memset(bs->filename, 0, PATH_MAX);
-    memset(bs->exact_filename, 0, PATH_MAX);
-    strcpy(bs->filename, snapshot_file);
-    strcpy(bs->exact_filename, snapshot_file);
+        memset(bs->filename, 0, PATH_MAX);
+        memset(bs->exact_filename, 0, PATH_MAX);
+        strcpy(bs->filename, snapshot_file);
+        strcpy(bs->exact_filename, snapshot_file);
 
-    ret = create_tmp_overlay();
-    if (ret < 0) {
-        monitor_printf(mon, "Cannot create temporary overlay %s\n", name);
-        goto end;
+        ret = create_tmp_overlay();
+        if (ret < 0) {
+            monitor_printf(mon, "Cannot create temporary overlay %s\n", name);
+            goto end;
+        }
     }
 
     saved_vm_running = runstate_is_running();
@@ -491,7 +555,15 @@ int save_vmstate_ext(Monitor *mon, const char *name)
         goto end;
     }
 
+    sprintf(ram_file, "%s/ram", snap_dir->string);
+    if (migrate_use_seekable_ram()) {
+        ram_file_set_target(ram_file);
+    } else {
+        /* A stale RAM file would shadow the pages in the stream on load */
+        unlink(ram_file);
+    }
     ret = qemu_savevm_state(f, &local_err);
+    ram_file_set_target(NULL);
     if (ret < 0) {
         error_report_err(local_err);
         goto end;
@@ -561,9 +633,24 @@ static int load_state_ext(QString *dir_path)
     QEMUFile *f;
     int ret = -EINVAL;
     char command[NAME_MAX] = {};
+    char ram_file[PATH_MAX] = {};
     Error *local_err = NULL;
     MigrationIncomingState *mis = migration_incoming_get_current();
 
+    /*
+     * Device state may refer to guest memory while loading (e.g. virtio
+     * rings), so the RAM file has to be read before the state stream.
+     */
+    sprintf(ram_file, "%s/ram", dir_path->string);
+    if (access(ram_file, F_OK) == 0) {
+        ret = ram_file_load(ram_file, migrate_ram_file_threads(),
+                            migrate_ram_file_share(), &local_err);
+        if (ret < 0) {
+            error_report_err(local_err);
+            goto end;
+        }
+    }
+
     sprintf(command, "%s %s/mem", input_command, dir_path->string);
     const char *argv[] = { "/bin/sh", "-c", command, NULL };
 
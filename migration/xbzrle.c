@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,8 +25,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,6 +127,242 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/*
+ * Vectorized encoders.  They find the end of each zrun and nzrun with
+ * byte compares over a whole vector and produce exactly the same output
+ * as xbzrle_encode_buffer_int.
+ *
+ * A run finder returns the index of the first byte at or after @i that
+ * ends the current run: the first changed byte for a zrun, the first
+ * unchanged byte for an nzrun, or @slen.
+ */
+typedef int (*XBZRLERunFn)(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int i, int slen, bool zrun);
+
+static inline int xbzrle_encode_vector(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen,
+                                       XBZRLERunFn find_run_end)
+{
+    int d = 0, i = 0, end;
+    uint32_t zrun_len, nzrun_len;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        end = find_run_end(old_buf, new_buf, i, slen, true);
+        zrun_len = end - i;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (end == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+        i = end;
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        end = find_run_end(old_buf, new_buf, i, slen, false);
+        nzrun_len = end - i;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i = end;
+    }
+
+    return d;
+}
+
+static inline int xbzrle_run_end_tail(const uint8_t *old_buf,
+                                      const uint8_t *new_buf,
+                                      int i, int slen, bool zrun)
+{
+    while (i < slen && (old_buf[i] == new_buf[i]) == zrun) {
+        i++;
+    }
+    return i;
+}
+
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+static int xbzrle_run_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen, bool zrun)
+{
+    /* Flip the compare result so that the bytes ending the run are set */
+    uint32_t flip = zrun ? 0xffff : 0;
+
+    for (; i + 16 <= slen; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(new_buf + i));
+        uint32_t stop = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ flip;
+
+        if (stop) {
+            return i + ctz32(stop);
+        }
+    }
+    return xbzrle_run_end_tail(old_buf, new_buf, i, slen, zrun);
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_vector(old_buf, new_buf, slen, dst, dlen,
+                                xbzrle_run_end_sse2);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int xbzrle_run_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen, bool zrun)
+{
+    uint32_t flip = zrun ? 0xffffffff : 0;
+
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        uint32_t stop = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) ^ flip;
+
+        if (stop) {
+            return i + ctz32(stop);
+        }
+    }
+    return xbzrle_run_end_tail(old_buf, new_buf, i, slen, zrun);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_vector(old_buf, new_buf, slen, dst, dlen,
+                                xbzrle_run_end_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+/* Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_SSE2    2
+
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ACCEL xbzrle_encode_buffer_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL xbzrle_encode_buffer_sse2
+#endif
+
+typedef int (*XBZRLEEncodeFn)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen);
+
+static unsigned cpuid_cache = INIT_CACHE;
+static XBZRLEEncodeFn encode_accel = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    XBZRLEEncodeFn fn = xbzrle_encode_buffer_int;
+
+    if (cache & CACHE_SSE2) {
+        fn = xbzrle_encode_buffer_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+    encode_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_buffer_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#else
+#define encode_accel xbzrle_encode_buffer_int
+bool test_xbzrle_encode_next_accel(void)
+{
+    return false;
+}
+#endif
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -114,6 +114,7 @@
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "qemu/thread.h"
+#include "sysemu/iothread.h"
 #include "block/qapi.h"
 #include "qapi/qmp-event.h"
 #include "qapi-event.h"
@@ -214,6 +215,17 @@ typedef struct {
      * mode.
      */
     QmpCommandList *commands;
+    bool capab_offered[QMP_CAPABILITY__MAX]; /* capabilities offered */
+    bool capab[QMP_CAPABILITY__MAX];         /* offered and accepted */
+    /*
+     * With MONITOR_USE_OOB, input is parsed in the monitor I/O thread.
+     * In-band requests wait in @qmp_requests for the dispatcher in the
+     * main loop, and responses wait in @qmp_responses for the I/O
+     * thread to write them out.  @qmp_queue_lock protects both.
+     */
+    QemuMutex qmp_queue_lock;
+    GQueue *qmp_requests;
+    GQueue *qmp_responses;
 } MonitorQMP;
 
 /*
@@ -253,19 +265,51 @@ struct Monitor {
     void *password_opaque;
     mon_cmd_t *cmd_table;
     QLIST_HEAD(,mon_fd_t) fds;
-    QLIST_ENTRY(Monitor) entry;
+    QTAILQ_ENTRY(Monitor) entry;
 };
 
 /* QMP checker flags */
 #define QMP_ACCEPT_UNKNOWNS 1
 
+/*
+ * Maximum number of in-band requests that a monitor queues.  When the
+ * queue is full, the I/O thread stops reading from that monitor until
+ * the dispatcher catches up.
+ */
+#define QMP_REQ_QUEUE_LEN_MAX 8
+
+typedef struct QMPRequest {
+    Monitor *mon;
+    QObject *req;
+    QObject *id;
+    int64_t queued_at;  /* get_clock() when the request was queued */
+} QMPRequest;
+
+/* Shared by all monitors created with MONITOR_USE_OOB */
+typedef struct {
+    IOThread *mon_iothread;     /* reads and writes their chardevs */
+    QEMUBH *qmp_dispatcher_bh;  /* runs in-band requests in the main loop */
+    QEMUBH *qmp_respond_bh;     /* flushes responses in mon_iothread */
+} MonitorGlobal;
+
+static MonitorGlobal mon_global;
+
 /* Protects mon_list, monitor_event_state.  */
 static QemuMutex monitor_lock;
 
-static QLIST_HEAD(mon_list, Monitor) mon_list;
+static QTAILQ_HEAD(mon_list, Monitor) mon_list =
+    QTAILQ_HEAD_INITIALIZER(mon_list);
 static QLIST_HEAD(mon_fdsets, MonFdset) mon_fdsets;
+/* Updated atomically, QMP monitors can open in the monitor I/O thread */
 static int mon_refcount;
 
+/* Protects qmp_cmd_stats, which maps command names to QmpCommandStats */
+static QemuMutex qmp_stats_lock;
+static GHashTable *qmp_cmd_stats;
+
+/* Blocks x-oob-test with @lock until an x-oob-test without it */
+static QemuSemaphore x_oob_test_sem;
+
 static mon_cmd_t mon_cmds[];
 static mon_cmd_t info_cmds[];
 
@@ -294,6 +338,14 @@ bool monitor_cur_is_qmp(void)
     return cur_mon && monitor_is_qmp(cur_mon);
 }
 
+/**
+ * Is @mon served by the monitor I/O thread?
+ */
+static inline bool monitor_uses_oob(const Monitor *mon)
+{
+    return mon->flags & MONITOR_USE_OOB;
+}
+
 void monitor_read_command(Monitor *mon, int show_prompt)
 {
     if (!mon->rs)
@@ -437,11 +489,51 @@ static void monitor_json_emitter(Monitor *mon, const QObject *data)
     assert(json != NULL);
 
     qstring_append_chr(json, '\n');
+
+    if (monitor_uses_oob(mon)) {
+        /* The chardev belongs to the I/O thread, let it do the writing */
+        qemu_mutex_lock(&mon->qmp.qmp_queue_lock);
+        g_queue_push_tail(mon->qmp.qmp_responses, json);
+        qemu_mutex_unlock(&mon->qmp.qmp_queue_lock);
+        qemu_bh_schedule(mon_global.qmp_respond_bh);
+        return;
+    }
+
     monitor_puts(mon, qstring_get_str(json));
 
     QDECREF(json);
 }
 
+static void monitor_qmp_response_flush(Monitor *mon)
+{
+    QString *json;
+
+    for (;;) {
+        qemu_mutex_lock(&mon->qmp.qmp_queue_lock);
+        json = g_queue_pop_head(mon->qmp.qmp_responses);
+        qemu_mutex_unlock(&mon->qmp.qmp_queue_lock);
+        if (!json) {
+            break;
+        }
+        monitor_puts(mon, qstring_get_str(json));
+        QDECREF(json);
+    }
+}
+
+/* Runs in the monitor I/O thread */
+static void monitor_qmp_bh_responder(void *opaque)
+{
+    Monitor *mon;
+
+    qemu_mutex_lock(&monitor_lock);
+    QTAILQ_FOREACH(mon, &mon_list, entry) {
+        if (monitor_uses_oob(mon)) {
+            monitor_qmp_response_flush(mon);
+        }
+    }
+    qemu_mutex_unlock(&monitor_lock);
+}
+
 static MonitorQAPIEventConf monitor_qapi_event_conf[QAPI_EVENT__MAX] = {
     /* Limit guest-triggerable events to 1 per second */
     [QAPI_EVENT_RTC_CHANGE]        = { 1000 * SCALE_MS },
@@ -463,7 +555,7 @@ static void monitor_qapi_event_emit(QAPIEvent event, QDict *qdict)
     Monitor *mon;
 
     trace_monitor_protocol_event_emit(event, qdict);
-    QLIST_FOREACH(mon, &mon_list, entry) {
+    QTAILQ_FOREACH(mon, &mon_list, entry) {
         if (monitor_is_qmp(mon)
             && mon->qmp.commands != &qmp_cap_negotiation_commands) {
             monitor_json_emitter(mon, QOBJECT(qdict));
@@ -615,6 +707,7 @@ static void monitor_qapi_event_init(void)
 }
 
 static void handle_hmp_command(Monitor *mon, const char *cmdline);
+static void monitor_qmp_cleanup_queues(Monitor *mon);
 
 static void monitor_data_init(Monitor *mon)
 {
@@ -630,6 +723,10 @@ static void monitor_data_destroy(Monitor *mon)
     qemu_chr_fe_deinit(&mon->chr, false);
     if (monitor_is_qmp(mon)) {
         json_message_parser_destroy(&mon->qmp.parser);
+        monitor_qmp_cleanup_queues(mon);
+        g_queue_free(mon->qmp.qmp_requests);
+        g_queue_free(mon->qmp.qmp_responses);
+        qemu_mutex_destroy(&mon->qmp.qmp_queue_lock);
     }
     g_free(mon->rs);
     QDECREF(mon->outbuf);
@@ -1072,10 +1169,15 @@ void monitor_init_qmp_commands(void)
     QTAILQ_INIT(&qmp_cap_negotiation_commands);
     qmp_register_command(&qmp_cap_negotiation_commands, "qmp_capabilities",
                          qmp_marshal_qmp_capabilities, QCO_NO_OPTIONS);
+
+    qmp_cmd_stats = g_hash_table_new(g_str_hash, g_str_equal);
 }
 
-void qmp_qmp_capabilities(Error **errp)
+void qmp_qmp_capabilities(bool has_enable, QMPCapabilityList *enable,
+                          Error **errp)
 {
+    QMPCapabilityList *cap;
+
     if (cur_mon->qmp.commands == &qmp_commands) {
         error_set(errp, ERROR_CLASS_COMMAND_NOT_FOUND,
                   "Capabilities negotiation is already complete, command "
@@ -1083,9 +1185,53 @@ void qmp_qmp_capabilities(Error **errp)
         return;
     }
 
+    for (cap = has_enable ? enable : NULL; cap; cap = cap->next) {
+        if (!cur_mon->qmp.capab_offered[cap->value]) {
+            error_setg(errp, "Capability '%s' is not available",
+                       QMPCapability_str(cap->value));
+            return;
+        }
+    }
+    for (cap = has_enable ? enable : NULL; cap; cap = cap->next) {
+        cur_mon->qmp.capab[cap->value] = true;
+    }
+
     cur_mon->qmp.commands = &qmp_commands;
 }
 
+QmpCommandStatsList *qmp_query_qmp_stats(Error **errp)
+{
+    QmpCommandStatsList *head = NULL, *entry;
+    QmpCommandStats *stats, *info;
+    GHashTableIter iter;
+    gpointer value;
+
+    qemu_mutex_lock(&qmp_stats_lock);
+    g_hash_table_iter_init(&iter, qmp_cmd_stats);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        stats = value;
+        info = g_memdup(stats, sizeof(*stats));
+        info->name = g_strdup(stats->name);
+
+        entry = g_new0(QmpCommandStatsList, 1);
+        entry->value = info;
+        entry->next = head;
+        head = entry;
+    }
+    qemu_mutex_unlock(&qmp_stats_lock);
+
+    return head;
+}
+
+void qmp_x_oob_test(bool lock, Error **errp)
+{
+    if (lock) {
+        qemu_sem_wait(&x_oob_test_sem);
+    } else {
+        qemu_sem_post(&x_oob_test_sem);
+    }
+}
+
 /* set the current CPU defined by the user */
 int monitor_set_cpu(int cpu_index)
 {
@@ -2078,7 +2224,8 @@ static void monitor_fdset_cleanup(MonFdset *mon_fdset)
 
     QLIST_FOREACH_SAFE(mon_fdset_fd, &mon_fdset->fds, next, mon_fdset_fd_next) {
         if ((mon_fdset_fd->removed ||
-                (QLIST_EMPTY(&mon_fdset->dup_fds) && mon_refcount == 0)) &&
+                (QLIST_EMPTY(&mon_fdset->dup_fds) &&
+                 atomic_read(&mon_refcount) == 0)) &&
                 runstate_is_running()) {
             close(mon_fdset_fd->fd);
             g_free(mon_fdset_fd->opaque);
@@ -3892,14 +4039,203 @@ static int monitor_can_read(void *opaque)
 {
     Monitor *mon = opaque;
 
-    return (mon->suspend_cnt == 0) ? 1 : 0;
+    return (atomic_mb_read(&mon->suspend_cnt) == 0) ? 1 : 0;
+}
+
+/*
+ * Account one execution of the command that @req names.  Requests for
+ * commands that do not exist are not counted, so that clients cannot
+ * grow the table without bound.
+ */
+static void monitor_qmp_account(QmpCommandList *cmds, QObject *req, bool oob,
+                                int64_t exec_ns, int64_t queued_ns)
+{
+    QDict *qdict = qobject_to_qdict(req);
+    const char *name = NULL;
+    QmpCommand *cmd = NULL;
+    QmpCommandStats *stats;
+
+    if (qdict) {
+        name = qdict_get_try_str(qdict, oob ? "exec-oob" : "execute");
+    }
+    if (name) {
+        cmd = qmp_find_command(cmds, name);
+    }
+    if (!cmd) {
+        return;
+    }
+
+    qemu_mutex_lock(&qmp_stats_lock);
+    stats = g_hash_table_lookup(qmp_cmd_stats, cmd->name);
+    if (!stats) {
+        stats = g_new0(QmpCommandStats, 1);
+        stats->name = g_strdup(cmd->name);
+        g_hash_table_insert(qmp_cmd_stats, stats->name, stats);
+    }
+    stats->count++;
+    if (oob) {
+        stats->oob_count++;
+    }
+    stats->total_ns += exec_ns;
+    stats->max_ns = MAX(stats->max_ns, exec_ns);
+    stats->queued_ns += queued_ns;
+    qemu_mutex_unlock(&qmp_stats_lock);
+}
+
+/*
+ * Send @rsp, or an error response built from @err if it is set, with
+ * the request's @id.  Takes ownership of @rsp, @err and @id.
+ */
+static void monitor_qmp_respond(Monitor *mon, QObject *rsp, Error *err,
+                                QObject *id)
+{
+    QDict *qdict;
+
+    if (err) {
+        assert(!rsp);
+        qdict = qdict_new();
+        qdict_put_obj(qdict, "error", qmp_build_error_object(err));
+        error_free(err);
+        rsp = QOBJECT(qdict);
+    }
+
+    if (rsp) {
+        if (id) {
+            qdict_put_obj(qobject_to_qdict(rsp), "id", id);
+            id = NULL;
+        }
+
+        monitor_json_emitter(mon, rsp);
+    }
+
+    qobject_decref(id);
+    qobject_decref(rsp);
+}
+
+/*
+ * Execute @req and respond to it.  Out-of-band requests run in the
+ * monitor I/O thread without the BQL, so they leave cur_mon alone: it
+ * belongs to the main loop.  Takes ownership of @req and @id.
+ */
+static void monitor_qmp_dispatch_one(Monitor *mon, QObject *req, QObject *id,
+                                     bool oob, int64_t queued_ns)
+{
+    QmpCommandList *cmds = mon->qmp.commands;
+    Monitor *old_mon;
+    QObject *rsp;
+    QDict *error;
+    int64_t start;
+
+    start = get_clock();
+    if (oob) {
+        rsp = qmp_dispatch(cmds, req);
+    } else {
+        old_mon = cur_mon;
+        cur_mon = mon;
+        rsp = qmp_dispatch(cmds, req);
+        cur_mon = old_mon;
+    }
+    monitor_qmp_account(cmds, req, oob, get_clock() - start, queued_ns);
+
+    if (cmds == &qmp_cap_negotiation_commands) {
+        error = qdict_get_qdict(qobject_to_qdict(rsp), "error");
+        if (error
+            && !g_strcmp0(qdict_get_try_str(error, "class"),
+                    QapiErrorClass_str(ERROR_CLASS_COMMAND_NOT_FOUND))) {
+            /* Provide a more useful error message */
+            qdict_del(error, "desc");
+            qdict_put_str(error, "desc", "Expecting capabilities negotiation"
+                          " with 'qmp_capabilities'");
+        }
+    }
+
+    monitor_qmp_respond(mon, rsp, NULL, id);
+    qobject_decref(req);
+}
+
+/*
+ * Pop an in-band request from the first monitor that has one, and move
+ * that monitor to the end of the list so that a busy monitor cannot
+ * starve the others.  When that makes room in a full queue, let the I/O
+ * thread read again.
+ */
+static QMPRequest *monitor_qmp_requests_pop_any(void)
+{
+    QMPRequest *req_obj = NULL;
+    Monitor *mon;
+
+    qemu_mutex_lock(&monitor_lock);
+    QTAILQ_FOREACH(mon, &mon_list, entry) {
+        if (!monitor_uses_oob(mon)) {
+            continue;
+        }
+        qemu_mutex_lock(&mon->qmp.qmp_queue_lock);
+        req_obj = g_queue_pop_head(mon->qmp.qmp_requests);
+        if (req_obj && g_queue_get_length(mon->qmp.qmp_requests) ==
+                       QMP_REQ_QUEUE_LEN_MAX - 1) {
+            atomic_dec(&mon->suspend_cnt);
+            g_main_context_wakeup(
+                iothread_get_g_main_context(mon_global.mon_iothread));
+        }
+        qemu_mutex_unlock(&mon->qmp.qmp_queue_lock);
+        if (req_obj) {
+            break;
+        }
+    }
+    if (req_obj) {
+        QTAILQ_REMOVE(&mon_list, mon, entry);
+        QTAILQ_INSERT_TAIL(&mon_list, mon, entry);
+    }
+    qemu_mutex_unlock(&monitor_lock);
+
+    return req_obj;
+}
+
+/* Runs in the main loop, with the BQL held */
+static void monitor_qmp_bh_dispatcher(void *opaque)
+{
+    QMPRequest *req_obj = monitor_qmp_requests_pop_any();
+
+    if (!req_obj) {
+        return;
+    }
+
+    monitor_qmp_dispatch_one(req_obj->mon, req_obj->req, req_obj->id, false,
+                             get_clock() - req_obj->queued_at);
+    g_free(req_obj);
+
+    /* One request per iteration, so that the main loop keeps running */
+    qemu_bh_schedule(mon_global.qmp_dispatcher_bh);
+}
+
+/* Drop whatever @mon still has queued, e.g. when its client went away */
+static void monitor_qmp_cleanup_queues(Monitor *mon)
+{
+    QMPRequest *req_obj;
+    QString *json;
+
+    qemu_mutex_lock(&mon->qmp.qmp_queue_lock);
+    if (g_queue_get_length(mon->qmp.qmp_requests) == QMP_REQ_QUEUE_LEN_MAX) {
+        atomic_dec(&mon->suspend_cnt);
+    }
+    while ((req_obj = g_queue_pop_head(mon->qmp.qmp_requests))) {
+        qobject_decref(req_obj->req);
+        qobject_decref(req_obj->id);
+        g_free(req_obj);
+    }
+    while ((json = g_queue_pop_head(mon->qmp.qmp_responses))) {
+        QDECREF(json);
+    }
+    qemu_mutex_unlock(&mon->qmp.qmp_queue_lock);
 }
 
 static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
 {
-    QObject *req, *rsp = NULL, *id = NULL;
+    QObject *req, *id = NULL;
     QDict *qdict = NULL;
-    Monitor *mon = cur_mon;
+    MonitorQMP *mon_qmp = container_of(parser, MonitorQMP, parser);
+    Monitor *mon = container_of(mon_qmp, Monitor, qmp);
+    QMPRequest *req_obj;
     Error *err = NULL;
 
     req = json_parser_parse_err(tokens, NULL, &err);
@@ -3908,7 +4244,9 @@ static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
         error_setg(&err, QERR_JSON_PARSING);
     }
     if (err) {
-        goto err_out;
+        monitor_qmp_respond(mon, NULL, err, NULL);
+        qobject_decref(req);
+        return;
     }
 
     qdict = qobject_to_qdict(req);
@@ -3924,51 +4262,51 @@ static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
         QDECREF(req_json);
     }
 
-    rsp = qmp_dispatch(cur_mon->qmp.commands, req);
-
-    if (mon->qmp.commands == &qmp_cap_negotiation_commands) {
-        qdict = qdict_get_qdict(qobject_to_qdict(rsp), "error");
-        if (qdict
-            && !g_strcmp0(qdict_get_try_str(qdict, "class"),
-                    QapiErrorClass_str(ERROR_CLASS_COMMAND_NOT_FOUND))) {
-            /* Provide a more useful error message */
-            qdict_del(qdict, "desc");
-            qdict_put_str(qdict, "desc", "Expecting capabilities negotiation"
-                          " with 'qmp_capabilities'");
+    if (qdict && qmp_is_oob(qdict)) {
+        if (!mon->qmp.capab[QMP_CAPABILITY_OOB]) {
+            error_setg(&err, "Out-of-band execution requires the 'oob' "
+                       "capability");
+        } else if (!id) {
+            error_setg(&err, "Out-of-band commands require an 'id'");
+        }
+        if (err) {
+            monitor_qmp_respond(mon, NULL, err, id);
+            qobject_decref(req);
+            return;
         }
+        /* Jump the queue and run it right here, in the I/O thread */
+        monitor_qmp_dispatch_one(mon, req, id, true, 0);
+        return;
     }
 
-err_out:
-    if (err) {
-        qdict = qdict_new();
-        qdict_put_obj(qdict, "error", qmp_build_error_object(err));
-        error_free(err);
-        rsp = QOBJECT(qdict);
+    if (!monitor_uses_oob(mon)) {
+        /* We are in the main loop already */
+        monitor_qmp_dispatch_one(mon, req, id, false, 0);
+        return;
     }
 
-    if (rsp) {
-        if (id) {
-            qdict_put_obj(qobject_to_qdict(rsp), "id", id);
-            id = NULL;
-        }
+    req_obj = g_new0(QMPRequest, 1);
+    req_obj->mon = mon;
+    req_obj->req = req;
+    req_obj->id = id;
+    req_obj->queued_at = get_clock();
 
-        monitor_json_emitter(mon, rsp);
+    qemu_mutex_lock(&mon->qmp.qmp_queue_lock);
+    g_queue_push_tail(mon->qmp.qmp_requests, req_obj);
+    if (g_queue_get_length(mon->qmp.qmp_requests) == QMP_REQ_QUEUE_LEN_MAX) {
+        /* Stop reading until the dispatcher pops one */
+        atomic_inc(&mon->suspend_cnt);
     }
+    qemu_mutex_unlock(&mon->qmp.qmp_queue_lock);
 
-    qobject_decref(id);
-    qobject_decref(rsp);
-    qobject_decref(req);
+    qemu_bh_schedule(mon_global.qmp_dispatcher_bh);
 }
 
 static void monitor_qmp_read(void *opaque, const uint8_t *buf, int size)
 {
-    Monitor *old_mon = cur_mon;
-
-    cur_mon = opaque;
-
-    json_message_parser_feed(&cur_mon->qmp.parser, (const char *) buf, size);
+    Monitor *mon = opaque;
 
-    cur_mon = old_mon;
+    json_message_parser_feed(&mon->qmp.parser, (const char *) buf, size);
 }
 
 static void monitor_read(void *opaque, const uint8_t *buf, int size)
@@ -4017,14 +4355,35 @@ void monitor_resume(Monitor *mon)
         readline_show_prompt(mon->rs);
 }
 
-static QObject *get_qmp_greeting(void)
+static QObject *get_qmp_greeting(Monitor *mon)
 {
+    QList *cap_list = qlist_new();
     QObject *ver = NULL;
+    QMPCapability cap;
 
     qmp_marshal_query_version(NULL, &ver, NULL);
 
-    return qobject_from_jsonf("{'QMP': {'version': %p, 'capabilities': []}}",
-                              ver);
+    for (cap = 0; cap < QMP_CAPABILITY__MAX; cap++) {
+        if (mon->qmp.capab_offered[cap]) {
+            qlist_append_str(cap_list, QMPCapability_str(cap));
+        }
+    }
+
+    return qobject_from_jsonf("{'QMP': {'version': %p, 'capabilities': %p}}",
+                              ver, cap_list);
+}
+
+static void monitor_qmp_caps_reset(Monitor *mon)
+{
+    memset(mon->qmp.capab_offered, 0, sizeof(mon->qmp.capab_offered));
+    memset(mon->qmp.capab, 0, sizeof(mon->qmp.capab));
+    mon->qmp.capab_offered[QMP_CAPABILITY_OOB] = monitor_uses_oob(mon);
+}
+
+static void monitor_qmp_closed_bh(void *opaque)
+{
+    atomic_dec(&mon_refcount);
+    monitor_fdsets_cleanup();
 }
 
 static void monitor_qmp_event(void *opaque, int event)
@@ -4035,16 +4394,23 @@ static void monitor_qmp_event(void *opaque, int event)
     switch (event) {
     case CHR_EVENT_OPENED:
         mon->qmp.commands = &qmp_cap_negotiation_commands;
-        data = get_qmp_greeting();
+        monitor_qmp_caps_reset(mon);
+        data = get_qmp_greeting(mon);
         monitor_json_emitter(mon, data);
         qobject_decref(data);
-        mon_refcount++;
+        atomic_inc(&mon_refcount);
         break;
     case CHR_EVENT_CLOSED:
+        monitor_qmp_cleanup_queues(mon);
         json_message_parser_destroy(&mon->qmp.parser);
         json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
-        mon_refcount--;
-        monitor_fdsets_cleanup();
+        if (monitor_uses_oob(mon)) {
+            /* We may be in the I/O thread; fd sets need the main loop */
+            aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                    monitor_qmp_closed_bh, NULL);
+        } else {
+            monitor_qmp_closed_bh(NULL);
+        }
         break;
     }
 }
@@ -4090,11 +4456,11 @@ static void monitor_event(void *opaque, int event)
             readline_show_prompt(mon->rs);
         }
         mon->reset_seen = 1;
-        mon_refcount++;
+        atomic_inc(&mon_refcount);
         break;
 
     case CHR_EVENT_CLOSED:
-        mon_refcount--;
+        atomic_dec(&mon_refcount);
         monitor_fdsets_cleanup();
         break;
     }
@@ -4162,6 +4528,23 @@ void error_vprintf_unless_qmp(const char *fmt, va_list ap)
 static void __attribute__((constructor)) monitor_lock_init(void)
 {
     qemu_mutex_init(&monitor_lock);
+    qemu_mutex_init(&qmp_stats_lock);
+    qemu_sem_init(&x_oob_test_sem, 0);
+}
+
+static void monitor_iothread_init(void)
+{
+    if (mon_global.mon_iothread) {
+        return;
+    }
+
+    mon_global.mon_iothread = iothread_create("mon_iothread", &error_abort);
+    mon_global.qmp_dispatcher_bh = aio_bh_new(qemu_get_aio_context(),
+                                              monitor_qmp_bh_dispatcher,
+                                              NULL);
+    mon_global.qmp_respond_bh =
+        aio_bh_new(iothread_get_aio_context(mon_global.mon_iothread),
+                   monitor_qmp_bh_responder, NULL);
 }
 
 void monitor_init(Chardev *chr, int flags)
@@ -4189,31 +4572,60 @@ void monitor_init(Chardev *chr, int flags)
     }
 
     if (monitor_is_qmp(mon)) {
+        GMainContext *context = NULL;
+
+        qemu_mutex_init(&mon->qmp.qmp_queue_lock);
+        mon->qmp.qmp_requests = g_queue_new();
+        mon->qmp.qmp_responses = g_queue_new();
+        json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
+        if (monitor_uses_oob(mon)) {
+            monitor_iothread_init();
+            context = iothread_get_g_main_context(mon_global.mon_iothread);
+        }
         qemu_chr_fe_set_handlers(&mon->chr, monitor_can_read, monitor_qmp_read,
-                                 monitor_qmp_event, NULL, mon, NULL, true);
+                                 monitor_qmp_event, NULL, mon, context, true);
         qemu_chr_fe_set_echo(&mon->chr, true);
-        json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
     } else {
         qemu_chr_fe_set_handlers(&mon->chr, monitor_can_read, monitor_read,
                                  monitor_event, NULL, mon, NULL, true);
     }
 
     qemu_mutex_lock(&monitor_lock);
-    QLIST_INSERT_HEAD(&mon_list, mon, entry);
+    QTAILQ_INSERT_HEAD(&mon_list, mon, entry);
     qemu_mutex_unlock(&monitor_lock);
+
+    if (monitor_uses_oob(mon)) {
+        /* The greeting may be queued already */
+        qemu_bh_schedule(mon_global.qmp_respond_bh);
+    }
 }
 
 void monitor_cleanup(void)
 {
     Monitor *mon, *next;
 
+    /* Nothing may touch the monitors' chardevs while they go away */
+    if (mon_global.mon_iothread) {
+        iothread_stop(mon_global.mon_iothread);
+    }
+
     qemu_mutex_lock(&monitor_lock);
-    QLIST_FOREACH_SAFE(mon, &mon_list, entry, next) {
-        QLIST_REMOVE(mon, entry);
+    QTAILQ_FOREACH_SAFE(mon, &mon_list, entry, next) {
+        QTAILQ_REMOVE(&mon_list, mon, entry);
+        if (monitor_uses_oob(mon)) {
+            monitor_qmp_response_flush(mon);
+        }
         monitor_data_destroy(mon);
         g_free(mon);
     }
     qemu_mutex_unlock(&monitor_lock);
+
+    if (mon_global.mon_iothread) {
+        qemu_bh_delete(mon_global.qmp_dispatcher_bh);
+        qemu_bh_delete(mon_global.qmp_respond_bh);
+        iothread_destroy(mon_global.mon_iothread);
+        mon_global.mon_iothread = NULL;
+    }
 }
 
 QemuOptsList qemu_mon_opts = {
@@ -4233,6 +4645,9 @@ QemuOptsList qemu_mon_opts = {
         },{
             .name = "pretty",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "x-oob",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
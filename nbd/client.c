@@ -66,38 +66,6 @@
 #include "trace.h"
 #include "nbd-internal.h"
 
-static int nbd_errno_to_system_errno(int err)
-{
-    int ret;
-    switch (err) {
-    case NBD_SUCCESS:
-        ret = 0;
-        break;
-    case NBD_EPERM:
-        ret = EPERM;
-        break;
-    case NBD_EIO:
-        ret = EIO;
-        break;
-    case NBD_ENOMEM:
-        ret = ENOMEM;
-        break;
-    case NBD_ENOSPC:
-        ret = ENOSPC;
-        break;
-    case NBD_ESHUTDOWN:
-        ret = ESHUTDOWN;
-        break;
-    default:
-        trace_nbd_unknown_error(err);
-        /* fallthrough */
-    case NBD_EINVAL:
-        ret = EINVAL;
-        break;
-    }
-    return ret;
-}
-
 /* Definitions for opaque data types */
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -584,6 +552,144 @@ static int nbd_receive_query_exports(QIOChannel *ioc,
     }
 }
 
+/* Send an option that takes no payload and is answered by a plain
+ * NBD_REP_ACK.  Return -1 with errp set if it is impossible to continue,
+ * 0 if the server does not support the option, and 1 if it accepted it. */
+static int nbd_request_simple_option(QIOChannel *ioc, uint32_t opt,
+                                     Error **errp)
+{
+    nbd_opt_reply reply;
+    int error;
+
+    if (nbd_send_option_request(ioc, opt, 0, NULL, errp) < 0) {
+        return -1;
+    }
+
+    if (nbd_receive_option_reply(ioc, opt, &reply, errp) < 0) {
+        return -1;
+    }
+    error = nbd_handle_reply_err(ioc, &reply, errp);
+    if (error <= 0) {
+        return error;
+    }
+
+    if (reply.type != NBD_REP_ACK) {
+        error_setg(errp, "Server answered option %" PRIu32 " (%s) with "
+                   "unexpected reply %" PRIx32 " (%s)", opt,
+                   nbd_opt_lookup(opt), reply.type,
+                   nbd_rep_lookup(reply.type));
+        nbd_send_opt_abort(ioc);
+        return -1;
+    }
+    if (reply.length != 0) {
+        error_setg(errp, "Option %" PRIu32 " (%s) response length is %"
+                   PRIu32 " (it should be zero)", opt, nbd_opt_lookup(opt),
+                   reply.length);
+        nbd_send_opt_abort(ioc);
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Select the "base:allocation" metadata context of export @name with
+ * NBD_OPT_SET_META_CONTEXT, and store the context id the server picked
+ * in @info.  Return -1 with errp set if it is impossible to continue, 0
+ * if the server does not provide the context, and 1 on success. */
+static int nbd_negotiate_simple_meta_context(QIOChannel *ioc,
+                                             const char *name,
+                                             NBDExportInfo *info,
+                                             Error **errp)
+{
+    const char *context = NBD_META_BASE_ALLOCATION;
+    uint32_t namelen = strlen(name);
+    uint32_t contextlen = strlen(context);
+    uint32_t len = 4 + namelen + 4 + 4 + contextlen;
+    nbd_opt_reply reply;
+    bool received = false;
+    uint32_t id;
+    char *buf;
+    int error;
+
+    /* Client sends:
+        4 bytes: export name length
+        export name
+        4 bytes: number of queries (1)
+        4 bytes: query length
+        query (context name)
+     */
+    buf = g_malloc(len);
+    stl_be_p(buf, namelen);
+    memcpy(buf + 4, name, namelen);
+    stl_be_p(buf + 4 + namelen, 1);
+    stl_be_p(buf + 8 + namelen, contextlen);
+    memcpy(buf + 12 + namelen, context, contextlen);
+    error = nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT, len, buf,
+                                    errp);
+    g_free(buf);
+    if (error < 0) {
+        return -1;
+    }
+
+    while (1) {
+        char replyname[NBD_MAX_NAME_SIZE + 1];
+
+        if (nbd_receive_option_reply(ioc, NBD_OPT_SET_META_CONTEXT, &reply,
+                                     errp) < 0) {
+            return -1;
+        }
+        error = nbd_handle_reply_err(ioc, &reply, errp);
+        if (error <= 0) {
+            return error;
+        }
+
+        if (reply.type == NBD_REP_ACK) {
+            if (reply.length) {
+                error_setg(errp, "server sent invalid NBD_REP_ACK");
+                nbd_send_opt_abort(ioc);
+                return -1;
+            }
+            return received;
+        }
+        if (reply.type != NBD_REP_META_CONTEXT) {
+            error_setg(errp, "unexpected reply type %" PRIx32
+                       " (%s), expected %x",
+                       reply.type, nbd_rep_lookup(reply.type),
+                       NBD_REP_META_CONTEXT);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        if (reply.length != sizeof(id) + contextlen || received) {
+            error_setg(errp, "server sent an unexpected metadata context");
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+
+        if (nbd_read(ioc, &id, sizeof(id), errp) < 0) {
+            error_prepend(errp, "failed to read metadata context id");
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        id = be32_to_cpu(id);
+        if (nbd_read(ioc, replyname, contextlen, errp) < 0) {
+            error_prepend(errp, "failed to read metadata context name");
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        replyname[contextlen] = '\0';
+        if (strcmp(replyname, context)) {
+            error_setg(errp, "server selected unexpected metadata context "
+                       "'%s'", replyname);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+
+        trace_nbd_opt_meta_reply(replyname, id);
+        info->meta_base_allocation_id = id;
+        received = true;
+    }
+}
+
 static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
                                         QCryptoTLSCreds *tlscreds,
                                         const char *hostname, Error **errp)
@@ -652,9 +758,14 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name,
     uint64_t magic;
     int rc;
     bool zeroes = true;
+    bool structured_reply = info->structured_reply;
+    bool base_allocation = info->base_allocation;
 
     trace_nbd_receive_negotiate(tlscreds, hostname ? hostname : "<null>");
 
+    info->structured_reply = false;
+    info->base_allocation = false;
+
     rc = -EINVAL;
 
     if (outioc) {
@@ -735,6 +846,26 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name,
         if (fixedNewStyle) {
             int result;
 
+            if (structured_reply) {
+                result = nbd_request_simple_option(ioc,
+                                                   NBD_OPT_STRUCTURED_REPLY,
+                                                   errp);
+                if (result < 0) {
+                    goto fail;
+                }
+                info->structured_reply = result == 1;
+            }
+
+            /* Block status can only be reported with structured replies */
+            if (info->structured_reply && base_allocation) {
+                result = nbd_negotiate_simple_meta_context(ioc, name, info,
+                                                           errp);
+                if (result < 0) {
+                    goto fail;
+                }
+                info->base_allocation = result == 1;
+            }
+
             /* Try NBD_OPT_GO first - if it works, we are done (it
              * also gives us a good message if the server requires
              * TLS).  If it is not available, fall back to
@@ -959,28 +1090,58 @@ int nbd_send_request(QIOChannel *ioc, NBDRequest *request)
 }
 
 /* nbd_receive_reply
+ * Reads a simple reply or the header of a structured reply chunk; the
+ * payload of a chunk is left for the caller.
  * Returns 1 on success
  *         0 on eof, when no data was read (errp is not set)
  *         negative errno on failure (errp is set)
  */
 int nbd_receive_reply(QIOChannel *ioc, NBDReply *reply, Error **errp)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     int ret;
 
-    ret = nbd_read_eof(ioc, buf, sizeof(buf), errp);
+    ret = nbd_read_eof(ioc, buf, NBD_REPLY_SIZE, errp);
     if (ret <= 0) {
         return ret;
     }
 
+    magic = ldl_be_p(buf);
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags   (NBD_REPLY_FLAG_DONE, ...)
+           [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+           [ 8 .. 15]    handle
+           [16 .. 19]    length  (of the payload)
+         */
+        if (nbd_read(ioc, buf + NBD_REPLY_SIZE,
+                     NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE, errp) < 0) {
+            error_prepend(errp, "failed to read structured reply chunk: ");
+            return -EIO;
+        }
+
+        reply->structured = true;
+        reply->error  = 0;
+        reply->flags  = lduw_be_p(buf + 4);
+        reply->type   = lduw_be_p(buf + 6);
+        reply->handle = ldq_be_p(buf + 8);
+        reply->length = ldl_be_p(buf + 16);
+
+        trace_nbd_receive_structured_reply_chunk(
+            reply->flags, reply->type, nbd_reply_type_lookup(reply->type),
+            reply->handle, reply->length);
+        return 1;
+    }
+
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
 
-    magic = ldl_be_p(buf);
+    reply->structured = false;
     reply->error  = ldl_be_p(buf + 4);
     reply->handle = ldq_be_p(buf + 8);
 
@@ -1000,4 +1161,3 @@ int nbd_receive_reply(QIOChannel *ioc, NBDReply *reply, Error **errp)
 
     return 1;
 }
-
@@ -98,8 +98,17 @@ struct NBDClient {
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
+
+    bool structured_reply;
+    bool base_allocation; /* "base:allocation" context was selected */
 };
 
+/* Id of the "base:allocation" metadata context, our only one */
+#define NBD_META_ID_BASE_ALLOCATION 0
+
+/* Most extents in a single NBD_REPLY_TYPE_BLOCK_STATUS chunk */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 1024
+
 /* That's all folks */
 
 static void nbd_client_receive_next_request(NBDClient *client);
@@ -526,6 +535,139 @@ static int nbd_negotiate_handle_info(NBDClient *client, uint32_t length,
 }
 
 
+/* Handle NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.  The only
+ * context we provide is "base:allocation", which describes the result of
+ * bdrv_get_block_status() for the export.
+ * Return -errno on error, 0 if ready for next option. */
+static int nbd_negotiate_meta_queries(NBDClient *client, uint32_t length,
+                                      uint32_t opt, Error **errp)
+{
+    char name[NBD_MAX_NAME_SIZE + 1];
+    char query[NBD_MAX_NAME_SIZE + 1];
+    const char *context = NBD_META_BASE_ALLOCATION;
+    uint32_t namelen, nb_queries, len, id;
+    bool base_allocation = false;
+    bool match;
+    NBDExport *exp;
+    const char *msg;
+    int rc;
+
+    /* Client sends:
+        4 bytes: L, name length (can be 0)
+        L bytes: export name
+        4 bytes: N, number of queries (can be 0)
+        N times:
+            4 bytes: Q, query length
+            Q bytes: query
+    */
+    if (opt == NBD_OPT_SET_META_CONTEXT && !client->structured_reply) {
+        msg = "structured replies were not negotiated";
+        goto invalid;
+    }
+    if (length < sizeof(namelen) + sizeof(nb_queries)) {
+        msg = "overall request too short";
+        goto invalid;
+    }
+    if (nbd_read(client->ioc, &namelen, sizeof(namelen), errp) < 0) {
+        return -EIO;
+    }
+    be32_to_cpus(&namelen);
+    length -= sizeof(namelen);
+    if (namelen > NBD_MAX_NAME_SIZE || namelen > length - sizeof(nb_queries)) {
+        msg = "name length is incorrect";
+        goto invalid;
+    }
+    if (nbd_read(client->ioc, name, namelen, errp) < 0) {
+        return -EIO;
+    }
+    name[namelen] = '\0';
+    length -= namelen;
+
+    if (nbd_read(client->ioc, &nb_queries, sizeof(nb_queries), errp) < 0) {
+        return -EIO;
+    }
+    be32_to_cpus(&nb_queries);
+    length -= sizeof(nb_queries);
+    trace_nbd_negotiate_meta_context(nbd_opt_lookup(opt), name, nb_queries);
+
+    /* Listing without queries asks for everything we have */
+    if (opt == NBD_OPT_LIST_META_CONTEXT && !nb_queries) {
+        base_allocation = true;
+    }
+
+    while (nb_queries--) {
+        if (length < sizeof(len)) {
+            msg = "query length is incorrect";
+            goto invalid;
+        }
+        if (nbd_read(client->ioc, &len, sizeof(len), errp) < 0) {
+            return -EIO;
+        }
+        be32_to_cpus(&len);
+        length -= sizeof(len);
+        if (len > length) {
+            msg = "query length is incorrect";
+            goto invalid;
+        }
+        if (len >= sizeof(query)) {
+            /* Too long to be anything we know */
+            if (nbd_drop(client->ioc, len, errp) < 0) {
+                return -EIO;
+            }
+            length -= len;
+            continue;
+        }
+        if (nbd_read(client->ioc, query, len, errp) < 0) {
+            return -EIO;
+        }
+        query[len] = '\0';
+        length -= len;
+
+        match = !strcmp(query, context) ||
+                (opt == NBD_OPT_LIST_META_CONTEXT && !strcmp(query, "base:"));
+        trace_nbd_negotiate_meta_query(query, match);
+        base_allocation |= match;
+    }
+    if (length) {
+        msg = "trailing bytes after the last query";
+        goto invalid;
+    }
+
+    exp = nbd_export_find(name);
+    if (!exp) {
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_UNKNOWN,
+                                          opt, errp, "export '%s' not present",
+                                          name);
+    }
+
+    if (base_allocation) {
+        len = strlen(context);
+        rc = nbd_negotiate_send_rep_len(client->ioc, NBD_REP_META_CONTEXT, opt,
+                                        sizeof(id) + len, errp);
+        if (rc < 0) {
+            return rc;
+        }
+        id = cpu_to_be32(NBD_META_ID_BASE_ALLOCATION);
+        if (nbd_write(client->ioc, &id, sizeof(id), errp) < 0 ||
+            nbd_write(client->ioc, context, len, errp) < 0) {
+            return -EIO;
+        }
+    }
+
+    if (opt == NBD_OPT_SET_META_CONTEXT) {
+        client->base_allocation = base_allocation;
+    }
+
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt, errp);
+
+ invalid:
+    if (nbd_drop(client->ioc, length, errp) < 0) {
+        return -EIO;
+    }
+    return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID, opt,
+                                      errp, "%s", msg);
+}
+
 /* Handle NBD_OPT_STARTTLS. Return NULL to drop connection, or else the
  * new channel for all further (now-encrypted) communication. */
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
@@ -760,6 +902,43 @@ static int nbd_negotiate_options(NBDClient *client, uint16_t myflags,
                     return ret;
                 }
                 break;
+
+            case NBD_OPT_STRUCTURED_REPLY:
+                if (length) {
+                    if (nbd_drop(client->ioc, length, errp) < 0) {
+                        return -EIO;
+                    }
+                    ret = nbd_negotiate_send_rep_err(client->ioc,
+                                                     NBD_REP_ERR_INVALID,
+                                                     option, errp,
+                                                     "option '%s' should "
+                                                     "have zero length",
+                                                     nbd_opt_lookup(option));
+                } else if (client->structured_reply) {
+                    ret = nbd_negotiate_send_rep_err(client->ioc,
+                                                     NBD_REP_ERR_INVALID,
+                                                     option, errp,
+                                                     "structured reply "
+                                                     "already negotiated");
+                } else {
+                    ret = nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                                 option, errp);
+                    client->structured_reply = true;
+                }
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_meta_queries(client, length, option,
+                                                 errp);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             default:
                 if (nbd_drop(client->ioc, length, errp) < 0) {
                     return -EIO;
@@ -1240,6 +1419,269 @@ static int nbd_co_send_reply(NBDRequestData *req, NBDReply *reply, int len,
     return ret;
 }
 
+static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
+                                        unsigned niov, Error **errp)
+{
+    int ret;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
+static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
+                                uint16_t type, uint64_t handle, uint32_t length)
+{
+    stl_be_p(&chunk->magic, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(&chunk->flags, flags);
+    stw_be_p(&chunk->type, type);
+    stq_be_p(&chunk->handle, handle);
+    stl_be_p(&chunk->length, length);
+}
+
+static int coroutine_fn nbd_co_send_structured_done(NBDClient *client,
+                                                    uint64_t handle,
+                                                    Error **errp)
+{
+    NBDStructuredReplyChunk chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+    };
+
+    trace_nbd_co_send_structured_done(handle);
+    set_be_chunk(&chunk, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, handle, 0);
+
+    return nbd_co_send_iov(client, iov, 1, errp);
+}
+
+static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
+                                                    uint64_t handle,
+                                                    uint64_t offset,
+                                                    void *data,
+                                                    size_t size,
+                                                    bool final,
+                                                    Error **errp)
+{
+    NBDStructuredReadData chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+        {.iov_base = data, .iov_len = size}
+    };
+
+    assert(size);
+    trace_nbd_co_send_structured_read(handle, offset, size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                 sizeof(chunk) - sizeof(chunk.h) + size);
+    stq_be_p(&chunk.offset, offset);
+
+    return nbd_co_send_iov(client, iov, 2, errp);
+}
+
+static int coroutine_fn nbd_co_send_structured_hole(NBDClient *client,
+                                                    uint64_t handle,
+                                                    uint64_t offset,
+                                                    size_t size,
+                                                    bool final,
+                                                    Error **errp)
+{
+    NBDStructuredReadHole chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+    };
+
+    trace_nbd_co_send_structured_read_hole(handle, offset, size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_HOLE, handle,
+                 sizeof(chunk) - sizeof(chunk.h));
+    stq_be_p(&chunk.offset, offset);
+    stl_be_p(&chunk.length, size);
+
+    return nbd_co_send_iov(client, iov, 1, errp);
+}
+
+static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
+                                                     uint64_t handle,
+                                                     uint32_t error,
+                                                     Error **errp)
+{
+    NBDStructuredError chunk;
+    int nbd_err = system_errno_to_nbd_errno(error);
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+    };
+
+    assert(nbd_err);
+    trace_nbd_co_send_structured_error(handle, nbd_err);
+    set_be_chunk(&chunk.h, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, handle,
+                 sizeof(chunk) - sizeof(chunk.h));
+    stl_be_p(&chunk.error, nbd_err);
+    stw_be_p(&chunk.message_length, 0);
+
+    return nbd_co_send_iov(client, iov, 1, errp);
+}
+
+/* Find out how many bytes starting at @offset of @bs (at most @bytes) share
+ * the allocation status of the first one, and describe it as NBD_STATE_*
+ * flags in *@flags.  Return 0 on success, -errno on failure. */
+static int coroutine_fn nbd_co_block_status(BlockDriverState *bs,
+                                            uint64_t offset, uint32_t bytes,
+                                            uint32_t *pnum, uint32_t *flags)
+{
+    int64_t sector_num = offset >> BDRV_SECTOR_BITS;
+    uint32_t head = offset & (BDRV_SECTOR_SIZE - 1);
+    int nb_sectors = MIN(DIV_ROUND_UP((uint64_t)head + bytes,
+                                      BDRV_SECTOR_SIZE),
+                         BDRV_REQUEST_MAX_SECTORS);
+    BlockDriverState *file;
+    int64_t ret;
+    int n;
+
+    ret = bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors, &n,
+                                      &file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!n) {
+        /* Past the end of the image, let the read path deal with it */
+        *pnum = bytes;
+        *flags = 0;
+        return 0;
+    }
+
+    *pnum = MIN((uint64_t)n * BDRV_SECTOR_SIZE - head, bytes);
+    *flags = (ret & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+             (ret & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+    return 0;
+}
+
+/* Reply to NBD_CMD_READ with structured chunks, sending a hole chunk
+ * instead of data for every range that reads as zero.
+ * Return -errno on failure; if nothing was sent yet, the caller still
+ * has to send an error reply. */
+static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
+                                                uint64_t handle,
+                                                uint64_t offset,
+                                                uint8_t *data,
+                                                uint32_t size,
+                                                Error **errp)
+{
+    NBDExport *exp = client->exp;
+    uint32_t progress = 0;
+    int ret;
+
+    if (!size) {
+        return nbd_co_send_structured_done(client, handle, errp);
+    }
+
+    while (progress < size) {
+        uint32_t pnum, flags;
+        bool final;
+
+        ret = nbd_co_block_status(blk_bs(exp->blk),
+                                  offset + progress + exp->dev_offset,
+                                  size - progress, &pnum, &flags);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "unable to check for holes");
+            return ret;
+        }
+        assert(pnum && pnum <= size - progress);
+        final = progress + pnum == size;
+
+        if (flags & NBD_STATE_ZERO) {
+            ret = nbd_co_send_structured_hole(client, handle,
+                                              offset + progress, pnum, final,
+                                              errp);
+        } else {
+            ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
+                            data + progress, pnum);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "reading from file failed");
+                return ret;
+            }
+            ret = nbd_co_send_structured_read(client, handle,
+                                              offset + progress,
+                                              data + progress, pnum, final,
+                                              errp);
+        }
+
+        if (ret < 0) {
+            return ret;
+        }
+        progress += pnum;
+    }
+
+    return 0;
+}
+
+/* Reply to NBD_CMD_BLOCK_STATUS with up to @nb_extents extents of the
+ * "base:allocation" context, covering at most @length bytes at @offset.
+ * Return -errno on failure. */
+static int coroutine_fn nbd_co_send_block_status(NBDClient *client,
+                                                 uint64_t handle,
+                                                 uint64_t offset,
+                                                 uint32_t length,
+                                                 unsigned int nb_extents,
+                                                 Error **errp)
+{
+    NBDExport *exp = client->exp;
+    NBDStructuredMeta chunk;
+    NBDExtent *extents = g_new(NBDExtent, nb_extents);
+    uint64_t progress = 0;
+    unsigned int i = 0, j;
+    struct iovec iov[2];
+    int ret;
+
+    while (progress < length && i < nb_extents) {
+        uint32_t pnum, flags;
+
+        ret = nbd_co_block_status(blk_bs(exp->blk),
+                                  offset + progress + exp->dev_offset,
+                                  length - progress, &pnum, &flags);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "unable to get block status");
+            goto out;
+        }
+
+        if (i && extents[i - 1].flags == flags) {
+            extents[i - 1].length += pnum;
+        } else {
+            extents[i].length = pnum;
+            extents[i].flags = flags;
+            i++;
+        }
+        progress += pnum;
+    }
+
+    trace_nbd_co_send_block_status(handle, i, progress);
+    for (j = 0; j < i; j++) {
+        cpu_to_be32s(&extents[j].length);
+        cpu_to_be32s(&extents[j].flags);
+    }
+
+    set_be_chunk(&chunk.h, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS,
+                 handle, sizeof(chunk) - sizeof(chunk.h) +
+                 i * sizeof(NBDExtent));
+    stl_be_p(&chunk.context_id, NBD_META_ID_BASE_ALLOCATION);
+    iov[0].iov_base = &chunk;
+    iov[0].iov_len = sizeof(chunk);
+    iov[1].iov_base = extents;
+    iov[1].iov_len = i * sizeof(NBDExtent);
+    ret = nbd_co_send_iov(client, iov, 2, errp);
+
+out:
+    g_free(extents);
+    return ret;
+}
+
 /* nbd_co_receive_request
  * Collect a client request. Return 0 if request looks valid, -EIO to drop
  * connection right away, and any other negative value to report an error to
@@ -1311,7 +1753,8 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
                    (uint64_t)client->exp->size);
         return request->type == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
     }
-    if (request->flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE)) {
+    if (request->flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE |
+                           NBD_CMD_FLAG_REQ_ONE)) {
         error_setg(errp, "unsupported flags (got 0x%x)", request->flags);
         return -EINVAL;
     }
@@ -1320,6 +1763,15 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
         error_setg(errp, "unexpected flags (got 0x%x)", request->flags);
         return -EINVAL;
     }
+    if (request->type != NBD_CMD_BLOCK_STATUS &&
+        (request->flags & NBD_CMD_FLAG_REQ_ONE)) {
+        error_setg(errp, "unexpected flags (got 0x%x)", request->flags);
+        return -EINVAL;
+    }
+    if (request->type == NBD_CMD_BLOCK_STATUS && !client->base_allocation) {
+        error_setg(errp, "block status requested without a metadata context");
+        return -EINVAL;
+    }
 
     return 0;
 }
@@ -1379,6 +1831,17 @@ static coroutine_fn void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            ret = nbd_co_send_sparse_read(client, request.handle,
+                                          request.from, req->data,
+                                          request.len, &local_err);
+            if (ret < 0) {
+                reply.error = -ret;
+                break;
+            }
+            goto complete;
+        }
+
         ret = blk_pread(exp->blk, request.from + exp->dev_offset,
                         req->data, request.len);
         if (ret < 0) {
@@ -1451,6 +1914,17 @@ static coroutine_fn void nbd_trip(void *opaque)
         }
 
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        ret = nbd_co_send_block_status(client, request.handle, request.from,
+                                       request.len,
+                                       request.flags & NBD_CMD_FLAG_REQ_ONE ?
+                                       1 : NBD_MAX_BLOCK_STATUS_EXTENTS,
+                                       &local_err);
+        if (ret < 0) {
+            reply.error = -ret;
+            break;
+        }
+        goto complete;
     default:
         error_setg(&local_err, "invalid request type (%" PRIu32 ") received",
                    request.type);
@@ -1465,11 +1939,22 @@ reply:
         local_err = NULL;
     }
 
-    if (nbd_co_send_reply(req, &reply, reply_data_len, &local_err) < 0) {
+    /* With structured replies, errors for commands that reply with
+     * chunks have to be sent as a chunk as well */
+    if (client->structured_reply && reply.error &&
+        (request.type == NBD_CMD_READ ||
+         request.type == NBD_CMD_BLOCK_STATUS)) {
+        ret = nbd_co_send_structured_error(client, request.handle,
+                                           reply.error, &local_err);
+    } else {
+        ret = nbd_co_send_reply(req, &reply, reply_data_len, &local_err);
+    }
+    if (ret < 0) {
         error_prepend(&local_err, "Failed to send reply: ");
         goto disconnect;
     }
 
+complete:
     /* We must disconnect after NBD_CMD_WRITE if we did not
      * read the payload.
      */
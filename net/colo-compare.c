@@ -795,6 +795,16 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         return;
     }
 
+    /* colo-compare runs in the GMainContext of its iothread */
+    if (s->iothread->group) {
+        char *id = iothread_get_id(s->iothread);
+
+        error_setg(errp, "iothread '%s' is a member of an iothread-group "
+                   "and cannot be used by colo-compare", id);
+        g_free(id);
+        return;
+    }
+
     if (find_and_check_chardev(&chr, s->pri_indev, errp) ||
         !qemu_chr_fe_init(&s->chr_pri_in, chr, errp)) {
         return;
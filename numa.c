@@ -682,11 +682,31 @@ MemdevList *qmp_query_memdev(Error **errp)
     return list;
 }
 
+static int ram_block_notify_add_single(const char *block_name, void *host,
+                                       ram_addr_t offset, ram_addr_t length,
+                                       void *opaque)
+{
+    RAMBlockNotifier *n = opaque;
+
+    n->ram_block_added(n, host, length);
+    return 0;
+}
+
 void ram_block_notifier_add(RAMBlockNotifier *n)
 {
     QLIST_INSERT_HEAD(&ram_list.ramblock_notifiers, n, next);
 }
 
+/* For notifiers added late, e.g. by hot-plugged devices, that need to know
+ * about the RAM that already exists.  Callers of ram_block_notifier_add()
+ * set up their own state for existing blocks, or have none to set up.
+ */
+void ram_block_notifier_add_replay(RAMBlockNotifier *n)
+{
+    ram_block_notifier_add(n);
+    qemu_ram_foreach_block(ram_block_notify_add_single, n);
+}
+
 void ram_block_notifier_remove(RAMBlockNotifier *n)
 {
     QLIST_REMOVE(n, next);
@@ -25,7 +25,7 @@ static QDict *qmp_dispatch_check_obj(const QObject *request, Error **errp)
     const QDictEntry *ent;
     const char *arg_name;
     const QObject *arg_obj;
-    bool has_exec_key = false;
+    const char *exec_key = NULL;
     QDict *dict = NULL;
 
     dict = qobject_to_qdict(request);
@@ -39,13 +39,19 @@ static QDict *qmp_dispatch_check_obj(const QObject *request, Error **errp)
         arg_name = qdict_entry_key(ent);
         arg_obj = qdict_entry_value(ent);
 
-        if (!strcmp(arg_name, "execute")) {
+        if (!strcmp(arg_name, "execute") || !strcmp(arg_name, "exec-oob")) {
             if (qobject_type(arg_obj) != QTYPE_QSTRING) {
                 error_setg(errp,
-                           "QMP input member 'execute' must be a string");
+                           "QMP input member '%s' must be a string",
+                           arg_name);
                 return NULL;
             }
-            has_exec_key = true;
+            if (exec_key) {
+                error_setg(errp, "QMP input member '%s' clashes with '%s'",
+                           arg_name, exec_key);
+                return NULL;
+            }
+            exec_key = arg_name;
         } else if (!strcmp(arg_name, "arguments")) {
             if (qobject_type(arg_obj) != QTYPE_QDICT) {
                 error_setg(errp,
@@ -59,7 +65,7 @@ static QDict *qmp_dispatch_check_obj(const QObject *request, Error **errp)
         }
     }
 
-    if (!has_exec_key) {
+    if (!exec_key) {
         error_setg(errp, "QMP input lacks member 'execute'");
         return NULL;
     }
@@ -81,7 +87,10 @@ static QObject *do_qmp_dispatch(QmpCommandList *cmds, QObject *request,
         return NULL;
     }
 
-    command = qdict_get_str(dict, "execute");
+    command = qdict_get_try_str(dict, "execute");
+    if (!command) {
+        command = qdict_get_str(dict, "exec-oob");
+    }
     cmd = qmp_find_command(cmds, command);
     if (cmd == NULL) {
         error_set(errp, ERROR_CLASS_COMMAND_NOT_FOUND,
@@ -93,6 +102,11 @@ static QObject *do_qmp_dispatch(QmpCommandList *cmds, QObject *request,
                    command);
         return NULL;
     }
+    if (qmp_is_oob(dict) && !(cmd->options & QCO_ALLOW_OOB)) {
+        error_setg(errp, "The command %s does not support out-of-band "
+                   "execution", command);
+        return NULL;
+    }
 
     if (!qdict_haskey(dict, "arguments")) {
         args = qdict_new();
@@ -115,6 +129,15 @@ static QObject *do_qmp_dispatch(QmpCommandList *cmds, QObject *request,
     return ret;
 }
 
+/*
+ * Does @dict ask for out-of-band execution?  The request is not
+ * validated; qmp_dispatch() rejects it if the command does not allow it.
+ */
+bool qmp_is_oob(const QDict *dict)
+{
+    return qdict_haskey(dict, "exec-oob") && !qdict_haskey(dict, "execute");
+}
+
 QObject *qmp_build_error_object(Error *err)
 {
     return qobject_from_jsonf("{ 'class': %s, 'desc': %s }",
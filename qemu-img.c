@@ -65,6 +65,8 @@ enum {
     OPTION_SIZE = 264,
     OPTION_PREALLOCATION = 265,
     OPTION_SHRINK = 266,
+    OPTION_COMPRESS_THREADS = 267,
+    OPTION_COMPRESS_LEVEL = 268,
 };
 
 typedef enum OutputFormat {
@@ -178,6 +180,10 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--compress-threads' is the number of clusters that a compressed target\n"
+           "       compresses in parallel (qcow2 only, defaults to the number of CPUs)\n"
+           "  '--compress-level' is the deflate level of compressed clusters, from 1\n"
+           "       (fastest) to 9 (smallest) (qcow2 only, defaults to 6)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -338,13 +344,14 @@ static int img_add_key_secrets(void *opaque,
 
 static BlockBackend *img_open_new_file(const char *filename,
                                        QemuOpts *create_opts,
+                                       QDict *options,
                                        const char *fmt, int flags,
                                        bool writethrough, bool quiet,
                                        bool force_share)
 {
-    QDict *options = NULL;
-
-    options = qdict_new();
+    if (!options) {
+        options = qdict_new();
+    }
     qemu_opt_foreach(create_opts, img_add_key_secrets, options, &error_abort);
 
     return img_open_file(filename, options, fmt, flags, writethrough, quiet,
@@ -1753,6 +1760,31 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
     return 0;
 }
 
+/* Let the write at @wr_offs proceed, entering or scheduling the coroutine
+ * that waits for it */
+static void coroutine_fn convert_co_next_write(ImgConvertState *s,
+                                               int64_t wr_offs, bool enter)
+{
+    int i;
+
+    s->wr_offs = wr_offs;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            if (enter) {
+                /*
+                 * A -> B -> A cannot occur because A has
+                 * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                 * B will never enter A during this time window.
+                 */
+                qemu_coroutine_enter(s->co[i]);
+            } else {
+                aio_co_schedule(qemu_get_aio_context(), s->co[i]);
+            }
+            break;
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1823,6 +1855,16 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
                 qemu_coroutine_yield();
             }
             s->wait_sector_num[index] = -1;
+
+            /* Compressed clusters are allocated in the order in which the
+             * writes reach the target, and compressed in worker threads
+             * afterwards.  So the next write only has to wait until this
+             * one is submitted; it is scheduled to run when this coroutine
+             * yields inside the target, and both clusters are compressed
+             * at the same time. */
+            if (s->compressed) {
+                convert_co_next_write(s, sector_num + n, false);
+            }
         }
 
         if (s->ret == -EINPROGRESS) {
@@ -1834,21 +1876,10 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
             }
         }
 
-        if (s->wr_in_order) {
+        if (s->wr_in_order && !s->compressed) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_co_next_write(s, sector_num + n, true);
         }
     }
 
@@ -1945,6 +1976,9 @@ static int img_convert(int argc, char **argv)
          skip_create = false, progress = false, tgt_image_opts = false;
     int64_t ret = -EINVAL;
     bool force_share = false;
+    bool explicit_coroutines = false;
+    long compress_threads = 0, compress_level = 0;
+    QDict *target_opts = NULL;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -1961,6 +1995,9 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"force-share", no_argument, 0, 'U'},
             {"target-image-opts", no_argument, 0, OPTION_TARGET_IMAGE_OPTS},
+            {"compress-threads", required_argument, 0,
+             OPTION_COMPRESS_THREADS},
+            {"compress-level", required_argument, 0, OPTION_COMPRESS_LEVEL},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:co:s:l:S:pt:T:qnm:WU",
@@ -2054,6 +2091,7 @@ static int img_convert(int argc, char **argv)
                              " coroutines is between 1 and %d", MAX_COROUTINES);
                 goto fail_getopt;
             }
+            explicit_coroutines = true;
             break;
         case 'W':
             s.wr_in_order = false;
@@ -2076,6 +2114,23 @@ static int img_convert(int argc, char **argv)
         case OPTION_TARGET_IMAGE_OPTS:
             tgt_image_opts = true;
             break;
+        case OPTION_COMPRESS_THREADS:
+            if (qemu_strtol(optarg, NULL, 0, &compress_threads) ||
+                compress_threads < 1 || compress_threads > MAX_COROUTINES) {
+                error_report("Invalid number of compress threads. Allowed "
+                             "number of threads is between 1 and %d",
+                             MAX_COROUTINES);
+                goto fail_getopt;
+            }
+            break;
+        case OPTION_COMPRESS_LEVEL:
+            if (qemu_strtol(optarg, NULL, 0, &compress_level) ||
+                compress_level < 1 || compress_level > 9) {
+                error_report("Invalid compress level. Allowed levels are "
+                             "between 1 and 9");
+                goto fail_getopt;
+            }
+            break;
         }
     }
 
@@ -2089,8 +2144,14 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
-    if (!s.wr_in_order && s.compressed) {
-        error_report("Out of order write and compress are mutually exclusive");
+    if ((compress_threads || compress_level) && !s.compressed) {
+        error_report("--compress-threads and --compress-level require -c");
+        goto fail_getopt;
+    }
+
+    if ((compress_threads || compress_level) && tgt_image_opts) {
+        error_report("Use the compress-threads and compress-level options of "
+                     "--target-image-opts instead");
         goto fail_getopt;
     }
 
@@ -2288,7 +2349,25 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    if (skip_create) {
+    /* The compression itself happens in the target's format driver */
+    if (compress_threads || compress_level) {
+        target_opts = qdict_new();
+        if (compress_threads) {
+            qdict_put_int(target_opts, "compress-threads", compress_threads);
+        }
+        if (compress_level) {
+            qdict_put_int(target_opts, "compress-level", compress_level);
+        }
+        /* Keep enough clusters in flight for all threads */
+        if (!explicit_coroutines) {
+            s.num_coroutines = MAX(s.num_coroutines, compress_threads);
+        }
+    }
+
+    if (skip_create && target_opts) {
+        s.target = img_open_file(out_filename, target_opts, out_fmt,
+                                 flags, writethrough, quiet, false);
+    } else if (skip_create) {
         s.target = img_open(tgt_image_opts, out_filename, out_fmt,
                             flags, writethrough, quiet, false);
     } else {
@@ -2297,7 +2376,7 @@ static int img_convert(int argc, char **argv)
          * That has to wait for bdrv_create to be improved
          * to allow filenames in option syntax
          */
-        s.target = img_open_new_file(out_filename, opts, out_fmt,
+        s.target = img_open_new_file(out_filename, opts, target_opts, out_fmt,
                                      flags, writethrough, quiet, false);
     }
     if (!s.target) {
@@ -3910,7 +3989,8 @@ static int img_bench(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hc:d:f:no:qs:S:t:wU", long_options, NULL);
+        c = getopt_long(argc, argv, ":hc:d:f:i:no:qs:S:t:wU", long_options,
+                        NULL);
         if (c == -1) {
             break;
         }
@@ -3950,6 +4030,13 @@ static int img_bench(int argc, char **argv)
         case 'f':
             fmt = optarg;
             break;
+        case 'i':
+            if (bdrv_parse_aio(optarg, &flags) < 0) {
+                error_report("Invalid aio option: %s", optarg);
+                ret = -1;
+                goto out;
+            }
+            break;
         case 'n':
             flags |= BDRV_O_NATIVE_AIO;
             break;
@@ -117,7 +117,7 @@ static void usage(const char *name)
 "                            '[ID_OR_NAME]'\n"
 "  -n, --nocache             disable host cache\n"
 "      --cache=MODE          set cache mode (none, writeback, ...)\n"
-"      --aio=MODE            set AIO mode (native or threads)\n"
+"      --aio=MODE            set AIO mode (native, io_uring or threads)\n"
 "      --discard=MODE        set discard mode (ignore, unmap)\n"
 "      --detect-zeroes=MODE  set detect-zeroes mode (off, on, unmap)\n"
 "      --image-opts          treat FILE as a full set of image options\n"
@@ -616,11 +616,7 @@ int main(int argc, char **argv)
                 exit(EXIT_FAILURE);
             }
             seen_aio = true;
-            if (!strcmp(optarg, "native")) {
-                flags |= BDRV_O_NATIVE_AIO;
-            } else if (!strcmp(optarg, "threads")) {
-                /* this is the default */
-            } else {
+            if (bdrv_parse_aio(optarg, &flags) < 0) {
                error_report("invalid aio mode `%s'", optarg);
                exit(EXIT_FAILURE);
             }
@@ -1013,6 +1009,12 @@ int main(int argc, char **argv)
         }
     }
 
+    /* All clients go through the same BlockBackend, so a flush from any
+     * of them covers the writes of all others */
+    if (shared > 1) {
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
+
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed,
                          writethrough, NULL, &local_err);
     if (!exp) {
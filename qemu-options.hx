@@ -692,7 +692,14 @@ This is the protocol-level block driver for accessing regular files.
 @item filename
 The path to the image file in the local filesystem
 @item aio
-Specifies the AIO backend (threads/native, default: threads)
+Specifies the AIO backend (threads/native/io_uring, default: threads)
+@item aio-fixed-files
+With @option{aio=io_uring}, registers the file with the ring so that the
+kernel does not have to look it up for every request (on/off, default: off)
+@item aio-fixed-buffers
+With @option{aio=io_uring}, registers guest RAM with the ring so that the
+kernel does not have to pin the pages of every request.  The guest RAM must
+fit in the locked memory limit of the process (on/off, default: off)
 @end table
 Example:
 @example
@@ -740,20 +747,33 @@ image file)
 
 @item cache-size
 The maximum total size of the L2 table and refcount block caches in bytes
-(default: 1048576 bytes or 8 clusters, whichever is larger)
+(default: the sum of l2-cache-size and refcount-cache-size)
 
 @item l2-cache-size
-The maximum size of the L2 table cache in bytes
-(default: 4/5 of the total cache size)
+The maximum size of the L2 table cache in bytes. The cache never grows beyond
+what is needed to cover the whole image
+(default: 4/5 of the total cache size if that is set, 4 times
+refcount-cache-size if that is set, 32 MB otherwise)
+
+@item l2-cache-entry-size
+The size of each entry in the L2 table cache in bytes; a power of two between
+512 and the cluster size (default: 4096 bytes or the cluster size, whichever is
+smaller)
 
 @item refcount-cache-size
 The maximum size of the refcount block cache in bytes
-(default: 1/5 of the total cache size)
+(default: 1/5 of the total cache size if that is set, 1/4 of l2-cache-size if
+that is set, 262144 bytes or 2 clusters otherwise, whichever is larger)
 
 @item cache-clean-interval
 Clean unused entries in the L2 and refcount caches. The interval is in seconds.
 The default value is 0 and it disables this feature.
 
+@item chain-index
+Keep an index of which image of the backing chain has each cluster, so that
+reads of unallocated clusters go straight to that image instead of walking
+the chain (on/off; default: on)
+
 @item pass-discard-request
 Whether discard requests to the qcow2 device should be forwarded to the data
 source (on/off; default: on if discard=unmap is specified, off otherwise)
@@ -795,7 +815,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -867,7 +887,9 @@ unsafe       │ on                off            on
 The default mode is @option{cache=writeback}.
 
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based
+disk I/O, native Linux AIO and Linux io_uring.  Native Linux AIO requires
+@option{cache.direct=on}, io_uring works with and without the host page cache.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specify format=raw to avoid interpreting
@@ -3461,11 +3483,16 @@ Like -qmp but uses pretty JSON formatting.
 ETEXI
 
 DEF("mon", HAS_ARG, QEMU_OPTION_mon, \
-    "-mon [chardev=]name[,mode=readline|control]\n", QEMU_ARCH_ALL)
+    "-mon [chardev=]name[,mode=readline|control][,pretty[=on|off]][,x-oob=on|off]\n", QEMU_ARCH_ALL)
 STEXI
-@item -mon [chardev=]name[,mode=readline|control]
+@item -mon [chardev=]name[,mode=readline|control][,pretty[=on|off]][,x-oob=on|off]
 @findex -mon
-Setup monitor on chardev @var{name}.
+Setup monitor on chardev @var{name}.  @code{pretty} turns on JSON pretty
+printing easing human reading and debugging.  @code{x-oob} moves the input
+of a @code{mode=control} monitor on a socket chardev to a dedicated I/O
+thread and lets clients run lightweight commands out-of-band with
+@code{exec-oob}, without waiting for the main loop; see
+@file{docs/interop/qmp-spec.txt}.
 ETEXI
 
 DEF("debugcon", HAS_ARG, QEMU_OPTION_debugcon, \
@@ -3685,6 +3712,22 @@ STEXI
 @findex -exton
 Use the external snapshot subsystem.
 ETEXI
+
+DEF("extram", HAS_ARG, QEMU_OPTION_extram, \
+    "-extram [size-limit=]size[,spill-dir=path][,chunk-size=size]\n" \
+    "                use the external snapshots subsystem and keep the writes\n" \
+    "                between snapshots in memory\n", QEMU_ARCH_ALL)
+STEXI
+@item -extram [size-limit=]@var{size}[,spill-dir=@var{path}][,chunk-size=@var{size}]
+@findex -extram
+Like @option{-exton}, but the temporary overlay is a @code{ramoverlay} node
+instead of a qcow2 file, so that the guest writes between two snapshots never
+reach the disk.  They are written into a qcow2 image only when
+@code{savevm-ext} saves a snapshot.  At most @var{size} bytes of written data
+are kept in memory (0 means no limit).  Beyond that, data is moved to a
+temporary file in @var{path}, or the writes fail if no @option{spill-dir} is
+given.
+ETEXI
 #endif //CONFIG_EXTSNAP
 #ifdef CONFIG_QUANTUM
 DEF("quantum", HAS_ARG, QEMU_OPTION_quantum,"aaa", QEMU_ARCH_ALL)
@@ -4236,6 +4279,25 @@ STEXI
 prepend a timestamp to each log message.(default:on)
 ETEXI
 
+DEF("main-loop", HAS_ARG, QEMU_OPTION_main_loop,
+    "-main-loop [backend=]glib|native\n"
+    "                select how the main loop waits for events\n"
+    "                glib polls every handler through glib (default)\n"
+    "                native polls the main AioContexts with epoll\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -main-loop [backend=]@var{backend}
+@findex -main-loop
+Select how the main loop thread waits for events.  With @option{glib}, the
+default, the handlers of the main AioContexts are glib sources and all of
+their file descriptors are passed to @code{g_poll} on every iteration.  With
+@option{native}, the AioContexts are driven with epoll and each iteration
+only polls one descriptor per context, plus those of chardevs, user
+interfaces and user mode networking.  @option{native} is only available on
+hosts with epoll.  The QMP command @code{query-main-loop} reports wakeups
+and per-iteration cost for either backend.
+ETEXI
+
 DEF("dump-vmstate", HAS_ARG, QEMU_OPTION_dump_vmstate,
     "-dump-vmstate <file>\n"
     "                Output vmstate information in JSON format to file.\n"
@@ -4564,6 +4626,20 @@ STEXI
 @findex -qflex_d
 Enable logging of specified items.
 ETEXI
+
+DEF("qflex_capture", HAS_ARG, QEMU_OPTION_qflex_capture, \
+    "-qflex_capture prefix\n"
+    "                write an instruction and memory trace of every vCPU\n"
+    "                to prefix.cpuN.qtrace\n",
+    QEMU_ARCH_ARM)
+STEXI
+@item -qflex_capture @var{prefix}
+@findex -qflex_capture
+Capture a trace of the instructions and memory accesses of every AArch64
+vCPU without a simulator attached.  vCPU @var{N} writes its records to
+@file{@var{prefix}.cpu@var{N}.qtrace} in compressed chunks; the traces can
+be read back with the reader in @file{include/qflex/qflex-capture.h}.
+ETEXI
 #endif
 
 HXCOMM This is the last statement. Insert new options before this line!
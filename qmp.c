@@ -81,6 +81,7 @@
 #include "qom/object_interfaces.h"
 #include "hw/mem/pc-dimm.h"
 #include "hw/acpi/acpi_dev_interface.h"
+#include "qemu/main-loop.h"
 
 NameInfo *qmp_query_name(Error **errp)
 {
@@ -125,6 +126,11 @@ UuidInfo *qmp_query_uuid(Error **errp)
     return info;
 }
 
+MainLoopInfo *qmp_query_main_loop(Error **errp)
+{
+    return qemu_main_loop_info();
+}
+
 void qmp_quit(Error **errp)
 {
 #ifdef CONFIG_FLEXUS
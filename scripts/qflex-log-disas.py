@@ -0,0 +1,54 @@
+#!/usr/bin/env python
+#
+# Disassemble the instructions logged with -qflex_d exec_raw
+#
+# Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or
+# (at your option) any later version.  See the COPYING file in the
+# top-level directory.
+#
+# Usage: qflex-log-disas.py [LOGFILE]
+#
+# Lines of the form "IN[cpu] pc insn" are replaced with the same disassembly
+# that the "exec" log item prints while the guest runs; every other line is
+# copied as is.  Needs the capstone Python bindings.
+
+import re
+import struct
+import sys
+
+try:
+    import capstone
+except ImportError:
+    sys.stderr.write('qflex-log-disas.py needs the capstone module\n')
+    sys.exit(1)
+
+raw_insn = re.compile(r'^IN\[(\d+)\] ([0-9a-f]{16}) ([0-9a-f]{8})$')
+
+def main():
+    logfile = open(sys.argv[1]) if len(sys.argv) > 1 else sys.stdin
+    md = capstone.Cs(capstone.CS_ARCH_ARM64, capstone.CS_MODE_ARM)
+    cache = {}
+
+    for line in logfile:
+        m = raw_insn.match(line.rstrip('\n'))
+        if not m:
+            sys.stdout.write(line)
+            continue
+
+        cpu, pc, insn = int(m.group(1)), int(m.group(2), 16), int(m.group(3), 16)
+        # the text only depends on the pc for pc-relative operands
+        key = (pc, insn)
+        text = cache.get(key)
+        if text is None:
+            code = struct.pack('<I', insn)
+            text = '.inst 0x%08x' % insn
+            for i in md.disasm(code, pc):
+                text = '%s %s' % (i.mnemonic, i.op_str)
+            cache[key] = text
+        sys.stdout.write('IN[%d]  :0x%016x:  %08x      %s\n' %
+                         (cpu, pc, insn, text))
+
+if __name__ == '__main__':
+    main()
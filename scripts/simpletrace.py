@@ -64,6 +64,12 @@ def get_record(edict, idtoname, rechdr, fobj):
         rec = ("dropped", rechdr[1], rechdr[3])
         (value,) = struct.unpack('=Q', fobj.read(8))
         rec = rec + (value,)
+        # Version 4 files do not record the thread that dropped the events
+        if rechdr[2] > struct.calcsize(rec_header_fmt) + 8:
+            (value,) = struct.unpack('=Q', fobj.read(8))
+        else:
+            value = 0
+        rec = rec + (value,)
     return rec
 
 def get_mapping(fobj):
@@ -91,9 +97,9 @@ def read_trace_header(fobj):
                          (header[1], header_magic))
 
     log_version = header[2]
-    if log_version not in [0, 2, 3, 4]:
+    if log_version not in [0, 2, 3, 4, 5]:
         raise ValueError('Unknown version of tracelog format!')
-    if log_version != 4:
+    if log_version not in [4, 5]:
         raise ValueError('Log format %d not supported with this QEMU release!'
                          % log_version)
 
@@ -175,7 +181,8 @@ def process(events, log, analyzer, read_header=True):
     if read_header:
         read_trace_header(log)
 
-    dropped_event = Event.build("Dropped_Event(uint64_t num_events_dropped)")
+    dropped_event = Event.build("Dropped_Event(uint64_t num_events_dropped, "
+                                "uint64_t tid)")
     edict = {"dropped": dropped_event}
     idtoname = {dropped_event_id: "dropped"}
 
@@ -76,6 +76,9 @@
 #include "qemu/int128.h"
 #include "tcg.h"
 #include <zlib.h> /* For crc32 */
+#ifdef CONFIG_FLEXUS
+#include "qflex/qflex-capture.h"
+#endif
 
 #if defined(CONFIG_FLEXUS) && defined(CONFIG_EXTSNAP)
 #include "include/sysemu/sysemu.h"
@@ -608,6 +611,26 @@ void helper_flexus_st_aa64(
 		      int is_atomic) {
   helper_flexus_st(env, addr, size, is_user, pc, is_atomic);
 }
+
+void HELPER(qflex_capture_insn)(CPUARMState *env, uint64_t pc,
+                                uint64_t paddr, uint32_t insn, uint32_t info)
+{
+    QFlexCaptureRecord *rec;
+
+    if (unlikely(!qflex_capture_enabled())) {
+        return;
+    }
+
+    rec = qflex_capture_next(ENV_GET_CPU(env)->cpu_index);
+    rec->pc = pc;
+    rec->vaddr = pc;
+    rec->paddr = paddr;
+    rec->opcode = insn;
+    rec->type = QFLEX_CAPTURE_INSN;
+    rec->size = 4;
+    rec->el = info & 0xff;
+    rec->flags = info >> 8;
+}
 #endif
 /* Returns 0 on success; 1 otherwise.  */
 uint64_t HELPER(paired_cmpxchg64_le)(CPUARMState *env, uint64_t addr,
@@ -50,6 +50,8 @@ DEF_HELPER_7(flexus_insn_fetch_aa64, void, env, tl, i64, int, int, int, int)
 DEF_HELPER_6(flexus_ld_aa64, void, env, i64, int, int, tl, int)
 // env, addr, size, is user, pc, is atomic
 DEF_HELPER_6(flexus_st_aa64, void, env, i64, int, int, tl, int)
+// env, pc, physical pc, encoding, exception level | capture flags << 8
+DEF_HELPER_5(qflex_capture_insn, void, env, i64, i64, i32, i32)
 #endif
 
 /*
@@ -62,6 +62,7 @@
 
 #ifdef CONFIG_FLEXUS
 #include "qflex/qflex.h"
+#include "qflex/qflex-capture.h"
 #endif /* CONFIG_FLEXUS */
 
 #ifdef CONFIG_FLEXUS
@@ -11846,12 +11847,69 @@ void helper_flexus_insn_fetch( CPUARMState *env,
     }
 }
 
+/* Guest physical page of the last access captured on this thread.  It
+ * stays valid for as long as the TLB entry it was looked up for maps the
+ * same host page.
+ */
+static __thread struct {
+    int cpu_index;
+    int mmu_idx;
+    target_ulong vpage;
+    uintptr_t addend;
+    physical_address_t ppage;
+} qflex_capture_page = { .cpu_index = -1 };
+
+static void qflex_capture_mem(CPUARMState *env, target_ulong addr, int size,
+                              int is_user, target_ulong pc, int is_atomic,
+                              bool is_store)
+{
+    CPUState *cs = ENV_GET_CPU(env);
+    int mmu_idx = cpu_mmu_index(env, false);
+    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    CPUTLBEntry *entry = &env->tlb_table[mmu_idx][index];
+    target_ulong tlb_addr = is_store ? entry->addr_write : entry->addr_read;
+    target_ulong vpage = addr & TARGET_PAGE_MASK;
+    physical_address_t paddr;
+    QFlexCaptureRecord *rec;
+
+    if (qflex_capture_page.cpu_index == cs->cpu_index &&
+        qflex_capture_page.mmu_idx == mmu_idx &&
+        qflex_capture_page.vpage == vpage &&
+        qflex_capture_page.addend == entry->addend && tlb_addr == vpage) {
+        paddr = qflex_capture_page.ppage | (addr & ~TARGET_PAGE_MASK);
+    } else {
+        paddr = mmu_logical_to_physical(arm_env_get_cpu(env), addr);
+        /* Only plain RAM mappings can be recognized by their addend */
+        if (tlb_addr == vpage && paddr != -1) {
+            qflex_capture_page.cpu_index = cs->cpu_index;
+            qflex_capture_page.mmu_idx = mmu_idx;
+            qflex_capture_page.vpage = vpage;
+            qflex_capture_page.addend = entry->addend;
+            qflex_capture_page.ppage = paddr & TARGET_PAGE_MASK;
+        }
+    }
+
+    rec = qflex_capture_next(cs->cpu_index);
+    rec->pc = pc;
+    rec->vaddr = addr;
+    rec->paddr = paddr;
+    rec->opcode = 0;
+    rec->type = is_store ? QFLEX_CAPTURE_STORE : QFLEX_CAPTURE_LOAD;
+    rec->size = size;
+    rec->el = arm_current_el(env);
+    rec->flags = (is_user ? QFLEX_CAPTURE_FLAG_USER : 0) |
+                 (is_atomic ? QFLEX_CAPTURE_FLAG_ATOMIC : 0);
+}
+
 void helper_flexus_ld( CPUARMState *env,
                        target_ulong addr,
                        int size,
                        int is_user,
                        target_ulong pc,
                        int is_atomic ) {
+    if (unlikely(qflex_capture_enabled())) {
+        qflex_capture_mem(env, addr, size, is_user, pc, is_atomic, false);
+    }
     if( flexus_in_trace() && qflex_trace_enabled ) {
         ARMCPU *arm_cpu = arm_env_get_cpu(env);
         int mmu_idx = cpu_mmu_index(env , false );                                                // Flexus Change made since function definition has changed
@@ -11901,6 +11959,9 @@ void helper_flexus_st(
             int is_user,
             target_ulong pc,
             int is_atomic) {  
+    if (unlikely(qflex_capture_enabled())) {
+        qflex_capture_mem(env, addr, size, is_user, pc, is_atomic, true);
+    }
     if( flexus_in_trace() && qflex_trace_enabled ) {
         ARMCPU *arm_cpu = arm_env_get_cpu(env);
         int mmu_idx = cpu_mmu_index(env , false );                                                     // Flexus Change made since function definition has changed
@@ -84,6 +84,16 @@ void HELPER(qflex_executed_instruction)(CPUARMState* env, uint64_t pc, int flags
     }
 }
 
+/**
+ * @brief HELPER(qflex_log_insn)
+ * Logs the pc and the encoding of an executed instruction without
+ * disassembling it; scripts/qflex-log-disas.py does that offline.
+ */
+void HELPER(qflex_log_insn)(CPUARMState* env, uint64_t pc, uint32_t insn) {
+    qemu_log("IN[%d] %016" PRIx64 " %08" PRIx32 "\n",
+             ENV_GET_CPU(env)->cpu_index, pc, insn);
+}
+
 /**
  * @brief HELPER(qflex_magic_insn)
  * In ARM, hint instruction (which is like a NOP) comes with an int with range 0-127
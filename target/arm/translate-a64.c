@@ -85,6 +85,7 @@
 #include "include/sysemu/sysemu.h"
 #include "../libqflex/api.h"
 #include "qflex/qflex.h"
+#include "qflex/qflex-capture.h"
 static target_ulong flexus_ins_pc = -1;
 static bool insn_is_branch = false;
 
@@ -94,8 +95,16 @@ static bool insn_is_branch = false;
   }						\
 } while(0)
 
+/* Loads and stores also feed the offline trace capture */
+#define FLEXUS_IF_TRACING_MEM( a ) do {	\
+  if( flexus_in_trace() || qflex_capture_enabled() ) {	\
+    (a) ;					\
+  }						\
+} while(0)
+
 #else
 #define FLEXUS_IF_IN_SIMULATION( a )
+#define FLEXUS_IF_TRACING_MEM( a )
 #endif
 
 #if defined(CONFIG_USER_ONLY)
@@ -878,7 +887,7 @@ static void do_gpr_st_memidx(DisasContext *s, TCGv_i64 source,
     g_assert(size <= 3);
     tcg_gen_qemu_st_i64(source, tcg_addr, memidx, s->be_data + size);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_st_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_st_aa64(cpu_env,
 			      tcg_addr, tcg_const_i32( 1 << size /* size */ ),
 			      tcg_const_i32(IS_USER(s)),
 						       tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -929,7 +938,7 @@ static void do_gpr_ld_memidx(DisasContext *s,
 
     tcg_gen_qemu_ld_i64(dest, tcg_addr, memidx, memop);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
                   tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -977,7 +986,7 @@ static void do_fp_st(DisasContext *s, int srcidx, TCGv_i64 tcg_addr, int size)
         tcg_gen_qemu_st_i64(tmp, tcg_addr, get_mem_index(s),
                             s->be_data + size);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_st_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_st_aa64(cpu_env,
                   tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -991,7 +1000,7 @@ static void do_fp_st(DisasContext *s, int srcidx, TCGv_i64 tcg_addr, int size)
         tcg_gen_qemu_st_i64(tmp, be ? tcg_hiaddr : tcg_addr, get_mem_index(s),
                             s->be_data | MO_Q);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_st_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_st_aa64(cpu_env,
                   tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -1001,7 +1010,7 @@ static void do_fp_st(DisasContext *s, int srcidx, TCGv_i64 tcg_addr, int size)
         tcg_gen_qemu_st_i64(tmp, be ? tcg_addr : tcg_hiaddr, get_mem_index(s),
                             s->be_data | MO_Q);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_st_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_st_aa64(cpu_env,
                   tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -1027,7 +1036,7 @@ static void do_fp_ld(DisasContext *s, int destidx, TCGv_i64 tcg_addr, int size)
         tmphi = tcg_const_i64(0);
         tcg_gen_qemu_ld_i64(tmplo, tcg_addr, get_mem_index(s), memop);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
                   tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -1044,7 +1053,7 @@ static void do_fp_ld(DisasContext *s, int destidx, TCGv_i64 tcg_addr, int size)
         tcg_gen_qemu_ld_i64(tmplo, be ? tcg_hiaddr : tcg_addr, get_mem_index(s),
                             s->be_data | MO_Q);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
                   tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -1053,7 +1062,7 @@ static void do_fp_ld(DisasContext *s, int destidx, TCGv_i64 tcg_addr, int size)
         tcg_gen_qemu_ld_i64(tmphi, be ? tcg_addr : tcg_hiaddr, get_mem_index(s),
                             s->be_data | MO_Q);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
                   tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -1203,7 +1212,7 @@ static void do_vec_st(DisasContext *s, int srcidx, int element,
     read_vec_element(s, tcg_tmp, srcidx, element, size);
     tcg_gen_qemu_st_i64(tcg_tmp, tcg_addr, get_mem_index(s), memop);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_st_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_st_aa64(cpu_env,
 			      tcg_addr, tcg_const_i32( 1 << size /* size */ ),
 			      tcg_const_i32(IS_USER(s)),
 						       tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -1222,7 +1231,7 @@ static void do_vec_ld(DisasContext *s, int destidx, int element,
 
     tcg_gen_qemu_ld_i64(tcg_tmp, tcg_addr, get_mem_index(s), memop);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
                   tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -2144,7 +2153,7 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
             memop |= MO_64 | MO_ALIGN;
             tcg_gen_qemu_ld_i64(cpu_exclusive_val, addr, idx, memop);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
                   addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -2163,7 +2172,7 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
             tcg_gen_qemu_ld_i64(cpu_exclusive_val, addr, idx,
                                 memop | MO_ALIGN_16);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
                   addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -2172,7 +2181,7 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
             tcg_gen_addi_i64(addr2, addr, 8);
             tcg_gen_qemu_ld_i64(cpu_exclusive_high, addr2, idx, memop);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
                   addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -2186,7 +2195,7 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
         memop |= size | MO_ALIGN;
         tcg_gen_qemu_ld_i64(cpu_exclusive_val, addr, idx, memop);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
                   addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -2316,7 +2325,7 @@ static void disas_ldst_excl(DisasContext *s, uint32_t insn)
             s->is_ldex = true;
             gen_load_exclusive(s, rt, rt2, tcg_addr, size, is_pair);
 #ifdef CONFIG_FLEXUS
-                        FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+                        FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
                                       tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                                       tcg_const_i32(IS_USER(s)),
                                            tcg_const_tl(flexus_ins_pc), tcg_const_i32(1)) );
@@ -2330,7 +2339,7 @@ static void disas_ldst_excl(DisasContext *s, uint32_t insn)
                 tcg_gen_mb(TCG_MO_ALL | TCG_BAR_STRL);
             }
 #ifdef CONFIG_FLEXUS
-                        FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_st_aa64(cpu_env,
+                        FLEXUS_IF_TRACING_MEM( gen_helper_flexus_st_aa64(cpu_env,
                                       tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                                       tcg_const_i32(IS_USER(s)),
                                            tcg_const_tl(flexus_ins_pc), tcg_const_i32(1)) );
@@ -2998,7 +3007,7 @@ static void disas_ldst_multiple_struct(DisasContext *s, uint32_t insn)
                 if (is_store) {
                     do_vec_st(s, tt, e, tcg_addr, size);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_st_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_st_aa64(cpu_env,
                   tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -3007,7 +3016,7 @@ static void disas_ldst_multiple_struct(DisasContext *s, uint32_t insn)
                 } else {
                     do_vec_ld(s, tt, e, tcg_addr, size);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
                   tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -3143,7 +3152,7 @@ static void disas_ldst_single_struct(DisasContext *s, uint32_t insn)
             tcg_gen_qemu_ld_i64(tcg_tmp, tcg_addr,
                                 get_mem_index(s), s->be_data + scale);
 #ifdef CONFIG_FLEXUS
-            FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+            FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
 			              tcg_addr, tcg_const_i32( 1 << scale /* size */ ),
 			              tcg_const_i32(IS_USER(s)),
 			              tcg_const_tl(flexus_ins_pc),
@@ -3181,7 +3190,7 @@ static void disas_ldst_single_struct(DisasContext *s, uint32_t insn)
             if (is_load) {
                 do_vec_ld(s, rt, index, tcg_addr, scale);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_ld_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_ld_aa64(cpu_env,
                   tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -3190,7 +3199,7 @@ static void disas_ldst_single_struct(DisasContext *s, uint32_t insn)
             } else {
                 do_vec_st(s, rt, index, tcg_addr, scale);
 #ifdef CONFIG_FLEXUS
-    FLEXUS_IF_IN_SIMULATION( gen_helper_flexus_st_aa64(cpu_env,
+    FLEXUS_IF_TRACING_MEM( gen_helper_flexus_st_aa64(cpu_env,
                   tcg_addr, tcg_const_i32( 1 << size /* size */ ),
                   tcg_const_i32(IS_USER(s)),
                                tcg_const_tl(flexus_ins_pc), tcg_const_i32(0)) );
@@ -11528,6 +11537,27 @@ static void disas_a64_insn(CPUARMState *env, DisasContext *s)
     s->insn = insn;
     s->pc += 4;
 
+#ifdef CONFIG_FLEXUS
+    if (unlikely(qflex_capture_enabled())) {
+        /* TBs are looked up by physical address, so the physical PC of
+         * an instruction cannot change once it has been translated */
+        uint64_t paddr = mmu_logical_to_physical(arm_env_get_cpu(env),
+                                                 flexus_ins_pc);
+        uint32_t flags = IS_USER(s) ? QFLEX_CAPTURE_FLAG_USER : 0;
+        TCGv_i64 tcg_pc = tcg_const_i64(flexus_ins_pc);
+        TCGv_i64 tcg_paddr = tcg_const_i64(paddr);
+        TCGv_i32 tcg_insn = tcg_const_i32(insn);
+        TCGv_i32 tcg_info = tcg_const_i32(s->current_el | flags << 8);
+
+        gen_helper_qflex_capture_insn(cpu_env, tcg_pc, tcg_paddr,
+                                      tcg_insn, tcg_info);
+        tcg_temp_free_i64(tcg_pc);
+        tcg_temp_free_i64(tcg_paddr);
+        tcg_temp_free_i32(tcg_insn);
+        tcg_temp_free_i32(tcg_info);
+    }
+#endif /* CONFIG_FLEXUS */
+
 #if defined(CONFIG_FLEXUS) || defined(CONFIG_FA_QFLEX)
     if( flexus_in_timing() || unlikely(qflex_loglevel_mask(QFLEX_LOG_TB_EXEC))) {
         uint32_t flags = 4 | (bswap_code(s->sctlr_b) ? 2 : 0);
@@ -11536,6 +11566,14 @@ static void disas_a64_insn(CPUARMState *env, DisasContext *s)
                                               tcg_const_i32(flags),
                                               tcg_const_i32(QFLEX_EXEC_IN));
     }
+    if (unlikely(qflex_loglevel_mask(QFLEX_LOG_TB_EXEC_RAW))) {
+        TCGv_i64 tcg_pc = tcg_const_i64(flexus_ins_pc);
+        TCGv_i32 tcg_insn = tcg_const_i32(insn);
+
+        gen_helper_qflex_log_insn(cpu_env, tcg_pc, tcg_insn);
+        tcg_temp_free_i64(tcg_pc);
+        tcg_temp_free_i32(tcg_insn);
+    }
 #endif /* CONFIG_FLEXUS */ /* CONFIG_FA_QFLEX */
 
     s->fp_access_checked = false;
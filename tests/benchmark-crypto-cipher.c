@@ -14,17 +14,22 @@
 #include "crypto/init.h"
 #include "crypto/cipher.h"
 
-static void test_cipher_speed(const void *opaque)
+static void test_cipher_speed(size_t chunk_size,
+                              QCryptoCipherAlgorithm alg,
+                              QCryptoCipherMode mode,
+                              const char *name)
 {
     QCryptoCipher *cipher;
     Error *err = NULL;
     double total = 0.0;
-    size_t chunk_size = (size_t)opaque;
     uint8_t *key = NULL, *iv = NULL;
     uint8_t *plaintext = NULL, *ciphertext = NULL;
-    size_t nkey = qcrypto_cipher_get_key_len(QCRYPTO_CIPHER_ALG_AES_128);
-    size_t niv = qcrypto_cipher_get_iv_len(QCRYPTO_CIPHER_ALG_AES_128,
-                                           QCRYPTO_CIPHER_MODE_CBC);
+    size_t nkey = qcrypto_cipher_get_key_len(alg);
+    size_t niv = qcrypto_cipher_get_iv_len(alg, mode);
+
+    if (mode == QCRYPTO_CIPHER_MODE_XTS) {
+        nkey *= 2;
+    }
 
     key = g_new0(uint8_t, nkey);
     memset(key, g_test_rand_int(), nkey);
@@ -37,9 +42,7 @@ static void test_cipher_speed(const void *opaque)
     plaintext = g_new0(uint8_t, chunk_size);
     memset(plaintext, g_test_rand_int(), chunk_size);
 
-    cipher = qcrypto_cipher_new(QCRYPTO_CIPHER_ALG_AES_128,
-                                QCRYPTO_CIPHER_MODE_CBC,
-                                key, nkey, &err);
+    cipher = qcrypto_cipher_new(alg, mode, key, nkey, &err);
     g_assert(cipher != NULL);
 
     g_assert(qcrypto_cipher_setiv(cipher,
@@ -58,7 +61,7 @@ static void test_cipher_speed(const void *opaque)
 
     total /= 1024 * 1024; /* to MB */
 
-    g_print("cbc(aes128): ");
+    g_print("%s: ", name);
     g_print("Testing chunk_size %zu bytes ", chunk_size);
     g_print("done: %.2f MB in %.2f secs: ", total, g_test_timer_last());
     g_print("%.2f MB/sec\n", total / g_test_timer_last());
@@ -70,8 +73,29 @@ static void test_cipher_speed(const void *opaque)
     g_free(key);
 }
 
+static void test_cipher_speed_cbc_aes128(const void *opaque)
+{
+    test_cipher_speed((size_t)opaque, QCRYPTO_CIPHER_ALG_AES_128,
+                      QCRYPTO_CIPHER_MODE_CBC, "cbc(aes128)");
+}
+
+static void test_cipher_speed_xts_aes128(const void *opaque)
+{
+    test_cipher_speed((size_t)opaque, QCRYPTO_CIPHER_ALG_AES_128,
+                      QCRYPTO_CIPHER_MODE_XTS, "xts(aes128)");
+}
+
+static void test_cipher_speed_xts_aes256(const void *opaque)
+{
+    test_cipher_speed((size_t)opaque, QCRYPTO_CIPHER_ALG_AES_256,
+                      QCRYPTO_CIPHER_MODE_XTS, "xts(aes256)");
+}
+
 int main(int argc, char **argv)
 {
+    static const size_t xts_chunk_sizes[] = {
+        512, 4 * 1024, 64 * 1024, 1024 * 1024,
+    };
     size_t i;
     char name[64];
 
@@ -81,7 +105,19 @@ int main(int argc, char **argv)
     for (i = 512; i <= (64 * 1204); i *= 2) {
         memset(name, 0 , sizeof(name));
         snprintf(name, sizeof(name), "/crypto/cipher/speed-%zu", i);
-        g_test_add_data_func(name, (void *)i, test_cipher_speed);
+        g_test_add_data_func(name, (void *)i, test_cipher_speed_cbc_aes128);
+    }
+
+    /* XTS is what LUKS volumes use, up to the largest guest requests */
+    for (i = 0; i < ARRAY_SIZE(xts_chunk_sizes); i++) {
+        size_t n = xts_chunk_sizes[i];
+
+        memset(name, 0 , sizeof(name));
+        snprintf(name, sizeof(name), "/crypto/cipher/speed-xts-aes128-%zu", n);
+        g_test_add_data_func(name, (void *)n, test_cipher_speed_xts_aes128);
+        memset(name, 0 , sizeof(name));
+        snprintf(name, sizeof(name), "/crypto/cipher/speed-xts-aes256-%zu", n);
+        g_test_add_data_func(name, (void *)n, test_cipher_speed_xts_aes256);
     }
 
     return g_test_run();
@@ -0,0 +1,101 @@
+/*
+ * QFlex trace capture throughput benchmark
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qflex/qflex-capture.h"
+
+/* A loop of loads and stores over a 1 MB buffer, roughly what a guest
+ * kernel copy routine looks like */
+static void fill_record(QFlexCaptureRecord *rec, uint64_t i)
+{
+    uint64_t pc = 0xffff000008000000ULL + (i % 64) * 4;
+
+    rec->pc = pc;
+    rec->el = 1;
+    rec->flags = 0;
+    switch (i % 4) {
+    case 1:
+    case 2:
+        rec->type = i % 4 == 1 ? QFLEX_CAPTURE_LOAD : QFLEX_CAPTURE_STORE;
+        rec->vaddr = 0xffff800000100000ULL + (i * 8) % (1024 * 1024);
+        rec->paddr = rec->vaddr - 0xffff800000000000ULL;
+        rec->opcode = 0;
+        rec->size = 8;
+        break;
+    default:
+        rec->type = QFLEX_CAPTURE_INSN;
+        rec->vaddr = pc;
+        rec->paddr = pc - 0xffff000000000000ULL;
+        rec->opcode = 0xf9400000 | (i % 32);
+        rec->size = 4;
+        break;
+    }
+}
+
+static void test_capture_speed(void)
+{
+    char *filename = g_strdup_printf("%s/qflex-capture-bench-%d.qtrace",
+                                     g_get_tmp_dir(), getpid());
+    QFlexCaptureFile *f;
+    QFlexCaptureReader *r;
+    QFlexCaptureRecord rec, expected;
+    uint64_t i, n = 0;
+    double mb;
+    int ret;
+
+    f = qflex_capture_file_open(filename, 0, &error_abort);
+    g_test_timer_start();
+    do {
+        for (i = 0; i < 1024 * 1024; i++, n++) {
+            fill_record(qflex_capture_file_next(f), n);
+        }
+    } while (g_test_timer_elapsed() < 5.0);
+    g_assert_cmpint(qflex_capture_file_close(f), ==, 0);
+    g_test_timer_elapsed();
+
+    mb = (double)n * sizeof(QFlexCaptureRecord) / (1024 * 1024);
+    g_print("write: %" PRIu64 " records (%.2f MB) in %.2f secs: "
+            "%.2f Mrecords/sec, %.2f MB/sec\n",
+            n, mb, g_test_timer_last(),
+            n / g_test_timer_last() / 1e6, mb / g_test_timer_last());
+
+    r = qflex_capture_reader_open(filename, &error_abort);
+    g_assert_cmpint(qflex_capture_reader_cpu_index(r), ==, 0);
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        ret = qflex_capture_reader_next(r, &rec, &error_abort);
+        g_assert_cmpint(ret, ==, 1);
+    }
+    g_test_timer_elapsed();
+    g_assert_cmpint(qflex_capture_reader_next(r, &rec, &error_abort), ==, 0);
+
+    g_print("read: %" PRIu64 " records (%.2f MB) in %.2f secs: "
+            "%.2f Mrecords/sec, %.2f MB/sec\n",
+            n, mb, g_test_timer_last(),
+            n / g_test_timer_last() / 1e6, mb / g_test_timer_last());
+
+    /* Jumping into the middle of the trace only decompresses one chunk */
+    i = n / 2 + 3;
+    g_assert_cmpint(qflex_capture_reader_seek(r, i, &error_abort), ==, 0);
+    g_assert_cmpint(qflex_capture_reader_next(r, &rec, &error_abort), ==, 1);
+    fill_record(&expected, i);
+    g_assert(memcmp(&rec, &expected, sizeof(rec)) == 0);
+
+    qflex_capture_reader_close(r);
+    unlink(filename);
+    g_free(filename);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qflex/capture/speed", test_capture_speed);
+    return g_test_run();
+}
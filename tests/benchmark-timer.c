@@ -0,0 +1,89 @@
+/*
+ * QEMU timer list benchmark
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+
+static void dummy_cb(void *opaque)
+{
+}
+
+static void dummy_notify(void *opaque, QEMUClockType type)
+{
+}
+
+/* Re-arm random timers out of @nr_timers armed ones, the way devices
+ * reprogram their timers, and report the cost of one timer_mod_ns().
+ */
+static void test_timer_mod_speed(const void *opaque)
+{
+    size_t nr_timers = (uintptr_t)opaque;
+    QEMUTimerList *tl = timerlist_new(QEMU_CLOCK_REALTIME, dummy_notify, NULL);
+    QEMUTimer *timers = g_new0(QEMUTimer, nr_timers);
+    GRand *rand = g_rand_new_with_seed(nr_timers);
+    int64_t base = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                   3600 * NANOSECONDS_PER_SECOND;
+    uint64_t ops = 0;
+    size_t i;
+
+    for (i = 0; i < nr_timers; i++) {
+        timer_init_tl(&timers[i], tl, SCALE_NS, dummy_cb, NULL);
+        timer_mod_ns(&timers[i], base + g_rand_int(rand));
+    }
+
+    g_test_timer_start();
+    do {
+        for (i = 0; i < 100000; i++) {
+            QEMUTimer *ts = &timers[g_rand_int_range(rand, 0, nr_timers)];
+
+            if (i % 4 == 3) {
+                timer_del(ts);
+            }
+            timer_mod_ns(ts, base + g_rand_int(rand));
+        }
+        ops += 100000;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    g_print("%zu armed timers: %.1f ns per timer_mod_ns\n",
+            nr_timers, g_test_timer_last() * 1e9 / ops);
+
+    /* The earliest timer is cheap to find whatever the size */
+    g_test_timer_start();
+    for (i = 0; i < 1000000; i++) {
+        timerlist_deadline_ns(tl);
+    }
+    g_test_timer_elapsed();
+    g_print("%zu armed timers: %.1f ns per timerlist_deadline_ns\n",
+            nr_timers, g_test_timer_last() * 1e9 / 1000000);
+
+    for (i = 0; i < nr_timers; i++) {
+        timer_del(&timers[i]);
+    }
+    g_assert(!timerlist_has_timers(tl));
+
+    g_rand_free(rand);
+    g_free(timers);
+    timerlist_free(tl);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n;
+    char name[64];
+
+    g_test_init(&argc, &argv, NULL);
+    init_clocks(NULL);
+
+    for (n = 16; n <= 65536; n *= 16) {
+        snprintf(name, sizeof(name), "/timer/mod/%zu", n);
+        g_test_add_data_func(name, (void *)(uintptr_t)n, test_timer_mod_speed);
+    }
+
+    return g_test_run();
+}
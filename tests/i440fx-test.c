@@ -278,6 +278,103 @@ static void test_i440fx_pam(gconstpointer opaque)
     qtest_end();
 }
 
+/* Exercise incremental FlatView updates.  PAM writes switch the aliases
+ * that overlap RAM and PCI space in the BIOS areas, while moving the VGA
+ * BARs over each other and toggling memory decoding adds, removes and
+ * overlaps regions in the PCI address space.  QEMU_FLATVIEW_CHECK makes
+ * QEMU check every incrementally updated FlatView against a full render
+ * and abort if they differ.
+ */
+static void test_i440fx_flatview(gconstpointer opaque)
+{
+    const TestData *s = opaque;
+    QPCIBus *bus;
+    QPCIDevice *dev, *vga;
+    char *cmdline;
+    int i;
+
+    cmdline = g_strdup_printf("-smp %d -vga std", s->num_cpus);
+    setenv("QEMU_FLATVIEW_CHECK", "1", true);
+    qtest_start(cmdline);
+    unsetenv("QEMU_FLATVIEW_CHECK");
+    g_free(cmdline);
+    bus = qpci_init_pc(NULL);
+    dev = qpci_device_find(bus, QPCI_DEVFN(0, 0));
+    g_assert(dev != NULL);
+    vga = qpci_device_find(bus, QPCI_DEVFN(2, 0));
+    g_assert(vga != NULL);
+
+    qpci_config_writel(vga, PCI_BASE_ADDRESS_0, 0xE0000000);
+    qpci_config_writel(vga, PCI_BASE_ADDRESS_2, 0xE1000000);
+    qpci_config_writew(vga, PCI_COMMAND, PCI_COMMAND_MEMORY);
+
+    for (i = 0; i < 2000; i++) {
+        switch (g_test_rand_int_range(0, 4)) {
+        case 0:
+        case 1:
+            pam_set(dev, g_test_rand_int_range(1, 14),
+                    g_test_rand_int_range(0, 4));
+            break;
+        case 2:
+            /* Anywhere from below BAR0 to past its end */
+            qpci_config_writel(vga, PCI_BASE_ADDRESS_2,
+                               0xDFFF0000 +
+                               g_test_rand_int_range(0, 0x1020) * 0x1000);
+            break;
+        case 3:
+            qpci_config_writew(vga, PCI_COMMAND,
+                               qpci_config_readw(vga, PCI_COMMAND) ^
+                               PCI_COMMAND_MEMORY);
+            break;
+        }
+    }
+
+    /* QEMU is still alive and the BIOS area decodes as expected */
+    pam_set(dev, 1, PAM_RE | PAM_WE);
+    write_area(0xF0000, 0xFFFFF, 0x42);
+    g_assert(verify_area(0xF0000, 0xFFFFF, 0x42));
+
+    g_free(vga);
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+/* Time guest-triggered memory topology updates: each PAM write remaps
+ * one of the BIOS areas.  This runs without QEMU_FLATVIEW_CHECK, so only
+ * the incremental update is measured.
+ */
+static void test_i440fx_pam_perf(gconstpointer opaque)
+{
+    const TestData *s = opaque;
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    unsigned long i, updates = 20000;
+    double duration;
+
+    bus = test_start_get_bus(s);
+    dev = qpci_device_find(bus, QPCI_DEVFN(0, 0));
+    g_assert(dev != NULL);
+
+    g_test_timer_start();
+    for (i = 0; i < updates; i++) {
+        pam_set(dev, 2 + i % 12, i & 1 ? PAM_RE : PAM_RE | PAM_WE);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%lu PAM updates in %f s, %f us/update",
+                   updates, duration, duration * 1000000 / updates);
+
+    /* The topology must still be right after all these updates */
+    pam_set(dev, 1, PAM_RE | PAM_WE);
+    write_area(0xF0000, 0xFFFFF, 0x42);
+    g_assert(verify_area(0xF0000, 0xFFFFF, 0x42));
+
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
 #define BLOB_SIZE ((size_t)65536)
 #define ISA_BIOS_MAXSZ ((size_t)(128 * 1024))
 
@@ -406,6 +503,10 @@ int main(int argc, char **argv)
 
     qtest_add_data_func("i440fx/defaults", &data, test_i440fx_defaults);
     qtest_add_data_func("i440fx/pam", &data, test_i440fx_pam);
+    qtest_add_data_func("i440fx/flatview", &data, test_i440fx_flatview);
+    if (g_test_perf()) {
+        qtest_add_data_func("i440fx/perf/pam", &data, test_i440fx_pam_perf);
+    }
     add_firmware_test("i440fx/firmware/bios", request_bios);
     add_firmware_test("i440fx/firmware/pflash", request_pflash);
 
@@ -0,0 +1,88 @@
+/*
+ * QTest testcase for the main loop backends
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+/* Each request of the null driver sleeps on a QEMU_CLOCK_REALTIME timer */
+#define NULL_DRIVE(name) \
+    "-blockdev driver=null-co,node-name=" name ",size=1M,latency-ns=1000000 "
+
+typedef struct MainLoopStats {
+    int64_t iterations;
+    int64_t wakeups;
+    int64_t timeouts;
+    int64_t fds;
+} MainLoopStats;
+
+static void query_main_loop(const char *backend, MainLoopStats *stats)
+{
+    QDict *resp, *ret;
+
+    resp = qmp("{ 'execute': 'query-main-loop' }");
+    ret = qdict_get_qdict(resp, "return");
+    g_assert(ret);
+    g_assert_cmpstr(qdict_get_str(ret, "backend"), ==, backend);
+    stats->iterations = qdict_get_int(ret, "iterations");
+    stats->wakeups = qdict_get_int(ret, "wakeups");
+    stats->timeouts = qdict_get_int(ret, "timeouts");
+    stats->fds = qdict_get_int(ret, "fds");
+    g_assert_cmpint(qdict_get_int(ret, "busy-ns"), >=,
+                    qdict_get_int(ret, "max-busy-ns"));
+    QDECREF(resp);
+}
+
+/*
+ * Run a backup job between two null drives.  The job only makes progress
+ * when the main loop dispatches the completion of its requests, which
+ * arrive through timers, so the counters must grow while it runs.
+ */
+static void test_main_loop(const void *data)
+{
+    const char *backend = data;
+    MainLoopStats before, after;
+    QDict *resp;
+    char *args;
+
+    args = g_strdup_printf("-machine none -main-loop backend=%s "
+                           NULL_DRIVE("src") NULL_DRIVE("dst"), backend);
+    qtest_start(args);
+    g_free(args);
+
+    query_main_loop(backend, &before);
+    g_assert_cmpint(before.fds, >, 0);
+
+    resp = qmp("{ 'execute': 'blockdev-backup', 'arguments': {"
+               " 'job-id': 'job0', 'device': 'src', 'target': 'dst',"
+               " 'sync': 'full' } }");
+    g_assert(qdict_haskey(resp, "return"));
+    QDECREF(resp);
+    qmp_eventwait("BLOCK_JOB_COMPLETED");
+
+    query_main_loop(backend, &after);
+    g_assert_cmpint(after.iterations, >, before.iterations);
+    g_assert_cmpint(after.wakeups, >, before.wakeups);
+    g_assert_cmpint(after.timeouts, >, before.timeouts);
+    g_assert_cmpint(after.fds, >, 0);
+
+    qtest_end();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+#ifdef CONFIG_EPOLL_CREATE1
+    qtest_add_data_func("main-loop/native", "native", test_main_loop);
+#endif
+    qtest_add_data_func("main-loop/glib", "glib", test_main_loop);
+
+    return g_test_run();
+}
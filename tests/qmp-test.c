@@ -14,9 +14,11 @@
 #include "libqtest.h"
 #include "qapi-visit.h"
 #include "qapi/error.h"
+#include "qapi/qmp/qstring.h"
 #include "qapi/qobject-input-visitor.h"
 #include "qapi/util.h"
 #include "qapi/visitor.h"
+#include "qemu/sockets.h"
 
 const char common_args[] = "-nodefaults -machine none";
 
@@ -130,6 +132,105 @@ static void test_qmp_protocol(void)
     qtest_end();
 }
 
+static void test_qmp_oob(void)
+{
+    QDict *resp, *q, *ret;
+    QList *capabilities;
+    const QListEntry *entry;
+    gchar *sock_path, *args;
+    static const char *const in_band[] = { "lock", "queued-1", "queued-2" };
+    int in_band_done = 0;
+    bool unlocked;
+    const char *id;
+    int fd, i;
+
+    /* The monitor of libqtest stays in-band, add one that offers oob */
+    sock_path = g_strdup_printf("/tmp/qtest-%d-oob.qmp", getpid());
+    args = g_strdup_printf("%s -chardev socket,id=oob,path=%s,server,nowait "
+                           "-mon chardev=oob,mode=control,x-oob=on",
+                           common_args, sock_path);
+    global_qtest = qtest_init(args);
+    fd = unix_connect(sock_path, &error_abort);
+    unlink(sock_path);
+    g_free(sock_path);
+    g_free(args);
+
+    /* The greeting offers the 'oob' capability */
+    resp = qmp_fd_receive(fd);
+    q = qdict_get_qdict(resp, "QMP");
+    g_assert(q);
+    capabilities = qdict_get_qlist(q, "capabilities");
+    g_assert(capabilities && qlist_size(capabilities) == 1);
+    entry = qlist_first(capabilities);
+    g_assert_cmpstr(qstring_get_str(qobject_to_qstring(qlist_entry_obj(entry))),
+                    ==, "oob");
+    QDECREF(resp);
+
+    /* Out-of-band execution before the capability is enabled */
+    resp = qmp_fd(fd, "{ 'exec-oob': 'query-status', 'id': 'no-cap' }");
+    g_assert_cmpstr(get_error_class(resp), ==, "GenericError");
+    g_assert_cmpstr(qdict_get_try_str(resp, "id"), ==, "no-cap");
+    QDECREF(resp);
+
+    resp = qmp_fd(fd, "{ 'execute': 'qmp_capabilities', "
+                  "'arguments': { 'enable': [ 'oob' ] } }");
+    ret = qdict_get_qdict(resp, "return");
+    g_assert(ret && !qdict_size(ret));
+    QDECREF(resp);
+
+    /* Out-of-band execution without an id */
+    resp = qmp_fd(fd, "{ 'exec-oob': 'query-status' }");
+    g_assert_cmpstr(get_error_class(resp), ==, "GenericError");
+    g_assert(!qdict_haskey(resp, "id"));
+    QDECREF(resp);
+
+    /* Out-of-band execution of a command without 'allow-oob' */
+    resp = qmp_fd(fd, "{ 'exec-oob': 'query-kvm', 'id': 'no-oob' }");
+    g_assert_cmpstr(get_error_class(resp), ==, "GenericError");
+    g_assert_cmpstr(qdict_get_try_str(resp, "id"), ==, "no-oob");
+    QDECREF(resp);
+
+    /*
+     * Block the main loop, so that the next in-band commands stay
+     * queued, and check that an out-of-band command still gets through.
+     */
+    qmp_fd_send(fd, "{ 'execute': 'x-oob-test', 'arguments': { 'lock': true },"
+                " 'id': 'lock' }");
+    qmp_fd_send(fd, "{ 'execute': 'query-name', 'id': 'queued-1' }");
+    qmp_fd_send(fd, "{ 'execute': 'query-name', 'id': 'queued-2' }");
+    qmp_fd_send(fd, "{ 'exec-oob': 'query-status', 'id': 'oob' }");
+    resp = qmp_fd_receive(fd);
+    g_assert_cmpstr(qdict_get_try_str(resp, "id"), ==, "oob");
+    ret = qdict_get_qdict(resp, "return");
+    g_assert(ret && qdict_haskey(ret, "status"));
+    QDECREF(resp);
+
+    /*
+     * Release the main loop.  The in-band commands then complete in the
+     * order they were sent; the answer to the release can come anywhere.
+     */
+    qmp_fd_send(fd, "{ 'exec-oob': 'x-oob-test', 'arguments': { 'lock': false },"
+                " 'id': 'unlock' }");
+    for (i = 0, unlocked = false; i < 4; i++) {
+        resp = qmp_fd_receive(fd);
+        g_assert(qdict_haskey(resp, "return"));
+        id = qdict_get_try_str(resp, "id");
+        g_assert(id);
+        if (!strcmp(id, "unlock")) {
+            g_assert(!unlocked);
+            unlocked = true;
+        } else {
+            g_assert_cmpint(in_band_done, <, 3);
+            g_assert_cmpstr(id, ==, in_band[in_band_done++]);
+        }
+        QDECREF(resp);
+    }
+    g_assert(unlocked && in_band_done == 3);
+
+    close(fd);
+    qtest_end();
+}
+
 static int query_error_class(const char *cmd)
 {
     static struct {
@@ -308,6 +409,7 @@ int main(int argc, char *argv[])
     g_test_init(&argc, &argv, NULL);
 
     qtest_add_func("qmp/protocol", test_qmp_protocol);
+    qtest_add_func("qmp/oob", test_qmp_oob);
     qmp_schema_init(&schema);
     add_query_tests(&schema);
 
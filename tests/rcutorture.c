@@ -64,6 +64,7 @@
 #include "qemu/atomic.h"
 #include "qemu/rcu.h"
 #include "qemu/thread.h"
+#include "qemu/timer.h"
 
 long long n_reads = 0LL;
 long n_updates = 0L;
@@ -104,6 +105,44 @@ static void wait_all_threads(void)
     n_threads = 0;
 }
 
+/*
+ * Grace period latency histogram, in power-of-two buckets of nanoseconds.
+ */
+
+#define GP_HIST_BUCKETS 40
+
+static long long gp_hist[GP_HIST_BUCKETS];
+
+static void gp_hist_add(long long *hist, int64_t ns)
+{
+    int bucket = ns > 0 ? 63 - clz64(ns) : 0;
+
+    hist[MIN(bucket, GP_HIST_BUCKETS - 1)]++;
+}
+
+static void gp_hist_print(void)
+{
+    int i, first = -1, last = -1;
+
+    for (i = 0; i < GP_HIST_BUCKETS; i++) {
+        if (gp_hist[i]) {
+            last = i;
+            if (first < 0) {
+                first = i;
+            }
+        }
+    }
+    if (first < 0) {
+        return;
+    }
+
+    printf("grace period latency (ns):\n");
+    for (i = first; i <= last; i++) {
+        printf("  %12llu - %12llu: %lld\n",
+               1ULL << i, (2ULL << i) - 1, gp_hist[i]);
+    }
+}
+
 /*
  * Performance test.
  */
@@ -138,6 +177,9 @@ static void *rcu_read_perf_test(void *arg)
 static void *rcu_update_perf_test(void *arg)
 {
     long long n_updates_local = 0;
+    long long gp_hist_local[GP_HIST_BUCKETS] = { 0 };
+    int64_t start;
+    int i;
 
     rcu_register_thread();
 
@@ -147,11 +189,16 @@ static void *rcu_update_perf_test(void *arg)
         g_usleep(1000);
     }
     while (goflag == GOFLAG_RUN) {
+        start = get_clock();
         synchronize_rcu();
+        gp_hist_add(gp_hist_local, get_clock() - start);
         n_updates_local++;
     }
     qemu_mutex_lock(&counts_mutex);
     n_updates += n_updates_local;
+    for (i = 0; i < GP_HIST_BUCKETS; i++) {
+        gp_hist[i] += gp_hist_local[i];
+    }
     qemu_mutex_unlock(&counts_mutex);
 
     rcu_unregister_thread();
@@ -179,6 +226,7 @@ static void perftestrun(int nthreads, int duration, int nreaders, int nupdaters)
         (double)n_reads),
            ((duration * 1000*1000*1000.*(double)nupdaters) /
         (double)n_updates));
+    gp_hist_print();
     exit(0);
 }
 
@@ -405,6 +405,78 @@ static void test_aio_external_client(void)
     }
 }
 
+static int outer_poll(GArray *pollfds)
+{
+    return qemu_poll_ns((GPollFD *)pollfds->data, pollfds->len, 0);
+}
+
+static void test_outer_wait(void)
+{
+    EventNotifierTestData data = { .n = 0 };
+    AioContext *ctx2 = aio_context_new(&error_abort);
+    GArray *pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx2, &data.e, true, event_ready_cb, NULL);
+    while (aio_poll(ctx2, false));
+
+    atomic_add(&ctx2->notify_me, 2);
+    g_assert_cmpint(aio_context_add_pollfds(ctx2, pollfds), >, 0);
+    g_assert_cmpint(outer_poll(pollfds), ==, 0);
+
+    event_notifier_set(&data.e);
+    g_assert_cmpint(outer_poll(pollfds), >, 0);
+    g_assert(aio_poll(ctx2, false));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(outer_poll(pollfds), ==, 0);
+
+    aio_notify(ctx2);
+    g_assert_cmpint(outer_poll(pollfds), >, 0);
+    aio_poll(ctx2, false);
+    g_assert_cmpint(outer_poll(pollfds), ==, 0);
+
+    /* Disabled external clients must not wake up the outer loop */
+    aio_disable_external(ctx2);
+    event_notifier_set(&data.e);
+    g_array_set_size(pollfds, 0);
+    g_assert_cmpint(aio_context_add_pollfds(ctx2, pollfds), >, 0);
+    g_assert_cmpint(outer_poll(pollfds), ==, 0);
+    aio_enable_external(ctx2);
+    atomic_sub(&ctx2->notify_me, 2);
+
+    aio_set_event_notifier(ctx2, &data.e, true, NULL, NULL);
+    event_notifier_cleanup(&data.e);
+    g_array_free(pollfds, TRUE);
+    aio_context_unref(ctx2);
+}
+
+static void test_poll_once(void)
+{
+    EventNotifierTestData data = { .n = 0 };
+    AioContext *ctx2 = aio_context_new(&error_abort);
+
+    while (aio_poll(ctx2, false));
+    atomic_add(&ctx2->notify_me, 2);
+
+    /* ctx->notifier can be polled */
+    g_assert(!aio_context_poll_once(ctx2));
+    aio_notify(ctx2);
+    g_assert(aio_context_poll_once(ctx2));
+    aio_poll(ctx2, false);
+    g_assert(!aio_context_poll_once(ctx2));
+
+    /* A handler without ->io_poll() disables polling */
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx2, &data.e, false, event_ready_cb, NULL);
+    aio_notify(ctx2);
+    g_assert(!aio_context_poll_once(ctx2));
+    aio_set_event_notifier(ctx2, &data.e, false, NULL, NULL);
+    event_notifier_cleanup(&data.e);
+
+    atomic_sub(&ctx2->notify_me, 2);
+    aio_context_unref(ctx2);
+}
+
 static void test_wait_event_notifier_noflush(void)
 {
     EventNotifierTestData data = { .n = 0 };
@@ -863,6 +935,10 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/outer-wait",              test_outer_wait);
+#ifndef _WIN32
+    g_test_add_func("/aio/poll-once",               test_poll_once);
+#endif
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
@@ -23,6 +23,7 @@
 #include "crypto/init.h"
 #include "crypto/block.h"
 #include "qemu/buffer.h"
+#include "qemu/thread.h"
 #include "crypto/secret.h"
 #ifndef _WIN32
 #include <sys/resource.h>
@@ -271,6 +272,80 @@ static void test_block_assert_setup(const struct QCryptoBlockTestData *data,
 }
 
 
+#define TEST_BLOCK_THREADS 4
+#define TEST_BLOCK_CHUNK (64 * 1024)
+
+typedef struct TestBlockThread {
+    QemuThread thread;
+    QCryptoBlock *blk;
+    uint64_t offset;
+    uint8_t *buf;
+    bool encrypt;
+} TestBlockThread;
+
+static void *test_block_thread(void *opaque)
+{
+    TestBlockThread *t = opaque;
+
+    if (t->encrypt) {
+        g_assert(qcrypto_block_encrypt(t->blk, t->offset, t->buf,
+                                       TEST_BLOCK_CHUNK, &error_abort) == 0);
+    } else {
+        g_assert(qcrypto_block_decrypt(t->blk, t->offset, t->buf,
+                                       TEST_BLOCK_CHUNK, &error_abort) == 0);
+    }
+    return NULL;
+}
+
+static void test_block_run_threads(QCryptoBlock *blk, uint8_t *buf,
+                                   bool encrypt)
+{
+    TestBlockThread t[TEST_BLOCK_THREADS * 2];
+    size_t i;
+
+    /* More threads than ciphers, so that some of them have to wait */
+    for (i = 0; i < G_N_ELEMENTS(t); i++) {
+        t[i] = (TestBlockThread) {
+            .blk = blk,
+            .offset = i * TEST_BLOCK_CHUNK,
+            .buf = buf + i * TEST_BLOCK_CHUNK,
+            .encrypt = encrypt,
+        };
+        qemu_thread_create(&t[i].thread, "crypto", test_block_thread, &t[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < G_N_ELEMENTS(t); i++) {
+        qemu_thread_join(&t[i].thread);
+    }
+}
+
+/* Encrypting in parallel must give the same result as doing it inline */
+static void test_block_parallel(QCryptoBlock *blk)
+{
+    size_t len = TEST_BLOCK_THREADS * 2 * TEST_BLOCK_CHUNK;
+    uint8_t *plain = g_new(uint8_t, len);
+    uint8_t *serial = g_new(uint8_t, len);
+    uint8_t *parallel = g_new(uint8_t, len);
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        plain[i] = i * 7 + (i >> 9);
+    }
+    memcpy(serial, plain, len);
+    memcpy(parallel, plain, len);
+
+    g_assert(qcrypto_block_encrypt(blk, 0, serial, len, &error_abort) == 0);
+    test_block_run_threads(blk, parallel, true);
+    g_assert(memcmp(serial, parallel, len) == 0);
+
+    test_block_run_threads(blk, parallel, false);
+    g_assert(memcmp(plain, parallel, len) == 0);
+
+    g_free(plain);
+    g_free(serial);
+    g_free(parallel);
+}
+
 static void test_block(gconstpointer opaque)
 {
     const struct QCryptoBlockTestData *data = opaque;
@@ -304,6 +379,7 @@ static void test_block(gconstpointer opaque)
                              test_block_read_func,
                              &header,
                              0,
+                             1,
                              NULL);
     g_assert(blk == NULL);
 
@@ -312,6 +388,7 @@ static void test_block(gconstpointer opaque)
                              test_block_read_func,
                              &header,
                              QCRYPTO_BLOCK_OPEN_NO_IO,
+                             1,
                              &error_abort);
 
     g_assert(qcrypto_block_get_cipher(blk) == NULL);
@@ -326,10 +403,13 @@ static void test_block(gconstpointer opaque)
                              test_block_read_func,
                              &header,
                              0,
+                             TEST_BLOCK_THREADS,
                              &error_abort);
     g_assert(blk);
 
     test_block_assert_setup(data, blk);
+    g_assert_cmpint(qcrypto_block_get_n_threads(blk), ==, TEST_BLOCK_THREADS);
+    test_block_parallel(blk);
 
     qcrypto_block_free(blk);
 
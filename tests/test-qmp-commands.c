@@ -61,6 +61,10 @@ QObject *qmp_guest_sync(QObject *arg, Error **errp)
     return arg;
 }
 
+void qmp_test_command_oob(Error **errp)
+{
+}
+
 void qmp_boxed_struct(UserDefZero *arg, Error **errp)
 {
 }
@@ -135,6 +139,46 @@ static void test_dispatch_cmd_failure(void)
     QDECREF(req);
 }
 
+/* test that only commands marked with allow-oob run with exec-oob */
+static void test_dispatch_cmd_oob(void)
+{
+    QDict *req = qdict_new();
+    QObject *resp;
+
+    qdict_put_str(req, "exec-oob", "test-command-oob");
+    g_assert(qmp_is_oob(req));
+
+    resp = qmp_dispatch(&qmp_commands, QOBJECT(req));
+    assert(resp != NULL);
+    assert(!qdict_haskey(qobject_to_qdict(resp), "error"));
+
+    qobject_decref(resp);
+    QDECREF(req);
+
+    req = qdict_new();
+    qdict_put_str(req, "exec-oob", "user_def_cmd");
+
+    resp = qmp_dispatch(&qmp_commands, QOBJECT(req));
+    assert(resp != NULL);
+    assert(qdict_haskey(qobject_to_qdict(resp), "error"));
+
+    qobject_decref(resp);
+    QDECREF(req);
+
+    /* "execute" and "exec-oob" are mutually exclusive */
+    req = qdict_new();
+    qdict_put_str(req, "execute", "test-command-oob");
+    qdict_put_str(req, "exec-oob", "test-command-oob");
+    g_assert(!qmp_is_oob(req));
+
+    resp = qmp_dispatch(&qmp_commands, QOBJECT(req));
+    assert(resp != NULL);
+    assert(qdict_haskey(qobject_to_qdict(resp), "error"));
+
+    qobject_decref(resp);
+    QDECREF(req);
+}
+
 static QObject *test_qmp_dispatch(QDict *req)
 {
     QObject *resp_obj;
@@ -274,6 +318,7 @@ int main(int argc, char **argv)
     g_test_add_func("/0.15/dispatch_cmd", test_dispatch_cmd);
     g_test_add_func("/0.15/dispatch_cmd_failure", test_dispatch_cmd_failure);
     g_test_add_func("/0.15/dispatch_cmd_io", test_dispatch_cmd_io);
+    g_test_add_func("/qmp/dispatch_cmd_oob", test_dispatch_cmd_oob);
     g_test_add_func("/0.15/dealloc_types", test_dealloc_types);
     g_test_add_func("/0.15/dealloc_partial", test_dealloc_partial);
 
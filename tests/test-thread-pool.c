@@ -222,6 +222,56 @@ static void test_cancel_async(void)
     do_test_cancel(false);
 }
 
+static void test_max_threads(void)
+{
+    WorkerTestData data[20];
+    ThreadPoolInfo info;
+    int i;
+
+    aio_context_set_thread_pool_params(ctx, 0, 2, &error_abort);
+
+    thread_pool_get_info(pool, &info);
+    g_assert_cmpint(info.max_threads, ==, 2);
+
+    /* The earlier tests only needed one thread, so the pool is small */
+    for (i = 0; i < 20; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        data[i].aiocb = thread_pool_submit_aio(pool, worker_cb, &data[i],
+                                               done_cb, &data[i]);
+    }
+
+    active = 20;
+    while (active > 0) {
+        aio_poll(ctx, true);
+        thread_pool_get_info(pool, &info);
+        g_assert_cmpint(info.threads, <=, 2);
+    }
+    for (i = 0; i < 20; i++) {
+        g_assert_cmpint(data[i].n, ==, 1);
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+    g_assert_cmpuint(info.requests, >=, 20);
+    g_assert_cmpint(info.queue_depth, ==, 0);
+
+    aio_context_set_thread_pool_params(ctx, THREAD_POOL_MIN_THREADS_DEFAULT,
+                                       THREAD_POOL_MAX_THREADS_DEFAULT,
+                                       &error_abort);
+}
+
+static void test_invalid_params(void)
+{
+    Error *err = NULL;
+
+    aio_context_set_thread_pool_params(ctx, 0, 0, &err);
+    error_free_or_abort(&err);
+    aio_context_set_thread_pool_params(ctx, 4, 2, &err);
+    error_free_or_abort(&err);
+    aio_context_set_thread_pool_params(ctx, 0,
+                                       THREAD_POOL_MAX_THREADS_LIMIT + 1, &err);
+    error_free_or_abort(&err);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -234,6 +284,8 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit", test_submit);
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
+    g_test_add_func("/thread-pool/max-threads", test_max_threads);
+    g_test_add_func("/thread-pool/invalid-params", test_invalid_params);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
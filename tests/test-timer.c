@@ -0,0 +1,291 @@
+/*
+ * QEMU timer list tests
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+
+#define NR_TIMERS 1024
+
+typedef struct TestTimerList TestTimerList;
+
+typedef struct TestTimer {
+    QEMUTimer timer;
+    TestTimerList *ttl;
+    int64_t expire;
+    uint64_t order;     /* when the timer was last armed */
+    bool armed;
+} TestTimer;
+
+struct TestTimerList {
+    QEMUTimerList *tl;
+    TestTimer timers[NR_TIMERS];
+    TestTimer *fired[NR_TIMERS];
+    size_t nr_fired;
+    uint64_t order;
+};
+
+static void dummy_notify(void *opaque, QEMUClockType type)
+{
+}
+
+static void test_timer_cb(void *opaque)
+{
+    TestTimer *t = opaque;
+    TestTimerList *ttl = t->ttl;
+
+    g_assert(t->armed);
+    g_assert_cmpint(ttl->nr_fired, <, NR_TIMERS);
+    t->armed = false;
+    ttl->fired[ttl->nr_fired++] = t;
+}
+
+static TestTimerList *test_timer_list_new(void)
+{
+    TestTimerList *ttl = g_new0(TestTimerList, 1);
+    size_t i;
+
+    ttl->tl = timerlist_new(QEMU_CLOCK_REALTIME, dummy_notify, NULL);
+    for (i = 0; i < NR_TIMERS; i++) {
+        ttl->timers[i].ttl = ttl;
+        timer_init_tl(&ttl->timers[i].timer, ttl->tl, SCALE_NS,
+                      test_timer_cb, &ttl->timers[i]);
+    }
+    return ttl;
+}
+
+static void test_timer_list_free(TestTimerList *ttl)
+{
+    size_t i;
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        timer_del(&ttl->timers[i].timer);
+    }
+    g_assert(!timerlist_has_timers(ttl->tl));
+    timerlist_free(ttl->tl);
+    g_free(ttl);
+}
+
+static void test_timer_arm(TestTimer *t, int64_t expire)
+{
+    t->expire = expire;
+    t->order = t->ttl->order++;
+    t->armed = true;
+    timer_mod_ns(&t->timer, expire);
+}
+
+static void test_timer_del(TestTimer *t)
+{
+    t->armed = false;
+    timer_del(&t->timer);
+}
+
+static void test_timer_shuffle(GRand *rand, int *perm)
+{
+    int i, j, tmp;
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        perm[i] = i;
+    }
+    for (i = NR_TIMERS - 1; i > 0; i--) {
+        j = g_rand_int_range(rand, 0, i + 1);
+        tmp = perm[i];
+        perm[i] = perm[j];
+        perm[j] = tmp;
+    }
+}
+
+/* Earlier expiry first, then the timer that was armed first */
+static int test_timer_cmp(const void *a, const void *b)
+{
+    const TestTimer *ta = *(TestTimer * const *)a;
+    const TestTimer *tb = *(TestTimer * const *)b;
+
+    if (ta->expire != tb->expire) {
+        return ta->expire < tb->expire ? -1 : 1;
+    }
+    return ta->order < tb->order ? -1 : ta->order > tb->order;
+}
+
+/* Fire every armed timer and check that they ran in the same order as a
+ * sorted copy of the armed timers.  All deadlines are in the past.
+ */
+static void test_timer_check_fire_order(TestTimerList *ttl)
+{
+    TestTimer *expected[NR_TIMERS];
+    size_t nr_armed = 0;
+    size_t i;
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        g_assert_cmpint(timer_pending(&ttl->timers[i].timer), ==,
+                        ttl->timers[i].armed);
+        if (ttl->timers[i].armed) {
+            expected[nr_armed++] = &ttl->timers[i];
+        }
+    }
+    qsort(expected, nr_armed, sizeof(expected[0]), test_timer_cmp);
+
+    ttl->nr_fired = 0;
+    g_assert(timerlist_run_timers(ttl->tl) == (nr_armed > 0));
+    g_assert(!timerlist_has_timers(ttl->tl));
+
+    g_assert_cmpint(ttl->nr_fired, ==, nr_armed);
+    for (i = 0; i < nr_armed; i++) {
+        g_assert(ttl->fired[i] == expected[i]);
+    }
+}
+
+/* Check that the deadline of the list is the one of the earliest armed
+ * timer.  The list reports it relative to the time it was asked at.
+ */
+static void test_timer_check_deadline(TestTimerList *ttl)
+{
+    int64_t earliest = -1;
+    int64_t before, after, deadline;
+    size_t i;
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        TestTimer *t = &ttl->timers[i];
+
+        if (t->armed && (earliest == -1 || t->expire < earliest)) {
+            earliest = t->expire;
+        }
+    }
+
+    before = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    deadline = timerlist_deadline_ns(ttl->tl);
+    after = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (earliest == -1) {
+        g_assert_cmpint(deadline, ==, -1);
+        return;
+    }
+    g_assert_cmpint(before + deadline, <=, earliest);
+    g_assert_cmpint(after + deadline, >=, earliest);
+}
+
+/* Timers with the same deadline fire in the order they were armed, also
+ * when some of them are re-armed or deleted in between.
+ */
+static void test_timer_equal(void)
+{
+    TestTimerList *ttl = test_timer_list_new();
+    GRand *rand = g_rand_new_with_seed(1);
+    int perm[NR_TIMERS];
+    int i;
+
+    test_timer_shuffle(rand, perm);
+    for (i = 0; i < NR_TIMERS; i++) {
+        test_timer_arm(&ttl->timers[perm[i]], 1000);
+    }
+    for (i = 0; i < NR_TIMERS / 4; i++) {
+        TestTimer *t = &ttl->timers[g_rand_int_range(rand, 0, NR_TIMERS)];
+
+        if (i % 2) {
+            test_timer_del(t);
+        } else {
+            test_timer_arm(t, 1000);
+        }
+    }
+    test_timer_check_fire_order(ttl);
+
+    g_rand_free(rand);
+    test_timer_list_free(ttl);
+}
+
+/* Random deadlines from a small range, so that many are equal, with
+ * random re-arms and deletions that mostly hit timers below the root.
+ */
+static void test_timer_random(void)
+{
+    TestTimerList *ttl = test_timer_list_new();
+    GRand *rand = g_rand_new_with_seed(2);
+    int round, i;
+
+    for (round = 0; round < 16; round++) {
+        for (i = 0; i < NR_TIMERS; i++) {
+            if (g_rand_boolean(rand)) {
+                test_timer_arm(&ttl->timers[i],
+                               g_rand_int_range(rand, 1, 256));
+            }
+        }
+        for (i = 0; i < 4 * NR_TIMERS; i++) {
+            TestTimer *t = &ttl->timers[g_rand_int_range(rand, 0, NR_TIMERS)];
+
+            if (g_rand_int_range(rand, 0, 3) == 0) {
+                test_timer_del(t);
+            } else {
+                test_timer_arm(t, g_rand_int_range(rand, 1, 256));
+            }
+        }
+        test_timer_check_fire_order(ttl);
+    }
+
+    g_rand_free(rand);
+    test_timer_list_free(ttl);
+}
+
+/* Delete timers that are not the root, then check that the others still
+ * come out of the heap in deadline order.
+ */
+static void test_timer_del_nonroot(void)
+{
+    TestTimerList *ttl = test_timer_list_new();
+    GRand *rand = g_rand_new_with_seed(3);
+    int64_t base = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                   3600 * NANOSECONDS_PER_SECOND;
+    int perm[NR_TIMERS];
+    int i;
+
+    /* timers[0] is the earliest and stays at the root */
+    test_timer_arm(&ttl->timers[0], base - 1);
+    for (i = 1; i < NR_TIMERS; i++) {
+        test_timer_arm(&ttl->timers[i], base + g_rand_int_range(rand, 0, 64));
+    }
+    test_timer_check_deadline(ttl);
+
+    /* Take out half of the others, in random order */
+    test_timer_shuffle(rand, perm);
+    for (i = 0; i < NR_TIMERS / 2; i++) {
+        if (perm[i] != 0) {
+            test_timer_del(&ttl->timers[perm[i]]);
+            test_timer_check_deadline(ttl);
+        }
+    }
+
+    /* Then keep deleting the root, the next earliest must take its place */
+    while (timerlist_has_timers(ttl->tl)) {
+        TestTimer *earliest = NULL;
+
+        for (i = 0; i < NR_TIMERS; i++) {
+            TestTimer *t = &ttl->timers[i];
+
+            if (t->armed && (!earliest || t->expire < earliest->expire)) {
+                earliest = t;
+            }
+        }
+        g_assert(earliest);
+        test_timer_del(earliest);
+        test_timer_check_deadline(ttl);
+    }
+
+    g_rand_free(rand);
+    test_timer_list_free(ttl);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    init_clocks(NULL);
+
+    g_test_add_func("/timer/heap/equal", test_timer_equal);
+    g_test_add_func("/timer/heap/random", test_timer_random);
+    g_test_add_func("/timer/heap/del-nonroot", test_timer_del_nonroot);
+
+    return g_test_run();
+}
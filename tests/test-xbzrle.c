@@ -14,6 +14,7 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "../migration/xbzrle.h"
+#include "../migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -174,6 +175,142 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_CASES 64
+
+static void fill_random_runs(uint8_t *old, uint8_t *new, int runs, int max_len)
+{
+    int i, j;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int_range(0, 4);
+    }
+    memcpy(new, old, PAGE_SIZE);
+    for (i = 0; i < runs; i++) {
+        int start = g_test_rand_int_range(0, PAGE_SIZE);
+        int len = g_test_rand_int_range(1, max_len + 1);
+
+        for (j = start; j < start + len && j < PAGE_SIZE; j++) {
+            new[j] = old[j] ^ g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+static void test_encode_decode_accel(void)
+{
+    uint8_t *old = g_malloc(ACCEL_CASES * PAGE_SIZE);
+    uint8_t *new = g_malloc(ACCEL_CASES * PAGE_SIZE);
+    uint8_t *ref = g_malloc(ACCEL_CASES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    int ref_len[ACCEL_CASES], dlen_max[ACCEL_CASES];
+    int i, dlen, rc;
+
+    for (i = 0; i < ACCEL_CASES; i++) {
+        fill_random_runs(old + i * PAGE_SIZE, new + i * PAGE_SIZE,
+                         i, 1 + i * 4);
+        dlen_max[i] = g_test_rand_int_range(PAGE_SIZE / 8, PAGE_SIZE + 1);
+        ref_len[i] = xbzrle_encode_buffer(old + i * PAGE_SIZE,
+                                          new + i * PAGE_SIZE, PAGE_SIZE,
+                                          ref + i * PAGE_SIZE, dlen_max[i]);
+        if (ref_len[i] > 0) {
+            memcpy(decoded, old + i * PAGE_SIZE, PAGE_SIZE);
+            rc = xbzrle_decode_buffer(ref + i * PAGE_SIZE, ref_len[i],
+                                      decoded, PAGE_SIZE);
+            g_assert(rc > 0);
+            g_assert(memcmp(decoded, new + i * PAGE_SIZE, PAGE_SIZE) == 0);
+        }
+    }
+
+    /* Every encoder must produce the same stream as the preferred one */
+    while (test_xbzrle_encode_next_accel()) {
+        for (i = 0; i < ACCEL_CASES; i++) {
+            dlen = xbzrle_encode_buffer(old + i * PAGE_SIZE,
+                                        new + i * PAGE_SIZE, PAGE_SIZE,
+                                        compressed, dlen_max[i]);
+            g_assert_cmpint(dlen, ==, ref_len[i]);
+            if (dlen > 0) {
+                g_assert(memcmp(compressed, ref + i * PAGE_SIZE, dlen) == 0);
+            }
+        }
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(compressed);
+    g_free(decoded);
+}
+
+static void test_page_cache_lru(void)
+{
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    /* 16 pages as 2 sets of 8 ways; even pages all map to set 0 */
+    PageCache *cache = cache_init(16, PAGE_SIZE);
+    uint64_t age = 10;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        page[0] = i;
+        g_assert_cmpint(cache_insert(cache, i * 2 * PAGE_SIZE, page, age),
+                        ==, 0);
+    }
+    for (i = 0; i < 8; i++) {
+        g_assert(cache_is_cached(cache, i * 2 * PAGE_SIZE, age));
+        g_assert_cmpint(get_cached_data(cache, i * 2 * PAGE_SIZE)[0], ==, i);
+    }
+
+    /* The set is full of fresh pages, nothing gets evicted */
+    g_assert_cmpint(cache_insert(cache, 16 * PAGE_SIZE, page, age), ==, -1);
+    g_assert(!cache_is_cached(cache, 16 * PAGE_SIZE, age));
+
+    /* Touch all but page 6, which becomes the least recently used */
+    age += 2;
+    for (i = 0; i < 8; i++) {
+        if (i != 3) {
+            g_assert(cache_is_cached(cache, i * 2 * PAGE_SIZE, age - 2));
+        }
+    }
+    g_assert_cmpint(cache_insert(cache, 16 * PAGE_SIZE, page, age), ==, 1);
+    g_assert(cache_is_cached(cache, 16 * PAGE_SIZE, age));
+    g_assert(!cache_is_cached(cache, 6 * PAGE_SIZE, age));
+    g_assert(get_cached_data(cache, 6 * PAGE_SIZE) == NULL);
+
+    /* The other set is untouched */
+    g_assert(!cache_is_cached(cache, PAGE_SIZE, age));
+
+    cache_fini(cache);
+    g_free(page);
+}
+
+static void perf_encode(void)
+{
+    uint8_t *old = g_malloc0(PAGE_SIZE);
+    uint8_t *new = g_malloc0(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    unsigned long i, maxcycles = 1000000;
+    double duration;
+
+    /* a typical dirty page: a few small writes spread over the page */
+    for (i = 0; i < PAGE_SIZE; i += 512) {
+        new[i] = 1;
+        new[i + 7] = 1;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < maxcycles; i++) {
+        xbzrle_encode_buffer(old, new, PAGE_SIZE, compressed, PAGE_SIZE);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Encoded %lu pages in %f s, %f MB/s",
+                   maxcycles, duration,
+                   maxcycles * PAGE_SIZE / duration / 1000000);
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +323,12 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/page_cache_lru", test_page_cache_lru);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/encode", perf_encode);
+    }
+    /* Must run last, it cycles through the encoder implementations */
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
 
     return g_test_run();
 }
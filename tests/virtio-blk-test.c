@@ -17,6 +17,7 @@
 #include "libqos/virtio-mmio.h"
 #include "libqos/malloc-generic.h"
 #include "qemu/bswap.h"
+#include "qapi/qmp/qstring.h"
 #include "standard-headers/linux/virtio_ids.h"
 #include "standard-headers/linux/virtio_config.h"
 #include "standard-headers/linux/virtio_ring.h"
@@ -653,6 +654,272 @@ static void pci_idx(void)
     qtest_shutdown(qs);
 }
 
+/* Write a sector through @vq and read it back */
+static void test_queue_rw(QVirtioDevice *dev, QGuestAllocator *alloc,
+                          QVirtQueue *vq, uint64_t sector)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+    char *data;
+
+    req.type = VIRTIO_BLK_T_OUT;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_strdup_printf("%-511" PRIu64, sector);
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, 512, false, true);
+    qvirtqueue_add(vq, req_addr + 528, 1, true, false);
+    qvirtqueue_kick(dev, vq, free_head);
+
+    qvirtio_wait_used_elem(dev, vq, free_head, QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(readb(req_addr + 528), ==, 0);
+    guest_free(alloc, req_addr);
+
+    req.type = VIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = sector;
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, 512, true, true);
+    qvirtqueue_add(vq, req_addr + 528, 1, true, false);
+    qvirtqueue_kick(dev, vq, free_head);
+
+    qvirtio_wait_used_elem(dev, vq, free_head, QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(readb(req_addr + 528), ==, 0);
+
+    data = g_malloc0(512);
+    memread(req_addr + 16, data, 512);
+    g_assert(memcmp(data, req.data, 512) == 0);
+    g_free(data);
+    g_free(req.data);
+    guest_free(alloc, req_addr);
+}
+
+static void pci_iothreads(void)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueuePCI *vqpci[4];
+    QDict *response;
+    char *tmp_path;
+    uint32_t features;
+    int i, round;
+
+    tmp_path = drive_create();
+    qs = qtest_pc_boot("-object iothread,id=iothread0 "
+                       "-object iothread,id=iothread1 "
+                       "-drive if=none,id=drive0,file=%s,format=raw "
+                       "-drive if=none,id=drive1,file=null-co://,format=raw "
+                       "-device virtio-blk-pci,id=drv0,drive=drive0,"
+                       "num-queues=4,iothreads=iothread0:iothread1,"
+                       "addr=%x.%x",
+                       tmp_path, PCI_SLOT, PCI_FN);
+    unlink(tmp_path);
+    g_free(tmp_path);
+
+    dev = virtio_blk_pci_init(qs->pcibus, PCI_SLOT);
+    for (i = 0; i < ARRAY_SIZE(vqpci); i++) {
+        vqpci[i] = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev,
+                                                     qs->alloc, i);
+    }
+
+    features = qvirtio_get_features(&dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(&dev->vdev, features);
+    qvirtio_set_driver_ok(&dev->vdev);
+
+    /* Each IOThread services two of the queues */
+    for (round = 0; round < 4; round++) {
+        for (i = 0; i < ARRAY_SIZE(vqpci); i++) {
+            test_queue_rw(&dev->vdev, qs->alloc, &vqpci[i]->vq,
+                          round * ARRAY_SIZE(vqpci) + i);
+        }
+    }
+
+    for (i = 0; i < ARRAY_SIZE(vqpci); i++) {
+        qvirtqueue_cleanup(dev->vdev.bus, &vqpci[i]->vq, qs->alloc);
+    }
+    qvirtio_pci_device_disable(dev);
+    qvirtio_pci_device_free(dev);
+
+    /* Unknown IOThreads are rejected */
+    response = qmp("{'execute': 'device_add', 'arguments': {"
+                   " 'driver': 'virtio-blk-pci', 'id': 'drv1',"
+                   " 'drive': 'drive1', 'iothreads': 'iothread0:nothere'}}");
+    g_assert(qdict_haskey(response, "error"));
+    QDECREF(response);
+
+    qtest_shutdown(qs);
+}
+
+typedef struct IOThreadGroupStats {
+    int64_t poll_ns;
+    int64_t successes;
+    int64_t failures;
+    int64_t throttled;
+    int64_t time_ns;
+} IOThreadGroupStats;
+
+/* Check the members and budget of @id and return its polling counters */
+static void query_iothread_group(const char *id, const char *members,
+                                 int64_t budget, IOThreadGroupStats *stats)
+{
+    QDict *response, *group = NULL;
+    const QListEntry *entry;
+    GString *names = g_string_new("");
+
+    response = qmp("{'execute': 'query-iothread-groups'}");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(response, "return"), entry) {
+        QDict *info = qobject_to_qdict(qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(info, "id"), id)) {
+            group = info;
+        }
+    }
+    g_assert(group);
+
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(group, "members"), entry) {
+        g_string_append_printf(names, "%s%s", names->len ? ":" : "",
+            qstring_get_str(qobject_to_qstring(qlist_entry_obj(entry))));
+    }
+    g_assert_cmpstr(names->str, ==, members);
+    g_assert_cmpint(qdict_get_int(group, "poll-budget"), ==, budget);
+
+    stats->poll_ns = qdict_get_int(group, "poll-ns");
+    stats->successes = qdict_get_int(group, "poll-successes");
+    stats->failures = qdict_get_int(group, "poll-failures");
+    stats->throttled = qdict_get_int(group, "poll-throttled");
+    stats->time_ns = qdict_get_int(group, "poll-time-ns");
+
+    g_string_free(names, true);
+    QDECREF(response);
+}
+
+static void iothread_group_rw(QVirtioDevice *dev, QGuestAllocator *alloc,
+                              QVirtQueuePCI **vqpci, int rounds)
+{
+    static uint64_t sector;
+    int i, round;
+
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < 2; i++) {
+            test_queue_rw(dev, alloc, &vqpci[i]->vq, sector++);
+        }
+    }
+}
+
+static void pci_iothread_group(void)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueuePCI *vqpci[2];
+    IOThreadGroupStats before, after;
+    QDict *response;
+    char *tmp_path;
+    uint32_t features;
+    int i;
+
+    /*
+     * Both queues are served by the group's thread.  A poll-max-ns of one
+     * second makes every wait of the test grow poll_ns, so that busy
+     * polling rounds actually happen.
+     */
+    tmp_path = drive_create();
+    qs = qtest_pc_boot("-object iothread-group,id=group0,poll-budget=50,"
+                       "poll-max-ns=1000000000 "
+                       "-object iothread,id=iothread0,group=group0 "
+                       "-object iothread,id=iothread1,group=group0 "
+                       "-drive if=none,id=drive0,file=%s,format=raw "
+                       "-device virtio-blk-pci,id=drv0,drive=drive0,"
+                       "num-queues=2,iothreads=iothread0:iothread1,"
+                       "addr=%x.%x",
+                       tmp_path, PCI_SLOT, PCI_FN);
+    unlink(tmp_path);
+    g_free(tmp_path);
+
+    dev = virtio_blk_pci_init(qs->pcibus, PCI_SLOT);
+    for (i = 0; i < ARRAY_SIZE(vqpci); i++) {
+        vqpci[i] = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev,
+                                                     qs->alloc, i);
+    }
+
+    features = qvirtio_get_features(&dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(&dev->vdev, features);
+    qvirtio_set_driver_ok(&dev->vdev);
+
+    /* Requests on both members go through busy polling or the wait */
+    query_iothread_group("group0", "iothread0:iothread1", 50, &before);
+    iothread_group_rw(&dev->vdev, qs->alloc, vqpci, 8);
+    query_iothread_group("group0", "iothread0:iothread1", 50, &after);
+    g_assert_cmpint(after.successes + after.failures, >,
+                    before.successes + before.failures);
+    g_assert_cmpint(after.time_ns, >, before.time_ns);
+
+    /* Members come and go while the group runs */
+    response = qmp("{'execute': 'object-add', 'arguments': {"
+                   " 'qom-type': 'iothread', 'id': 'iothread2',"
+                   " 'props': { 'group': 'group0' } } }");
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+    query_iothread_group("group0", "iothread0:iothread1:iothread2", 50,
+                         &after);
+    iothread_group_rw(&dev->vdev, qs->alloc, vqpci, 2);
+
+    response = qmp("{'execute': 'object-del', 'arguments': {"
+                   " 'id': 'iothread2' } }");
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+    query_iothread_group("group0", "iothread0:iothread1", 50, &after);
+    iothread_group_rw(&dev->vdev, qs->alloc, vqpci, 2);
+
+    /* A group with members cannot be deleted */
+    response = qmp("{'execute': 'object-del', 'arguments': {"
+                   " 'id': 'group0' } }");
+    g_assert(qdict_haskey(response, "error"));
+    QDECREF(response);
+
+    /*
+     * Without budget the group stops busy polling and only waits.  The
+     * first requests may still complete in an iteration that started
+     * with the old budget, so only compare from the next ones on.
+     */
+    response = qmp("{'execute': 'qom-set', 'arguments': {"
+                   " 'path': '/objects/group0', 'property': 'poll-budget',"
+                   " 'value': 0 } }");
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+    iothread_group_rw(&dev->vdev, qs->alloc, vqpci, 2);
+
+    query_iothread_group("group0", "iothread0:iothread1", 0, &before);
+    g_assert_cmpint(before.poll_ns, >, 0);
+    iothread_group_rw(&dev->vdev, qs->alloc, vqpci, 4);
+    query_iothread_group("group0", "iothread0:iothread1", 0, &after);
+    g_assert_cmpint(after.successes, ==, before.successes);
+    g_assert_cmpint(after.failures, ==, before.failures);
+    g_assert_cmpint(after.time_ns, ==, before.time_ns);
+    g_assert_cmpint(after.throttled, >, before.throttled);
+
+    for (i = 0; i < ARRAY_SIZE(vqpci); i++) {
+        qvirtqueue_cleanup(dev->vdev.bus, &vqpci[i]->vq, qs->alloc);
+    }
+    qvirtio_pci_device_disable(dev);
+    qvirtio_pci_device_free(dev);
+    qtest_shutdown(qs);
+}
+
 static void pci_hotplug(void)
 {
     QVirtioPCIDevice *dev;
@@ -730,6 +997,9 @@ int main(int argc, char **argv)
         if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
             qtest_add_func("/virtio/blk/pci/msix", pci_msix);
             qtest_add_func("/virtio/blk/pci/idx", pci_idx);
+            qtest_add_func("/virtio/blk/pci/iothreads", pci_iothreads);
+            qtest_add_func("/virtio/blk/pci/iothread-group",
+                           pci_iothread_group);
         }
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
     } else if (strcmp(arch, "arm") == 0) {
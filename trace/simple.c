@@ -13,6 +13,7 @@
 #include <pthread.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/thread.h"
 #include "trace/control.h"
 #include "trace/simple.h"
 #include "qemu/error-report.h"
@@ -24,7 +25,7 @@
 #define HEADER_MAGIC 0xf2b177cb0aa429b4ULL
 
 /** Trace file version number, bump if format changes */
-#define HEADER_VERSION 4
+#define HEADER_VERSION 5
 
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
@@ -33,8 +34,11 @@
 #define TRACE_RECORD_VALID ((uint64_t)1 << 63)
 
 /*
- * Trace records are written out by a dedicated thread.  The thread waits for
- * records to become available, writes them out, and then waits again.
+ * Every thread that emits trace events gets its own ring buffer, so that
+ * vCPUs and IOThreads never contend on a shared reservation index.  Records
+ * are written out by a dedicated thread, which waits for records to become
+ * available, merges the per-thread buffers by timestamp, writes the records
+ * out, and then waits again.
  */
 static CompatGMutex trace_lock;
 static CompatGCond trace_available_cond;
@@ -48,10 +52,35 @@ enum {
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
-static volatile gint dropped_events;
+/*
+ * Per-thread trace buffer.  The owning thread reserves space with a
+ * compare-and-swap on @idx (a signal handler may emit events while the
+ * thread is in the middle of a record), the writeout thread is the only
+ * one that advances @writeout_idx.
+ *
+ * Buffers are never freed.  When a thread exits, its buffer is handed back
+ * and reused by the next thread that starts tracing; whatever it still
+ * holds is written out in the meantime.  @tid is the host thread id of the
+ * current owner, and is reported together with the dropped events.
+ */
+typedef struct TraceThreadBuffer {
+    uint8_t buf[TRACE_BUF_LEN];
+    volatile gint idx;
+    unsigned int writeout_idx;
+    volatile gint dropped_events;
+    volatile gint in_use;
+    int tid;
+    struct TraceThreadBuffer *next;
+} TraceThreadBuffer;
+
+static TraceThreadBuffer *volatile trace_buffers;
+#ifndef CONFIG_PTH
+static __thread TraceThreadBuffer *trace_thread_buffer;
+static __thread Notifier trace_thread_exit_notifier;
+#else
+/* All pth threads run on the same host thread and share one buffer */
+static TraceThreadBuffer *trace_thread_buffer;
+#endif
 static uint32_t trace_pid;
 static FILE *trace_fp;
 static char *trace_file_name;
@@ -75,52 +104,76 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_buffer(TraceThreadBuffer *tbuf, unsigned int idx,
+                             void *dataptr, size_t size);
+static unsigned int write_to_buffer(TraceThreadBuffer *tbuf, unsigned int idx,
+                                    void *dataptr, size_t size);
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+static void clear_buffer_range(TraceThreadBuffer *tbuf, unsigned int idx,
+                               size_t len)
 {
     uint32_t num = 0;
     while (num < len) {
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        trace_buf[idx++] = 0;
+        tbuf->buf[idx++] = 0;
         num++;
     }
 }
+
 /**
- * Read a trace record from the trace buffer
+ * Look at the next trace record of a thread buffer without consuming it
  *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * @tbuf        Thread buffer
+ * @record      Trace record header to fill
  *
- * Returns false if the record is not valid.
+ * Returns false if there is no valid record.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static bool peek_trace_record(TraceThreadBuffer *tbuf, TraceRecord *record)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    unsigned int idx = tbuf->writeout_idx % TRACE_BUF_LEN;
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
+    /* read the event flag to see if its a valid record */
+    read_from_buffer(tbuf, idx, record, sizeof(record->event));
+    if (!(record->event & TRACE_RECORD_VALID)) {
         return false;
     }
 
     smp_rmb(); /* read memory barrier before accessing record */
+    read_from_buffer(tbuf, idx, record, sizeof(TraceRecord));
+    return true;
+}
+
+/**
+ * Read the next trace record from a thread buffer
+ *
+ * @tbuf        Thread buffer
+ * @record      Trace record to fill
+ *
+ * Returns false if the record is not valid.
+ */
+static bool get_trace_record(TraceThreadBuffer *tbuf, TraceRecord **recordptr)
+{
+    unsigned int idx = tbuf->writeout_idx % TRACE_BUF_LEN;
+    TraceRecord record;
+
     /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
+    if (!peek_trace_record(tbuf, &record)) {
+        return false;
+    }
     *recordptr = malloc(record.length); /* don't use g_malloc, can deadlock when traced */
     /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
+    read_from_buffer(tbuf, idx, *recordptr, record.length);
     smp_rmb(); /* memory barrier before clearing valid flag */
     (*recordptr)->event &= ~TRACE_RECORD_VALID;
     /* clear the trace buffer range for consumed record otherwise any byte
      * with its MSB set may be considered as a valid event id when the writer
      * thread crosses this range of buffer again.
      */
-    clear_buffer_range(idx, record.length);
+    clear_buffer_range(tbuf, idx, record.length);
+    smp_wmb(); /* buffer range must be clear before the producer reuses it */
+    atomic_set(&tbuf->writeout_idx, tbuf->writeout_idx + record.length);
     return true;
 }
 
@@ -153,94 +206,194 @@ static void wait_for_trace_records_available(void)
     g_mutex_unlock(&trace_lock);
 }
 
-static gpointer writeout_thread(gpointer opaque)
+static void write_dropped_record(TraceThreadBuffer *tbuf)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
-        uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
+        uint8_t bytes[sizeof(TraceRecord) + 2 * sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
+    size_t unused __attribute__ ((unused));
+    uint64_t type = TRACE_RECORD_TYPE_EVENT;
     int dropped_count;
+
+    if (!g_atomic_int_get(&tbuf->dropped_events)) {
+        return;
+    }
+
+    dropped.rec.event = DROPPED_EVENT_ID,
+    dropped.rec.timestamp_ns = get_clock();
+    dropped.rec.length = sizeof(TraceRecord) + 2 * sizeof(uint64_t),
+    dropped.rec.pid = trace_pid;
+    do {
+        dropped_count = g_atomic_int_get(&tbuf->dropped_events);
+    } while (!g_atomic_int_compare_and_exchange(&tbuf->dropped_events,
+                                                dropped_count, 0));
+    dropped.rec.arguments[0] = dropped_count;
+    dropped.rec.arguments[1] = tbuf->tid;
+    unused = fwrite(&type, sizeof(type), 1, trace_fp);
+    unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+}
+
+/*
+ * Write out the records of all thread buffers, oldest first.  Each buffer is
+ * already in timestamp order, so it is enough to pick the buffer whose next
+ * record is the oldest one every time.
+ */
+static void write_trace_records(void)
+{
+    TraceThreadBuffer *tbuf, *oldest;
+    TraceRecord record, *recordptr;
+    uint64_t oldest_ns;
     size_t unused __attribute__ ((unused));
     uint64_t type = TRACE_RECORD_TYPE_EVENT;
 
+    for (tbuf = g_atomic_pointer_get(&trace_buffers); tbuf;
+         tbuf = tbuf->next) {
+        write_dropped_record(tbuf);
+    }
+
+    for (;;) {
+        oldest = NULL;
+        oldest_ns = 0;
+        for (tbuf = g_atomic_pointer_get(&trace_buffers); tbuf;
+             tbuf = tbuf->next) {
+            if (peek_trace_record(tbuf, &record) &&
+                (!oldest || record.timestamp_ns < oldest_ns)) {
+                oldest = tbuf;
+                oldest_ns = record.timestamp_ns;
+            }
+        }
+        if (!oldest || !get_trace_record(oldest, &recordptr)) {
+            break;
+        }
+
+        unused = fwrite(&type, sizeof(type), 1, trace_fp);
+        unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
+        free(recordptr); /* don't use g_free, can deadlock when traced */
+    }
+}
+
+static gpointer writeout_thread(gpointer opaque)
+{
     for (;;) {
         wait_for_trace_records_available();
+        write_trace_records();
+        fflush(trace_fp);
+    }
+    return NULL;
+}
 
-        if (g_atomic_int_get(&dropped_events)) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
-            dropped.rec.pid = trace_pid;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
-            dropped.rec.arguments[0] = dropped_count;
-            unused = fwrite(&type, sizeof(type), 1, trace_fp);
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+#ifndef CONFIG_PTH
+static void trace_thread_exit(Notifier *n, void *unused)
+{
+    TraceThreadBuffer *tbuf = trace_thread_buffer;
+
+    trace_thread_buffer = NULL;
+    g_atomic_int_set(&tbuf->in_use, 0);
+}
+#endif
+
+static TraceThreadBuffer *trace_get_thread_buffer(void)
+{
+    TraceThreadBuffer *tbuf = trace_thread_buffer;
+    TraceThreadBuffer *head;
+
+    if (likely(tbuf)) {
+        return tbuf;
+    }
+
+    /* Reuse the buffer of a thread that has exited... */
+    for (tbuf = g_atomic_pointer_get(&trace_buffers); tbuf;
+         tbuf = tbuf->next) {
+        if (!g_atomic_int_get(&tbuf->in_use) &&
+            g_atomic_int_compare_and_exchange(&tbuf->in_use, 0, 1)) {
+            break;
         }
+    }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(&type, sizeof(type), 1, trace_fp);
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* don't use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+    /* ...or add a new one */
+    if (!tbuf) {
+        /* don't use g_malloc, can deadlock when traced */
+        tbuf = calloc(1, sizeof(*tbuf));
+        if (!tbuf) {
+            return NULL;
         }
+        tbuf->in_use = 1;
+        do {
+            head = g_atomic_pointer_get(&trace_buffers);
+            tbuf->next = head;
+        } while (!g_atomic_pointer_compare_and_exchange(&trace_buffers,
+                                                        head, tbuf));
+    }
 
-        fflush(trace_fp);
+    tbuf->tid = qemu_get_thread_id();
+    trace_thread_buffer = tbuf;
+#ifndef CONFIG_PTH
+    /* Events emitted from other exit notifiers must not register again */
+    if (!trace_thread_exit_notifier.notify) {
+        trace_thread_exit_notifier.notify = trace_thread_exit;
+        qemu_thread_atexit_add(&trace_thread_exit_notifier);
     }
-    return NULL;
+#endif
+    return tbuf;
 }
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, (void*)s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, uint32_t event, size_t datasize)
 {
+    TraceThreadBuffer *tbuf = trace_get_thread_buffer();
     unsigned int idx, rec_off, old_idx, new_idx;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
     uint64_t event_u64 = event;
     uint64_t timestamp_ns = get_clock();
 
+    if (!tbuf) {
+        return -ENOMEM;
+    }
+
     do {
-        old_idx = g_atomic_int_get(&trace_idx);
+        old_idx = g_atomic_int_get(&tbuf->idx);
         smp_rmb();
         new_idx = old_idx + rec_len;
 
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
+        if (new_idx - atomic_read(&tbuf->writeout_idx) > TRACE_BUF_LEN) {
             /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
+            g_atomic_int_inc(&tbuf->dropped_events);
             return -ENOSPC;
         }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
+    } while (!g_atomic_int_compare_and_exchange(&tbuf->idx, old_idx, new_idx));
 
     idx = old_idx % TRACE_BUF_LEN;
 
     rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    rec_off = write_to_buffer(tbuf, rec_off, &event_u64, sizeof(event_u64));
+    rec_off = write_to_buffer(tbuf, rec_off,
+                              &timestamp_ns, sizeof(timestamp_ns));
+    rec_off = write_to_buffer(tbuf, rec_off, &rec_len, sizeof(rec_len));
+    rec_off = write_to_buffer(tbuf, rec_off, &trace_pid, sizeof(trace_pid));
 
+    rec->tbuf = tbuf;
     rec->tbuf_idx = idx;
     rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+static void read_from_buffer(TraceThreadBuffer *tbuf, unsigned int idx,
+                             void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
@@ -248,11 +401,12 @@ static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        data_ptr[x++] = trace_buf[idx++];
+        data_ptr[x++] = tbuf->buf[idx++];
     }
 }
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
+static unsigned int write_to_buffer(TraceThreadBuffer *tbuf, unsigned int idx,
+                                    void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
@@ -260,21 +414,22 @@ static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        trace_buf[idx++] = data_ptr[x++];
+        tbuf->buf[idx++] = data_ptr[x++];
     }
     return idx; /* most callers wants to know where to write next */
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
+    TraceThreadBuffer *tbuf = rec->tbuf;
     TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    read_from_buffer(tbuf, rec->tbuf_idx, &record, sizeof(TraceRecord));
     smp_wmb(); /* write barrier before marking as valid */
     record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    write_to_buffer(tbuf, rec->tbuf_idx, &record, sizeof(TraceRecord));
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    if (((unsigned int)g_atomic_int_get(&tbuf->idx) -
+         atomic_read(&tbuf->writeout_idx)) > TRACE_BUF_FLUSH_THRESHOLD) {
         flush_trace_file(false);
     }
 }
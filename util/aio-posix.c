@@ -772,6 +772,57 @@ void aio_context_setup(AioContext *ctx)
 #endif
 }
 
+int aio_context_add_pollfds(AioContext *ctx, GArray *pollfds)
+{
+    AioHandler *node;
+    int n = 0;
+
+#ifdef CONFIG_EPOLL_CREATE1
+    if (ctx->epoll_available && !ctx->epoll_enabled) {
+        /* Keep aio_set_fd_handler() out while the set is being filled */
+        qemu_lockcnt_lock(&ctx->list_lock);
+        if (!aio_epoll_try_enable(ctx)) {
+            aio_epoll_disable(ctx);
+        }
+        qemu_lockcnt_unlock(&ctx->list_lock);
+    }
+    if (aio_epoll_enabled(ctx)) {
+        GPollFD pfd = { .fd = ctx->epollfd, .events = G_IO_IN };
+
+        g_array_append_val(pollfds, pfd);
+        return 1;
+    }
+#endif
+
+    qemu_lockcnt_inc(&ctx->list_lock);
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->pfd.events &&
+            aio_node_check(ctx, node->is_external)) {
+            GPollFD pfd = { .fd = node->pfd.fd, .events = node->pfd.events };
+
+            g_array_append_val(pollfds, pfd);
+            n++;
+        }
+    }
+    qemu_lockcnt_dec(&ctx->list_lock);
+    return n;
+}
+
+bool aio_context_poll_once(AioContext *ctx)
+{
+    bool progress = false;
+
+    assert(ctx->notify_me);
+
+    qemu_lockcnt_inc(&ctx->list_lock);
+    if (ctx->poll_disable_cnt == 0) {
+        poll_set_started(ctx, true);
+        progress = run_poll_handlers_once(ctx);
+    }
+    qemu_lockcnt_dec(&ctx->list_lock);
+    return progress;
+}
+
 void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink, Error **errp)
 {
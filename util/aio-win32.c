@@ -407,6 +407,35 @@ void aio_context_setup(AioContext *ctx)
 {
 }
 
+int aio_context_add_pollfds(AioContext *ctx, GArray *pollfds)
+{
+    AioHandler *node;
+    int n = 0;
+
+    /* Sockets are signalled through ctx->notifier, see aio_set_fd_handler */
+    qemu_lockcnt_inc(&ctx->list_lock);
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_notify &&
+            aio_node_check(ctx, node->is_external)) {
+            GPollFD pfd = {
+                .fd = (uintptr_t)event_notifier_get_handle(node->e),
+                .events = G_IO_IN,
+            };
+
+            g_array_append_val(pollfds, pfd);
+            n++;
+        }
+    }
+    qemu_lockcnt_dec(&ctx->list_lock);
+    return n;
+}
+
+bool aio_context_poll_once(AioContext *ctx)
+{
+    /* There are no ->io_poll() callbacks on Windows */
+    return false;
+}
+
 void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink, Error **errp)
 {
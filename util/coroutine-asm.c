@@ -0,0 +1,384 @@
+/*
+ * Assembly coroutine backend for x86-64 and aarch64 hosts
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Unlike the ucontext backend, a switch here never enters the kernel: only
+ * the callee-saved registers are pushed on the old stack, the stack pointer
+ * is exchanged and the registers of the new coroutine are popped.  Creating
+ * a coroutine just lays out such a frame on a fresh stack, so there is no
+ * getcontext/makecontext/swapcontext round trip either.
+ *
+ * Stacks come from a per-thread pool so that a coroutine that is created
+ * after the coroutine freelist ran dry does not pay for mmap, mprotect and
+ * munmap every time.  Every stack keeps the guard page set up by
+ * qemu_alloc_stack().
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/coroutine_int.h"
+#include "qemu/notify.h"
+#include "qemu/thread.h"
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#error "the asm coroutine backend only supports x86-64 and aarch64 hosts"
+#endif
+
+#ifdef CONFIG_VALGRIND_H
+#include <valgrind/valgrind.h>
+#endif
+
+#if defined(__SANITIZE_ADDRESS__) || __has_feature(address_sanitizer)
+#ifdef HAVE_ASAN_IFACE_FIBER
+#define CONFIG_ASAN 1
+#include <sanitizer/asan_interface.h>
+#endif
+#endif
+
+typedef struct {
+    Coroutine base;
+    void *stack;
+    size_t stack_size;
+    void *sp;
+
+#ifdef CONFIG_VALGRIND_H
+    unsigned int valgrind_stack_id;
+#endif
+} CoroutineAsm;
+
+/*
+ * coroutine_asm_switch:
+ *
+ * Saves the callee-saved registers of the caller on its stack, stores the
+ * resulting stack pointer in *@save_sp and resumes the context that was
+ * saved at @sp.  The resumed context sees @action as the return value of
+ * its own call to coroutine_asm_switch().
+ *
+ * coroutine_asm_entry is the return address of the frame built by
+ * qemu_coroutine_new(); it passes the coroutine, which the frame holds in
+ * a callee-saved register, to coroutine_trampoline().
+ */
+CoroutineAction coroutine_asm_switch(void **save_sp, void *sp,
+                                     CoroutineAction action);
+void coroutine_asm_entry(void);
+
+static void QEMU_NORETURN __attribute__((used))
+coroutine_trampoline(CoroutineAsm *self);
+
+#if defined(__x86_64__)
+/*
+ * Frame layout, from the saved stack pointer up: MXCSR and x87 control
+ * word, r15, r14, r13, r12, rbx, rbp, return address.
+ */
+#define FRAME_WORDS         8
+#define FRAME_FPCTL         0
+#define FRAME_SELF          5   /* rbx */
+#define FRAME_RET           7
+#define FRAME_FPCTL_INIT    (0x1f80ull | (0x037full << 32))
+
+asm(".text\n"
+    ".p2align 4\n"
+    ".globl coroutine_asm_switch\n"
+    ".hidden coroutine_asm_switch\n"
+    ".type coroutine_asm_switch, @function\n"
+    "coroutine_asm_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    movl %edx, %eax\n"
+    "    ret\n"
+    ".size coroutine_asm_switch, .-coroutine_asm_switch\n"
+    "\n"
+    ".p2align 4\n"
+    ".globl coroutine_asm_entry\n"
+    ".hidden coroutine_asm_entry\n"
+    ".type coroutine_asm_entry, @function\n"
+    "coroutine_asm_entry:\n"
+    "    .cfi_startproc\n"
+    "    .cfi_undefined rip\n"
+    "    movq %rbx, %rdi\n"
+    "    call coroutine_trampoline\n"
+    "    ud2\n"
+    "    .cfi_endproc\n"
+    ".size coroutine_asm_entry, .-coroutine_asm_entry\n");
+
+#elif defined(__aarch64__)
+/*
+ * Frame layout, from the saved stack pointer up: x19-x28, x29, x30 (the
+ * return address), d8-d15.
+ */
+#define FRAME_WORDS         20
+#define FRAME_SELF          0   /* x19 */
+#define FRAME_RET           11  /* x30 */
+
+asm(".text\n"
+    ".p2align 4\n"
+    ".globl coroutine_asm_switch\n"
+    ".hidden coroutine_asm_switch\n"
+    ".type coroutine_asm_switch, %function\n"
+    "coroutine_asm_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x3, sp\n"
+    "    str x3, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    mov w0, w2\n"
+    "    ret\n"
+    ".size coroutine_asm_switch, .-coroutine_asm_switch\n"
+    "\n"
+    ".p2align 4\n"
+    ".globl coroutine_asm_entry\n"
+    ".hidden coroutine_asm_entry\n"
+    ".type coroutine_asm_entry, %function\n"
+    "coroutine_asm_entry:\n"
+    "    .cfi_startproc\n"
+    "    .cfi_undefined x30\n"
+    "    mov x0, x19\n"
+    "    bl coroutine_trampoline\n"
+    "    brk #0\n"
+    "    .cfi_endproc\n"
+    ".size coroutine_asm_entry, .-coroutine_asm_entry\n");
+#endif
+
+/**
+ * Per-thread coroutine bookkeeping
+ */
+static __thread CoroutineAsm leader;
+static __thread Coroutine *current;
+
+/**
+ * Per-thread pool of coroutine stacks
+ */
+#ifdef CONFIG_DEBUG_STACK_USAGE
+/* Stack usage is measured when a stack is freed, so never reuse one */
+#define STACK_POOL_MAX 0
+#else
+#define STACK_POOL_MAX 64
+#endif
+
+typedef struct {
+    void *stack;
+    size_t size;
+} PooledStack;
+
+static __thread PooledStack stack_pool[STACK_POOL_MAX + 1];
+static __thread unsigned int stack_pool_size;
+static __thread Notifier stack_pool_cleanup_notifier;
+
+static void stack_pool_cleanup(Notifier *n, void *value)
+{
+    while (stack_pool_size > 0) {
+        PooledStack *s = &stack_pool[--stack_pool_size];
+
+        qemu_free_stack(s->stack, s->size);
+    }
+}
+
+static void *stack_pool_get(size_t *size)
+{
+    if (stack_pool_size > 0) {
+        PooledStack *s = &stack_pool[--stack_pool_size];
+
+        *size = s->size;
+        return s->stack;
+    }
+    *size = COROUTINE_STACK_SIZE;
+    return qemu_alloc_stack(size);
+}
+
+static void stack_pool_put(void *stack, size_t size)
+{
+    if (stack_pool_size < STACK_POOL_MAX) {
+        if (!stack_pool_cleanup_notifier.notify) {
+            stack_pool_cleanup_notifier.notify = stack_pool_cleanup;
+            qemu_thread_atexit_add(&stack_pool_cleanup_notifier);
+        }
+        stack_pool[stack_pool_size].stack = stack;
+        stack_pool[stack_pool_size].size = size;
+        stack_pool_size++;
+        return;
+    }
+    qemu_free_stack(stack, size);
+}
+
+static void finish_switch_fiber(void *fake_stack_save)
+{
+#ifdef CONFIG_ASAN
+    const void *bottom_old;
+    size_t size_old;
+
+    __sanitizer_finish_switch_fiber(fake_stack_save, &bottom_old, &size_old);
+
+    /* The first switch of a thread always leaves the leader */
+    if (!leader.stack) {
+        leader.stack = (void *)bottom_old;
+        leader.stack_size = size_old;
+    }
+#endif
+}
+
+static void start_switch_fiber(void **fake_stack_save,
+                               const void *bottom, size_t size)
+{
+#ifdef CONFIG_ASAN
+    __sanitizer_start_switch_fiber(fake_stack_save, bottom, size);
+#endif
+}
+
+static void coroutine_trampoline(CoroutineAsm *self)
+{
+    Coroutine *co = &self->base;
+
+    finish_switch_fiber(NULL);
+
+    while (true) {
+        co->entry(co->entry_arg);
+        qemu_coroutine_switch(co, co->caller, COROUTINE_TERMINATE);
+    }
+}
+
+Coroutine *qemu_coroutine_new(void)
+{
+    CoroutineAsm *co;
+    uintptr_t *frame;
+
+    co = g_malloc0(sizeof(*co));
+    co->stack = stack_pool_get(&co->stack_size);
+
+#ifdef CONFIG_VALGRIND_H
+    co->valgrind_stack_id =
+        VALGRIND_STACK_REGISTER(co->stack, co->stack + co->stack_size);
+#endif
+
+    /*
+     * Build the frame that coroutine_asm_switch() pops on the first switch
+     * into the coroutine.  The stack top is page aligned, so the entry stub
+     * starts with a 16-byte aligned stack pointer as the ABIs require.
+     */
+    frame = (uintptr_t *)(co->stack + co->stack_size) - FRAME_WORDS;
+    memset(frame, 0, FRAME_WORDS * sizeof(*frame));
+#ifdef FRAME_FPCTL
+    frame[FRAME_FPCTL] = FRAME_FPCTL_INIT;
+#endif
+    frame[FRAME_SELF] = (uintptr_t)co;
+    frame[FRAME_RET] = (uintptr_t)coroutine_asm_entry;
+    co->sp = frame;
+
+    return &co->base;
+}
+
+#ifdef CONFIG_VALGRIND_H
+#ifdef CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE
+/* Work around an unused variable in the valgrind.h macro... */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#endif
+static inline void valgrind_stack_deregister(CoroutineAsm *co)
+{
+    VALGRIND_STACK_DEREGISTER(co->valgrind_stack_id);
+}
+#ifdef CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+void qemu_coroutine_delete(Coroutine *co_)
+{
+    CoroutineAsm *co = DO_UPCAST(CoroutineAsm, base, co_);
+
+#ifdef CONFIG_VALGRIND_H
+    valgrind_stack_deregister(co);
+#endif
+
+    stack_pool_put(co->stack, co->stack_size);
+    g_free(co);
+}
+
+/* This function is marked noinline for the same reason as in the ucontext
+ * backend: the switch may return in a different thread than the one it was
+ * called from, so the address of "current" must not be cached across it.
+ */
+CoroutineAction __attribute__((noinline))
+qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
+                      CoroutineAction action)
+{
+    CoroutineAsm *from = DO_UPCAST(CoroutineAsm, base, from_);
+    CoroutineAsm *to = DO_UPCAST(CoroutineAsm, base, to_);
+    CoroutineAction ret;
+    void *fake_stack_save = NULL;
+
+    current = to_;
+
+    start_switch_fiber(action == COROUTINE_TERMINATE ?
+                       NULL : &fake_stack_save, to->stack, to->stack_size);
+    ret = coroutine_asm_switch(&from->sp, to->sp, action);
+    finish_switch_fiber(fake_stack_save);
+
+    return ret;
+}
+
+Coroutine *qemu_coroutine_self(void)
+{
+    if (!current) {
+        current = &leader.base;
+    }
+    return current;
+}
+
+bool qemu_in_coroutine(void)
+{
+    return current && current->caller;
+}
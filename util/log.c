@@ -68,14 +68,383 @@
 #include "qemu/error-report.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
 #include "trace/control.h"
 
 static char *logfilename;
 FILE *qemu_logfile;
 int qemu_loglevel;
+bool qemu_log_async;
 static int log_append = 0;
 static GArray *debug_regions;
 
+/*
+ * Asynchronous logging ("-d async" together with "-D logfile").
+ *
+ * Every thread formats its messages into a staging buffer of its own,
+ * without taking any global lock.  Full buffers are handed to a writer
+ * thread, which also collects whatever has been sitting in the staging
+ * buffers for longer than LOG_WRITER_PERIOD_MS.  Code that writes to
+ * qemu_logfile directly (disassembly, register dumps) goes through a
+ * stdio cookie stream that ends up in the same staging buffer, so the
+ * output of each thread stays in order.
+ *
+ * qemu_log_lock() only keeps the writer thread from splitting a group of
+ * messages; it does not serialize threads any more.
+ */
+enum {
+    LOG_STAGE_SIZE = 64 * 1024,
+    LOG_STAGE_FLUSH_THRESHOLD = LOG_STAGE_SIZE / 2,
+    /* producers wait when this much output has not been written yet */
+    LOG_MAX_PENDING = 64 * 1024 * 1024,
+    LOG_WRITER_PERIOD_MS = 100,
+};
+
+typedef struct QemuLogChunk {
+    char *buf;
+    size_t len;
+    QSIMPLEQ_ENTRY(QemuLogChunk) next;
+} QemuLogChunk;
+
+typedef struct QemuLogStage {
+    QemuMutex lock;
+    char *buf;
+    size_t len;
+    int depth;      /* qemu_log_lock() nesting */
+    bool dead;      /* owner thread has exited */
+    QTAILQ_ENTRY(QemuLogStage) next;
+} QemuLogStage;
+
+static FILE *log_async_fp;
+static QemuThread log_writer_thread;
+static QemuMutex log_writer_lock;
+static QemuCond log_writer_cond;
+static QemuSemaphore log_writer_sem;
+static QSIMPLEQ_HEAD(, QemuLogChunk) log_chunks =
+    QSIMPLEQ_HEAD_INITIALIZER(log_chunks);
+static QTAILQ_HEAD(, QemuLogStage) log_stages =
+    QTAILQ_HEAD_INITIALIZER(log_stages);
+static size_t log_pending;
+static bool log_writer_busy;
+static bool log_writer_stopping;
+
+#ifndef CONFIG_PTH
+static __thread QemuLogStage *log_stage;
+static __thread Notifier log_stage_exit_notifier;
+#else
+/* All pth threads run on the same host thread and share one buffer */
+static QemuLogStage *log_stage;
+#endif
+
+/* Called with stage->lock held */
+static void log_stage_detach(QemuLogStage *stage)
+{
+    QemuLogChunk *chunk;
+
+    if (!stage->len) {
+        return;
+    }
+
+    chunk = g_new(QemuLogChunk, 1);
+    chunk->buf = stage->buf;
+    chunk->len = stage->len;
+    stage->buf = g_malloc(LOG_STAGE_SIZE);
+    stage->len = 0;
+
+    qemu_mutex_lock(&log_writer_lock);
+    QSIMPLEQ_INSERT_TAIL(&log_chunks, chunk, next);
+    log_pending += chunk->len;
+    qemu_sem_post(&log_writer_sem);
+    qemu_mutex_unlock(&log_writer_lock);
+}
+
+/*
+ * Log output is never dropped; if the writer falls behind, wait.  Must not
+ * be called with a stage lock held, the writer needs those.
+ */
+static void log_wait_pending(void)
+{
+    qemu_mutex_lock(&log_writer_lock);
+    while (log_pending > LOG_MAX_PENDING) {
+        qemu_cond_wait(&log_writer_cond, &log_writer_lock);
+    }
+    qemu_mutex_unlock(&log_writer_lock);
+}
+
+#ifndef CONFIG_PTH
+static void log_stage_exit(Notifier *n, void *unused)
+{
+    QemuLogStage *stage = log_stage;
+
+    qemu_mutex_lock(&stage->lock);
+    stage->dead = true;
+    qemu_mutex_unlock(&stage->lock);
+    log_stage = NULL;
+}
+#endif
+
+static QemuLogStage *log_get_stage(void)
+{
+    QemuLogStage *stage = log_stage;
+
+    if (likely(stage)) {
+        return stage;
+    }
+
+    stage = g_new0(QemuLogStage, 1);
+    qemu_mutex_init(&stage->lock);
+    stage->buf = g_malloc(LOG_STAGE_SIZE);
+
+    qemu_mutex_lock(&log_writer_lock);
+    QTAILQ_INSERT_TAIL(&log_stages, stage, next);
+    qemu_mutex_unlock(&log_writer_lock);
+
+    log_stage = stage;
+#ifndef CONFIG_PTH
+    if (!log_stage_exit_notifier.notify) {
+        log_stage_exit_notifier.notify = log_stage_exit;
+        qemu_thread_atexit_add(&log_stage_exit_notifier);
+    }
+#endif
+    return stage;
+}
+
+static void log_stage_append(const char *buf, size_t len)
+{
+    QemuLogStage *stage = log_get_stage();
+    QemuLogChunk *chunk;
+    bool wait = false;
+
+    qemu_mutex_lock(&stage->lock);
+    if (stage->len + len > LOG_STAGE_SIZE) {
+        log_stage_detach(stage);
+        wait = stage->depth == 0;
+    }
+    if (len > LOG_STAGE_SIZE) {
+        /* too big for any staging buffer, hand it over as is */
+        chunk = g_new(QemuLogChunk, 1);
+        chunk->buf = g_memdup(buf, len);
+        chunk->len = len;
+        qemu_mutex_lock(&log_writer_lock);
+        QSIMPLEQ_INSERT_TAIL(&log_chunks, chunk, next);
+        log_pending += len;
+        qemu_sem_post(&log_writer_sem);
+        qemu_mutex_unlock(&log_writer_lock);
+    } else {
+        memcpy(stage->buf + stage->len, buf, len);
+        stage->len += len;
+        if (stage->depth == 0 && stage->len >= LOG_STAGE_FLUSH_THRESHOLD) {
+            log_stage_detach(stage);
+            wait = true;
+        }
+    }
+    qemu_mutex_unlock(&stage->lock);
+
+    if (wait) {
+        log_wait_pending();
+    }
+}
+
+static int log_stage_vprintf(const char *fmt, va_list ap)
+{
+    char buf[512];
+    char *p = buf;
+    va_list ap2;
+    int ret;
+
+    va_copy(ap2, ap);
+    ret = vsnprintf(buf, sizeof(buf), fmt, ap2);
+    va_end(ap2);
+    if (ret < 0) {
+        return 0;
+    }
+    if (ret >= sizeof(buf)) {
+        p = g_strdup_vprintf(fmt, ap);
+    }
+
+    log_stage_append(p, ret);
+    if (p != buf) {
+        g_free(p);
+    }
+    return ret;
+}
+
+void qemu_log_stage_lock(void)
+{
+    QemuLogStage *stage = log_get_stage();
+
+    qemu_mutex_lock(&stage->lock);
+    stage->depth++;
+    qemu_mutex_unlock(&stage->lock);
+}
+
+void qemu_log_stage_unlock(void)
+{
+    QemuLogStage *stage = log_get_stage();
+    bool wait = false;
+
+    qemu_mutex_lock(&stage->lock);
+    if (--stage->depth == 0 && stage->len >= LOG_STAGE_FLUSH_THRESHOLD) {
+        log_stage_detach(stage);
+        wait = true;
+    }
+    qemu_mutex_unlock(&stage->lock);
+
+    if (wait) {
+        log_wait_pending();
+    }
+}
+
+static void *log_writer(void *opaque)
+{
+    QemuLogStage *stage, *next_stage;
+    QemuLogChunk *chunk;
+    size_t unused __attribute__((unused));
+    bool stopping;
+
+    do {
+        qemu_sem_timedwait(&log_writer_sem, LOG_WRITER_PERIOD_MS);
+
+        qemu_mutex_lock(&log_writer_lock);
+        log_writer_busy = true;
+        stopping = log_writer_stopping;
+
+        /* Pick up what has been sitting in the staging buffers */
+        QTAILQ_FOREACH_SAFE(stage, &log_stages, next, next_stage) {
+            qemu_mutex_unlock(&log_writer_lock);
+            qemu_mutex_lock(&stage->lock);
+            if (stage->depth == 0 || stage->dead || stopping) {
+                log_stage_detach(stage);
+            }
+            qemu_mutex_unlock(&stage->lock);
+            qemu_mutex_lock(&log_writer_lock);
+
+            if (stage->dead && !stage->len) {
+                QTAILQ_REMOVE(&log_stages, stage, next);
+                qemu_mutex_destroy(&stage->lock);
+                g_free(stage->buf);
+                g_free(stage);
+            }
+        }
+
+        while ((chunk = QSIMPLEQ_FIRST(&log_chunks)) != NULL) {
+            QSIMPLEQ_REMOVE_HEAD(&log_chunks, next);
+            qemu_mutex_unlock(&log_writer_lock);
+
+            unused = fwrite(chunk->buf, 1, chunk->len, log_async_fp);
+            g_free(chunk->buf);
+
+            qemu_mutex_lock(&log_writer_lock);
+            log_pending -= chunk->len;
+            g_free(chunk);
+            qemu_cond_broadcast(&log_writer_cond);
+        }
+        qemu_mutex_unlock(&log_writer_lock);
+
+        fflush(log_async_fp);
+
+        qemu_mutex_lock(&log_writer_lock);
+        log_writer_busy = false;
+        qemu_cond_broadcast(&log_writer_cond);
+        qemu_mutex_unlock(&log_writer_lock);
+    } while (!stopping);
+
+    return NULL;
+}
+
+#ifdef CONFIG_FOPENCOOKIE
+/* QEMU does not close the log when it exits normally, do it here so that
+ * the staging buffers and the queued chunks still reach the file. */
+static void log_async_atexit(void)
+{
+    if (qemu_log_async) {
+        qemu_log_close();
+    }
+}
+
+static ssize_t log_cookie_write(void *cookie, const char *buf, size_t size)
+{
+    log_stage_append(buf, size);
+    return size;
+}
+
+/* Route the log through the staging buffers.  Returns the stream that
+ * the rest of QEMU writes to, or @fp if that is not possible. */
+static FILE *log_async_start(FILE *fp)
+{
+    static const cookie_io_functions_t log_cookie_fns = {
+        .write = log_cookie_write,
+    };
+    static bool atexit_registered;
+    FILE *cookie_fp;
+
+    cookie_fp = fopencookie(NULL, "w", log_cookie_fns);
+    if (!cookie_fp) {
+        return fp;
+    }
+    /* every fprintf goes straight to the calling thread's buffer */
+    setvbuf(cookie_fp, NULL, _IONBF, 0);
+
+    log_async_fp = fp;
+    setvbuf(log_async_fp, NULL, _IOFBF, LOG_STAGE_SIZE);
+    qemu_mutex_init(&log_writer_lock);
+    qemu_cond_init(&log_writer_cond);
+    qemu_sem_init(&log_writer_sem, 0);
+    log_writer_stopping = false;
+    qemu_thread_create(&log_writer_thread, "log-writer", log_writer, NULL,
+                       QEMU_THREAD_JOINABLE);
+    qemu_log_async = true;
+    if (!atexit_registered) {
+        atexit(log_async_atexit);
+        atexit_registered = true;
+    }
+    return cookie_fp;
+}
+#else
+static FILE *log_async_start(FILE *fp)
+{
+    warn_report("Asynchronous logging is not supported on this host");
+    return fp;
+}
+#endif
+
+/* Write out everything that has been logged so far */
+static void log_async_flush(void)
+{
+    QemuLogStage *stage = log_get_stage();
+
+    qemu_mutex_lock(&stage->lock);
+    log_stage_detach(stage);
+    qemu_mutex_unlock(&stage->lock);
+
+    qemu_mutex_lock(&log_writer_lock);
+    qemu_sem_post(&log_writer_sem);
+    while (log_writer_busy || !QSIMPLEQ_EMPTY(&log_chunks)) {
+        qemu_cond_wait(&log_writer_cond, &log_writer_lock);
+    }
+    qemu_mutex_unlock(&log_writer_lock);
+}
+
+static void log_async_stop(void)
+{
+    qemu_log_async = false;
+
+    qemu_mutex_lock(&log_writer_lock);
+    log_writer_stopping = true;
+    qemu_sem_post(&log_writer_sem);
+    qemu_mutex_unlock(&log_writer_lock);
+    qemu_thread_join(&log_writer_thread);
+    qemu_sem_destroy(&log_writer_sem);
+    qemu_cond_destroy(&log_writer_cond);
+    qemu_mutex_destroy(&log_writer_lock);
+
+    if (log_async_fp != stderr) {
+        fclose(log_async_fp);
+    }
+    log_async_fp = NULL;
+}
+
 /* Return the number of characters emitted.  */
 int qemu_log(const char *fmt, ...)
 {
@@ -83,7 +452,11 @@ int qemu_log(const char *fmt, ...)
     if (qemu_logfile) {
         va_list ap;
         va_start(ap, fmt);
-        ret = vfprintf(qemu_logfile, fmt, ap);
+        if (qemu_log_async) {
+            ret = log_stage_vprintf(fmt, ap);
+        } else {
+            ret = vfprintf(qemu_logfile, fmt, ap);
+        }
         va_end(ap);
 
         /* Don't pass back error results.  */
@@ -94,6 +467,17 @@ int qemu_log(const char *fmt, ...)
     return ret;
 }
 
+void qemu_log_vprintf(const char *fmt, va_list va)
+{
+    if (qemu_logfile) {
+        if (qemu_log_async) {
+            log_stage_vprintf(fmt, va);
+        } else {
+            vfprintf(qemu_logfile, fmt, va);
+        }
+    }
+}
+
 static bool log_uses_own_buffers;
 
 /* enable or disable low levels log */
@@ -117,6 +501,8 @@ void qemu_set_log(int log_flags)
                 fclose(qemu_logfile);
                 /* This will skip closing logfile in qemu_log_close() */
                 qemu_logfile = stderr;
+            } else if (qemu_loglevel & LOG_ASYNC) {
+                qemu_logfile = log_async_start(qemu_logfile);
             }
         } else {
             /* Default to stderr if no log file specified */
@@ -124,7 +510,9 @@ void qemu_set_log(int log_flags)
             qemu_logfile = stderr;
         }
         /* must avoid mmap() usage of glibc by setting a buffer "by hand" */
-        if (log_uses_own_buffers) {
+        if (qemu_log_async) {
+            log_append = 1;
+        } else if (log_uses_own_buffers) {
             static char logfile_buf[4096];
 
             setvbuf(qemu_logfile, logfile_buf, _IOLBF, sizeof(logfile_buf));
@@ -269,13 +657,21 @@ out:
 /* fflush() the log file */
 void qemu_log_flush(void)
 {
-    fflush(qemu_logfile);
+    if (qemu_log_async) {
+        log_async_flush();
+    } else {
+        fflush(qemu_logfile);
+    }
 }
 
 /* Close the log file */
 void qemu_log_close(void)
 {
     if (qemu_logfile) {
+        if (qemu_log_async) {
+            log_async_flush();
+            log_async_stop();
+        }
         if (qemu_logfile != stderr) {
             fclose(qemu_logfile);
         }
@@ -316,6 +712,9 @@ const QEMULogItem qemu_log_items[] = {
     { CPU_LOG_TB_NOCHAIN, "nochain",
       "do not chain compiled TBs so that \"exec\" and \"cpu\" show\n"
       "complete traces" },
+    { LOG_ASYNC, "async",
+      "buffer the log in every thread and write it from a background\n"
+      "thread (only together with -D)" },
     { 0, NULL, NULL },
 };
 
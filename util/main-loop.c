@@ -77,6 +77,7 @@
 #include "qemu/main-loop.h"
 #include "block/aio.h"
 #include "qemu/error-report.h"
+#include "trace.h"
 
 #ifndef _WIN32
 
@@ -185,6 +186,20 @@ void qemu_notify_event(void)
 }
 
 static GArray *gpollfds;
+static MainLoopBackend main_loop_backend = MAIN_LOOP_BACKEND_GLIB;
+
+int qemu_main_loop_set_backend(MainLoopBackend backend, Error **errp)
+{
+    assert(!qemu_aio_context);
+#ifndef CONFIG_EPOLL_CREATE1
+    if (backend == MAIN_LOOP_BACKEND_NATIVE) {
+        error_setg(errp, "The native main loop requires epoll support");
+        return -ENOTSUP;
+    }
+#endif
+    main_loop_backend = backend;
+    return 0;
+}
 
 int qemu_init_main_loop(Error **errp)
 {
@@ -206,6 +221,15 @@ int qemu_init_main_loop(Error **errp)
     }
     qemu_notify_bh = qemu_bh_new(notify_event_cb, NULL);
     gpollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+
+    if (main_loop_backend == MAIN_LOOP_BACKEND_NATIVE) {
+        /* os_host_main_loop_wait() polls the two contexts itself, glib
+         * only sees the sources that chardevs and UIs attach to it.
+         */
+        iohandler_get_aio_context();
+        return 0;
+    }
+
     src = aio_get_g_source(qemu_aio_context);
     g_source_set_name(src, "aio-context");
     g_source_attach(src, NULL);
@@ -219,6 +243,59 @@ int qemu_init_main_loop(Error **errp)
 
 static int max_priority;
 
+/* Counters for query-main-loop, only touched by the main loop thread */
+static struct {
+    uint64_t iterations;
+    uint64_t wakeups;
+    uint64_t timeouts;
+    uint64_t busy_ns;
+    uint64_t max_busy_ns;
+    unsigned int fds;
+    int64_t woken_at;
+} main_loop_stats;
+
+static void main_loop_poll_begin(unsigned int nfds, int64_t timeout)
+{
+    int64_t now = get_clock();
+    int64_t busy = 0;
+
+    /* Everything since the previous poll returned is cost of an iteration */
+    if (main_loop_stats.woken_at) {
+        busy = now - main_loop_stats.woken_at;
+        main_loop_stats.busy_ns += busy;
+        main_loop_stats.max_busy_ns = MAX(main_loop_stats.max_busy_ns, busy);
+    }
+    main_loop_stats.iterations++;
+    if (timeout) {
+        main_loop_stats.wakeups++;
+    }
+    main_loop_stats.fds = nfds;
+    trace_main_loop_poll(nfds, timeout, busy);
+}
+
+/* Only a wait that was allowed to block can end because of a deadline */
+static void main_loop_poll_end(int ret, int64_t timeout)
+{
+    if (ret == 0 && timeout != 0) {
+        main_loop_stats.timeouts++;
+    }
+    main_loop_stats.woken_at = get_clock();
+}
+
+MainLoopInfo *qemu_main_loop_info(void)
+{
+    MainLoopInfo *info = g_new0(MainLoopInfo, 1);
+
+    info->backend = main_loop_backend;
+    info->iterations = main_loop_stats.iterations;
+    info->wakeups = main_loop_stats.wakeups;
+    info->timeouts = main_loop_stats.timeouts;
+    info->fds = main_loop_stats.fds;
+    info->busy_ns = main_loop_stats.busy_ns;
+    info->max_busy_ns = main_loop_stats.max_busy_ns;
+    return info;
+}
+
 #ifndef _WIN32
 static int glib_pollfds_idx;
 static int glib_n_poll_fds;
@@ -262,6 +339,61 @@ static void glib_pollfds_poll(void)
     }
 }
 
+#ifdef CONFIG_EPOLL_CREATE1
+/* Range of gpollfds that belongs to each context */
+static struct {
+    int idx;
+    int n;
+} native_ctx_fds[2];
+
+static AioContext *native_ctx(int i)
+{
+    return i ? iohandler_get_aio_context() : qemu_aio_context;
+}
+
+/* With the native backend, each of the two main loop contexts normally
+ * takes a single slot in gpollfds no matter how many handlers it has.
+ */
+static void native_pollfds_fill(int64_t *cur_timeout)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(native_ctx_fds); i++) {
+        AioContext *ctx = native_ctx(i);
+
+        /* As in aio_ctx_prepare(), make aio_notify() kick the poll */
+        atomic_or(&ctx->notify_me, 1);
+        *cur_timeout = qemu_soonest_timeout(*cur_timeout,
+                                            aio_compute_timeout(ctx));
+
+        native_ctx_fds[i].idx = gpollfds->len;
+        native_ctx_fds[i].n = aio_context_add_pollfds(ctx, gpollfds);
+    }
+}
+
+static void native_pollfds_poll(void)
+{
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(native_ctx_fds); i++) {
+        AioContext *ctx = native_ctx(i);
+        bool ready = false;
+
+        atomic_and(&ctx->notify_me, ~1);
+
+        for (j = 0; j < native_ctx_fds[i].n; j++) {
+            ready |= !!g_array_index(gpollfds, GPollFD,
+                                     native_ctx_fds[i].idx + j).revents;
+        }
+
+        /* aio_poll() costs at least one syscall, skip idle contexts */
+        if (ready || aio_compute_timeout(ctx) == 0) {
+            aio_poll(ctx, false);
+        }
+    }
+}
+#endif
+
 #define MAX_MAIN_LOOP_SPIN (1000)
 
 static int os_host_main_loop_wait(int64_t timeout)
@@ -272,6 +404,11 @@ static int os_host_main_loop_wait(int64_t timeout)
 
     g_main_context_acquire(context);
 
+#ifdef CONFIG_EPOLL_CREATE1
+    if (main_loop_backend == MAIN_LOOP_BACKEND_NATIVE) {
+        native_pollfds_fill(&timeout);
+    }
+#endif
     glib_pollfds_fill(&timeout);
 
     /* If the I/O thread is very busy or we are incorrectly busy waiting in
@@ -299,13 +436,20 @@ static int os_host_main_loop_wait(int64_t timeout)
         spin_counter++;
     }
 
+    main_loop_poll_begin(gpollfds->len, timeout);
     ret = qemu_poll_ns((GPollFD *)gpollfds->data, gpollfds->len, timeout);
+    main_loop_poll_end(ret, timeout);
 
     if (timeout) {
         qemu_mutex_lock_iothread();
     }
 
     glib_pollfds_poll();
+#ifdef CONFIG_EPOLL_CREATE1
+    if (main_loop_backend == MAIN_LOOP_BACKEND_NATIVE) {
+        native_pollfds_poll();
+    }
+#endif
 
     g_main_context_release(context);
 
@@ -510,7 +654,9 @@ static int os_host_main_loop_wait(int64_t timeout)
     poll_timeout_ns = qemu_soonest_timeout(poll_timeout_ns, timeout);
 
     qemu_mutex_unlock_iothread();
+    main_loop_poll_begin(n_poll_fds + w->num, poll_timeout_ns);
     g_poll_ret = qemu_poll_ns(poll_fds, n_poll_fds + w->num, poll_timeout_ns);
+    main_loop_poll_end(g_poll_ret, poll_timeout_ns);
 
     qemu_mutex_lock_iothread();
     if (g_poll_ret > 0) {
@@ -107,12 +107,18 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
  * used by different AioContexts / threads. Each clock also has
  * a list of the QEMUTimerLists associated with it, in order that
  * reenabling the clock can call all the notifiers.
+ *
+ * The armed timers form a pairing heap whose root, active_timers, is
+ * the timer that expires first.  Arming a timer is O(1), removing one
+ * is O(log n) amortized.  Timers with the same expiry fire in the order
+ * they were armed.
  */
 
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
     QEMUTimer *active_timers;
+    uint64_t active_timers_seq;
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -407,43 +413,112 @@ void timer_deinit(QEMUTimer *ts)
     ts->timer_list = NULL;
 }
 
+static inline bool timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
+
+/* Join two heaps.  Both roots must have no siblings and no parent.  */
+static QEMUTimer *timer_heap_meld(QEMUTimer *a, QEMUTimer *b)
+{
+    QEMUTimer *t;
+
+    if (timer_before(b, a)) {
+        t = a;
+        a = b;
+        b = t;
+    }
+
+    b->prev = a;
+    b->next = a->child;
+    if (a->child) {
+        a->child->prev = b;
+    }
+    a->child = b;
+    return a;
+}
+
+/* Turn the sibling list starting at @first into a single heap, with the
+ * usual two passes: meld pairs from left to right, then meld the results
+ * from right to left.
+ */
+static QEMUTimer *timer_heap_merge_pairs(QEMUTimer *first)
+{
+    QEMUTimer *a, *b, *rest, *pairs = NULL, *root = NULL;
+
+    while (first) {
+        a = first;
+        b = a->next;
+        rest = b ? b->next : NULL;
+        a->prev = a->next = NULL;
+        if (b) {
+            b->prev = b->next = NULL;
+            a = timer_heap_meld(a, b);
+        }
+        a->next = pairs;
+        pairs = a;
+        first = rest;
+    }
+
+    while (pairs) {
+        a = pairs;
+        pairs = a->next;
+        a->next = NULL;
+        root = root ? timer_heap_meld(root, a) : a;
+    }
+    return root;
+}
+
 static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimer *sub;
 
+    if (ts->expire_time == -1) {
+        return;
+    }
     ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            atomic_set(pt, t->next);
-            break;
-        }
-        pt = &t->next;
+
+    if (ts == timer_list->active_timers) {
+        sub = timer_heap_merge_pairs(ts->child);
+        ts->child = NULL;
+        atomic_set(&timer_list->active_timers, sub);
+        return;
+    }
+
+    /* Unlink from the parent's list of children, then put the subheap
+     * back in at the root.
+     */
+    if (ts->prev->child == ts) {
+        ts->prev->child = ts->next;
+    } else {
+        ts->prev->next = ts->next;
+    }
+    if (ts->next) {
+        ts->next->prev = ts->prev;
+    }
+    ts->prev = ts->next = NULL;
+
+    sub = timer_heap_merge_pairs(ts->child);
+    ts->child = NULL;
+    if (sub) {
+        timer_list->active_timers =
+            timer_heap_meld(timer_list->active_timers, sub);
     }
 }
 
 static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
                                 QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimer *root = timer_list->active_timers;
 
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
-    for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
-            break;
-        }
-        pt = &t->next;
-    }
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    atomic_set(pt, ts);
+    ts->seq = timer_list->active_timers_seq++;
+    ts->child = ts->next = ts->prev = NULL;
+    atomic_set(&timer_list->active_timers,
+               root ? timer_heap_meld(root, ts) : ts);
 
-    return pt == &timer_list->active_timers;
+    return timer_list->active_timers == ts;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -576,9 +651,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
         }
 
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
-        ts->expire_time = -1;
+        timer_del_locked(timer_list, ts);
         cb = ts->cb;
         opaque = ts->opaque;
         qemu_mutex_unlock(&timer_list->active_timers_lock);
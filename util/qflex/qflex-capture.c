@@ -0,0 +1,598 @@
+//  DO-NOT-REMOVE begin-copyright-block
+// QFlex consists of several software components that are governed by various
+// licensing terms, in addition to software that was developed internally.
+// Anyone interested in using QFlex needs to fully understand and abide by the
+// licenses governing all the software components.
+// 
+// ### Software developed externally (not by the QFlex group)
+// 
+//     * [NS-3] (https://www.gnu.org/copyleft/gpl.html)
+//     * [QEMU] (http://wiki.qemu.org/License)
+//     * [SimFlex] (http://parsa.epfl.ch/simflex/)
+//     * [GNU PTH] (https://www.gnu.org/software/pth/)
+// 
+// ### Software developed internally (by the QFlex group)
+// **QFlex License**
+// 
+// QFlex
+// Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+// 
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright notice,
+//       this list of conditions and the following disclaimer in the documentation
+//       and/or other materials provided with the distribution.
+//     * Neither the name of the Parallel Systems Architecture Laboratory, EPFL,
+//       nor the names of its contributors may be used to endorse or promote
+//       products derived from this software without specific prior written
+//       permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE PARALLEL SYSTEMS ARCHITECTURE LABORATORY,
+// EPFL BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+// GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//  DO-NOT-REMOVE end-copyright-block
+#include "qemu/osdep.h"
+#include <zlib.h>
+
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qflex/qflex-capture.h"
+
+QEMU_BUILD_BUG_ON(sizeof(QFlexCaptureRecord) != 32);
+QEMU_BUILD_BUG_ON(sizeof(QFlexCaptureChunkHeader) != 24);
+
+/* Chunks in flight per file before the producer has to wait */
+#define QFLEX_CAPTURE_MAX_CHUNKS    4
+
+#define QFLEX_CAPTURE_CHUNK_SIZE \
+    (QFLEX_CAPTURE_CHUNK_RECORDS * sizeof(QFlexCaptureRecord))
+
+typedef struct QFlexCaptureWriter {
+    FILE *fp;
+    char *filename;
+    uint64_t nr_records;
+
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    QSIMPLEQ_HEAD(, QFlexCaptureChunk) full;
+    QSIMPLEQ_HEAD(, QFlexCaptureChunk) free;
+    int nr_chunks;
+    bool stopping;
+    int ret;
+} QFlexCaptureWriter;
+
+bool qflex_capture_on;
+QFlexCaptureFile **qflex_capture_files;
+static int qflex_capture_nr_files;
+
+static void qflex_capture_records_to_le(QFlexCaptureRecord *recs, uint32_t n)
+{
+#ifdef HOST_WORDS_BIGENDIAN
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        cpu_to_le64s(&recs[i].pc);
+        cpu_to_le64s(&recs[i].vaddr);
+        cpu_to_le64s(&recs[i].paddr);
+        cpu_to_le32s(&recs[i].opcode);
+    }
+#endif
+}
+
+static void qflex_capture_records_from_le(QFlexCaptureRecord *recs,
+                                          uint32_t n)
+{
+#ifdef HOST_WORDS_BIGENDIAN
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        le64_to_cpus(&recs[i].pc);
+        le64_to_cpus(&recs[i].vaddr);
+        le64_to_cpus(&recs[i].paddr);
+        le32_to_cpus(&recs[i].opcode);
+    }
+#endif
+}
+
+static QFlexCaptureChunk *qflex_capture_chunk_new(void)
+{
+    QFlexCaptureChunk *chunk = g_new0(QFlexCaptureChunk, 1);
+
+    chunk->records = g_new(QFlexCaptureRecord, QFLEX_CAPTURE_CHUNK_RECORDS);
+    return chunk;
+}
+
+static void qflex_capture_chunk_free(QFlexCaptureChunk *chunk)
+{
+    g_free(chunk->records);
+    g_free(chunk);
+}
+
+static int qflex_capture_write_chunk(QFlexCaptureWriter *w,
+                                     QFlexCaptureChunk *chunk,
+                                     uint8_t *zbuf, uLongf zbuf_size)
+{
+    QFlexCaptureChunkHeader hdr;
+    uLongf zlen = zbuf_size;
+
+    qflex_capture_records_to_le(chunk->records, chunk->nr_records);
+
+    /* Speed matters more than size here, the trace is written as the
+     * guest runs */
+    if (compress2(zbuf, &zlen, (Bytef *)chunk->records,
+                  chunk->nr_records * sizeof(QFlexCaptureRecord),
+                  Z_BEST_SPEED) != Z_OK) {
+        return -EIO;
+    }
+
+    hdr = (QFlexCaptureChunkHeader) {
+        .magic           = cpu_to_le32(QFLEX_CAPTURE_CHUNK_MAGIC),
+        .nr_records      = cpu_to_le32(chunk->nr_records),
+        .compressed_size = cpu_to_le32(zlen),
+        .first_record    = cpu_to_le64(chunk->first_record),
+    };
+
+    if (fwrite(&hdr, sizeof(hdr), 1, w->fp) != 1 ||
+        fwrite(zbuf, zlen, 1, w->fp) != 1) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static void *qflex_capture_writer_thread(void *opaque)
+{
+    QFlexCaptureWriter *w = opaque;
+    QFlexCaptureChunk *chunk;
+    uLongf zbuf_size = compressBound(QFLEX_CAPTURE_CHUNK_SIZE);
+    uint8_t *zbuf = g_malloc(zbuf_size);
+    int ret;
+
+    qemu_mutex_lock(&w->lock);
+    for (;;) {
+        while (QSIMPLEQ_EMPTY(&w->full) && !w->stopping) {
+            qemu_cond_wait(&w->cond, &w->lock);
+        }
+        chunk = QSIMPLEQ_FIRST(&w->full);
+        if (!chunk) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&w->full, next);
+        qemu_mutex_unlock(&w->lock);
+
+        ret = w->ret ? 0 : qflex_capture_write_chunk(w, chunk, zbuf,
+                                                     zbuf_size);
+
+        qemu_mutex_lock(&w->lock);
+        if (ret < 0 && !w->ret) {
+            w->ret = ret;
+        }
+        QSIMPLEQ_INSERT_TAIL(&w->free, chunk, next);
+        qemu_cond_broadcast(&w->cond);
+    }
+    qemu_mutex_unlock(&w->lock);
+
+    g_free(zbuf);
+    return NULL;
+}
+
+QFlexCaptureFile *qflex_capture_file_open(const char *filename, int cpu_index,
+                                          Error **errp)
+{
+    QFlexCaptureFile *f;
+    QFlexCaptureWriter *w;
+    QFlexCaptureHeader hdr = {
+        .magic         = cpu_to_le64(QFLEX_CAPTURE_MAGIC),
+        .version       = cpu_to_le32(QFLEX_CAPTURE_VERSION),
+        .record_size   = cpu_to_le32(sizeof(QFlexCaptureRecord)),
+        .cpu_index     = cpu_to_le32(cpu_index),
+        .chunk_records = cpu_to_le32(QFLEX_CAPTURE_CHUNK_RECORDS),
+    };
+    FILE *fp;
+
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        error_setg_errno(errp, errno, "Could not create trace file '%s'",
+                         filename);
+        return NULL;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        error_setg_errno(errp, errno, "Could not write trace file '%s'",
+                         filename);
+        fclose(fp);
+        return NULL;
+    }
+
+    w = g_new0(QFlexCaptureWriter, 1);
+    w->fp = fp;
+    w->filename = g_strdup(filename);
+    qemu_mutex_init(&w->lock);
+    qemu_cond_init(&w->cond);
+    QSIMPLEQ_INIT(&w->full);
+    QSIMPLEQ_INIT(&w->free);
+    w->nr_chunks = 1;
+
+    f = g_new0(QFlexCaptureFile, 1);
+    f->writer = w;
+    f->cur = qflex_capture_chunk_new();
+
+    qemu_thread_create(&w->thread, "qflex-capture",
+                       qflex_capture_writer_thread, w, QEMU_THREAD_JOINABLE);
+    return f;
+}
+
+/* Hand the current chunk to the writer thread and start a new one */
+void qflex_capture_file_submit(QFlexCaptureFile *f)
+{
+    QFlexCaptureWriter *w = f->writer;
+    QFlexCaptureChunk *chunk = f->cur;
+
+    chunk->first_record = w->nr_records;
+    w->nr_records += chunk->nr_records;
+
+    qemu_mutex_lock(&w->lock);
+    QSIMPLEQ_INSERT_TAIL(&w->full, chunk, next);
+    qemu_cond_broadcast(&w->cond);
+
+    /* Records are never dropped: if the writer falls behind, the vCPU
+     * waits for it */
+    while (QSIMPLEQ_EMPTY(&w->free) &&
+           w->nr_chunks >= QFLEX_CAPTURE_MAX_CHUNKS) {
+        qemu_cond_wait(&w->cond, &w->lock);
+    }
+    chunk = QSIMPLEQ_FIRST(&w->free);
+    if (chunk) {
+        QSIMPLEQ_REMOVE_HEAD(&w->free, next);
+    }
+    qemu_mutex_unlock(&w->lock);
+
+    if (!chunk) {
+        chunk = qflex_capture_chunk_new();
+        w->nr_chunks++;
+    }
+    chunk->nr_records = 0;
+    f->cur = chunk;
+}
+
+int qflex_capture_file_close(QFlexCaptureFile *f)
+{
+    QFlexCaptureWriter *w = f->writer;
+    QFlexCaptureChunk *chunk, *next_chunk;
+    int ret;
+
+    if (f->cur->nr_records) {
+        qflex_capture_file_submit(f);
+    }
+
+    qemu_mutex_lock(&w->lock);
+    w->stopping = true;
+    qemu_cond_broadcast(&w->cond);
+    qemu_mutex_unlock(&w->lock);
+    qemu_thread_join(&w->thread);
+
+    ret = w->ret;
+    if (fclose(w->fp) && !ret) {
+        ret = -errno;
+    }
+
+    qflex_capture_chunk_free(f->cur);
+    QSIMPLEQ_FOREACH_SAFE(chunk, &w->free, next, next_chunk) {
+        qflex_capture_chunk_free(chunk);
+    }
+    qemu_cond_destroy(&w->cond);
+    qemu_mutex_destroy(&w->lock);
+    g_free(w->filename);
+    g_free(w);
+    g_free(f);
+    return ret;
+}
+
+/* Reader */
+
+typedef struct QFlexCaptureChunkIndex {
+    off_t offset;
+    uint64_t first_record;
+    uint32_t nr_records;
+} QFlexCaptureChunkIndex;
+
+struct QFlexCaptureReader {
+    FILE *fp;
+    QFlexCaptureHeader hdr;
+
+    /* decompressed records of the current chunk */
+    QFlexCaptureRecord *records;
+    uint32_t nr_records;
+    uint32_t pos;
+    uint8_t *zbuf;
+    uLongf zbuf_size;
+
+    /* offsets of all chunks, built on the first seek */
+    GArray *index;
+};
+
+static int qflex_capture_read_chunk_header(QFlexCaptureReader *r,
+                                           QFlexCaptureChunkHeader *hdr,
+                                           Error **errp)
+{
+    size_t n = fread(hdr, 1, sizeof(*hdr), r->fp);
+
+    if (n == 0 && feof(r->fp)) {
+        return 0;
+    }
+    if (n != sizeof(*hdr)) {
+        error_setg(errp, "Truncated trace file");
+        return -EIO;
+    }
+
+    hdr->magic = le32_to_cpu(hdr->magic);
+    hdr->nr_records = le32_to_cpu(hdr->nr_records);
+    hdr->compressed_size = le32_to_cpu(hdr->compressed_size);
+    hdr->first_record = le64_to_cpu(hdr->first_record);
+
+    if (hdr->magic != QFLEX_CAPTURE_CHUNK_MAGIC ||
+        hdr->nr_records > r->hdr.chunk_records ||
+        hdr->compressed_size > r->zbuf_size) {
+        error_setg(errp, "Invalid chunk header in trace file");
+        return -EINVAL;
+    }
+    return 1;
+}
+
+/* Returns 1 if a chunk was loaded, 0 at the end of the file */
+static int qflex_capture_load_chunk(QFlexCaptureReader *r, Error **errp)
+{
+    QFlexCaptureChunkHeader hdr;
+    uLongf len;
+    int ret;
+
+    ret = qflex_capture_read_chunk_header(r, &hdr, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    if (fread(r->zbuf, hdr.compressed_size, 1, r->fp) != 1) {
+        error_setg(errp, "Truncated trace file");
+        return -EIO;
+    }
+
+    len = hdr.nr_records * sizeof(QFlexCaptureRecord);
+    if (uncompress((Bytef *)r->records, &len, r->zbuf,
+                   hdr.compressed_size) != Z_OK ||
+        len != hdr.nr_records * sizeof(QFlexCaptureRecord)) {
+        error_setg(errp, "Corrupt chunk in trace file");
+        return -EIO;
+    }
+
+    qflex_capture_records_from_le(r->records, hdr.nr_records);
+    r->nr_records = hdr.nr_records;
+    r->pos = 0;
+    return 1;
+}
+
+QFlexCaptureReader *qflex_capture_reader_open(const char *filename,
+                                              Error **errp)
+{
+    QFlexCaptureReader *r;
+    QFlexCaptureHeader hdr;
+    FILE *fp;
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        error_setg_errno(errp, errno, "Could not open trace file '%s'",
+                         filename);
+        return NULL;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1) {
+        error_setg(errp, "Could not read header of trace file '%s'",
+                   filename);
+        goto fail;
+    }
+    hdr.magic = le64_to_cpu(hdr.magic);
+    hdr.version = le32_to_cpu(hdr.version);
+    hdr.record_size = le32_to_cpu(hdr.record_size);
+    hdr.cpu_index = le32_to_cpu(hdr.cpu_index);
+    hdr.chunk_records = le32_to_cpu(hdr.chunk_records);
+
+    if (hdr.magic != QFLEX_CAPTURE_MAGIC) {
+        error_setg(errp, "'%s' is not a QFlex trace file", filename);
+        goto fail;
+    }
+    if (hdr.version != QFLEX_CAPTURE_VERSION ||
+        hdr.record_size != sizeof(QFlexCaptureRecord)) {
+        error_setg(errp, "Unsupported trace file version %" PRIu32,
+                   hdr.version);
+        goto fail;
+    }
+    if (hdr.chunk_records == 0 || hdr.chunk_records > 16 * 1024 * 1024) {
+        error_setg(errp, "Invalid chunk size in trace file '%s'", filename);
+        goto fail;
+    }
+
+    r = g_new0(QFlexCaptureReader, 1);
+    r->fp = fp;
+    r->hdr = hdr;
+    r->records = g_new(QFlexCaptureRecord, hdr.chunk_records);
+    r->zbuf_size = compressBound(hdr.chunk_records *
+                                 sizeof(QFlexCaptureRecord));
+    r->zbuf = g_malloc(r->zbuf_size);
+    return r;
+
+fail:
+    fclose(fp);
+    return NULL;
+}
+
+/* Returns 1 and fills @rec with the next record, 0 at the end of the trace
+ * and a negative errno value on error. */
+int qflex_capture_reader_next(QFlexCaptureReader *r, QFlexCaptureRecord *rec,
+                              Error **errp)
+{
+    int ret;
+
+    while (r->pos == r->nr_records) {
+        ret = qflex_capture_load_chunk(r, errp);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+
+    *rec = r->records[r->pos++];
+    return 1;
+}
+
+static int qflex_capture_build_index(QFlexCaptureReader *r, Error **errp)
+{
+    QFlexCaptureChunkHeader hdr;
+    QFlexCaptureChunkIndex entry;
+    int ret;
+
+    r->index = g_array_new(false, false, sizeof(QFlexCaptureChunkIndex));
+    if (fseeko(r->fp, sizeof(QFlexCaptureHeader), SEEK_SET)) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not seek in trace file");
+        return ret;
+    }
+
+    for (;;) {
+        entry.offset = ftello(r->fp);
+        ret = qflex_capture_read_chunk_header(r, &hdr, errp);
+        if (ret <= 0) {
+            return ret;
+        }
+        entry.first_record = hdr.first_record;
+        entry.nr_records = hdr.nr_records;
+        g_array_append_val(r->index, entry);
+
+        if (fseeko(r->fp, hdr.compressed_size, SEEK_CUR)) {
+            ret = -errno;
+            error_setg_errno(errp, -ret, "Could not seek in trace file");
+            return ret;
+        }
+    }
+}
+
+/* Position @r so that the next record read is record number @index */
+int qflex_capture_reader_seek(QFlexCaptureReader *r, uint64_t index,
+                              Error **errp)
+{
+    QFlexCaptureChunkIndex *entry;
+    guint lo, hi, mid;
+    int ret;
+
+    if (!r->index) {
+        ret = qflex_capture_build_index(r, errp);
+        if (ret < 0) {
+            g_array_free(r->index, true);
+            r->index = NULL;
+            return ret;
+        }
+    }
+
+    /* binary search for the chunk that holds @index */
+    lo = 0;
+    hi = r->index->len;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        entry = &g_array_index(r->index, QFlexCaptureChunkIndex, mid);
+        if (index < entry->first_record) {
+            hi = mid;
+        } else if (index >= entry->first_record + entry->nr_records) {
+            lo = mid + 1;
+        } else {
+            break;
+        }
+    }
+    if (lo >= hi) {
+        error_setg(errp, "Record %" PRIu64 " is beyond the end of the trace",
+                   index);
+        return -ERANGE;
+    }
+
+    if (fseeko(r->fp, entry->offset, SEEK_SET)) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not seek in trace file");
+        return ret;
+    }
+    ret = qflex_capture_load_chunk(r, errp);
+    if (ret <= 0) {
+        return ret < 0 ? ret : -EIO;
+    }
+    r->pos = index - entry->first_record;
+    return 0;
+}
+
+uint32_t qflex_capture_reader_cpu_index(QFlexCaptureReader *r)
+{
+    return r->hdr.cpu_index;
+}
+
+void qflex_capture_reader_close(QFlexCaptureReader *r)
+{
+    if (r->index) {
+        g_array_free(r->index, true);
+    }
+    fclose(r->fp);
+    g_free(r->zbuf);
+    g_free(r->records);
+    g_free(r);
+}
+
+/* vCPU capture */
+
+int qflex_capture_start(const char *prefix, int nr_cpus, Error **errp)
+{
+    char *filename;
+    int i;
+
+    assert(!qflex_capture_files);
+
+    qflex_capture_files = g_new0(QFlexCaptureFile *, nr_cpus);
+    qflex_capture_nr_files = nr_cpus;
+    for (i = 0; i < nr_cpus; i++) {
+        filename = g_strdup_printf("%s.cpu%d.qtrace", prefix, i);
+        qflex_capture_files[i] = qflex_capture_file_open(filename, i, errp);
+        g_free(filename);
+        if (!qflex_capture_files[i]) {
+            qflex_capture_stop();
+            return -1;
+        }
+    }
+
+    qflex_capture_on = true;
+    return 0;
+}
+
+/* Must be called with the vCPUs stopped */
+void qflex_capture_stop(void)
+{
+    int i, ret;
+
+    qflex_capture_on = false;
+    for (i = 0; i < qflex_capture_nr_files; i++) {
+        if (!qflex_capture_files[i]) {
+            continue;
+        }
+        ret = qflex_capture_file_close(qflex_capture_files[i]);
+        if (ret < 0) {
+            error_report("Writing the trace of CPU %d failed: %s",
+                         i, strerror(-ret));
+        }
+    }
+    g_free(qflex_capture_files);
+    qflex_capture_files = NULL;
+    qflex_capture_nr_files = 0;
+}
@@ -58,6 +58,9 @@ const QEMULogItem qflex_log_items[] = {
       "show when QFLEX magic instrutions are executed" },
     { QFLEX_LOG_FF, "ff",
       "fast-forward cores into user-mode" },
+    { QFLEX_LOG_TB_EXEC_RAW, "exec_raw",
+      "show pc and encoding of each executed instruction, to be\n"
+      "disassembled offline with scripts/qflex-log-disas.py" },
     { 0, NULL, NULL },
 };
 
@@ -135,10 +135,11 @@ static void wait_for_readers(void)
             atomic_set(&index->waiting, true);
         }
 
-        /* Here, order the stores to index->waiting before the
-         * loads of index->ctr.
+        /* Here, order the stores to index->waiting before the loads of
+         * index->ctr.  Pairs with smp_mb_placeholder() in rcu_read_unlock(),
+         * ensuring that the loads of index->ctr are sequentially consistent.
          */
-        smp_mb();
+        smp_mb_global();
 
         QLIST_FOREACH_SAFE(index, &registry, node, tmp) {
             if (!rcu_gp_ongoing(&index->ctr)) {
@@ -276,6 +277,61 @@ retry:
     return node;
 }
 
+/* Take the callbacks that a registered thread batched up.  The batch is
+ * a LIFO list, so reverse it to keep the callbacks in the order they were
+ * queued.
+ */
+static struct rcu_head *take_batch(struct rcu_reader_data *reader)
+{
+    struct rcu_head *node, *next, *list = NULL;
+
+    if (!atomic_read(&reader->cb_batch)) {
+        return NULL;
+    }
+
+    node = atomic_xchg(&reader->cb_batch, NULL);
+    for (; node; node = next) {
+        next = node->next;
+        node->next = list;
+        list = node;
+    }
+    return list;
+}
+
+/* Move the batched callbacks of all registered threads to the queue */
+static void call_rcu_collect(void)
+{
+    struct rcu_reader_data *index;
+    struct rcu_head *node, *next;
+    int n = 0;
+
+    qemu_mutex_lock(&rcu_registry_lock);
+    QLIST_FOREACH(index, &registry, node) {
+        for (node = take_batch(index); node; node = next) {
+            next = node->next;
+            enqueue(node);
+            n++;
+        }
+    }
+    qemu_mutex_unlock(&rcu_registry_lock);
+
+    if (n) {
+        atomic_add(&rcu_call_count, n);
+    }
+}
+
+static int call_rcu_pending(void)
+{
+    /* rcu_sync_lock keeps synchronize_rcu() from moving readers out of
+     * the registry while we walk it.
+     */
+    qemu_mutex_lock(&rcu_sync_lock);
+    call_rcu_collect();
+    qemu_mutex_unlock(&rcu_sync_lock);
+
+    return atomic_read(&rcu_call_count);
+}
+
 static void *call_rcu_thread(void *opaque)
 {
     struct rcu_head *node;
@@ -284,7 +340,7 @@ static void *call_rcu_thread(void *opaque)
 
     for (;;) {
         int tries = 0;
-        int n = atomic_read(&rcu_call_count);
+        int n = call_rcu_pending();
 
         /* Heuristically wait for a decent number of callbacks to pile up.
          * Fetch rcu_call_count now, we only must process elements that were
@@ -294,12 +350,12 @@ static void *call_rcu_thread(void *opaque)
             g_usleep(10000);
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
-                n = atomic_read(&rcu_call_count);
+                n = call_rcu_pending();
                 if (n == 0) {
                     qemu_event_wait(&rcu_call_ready_event);
                 }
             }
-            n = atomic_read(&rcu_call_count);
+            n = call_rcu_pending();
         }
 
         atomic_sub(&rcu_call_count, n);
@@ -329,7 +385,31 @@ static void *call_rcu_thread(void *opaque)
 
 void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
 {
+#ifndef CONFIG_PTH
+    struct rcu_reader_data *p_rcu_reader = &rcu_reader;
+    struct rcu_head *old;
+
+    node->func = func;
+
+    /* Registered threads batch their callbacks locally, which saves them
+     * from bouncing the queue tail and rcu_call_count between CPUs.  Only
+     * the first callback of a batch wakes up the call_rcu thread; it will
+     * take the rest when it next collects.
+     */
+    if (p_rcu_reader->registered) {
+        do {
+            old = atomic_read(&p_rcu_reader->cb_batch);
+            node->next = old;
+        } while (atomic_cmpxchg(&p_rcu_reader->cb_batch, old, node) != old);
+
+        if (!old) {
+            qemu_event_set(&rcu_call_ready_event);
+        }
+        return;
+    }
+#else
     node->func = func;
+#endif
     enqueue(node);
     atomic_inc(&rcu_call_count);
     qemu_event_set(&rcu_call_ready_event);
@@ -342,15 +422,33 @@ void rcu_register_thread(void)
     assert(PTH(rcu_reader).ctr == 0);
     qemu_mutex_lock(&rcu_registry_lock);
     QLIST_INSERT_HEAD(&registry, &PTH(rcu_reader), node);
+#ifndef CONFIG_PTH
+    rcu_reader.registered = true;
+#endif
     qemu_mutex_unlock(&rcu_registry_lock);
 }
 
 void rcu_unregister_thread(void)
 {
     PTH_UPDATE_CONTEXT
+#ifndef CONFIG_PTH
+    struct rcu_head *node, *next;
+#endif
+
     qemu_mutex_lock(&rcu_registry_lock);
     QLIST_REMOVE(&PTH(rcu_reader), node);
+#ifndef CONFIG_PTH
+    rcu_reader.registered = false;
+    qemu_mutex_unlock(&rcu_registry_lock);
+
+    /* Hand over whatever is still batched */
+    for (node = take_batch(&rcu_reader); node; node = next) {
+        next = node->next;
+        call_rcu1(node, node->func);
+    }
+#else
     qemu_mutex_unlock(&rcu_registry_lock);
+#endif
 }
 #ifndef CONFIG_PTH
 static void rcu_init_complete(void)
@@ -360,6 +458,7 @@ static void rcu_init_complete(void)
     qemu_mutex_init(&rcu_registry_lock);
     qemu_mutex_init(&rcu_sync_lock);
     qemu_event_init(&rcu_gp_event, true);
+    smp_mb_global_init();
 
     qemu_event_init(&rcu_call_ready_event, false);
 
@@ -0,0 +1,54 @@
+/*
+ * Process-wide memory barriers
+ *
+ * Copyright (c) 2020, Parallel Systems Architecture Lab, EPFL
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/sys_membarrier.h"
+
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+bool have_sys_membarrier;
+
+static int membarrier(int cmd)
+{
+    return syscall(__NR_membarrier, cmd, 0);
+}
+
+void smp_mb_global(void)
+{
+    if (likely(have_sys_membarrier)) {
+        membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED);
+    } else {
+        smp_mb();
+    }
+}
+
+/*
+ * Registration is per address space, so this also has to run in the child
+ * after fork().  It must be called while no other thread can be inside a
+ * smp_mb_placeholder(), because the flag changes what the fast path does.
+ */
+void smp_mb_global_init(void)
+{
+    int ret = membarrier(MEMBARRIER_CMD_QUERY);
+
+    have_sys_membarrier =
+        ret > 0 && (ret & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+        membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED) == 0;
+}
@@ -19,6 +19,8 @@
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
@@ -26,6 +28,7 @@
 static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolWorker ThreadPoolWorker;
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -39,84 +42,283 @@ struct ThreadPoolElement {
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Moving state out of THREAD_QUEUED is protected by the lock of the
+     * worker whose queue holds the element.  After that, only the worker
+     * thread can write to it.  Reads and writes of state and ret are
+     * ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Set on submission, only read by the worker that runs the element */
+    int64_t submit_ns;
+
+    /* Access to this list is protected by worker->lock.  */
+    ThreadPoolWorker *worker;
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+/* A worker slot.  Slots are allocated on demand and reused by later
+ * threads once their owner exits; they are only freed with the pool.
+ */
+struct ThreadPoolWorker {
+    ThreadPool *pool;
+    int index;
+    QemuMutex lock;
+
+    /* The following variables are protected by lock.  The owner pops
+     * requests from the head of the queue, other workers steal from the
+     * tail.
+     */
+    QTAILQ_HEAD(ThreadPoolQueue, ThreadPoolElement) queue;
+    bool alive;     /* owned by a thread that is running or being created */
+    uint64_t requests;
+    uint64_t steals;
+    uint64_t queue_ns;
+    uint64_t service_ns;
+};
+
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
     QemuSemaphore sem;
-    int max_threads;
     QEMUBH *new_thread_bh;
 
+    /* NUMA node the workers are bound to, -1 if none */
+    int numa_node;
+
+    /* Slots are only added, under lock; nr_workers is read atomically */
+    ThreadPoolWorker *workers[THREAD_POOL_MAX_THREADS_LIMIT];
+    int nr_workers;
+    unsigned int next_worker;
+
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
 
     /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int min_threads;
+    int max_threads;
     int cur_threads;
-    int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
+    ThreadPoolWorker *new_workers[THREAD_POOL_MAX_THREADS_LIMIT];
     bool stopping;
+
+    /* Updated atomically.  */
+    int idle_threads;
+    int queued;
 };
 
+#ifdef CONFIG_LINUX
+/* Only bother with NUMA placement if the host has more than one node */
+static bool host_is_numa(void)
+{
+    return access("/sys/devices/system/node/node1", F_OK) == 0;
+}
+
+static int current_numa_node(void)
+{
+    int cpu = sched_getcpu();
+    char *path;
+    GDir *dir;
+    const char *name;
+    int node = -1;
+
+    if (cpu < 0) {
+        return -1;
+    }
+
+    path = g_strdup_printf("/sys/devices/system/cpu/cpu%d", cpu);
+    dir = g_dir_open(path, 0, NULL);
+    g_free(path);
+    if (!dir) {
+        return -1;
+    }
+    while ((name = g_dir_read_name(dir))) {
+        if (sscanf(name, "node%d", &node) == 1) {
+            break;
+        }
+        node = -1;
+    }
+    g_dir_close(dir);
+    return node;
+}
+
+/* Run the calling thread on the CPUs of @node only */
+static void bind_to_numa_node(int node)
+{
+    char *path, *cpulist, *p;
+    cpu_set_t set;
+    unsigned long first, last;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    if (!g_file_get_contents(path, &cpulist, NULL, NULL)) {
+        g_free(path);
+        return;
+    }
+    g_free(path);
+
+    /* The list looks like "0-7,16-23" */
+    CPU_ZERO(&set);
+    for (p = cpulist; *p && *p != '\n'; p++) {
+        first = strtoul(p, &p, 10);
+        last = *p == '-' ? strtoul(p + 1, &p, 10) : first;
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, &set);
+        }
+        if (*p != ',') {
+            break;
+        }
+    }
+    g_free(cpulist);
+
+    if (CPU_COUNT(&set)) {
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+}
+#endif
+
+static ThreadPoolElement *worker_pop(ThreadPoolWorker *worker, bool steal)
+{
+    ThreadPoolElement *req;
+
+    qemu_mutex_lock(&worker->lock);
+    req = steal ? QTAILQ_LAST(&worker->queue, ThreadPoolQueue) : QTAILQ_FIRST(&worker->queue);
+    if (req) {
+        QTAILQ_REMOVE(&worker->queue, req, reqs);
+        req->state = THREAD_ACTIVE;
+        atomic_dec(&worker->pool->queued);
+    }
+    qemu_mutex_unlock(&worker->lock);
+    return req;
+}
+
+/* Called after taking a token from pool->sem, so there is a request to
+ * run: every queued request has a token, and only whoever takes a token
+ * removes a request.  Look in our own queue first, then steal from the
+ * other workers.
+ */
+static ThreadPoolElement *worker_next_request(ThreadPoolWorker *self,
+                                              bool *stolen)
+{
+    ThreadPool *pool = self->pool;
+    ThreadPoolElement *req;
+    int i, n;
+
+    for (;;) {
+        req = worker_pop(self, false);
+        if (req) {
+            *stolen = false;
+            return req;
+        }
+
+        n = atomic_read(&pool->nr_workers);
+        for (i = 1; i < n; i++) {
+            ThreadPoolWorker *victim = pool->workers[(self->index + i) % n];
+
+            req = worker_pop(victim, true);
+            if (req) {
+                *stolen = true;
+                return req;
+            }
+        }
+        cpu_relax();
+    }
+}
+
+/* Give up the slot if the pool can do without this thread.  The queue
+ * must be empty, otherwise whoever submitted to it relies on us.
+ */
+static bool worker_try_exit(ThreadPoolWorker *self, bool idle)
+{
+    ThreadPool *pool = self->pool;
+    bool exit = false;
+
+    qemu_mutex_lock(&pool->lock);
+    if (pool->stopping ||
+        pool->cur_threads > pool->max_threads ||
+        (idle && pool->cur_threads > pool->min_threads)) {
+        qemu_mutex_lock(&self->lock);
+        if (pool->stopping || QTAILQ_EMPTY(&self->queue)) {
+            self->alive = false;
+            exit = true;
+        }
+        qemu_mutex_unlock(&self->lock);
+    }
+    if (exit) {
+        pool->cur_threads--;
+        qemu_cond_signal(&pool->worker_stopped);
+    }
+    qemu_mutex_unlock(&pool->lock);
+    return exit;
+}
+
 static void *worker_thread(void *opaque)
 {
-    ThreadPool *pool = opaque;
+    ThreadPoolWorker *self = opaque;
+    ThreadPool *pool = self->pool;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
+
+#ifdef CONFIG_LINUX
+    if (atomic_read(&pool->numa_node) >= 0) {
+        bind_to_numa_node(atomic_read(&pool->numa_node));
+    }
+#endif
 
-    while (!pool->stopping) {
+    for (;;) {
         ThreadPoolElement *req;
+        int64_t start_ns, end_ns;
+        bool stolen;
         int ret;
 
-        do {
-            pool->idle_threads++;
-            qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
-            qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
+        atomic_inc(&pool->idle_threads);
+        ret = qemu_sem_timedwait(&pool->sem, 10000);
+        atomic_dec(&pool->idle_threads);
+
+        if (ret == -1 || atomic_read(&pool->stopping)) {
+            if (worker_try_exit(self, true)) {
+                break;
+            }
+            continue;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
+        req = worker_next_request(self, &stolen);
 
+        start_ns = get_clock();
         ret = req->func(req->arg);
+        end_ns = get_clock();
+
+        /* Account before completing, req may be freed right after */
+        qemu_mutex_lock(&self->lock);
+        self->requests++;
+        self->steals += stolen;
+        self->queue_ns += start_ns - req->submit_ns;
+        self->service_ns += end_ns - start_ns;
+        qemu_mutex_unlock(&self->lock);
 
         req->ret = ret;
         /* Write ret before state.  */
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
-
         qemu_bh_schedule(pool->completion_bh);
+
+        /* Shrink right away if max_threads was lowered */
+        if (atomic_read(&pool->cur_threads) > atomic_read(&pool->max_threads) &&
+            worker_try_exit(self, false)) {
+            break;
+        }
     }
 
-    pool->cur_threads--;
-    qemu_cond_signal(&pool->worker_stopped);
-    qemu_mutex_unlock(&pool->lock);
     return NULL;
 }
 
@@ -132,22 +334,58 @@ static void do_spawn_thread(ThreadPool *pool)
     pool->new_threads--;
     pool->pending_threads++;
 
-    qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
+    qemu_thread_create(&t, "worker", worker_thread,
+                       pool->new_workers[pool->new_threads],
+                       QEMU_THREAD_DETACHED);
 }
 
 static void spawn_thread_bh_fn(void *opaque)
 {
     ThreadPool *pool = opaque;
 
+#ifdef CONFIG_LINUX
+    /* Workers of an IOThread's pool stay on that IOThread's node */
+    if (pool->ctx != qemu_get_aio_context() &&
+        pool->ctx == qemu_get_current_aio_context() &&
+        host_is_numa()) {
+        atomic_set(&pool->numa_node, current_numa_node());
+    }
+#endif
+
     qemu_mutex_lock(&pool->lock);
     do_spawn_thread(pool);
     qemu_mutex_unlock(&pool->lock);
 }
 
+/* Reserve a worker slot for a new thread.  Runs with lock taken.  */
 static void spawn_thread(ThreadPool *pool)
 {
+    ThreadPoolWorker *worker = NULL;
+    int i;
+
+    for (i = 0; i < pool->nr_workers; i++) {
+        if (!atomic_read(&pool->workers[i]->alive)) {
+            worker = pool->workers[i];
+            break;
+        }
+    }
+    if (!worker) {
+        assert(pool->nr_workers < THREAD_POOL_MAX_THREADS_LIMIT);
+        worker = g_new0(ThreadPoolWorker, 1);
+        worker->pool = pool;
+        worker->index = pool->nr_workers;
+        qemu_mutex_init(&worker->lock);
+        QTAILQ_INIT(&worker->queue);
+        pool->workers[pool->nr_workers] = worker;
+        atomic_mb_set(&pool->nr_workers, pool->nr_workers + 1);
+    }
+
+    qemu_mutex_lock(&worker->lock);
+    worker->alive = true;
+    qemu_mutex_unlock(&worker->lock);
+
     pool->cur_threads++;
-    pool->new_threads++;
+    pool->new_workers[pool->new_threads++] = worker;
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
      * starving the current vcpu.
@@ -160,6 +398,31 @@ static void spawn_thread(ThreadPool *pool)
     }
 }
 
+/* Put @req on the queue of a live worker, picked round robin.  Returns
+ * false if there is no live worker.
+ */
+static bool thread_pool_enqueue(ThreadPool *pool, ThreadPoolElement *req)
+{
+    int n = atomic_read(&pool->nr_workers);
+    unsigned int start = atomic_fetch_inc(&pool->next_worker);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        ThreadPoolWorker *worker = pool->workers[(start + i) % n];
+
+        qemu_mutex_lock(&worker->lock);
+        if (worker->alive) {
+            req->worker = worker;
+            QTAILQ_INSERT_TAIL(&worker->queue, req, reqs);
+            atomic_inc(&pool->queued);
+            qemu_mutex_unlock(&worker->lock);
+            return true;
+        }
+        qemu_mutex_unlock(&worker->lock);
+    }
+    return false;
+}
+
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -208,10 +471,11 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    ThreadPoolWorker *worker = elem->worker;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    qemu_mutex_lock(&pool->lock);
+    qemu_mutex_lock(&worker->lock);
     if (elem->state == THREAD_QUEUED &&
         /* No thread has yet started working on elem. we can try to "steal"
          * the item from the worker if we can get a signal from the
@@ -219,14 +483,15 @@ static void thread_pool_cancel(BlockAIOCB *acb)
          * the lock taken and ensure that elem will remain THREAD_QUEUED.
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+        QTAILQ_REMOVE(&worker->queue, elem, reqs);
+        atomic_dec(&pool->queued);
         qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
     }
 
-    qemu_mutex_unlock(&pool->lock);
+    qemu_mutex_unlock(&worker->lock);
 }
 
 static AioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -247,23 +512,36 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    bool queued;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->submit_ns = get_clock();
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    /* Only take the pool lock if a thread may have to be created */
+    queued = thread_pool_enqueue(pool, req);
+    if (!queued ||
+        (atomic_read(&pool->idle_threads) == 0 &&
+         atomic_read(&pool->cur_threads) < atomic_read(&pool->max_threads))) {
+        qemu_mutex_lock(&pool->lock);
+        if (pool->cur_threads < pool->max_threads &&
+            (!queued || atomic_read(&pool->idle_threads) == 0)) {
+            spawn_thread(pool);
+        }
+        if (!queued) {
+            /* With no live worker cur_threads was 0, so there is one now */
+            queued = thread_pool_enqueue(pool, req);
+            assert(queued);
+        }
+        qemu_mutex_unlock(&pool->lock);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
     qemu_sem_post(&pool->sem);
     return &req->common;
 }
@@ -296,6 +574,54 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
     thread_pool_submit_aio(pool, func, arg, NULL, NULL);
 }
 
+void thread_pool_update_params(ThreadPool *pool, int min_threads,
+                               int max_threads)
+{
+    qemu_mutex_lock(&pool->lock);
+    pool->min_threads = min_threads;
+    atomic_set(&pool->max_threads, max_threads);
+
+    /* Threads above the new maximum exit after their current request,
+     * threads below the new minimum are started right away.
+     */
+    while (pool->cur_threads < pool->min_threads) {
+        spawn_thread(pool);
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_get_info(ThreadPool *pool, ThreadPoolInfo *info)
+{
+    uint64_t queue_ns = 0, service_ns = 0;
+    int i, n;
+
+    qemu_mutex_lock(&pool->lock);
+    info->min_threads = pool->min_threads;
+    info->max_threads = pool->max_threads;
+    info->threads = pool->cur_threads;
+    qemu_mutex_unlock(&pool->lock);
+    info->idle_threads = atomic_read(&pool->idle_threads);
+    info->queue_depth = atomic_read(&pool->queued);
+    info->numa_node = atomic_read(&pool->numa_node);
+    info->requests = 0;
+    info->steals = 0;
+
+    n = atomic_read(&pool->nr_workers);
+    for (i = 0; i < n; i++) {
+        ThreadPoolWorker *worker = pool->workers[i];
+
+        qemu_mutex_lock(&worker->lock);
+        info->requests += worker->requests;
+        info->steals += worker->steals;
+        queue_ns += worker->queue_ns;
+        service_ns += worker->service_ns;
+        qemu_mutex_unlock(&worker->lock);
+    }
+
+    info->avg_queue_ns = info->requests ? queue_ns / info->requests : 0;
+    info->avg_service_ns = info->requests ? service_ns / info->requests : 0;
+}
+
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
     if (!ctx) {
@@ -308,11 +634,12 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
+    pool->numa_node = -1;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+
+    thread_pool_update_params(pool, ctx->thread_pool_min, ctx->thread_pool_max);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -324,6 +651,8 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    int i;
+
     if (!pool) {
         return;
     }
@@ -335,10 +664,12 @@ void thread_pool_free(ThreadPool *pool)
     /* Stop new threads from spawning */
     qemu_bh_delete(pool->new_thread_bh);
     pool->cur_threads -= pool->new_threads;
-    pool->new_threads = 0;
+    while (pool->new_threads) {
+        pool->new_workers[--pool->new_threads]->alive = false;
+    }
 
     /* Wait for worker threads to terminate */
-    pool->stopping = true;
+    atomic_set(&pool->stopping, true);
     while (pool->cur_threads > 0) {
         qemu_sem_post(&pool->sem);
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
@@ -346,6 +677,10 @@ void thread_pool_free(ThreadPool *pool)
 
     qemu_mutex_unlock(&pool->lock);
 
+    for (i = 0; i < pool->nr_workers; i++) {
+        qemu_mutex_destroy(&pool->workers[i]->lock);
+        g_free(pool->workers[i]);
+    }
     qemu_bh_delete(pool->completion_bh);
     qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
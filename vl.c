@@ -181,6 +181,7 @@ int main(int argc, char **argv)
 
 #if defined(CONFIG_FLEXUS)
 #include "qflex/qflex-log.h"
+#include "qflex/qflex-capture.h"
 #endif /* CONFIG_FLEXUS */
 
 #define MAX_VIRTIO_CONSOLES 1
@@ -492,6 +493,20 @@ static QemuOptsList qemu_msg_opts = {
     },
 };
 
+static QemuOptsList qemu_main_loop_opts = {
+    .name = "main-loop",
+    .implied_opt_name = "backend",
+    .merge_lists = true,
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_main_loop_opts.head),
+    .desc = {
+        {
+            .name = "backend",
+            .type = QEMU_OPT_STRING,
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_name_opts = {
     .name = "name",
     .implied_opt_name = "guest",
@@ -661,6 +676,28 @@ static QemuOptsList qemu_ckpt_opts = {
 #endif
 #endif
 
+#ifdef CONFIG_EXTSNAP
+static QemuOptsList qemu_extram_opts = {
+    .name = "extram",
+    .implied_opt_name = "size-limit",
+    .merge_lists = true,
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_extram_opts.head),
+    .desc = {
+        {
+            .name = "size-limit",
+            .type = QEMU_OPT_SIZE,
+        }, {
+            .name = "spill-dir",
+            .type = QEMU_OPT_STRING,
+        }, {
+            .name = "chunk-size",
+            .type = QEMU_OPT_SIZE,
+        },
+        { /* end of list */ }
+    },
+};
+#endif
+
 static QemuOptsList qemu_semihosting_config_opts = {
     .name = "semihosting-config",
     .implied_opt_name = "enable",
@@ -1515,6 +1552,20 @@ static void configure_msg(QemuOpts *opts)
     enable_timestamp_msg = qemu_opt_get_bool(opts, "timestamp", true);
 }
 
+static void configure_main_loop(QemuOpts *opts)
+{
+    Error *err = NULL;
+    int backend;
+
+    backend = qapi_enum_parse(&MainLoopBackend_lookup,
+                              qemu_opt_get(opts, "backend"),
+                              MAIN_LOOP_BACKEND_GLIB, &err);
+    if (err || qemu_main_loop_set_backend(backend, &err) < 0) {
+        error_report_err(err);
+        exit(1);
+    }
+}
+
 /***********************************************************/
 /* Semihosting */
 
@@ -2656,6 +2707,14 @@ static int mon_init_func(void *opaque, QemuOpts *opts, Error **errp)
     if (qemu_opt_get_bool(opts, "pretty", 0))
         flags |= MONITOR_USE_PRETTY;
 
+    if (qemu_opt_get_bool(opts, "x-oob", 0)) {
+        if (!(flags & MONITOR_USE_CONTROL)) {
+            error_report("option 'x-oob' requires 'mode=control'");
+            exit(1);
+        }
+        flags |= MONITOR_USE_OOB;
+    }
+
     if (qemu_opt_get_bool(opts, "default", 0)) {
         error_report("option 'default' does nothing and is deprecated");
     }
@@ -2667,6 +2726,14 @@ static int mon_init_func(void *opaque, QemuOpts *opts, Error **errp)
         exit(1);
     }
 
+    /* Only socket chardevs can be driven from the monitor I/O thread */
+    if ((flags & MONITOR_USE_OOB) &&
+        !object_dynamic_cast(OBJECT(chr), TYPE_CHARDEV_SOCKET)) {
+        error_report("option 'x-oob' requires a socket chardev, "
+                     "\"%s\" is not one", chardev);
+        exit(1);
+    }
+
     monitor_init(chr, flags);
     return 0;
 }
@@ -3318,6 +3385,7 @@ int main(int argc, char **argv, char **envp)
 #endif
 #if defined(CONFIG_FLEXUS)
     const char *qflex_log_opts = NULL;
+    const char *qflex_capture_prefix = NULL;
 #endif /* CONFIG_FLEXUS */
 
    char **dirs;
@@ -3367,6 +3435,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_tpmdev_opts);
     qemu_add_opts(&qemu_realtime_opts);
     qemu_add_opts(&qemu_msg_opts);
+    qemu_add_opts(&qemu_main_loop_opts);
     qemu_add_opts(&qemu_name_opts);
     qemu_add_opts(&qemu_numa_opts);
     qemu_add_opts(&qemu_icount_opts);
@@ -3379,6 +3448,9 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_ckpt_opts);
     qemu_add_opts(&qemu_phases_opts);
 #endif
+#endif
+#ifdef CONFIG_EXTSNAP
+    qemu_add_opts(&qemu_extram_opts);
 #endif
     qemu_add_opts(&qemu_semihosting_config_opts);
     qemu_add_opts(&qemu_fw_cfg_opts);
@@ -3620,6 +3692,15 @@ int main(int argc, char **argv, char **envp)
                 exton = true;
                 loadext = optarg;
                 break;
+            case QEMU_OPTION_extram:
+                opts = qemu_opts_parse_noisily(qemu_find_opts("extram"),
+                                               optarg, true);
+                if (!opts) {
+                    exit(1);
+                }
+                set_tmp_overlay_ram(opts);
+                exton = true;
+                break;
 #endif
             case QEMU_OPTION_portrait:
                 graphic_rotate = 90;
@@ -4450,6 +4531,13 @@ int main(int argc, char **argv, char **envp)
                 }
                 configure_msg(opts);
                 break;
+            case QEMU_OPTION_main_loop:
+                opts = qemu_opts_parse_noisily(qemu_find_opts("main-loop"),
+                                               optarg, true);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_dump_vmstate:
                 if (vmstate_dump_file) {
                     error_report("only one '-dump-vmstate' "
@@ -4467,6 +4555,11 @@ int main(int argc, char **argv, char **envp)
                     qflex_log_opts = optarg;
                     break;
 #endif /* CONFIG_FLEXUS */ /* CONFIG_FA_QFLEX */
+#ifdef CONFIG_FLEXUS
+            case QEMU_OPTION_qflex_capture:
+                qflex_capture_prefix = optarg;
+                break;
+#endif
             default:
                 os_parse_cmd_args(popt->index, optarg);
             }
@@ -4492,6 +4585,7 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    configure_main_loop(qemu_find_opts_singleton("main-loop"));
     if (qemu_init_main_loop(&main_loop_err)) {
         error_report_err(main_loop_err);
         exit(1);
@@ -5197,6 +5291,14 @@ int main(int argc, char **argv, char **envp)
     }
 #endif /* CONFIG_FLEXUS */ /* CONFIG_FA_QLEX */
 
+#ifdef CONFIG_FLEXUS
+    if (qflex_capture_prefix &&
+        qflex_capture_start(qflex_capture_prefix, max_cpus, &err) < 0) {
+        error_report_err(err);
+        exit(1);
+    }
+#endif
+
     qdev_prop_check_globals();
     if (vmstate_dump_file) {
         /* dump and exit */
@@ -5226,8 +5328,13 @@ int main(int argc, char **argv, char **envp)
     }
 #endif
 #ifdef CONFIG_FLEXUS
-    if (!flexus_in_timing() ) {
-        pause_all_vcpus();
+    /* The capture can only be closed once no vCPU appends to it anymore */
+    if (flexus_pause_all_vcpus()) {
+        if (qflex_capture_enabled()) {
+            qflex_capture_stop();
+        }
+    } else if (qflex_capture_enabled()) {
+        warn_report("vCPUs are still running, the capture is left open");
     }
 #else
     pause_all_vcpus();